@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+"""
+Generate a large synthetic program to check that compiling, linking and
+running scale linearly with the size of the source.
+
+usage: gen.py LINES [GROUP] > large.sst
+
+GROUP is the amount of functions called by each of the functions main calls.
+Large groups result in large functions.
+"""
+
+import sys
+
+FUNC_LINES = 24
+GROUP = 64
+
+
+def func(n):
+    return f"""long f{n}(long a, long b)
+	long i = 0
+	long s = a + {n}
+	while i < b
+		long t = s * 3
+		t = t + i
+		if t > 1000000
+			t = t % 1000003
+		end
+		long u = t / 7
+		u = u & 255
+		s = t - u
+		i = i + 1
+	end
+	if s < 0
+		s = 0 - s
+	end
+	long r = s % 9973
+	r = r + {n % 97}
+	long q = r ^ a
+	q = q & 65535
+	r = r + q
+	return r
+end
+"""
+
+
+def group(g, first, last):
+    out = [f"long g{g}(long s)"]
+    for n in range(first, last):
+        out.append(f"\ts = f{n} s, {n % 50 + 50}")
+        out.append("\ts = s % 1000000")
+    out.append("\treturn s")
+    out.append("end")
+    return "\n".join(out) + "\n"
+
+
+def main():
+    global GROUP
+    lines = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+    if len(sys.argv) > 2:
+        GROUP = int(sys.argv[2])
+    per_func = FUNC_LINES + 2 + 2 / GROUP
+    count = max(1, int(lines / per_func))
+    out = sys.stdout
+    for n in range(count):
+        out.write(func(n))
+        out.write("\n")
+    groups = (count + GROUP - 1) // GROUP
+    for g in range(groups):
+        out.write(group(g, g * GROUP, min(count, (g + 1) * GROUP)))
+        out.write("\n")
+    out.write("long main()\n\tlong s = 1\n")
+    for g in range(groups):
+        out.write(f"\ts = g{g} s\n")
+    out.write("\treturn s % 256\nend\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,35 @@
+#!/bin/sh
+# Time compiling, linking and running generated programs of increasing size.
+# Each step should take roughly twice as long as the previous one.
+#
+# usage: [JOBS=n] [GROUP=n] run.sh [interpreter]
+#        (run from the root of the repository)
+#
+# GROUP sets the amount of calls in the generated group functions, e.g.
+# GROUP=4000 makes the size of the largest functions grow with the program.
+
+set -e
+
+INTERP=${1:-build/interpreter}
+JOBS=${JOBS:-1}
+GROUP=${GROUP:-64}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+now()
+{
+	date +%s.%N
+}
+
+printf '%8s %8s %10s %10s\n' lines bytes compile run
+for n in 12500 25000 50000 100000; do
+	python3 benchmark/large/gen.py $n $GROUP > "$TMP/large.sst"
+	l=$(wc -l < "$TMP/large.sst")
+	t0=$(now)
+	build/compiler -j $JOBS -L build/std/_start.sso "$TMP/large.sst" -o "$TMP/large.ss" 2>/dev/null
+	t1=$(now)
+	"$INTERP" "$TMP/large.ss" > /dev/null || true
+	t2=$(now)
+	b=$(wc -c < "$TMP/large.ss")
+	echo $l $b $t0 $t1 $t2 | awk '{ printf "%8d %8d %10.3f %10.3f\n", $1, $2, $4 - $3, $5 - $4 }'
+done
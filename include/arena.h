@@ -0,0 +1,53 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+
+#include <stddef.h>
+#include "util.h"
+
+
+/**
+ * A bump allocator. Memory is handed out from large blocks and can only be
+ * released all at once with arena_free.
+ */
+struct arena {
+	struct arena_block *block;
+};
+
+
+/**
+ * The arena holding the lines and func_lines of the compilation unit the
+ * current thread is working on.
+ */
+extern thread_local struct arena unit_arena;
+
+
+/**
+ * Returns zeroed memory aligned for any type.
+ */
+void *arena_alloc(struct arena *a, size_t size);
+
+
+char *arena_strndup(struct arena *a, const char *str, size_t max);
+
+
+char *arena_printf(struct arena *a, const char *fmt, ...);
+
+
+void arena_free(struct arena *a);
+
+
+/**
+ * Returns the unique copy of a string. Interned strings are never freed and
+ * equal strings can be compared by pointer.
+ */
+const char *intern(const char *str);
+
+
+const char *internn(const char *str, size_t max);
+
+
+const char *internf(const char *fmt, ...);
+
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include "lines.h"
+#include "vasm.h"
+
+
+/**
+ * The directory results are cached in. Caching is disabled if it is NULL.
+ */
+extern const char *cache_dir;
+
+
+/**
+ * Hashes data, continuing from a previous hash. Use 0 to start a new one.
+ */
+uint64_t cache_hash(uint64_t h, const void *data, size_t len);
+
+
+/**
+ * Returns the cached entry of the given kind and key or NULL if there is
+ * none. The entry is allocated with malloc.
+ */
+char *cache_get(const char *kind, uint64_t key, size_t *len);
+
+
+/**
+ * Stores an entry. Failing to store an entry is not an error.
+ */
+void cache_put(const char *kind, uint64_t key, const void *data, size_t len);
+
+
+/**
+ * Loads the lines and strings of a module parsed earlier by text2lines. The
+ * key should be the hash of the source. Returns -1 if it isn't cached.
+ */
+int cache_get_lines(uint64_t key, line_t **lines, size_t *linecount,
+                    char ***strings, size_t *stringcount);
+
+
+void cache_put_lines(uint64_t key, const line_t *lines, size_t linecount,
+                     char *const *strings, size_t stringcount);
+
+
+/**
+ * Loads the binary and labels of a function assembled earlier by vasm2vbin.
+ * Returns -1 if it isn't cached.
+ */
+int cache_get_vbin(uint64_t key, char **vbin, size_t *vbinlen,
+                   struct lblmap *map);
+
+
+void cache_put_vbin(uint64_t key, const char *vbin, size_t vbinlen,
+                    const struct lblmap *map);
+
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef FLOW_H
+#define FLOW_H
+
+#include <stdint.h>
+#include "func.h"
+#include "hashtbl.h"
+
+
+/**
+ * The control flow graph of a function and the dataflow facts derived from it.
+ *
+ * Lines are split into basic blocks at labels and after branches, returns and
+ * throws. Only the variables of the function that fit in a register are
+ * tracked. Struct members and names that aren't declared in the function are
+ * always assumed to be live, which is safe for every query below.
+ *
+ * The facts describe the lines as they were when the flow was built. Removing
+ * uses or definitions whose value is never used doesn't make other variables
+ * live, so the flow may still be queried afterwards, but anything else
+ * requires building it again.
+ */
+struct flow {
+	func f;
+	size_t blockcount;
+	struct flow_block {
+		size_t start, end;
+		size_t succ[2];
+	} *blocks;
+	// The block of each line
+	size_t *block;
+	// Tracked variables
+	struct hashtbl vars;
+	const char **names;
+	size_t varcount, words;
+	// The variables used and defined by line i are in
+	// usevars[useoff[i] ... useoff[i + 1]] and defvars[defoff[i] ...
+	// defoff[i + 1]]. The index in defvars identifies the definition.
+	size_t *useoff, *usevars;
+	size_t *defoff, *defvars;
+	// The variables live at the start and at the end of each block
+	uint64_t *in, *out;
+	// Use-def and def-use chains, see flow_chains
+	size_t *udoff, *udlines;
+	size_t *duoff, *dulines;
+};
+
+#define FLOW_NONE	((size_t)-1)
+// The pseudo line at which the arguments and uninitialized variables are
+// defined
+#define FLOW_ENTRY	((size_t)-1)
+
+
+/**
+ * Splits the function in basic blocks and determines which variables are live
+ * at the start and end of each of them.
+ */
+void flow_build(struct flow *fl, func f);
+
+
+void flow_free(struct flow *fl);
+
+
+/**
+ * Returns the index of a variable or FLOW_NONE if it isn't tracked.
+ */
+size_t flow_var(const struct flow *fl, const char *var);
+
+
+/**
+ * Returns whether variable v is in the set. Untracked variables always are.
+ */
+static inline int flow_has(const uint64_t *set, size_t v)
+{
+	return v == FLOW_NONE || (set[v / 64] >> (v % 64) & 1);
+}
+
+
+/**
+ * Returns whether the line uses or defines variable v.
+ */
+int flow_mentions(const struct flow *fl, size_t i, size_t v);
+
+
+/**
+ * Turns the variables live after line i into the variables live before it.
+ */
+void flow_step(const struct flow *fl, size_t i, uint64_t *live);
+
+
+/**
+ * Stores the variables live after line i in live, which must have room for
+ * fl->words words.
+ */
+void flow_live_out(const struct flow *fl, size_t i, uint64_t *live);
+
+
+/**
+ * Determines which definitions reach each use, i.e. the use-def and def-use
+ * chains.
+ */
+void flow_chains(struct flow *fl);
+
+
+/**
+ * Returns the amount of definitions of variable v that reach its use at line
+ * i and stores the lines of those definitions in lines. The chains must have
+ * been determined with flow_chains first.
+ */
+size_t flow_defs(const struct flow *fl, size_t i, size_t v, const size_t **lines);
+
+
+/**
+ * Returns the amount of lines that use the value variable v is given at line
+ * i and stores them in lines.
+ */
+size_t flow_uses(const struct flow *fl, size_t i, size_t v, const size_t **lines);
+
+#endif
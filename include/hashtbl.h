@@ -13,10 +13,26 @@
 
 
 
+/**
+ * The table uses open addressing with robin hood probing. Each entry caches
+ * the hash of its key so most mismatches are rejected without a strcmp. The
+ * keys are not copied and must outlive the table.
+ *
+ * Lookups don't modify the table and may run concurrently. Adding or removing
+ * entries needs exclusive access, which is up to the owner of the table.
+ */
+struct h_entry {
+	const char *key;
+	size_t      val;
+	uint32_t    hash;
+	uint32_t    dist;
+};
+
+
 typedef struct hashtbl {
 	size_t  len;
 	size_t  count;
-	void ***arrays;
+	struct h_entry *entries;
 } hashtbl_t, *hashtbl;
 
 
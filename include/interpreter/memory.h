@@ -0,0 +1,108 @@
+#ifndef INTERPRETER_MEMORY_H
+#define INTERPRETER_MEMORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/**
+ * Layout of the guest address space. The whole range is reserved up front
+ * but only the image, the stack and the heap below the break are accessible.
+ * Pages are committed by the host on first access.
+ *
+ * The stack grows upwards, so the inaccessible gap between the end of the
+ * stack and the start of the heap acts as a guard region. The same goes for
+ * everything above the break.
+ *
+ * The image area is large enough for binaries that still use the old fixed
+ * stack and heap addresses (0x10000 and 0x20000).
+ *
+ * The stacks of green threads lie between the stack and the heap. The last
+ * page of each is left inaccessible as its guard.
+ *
+ * Guest addresses are 32 bits wide. An inaccessible tail after the address
+ * space catches accesses that start right below 4 GiB and run past it.
+ */
+#define VASM_MEM_SIZE		0x100000000UL
+#define VASM_MEM_GUARD		0x10000UL
+#define VASM_MEM_IMAGE_SIZE	0x1000000UL
+#define VASM_MEM_STACK		0x10000000UL
+#define VASM_MEM_STACK_SIZE	0x800000UL
+#define VASM_MEM_HEAP		0x20000000UL
+#define VASM_MEM_THREADS	0x11000000UL
+#define VASM_MEM_THREAD_STACK	0x10000UL
+#define VASM_MEM_THREAD_COUNT	((VASM_MEM_HEAP - VASM_MEM_THREADS) / VASM_MEM_THREAD_STACK)
+
+
+/**
+ * The address space of a single guest program.
+ */
+struct vasm_mem {
+	uint8_t *base;
+	uint64_t brk;
+};
+
+
+/**
+ * Returns the host address of a guest buffer and shortens its length so it
+ * doesn't go past the end of the address space.
+ */
+static inline void *vasm_mem_buf(uint8_t *base, uint64_t addr, uint64_t *len)
+{
+	addr = (uint32_t)addr;
+	if (*len > VASM_MEM_SIZE - addr)
+		*len = VASM_MEM_SIZE - addr;
+	return base + addr;
+}
+
+
+/**
+ * Reserves a guest address space. Returns -1 on failure.
+ */
+int vasm_mem_create(struct vasm_mem *m);
+
+void vasm_mem_destroy(struct vasm_mem *m);
+
+/**
+ * Moves the end of the heap to the given address. Returns the new break or -1
+ * on failure. If addr is 0, the current break is returned.
+ */
+int64_t vasm_mem_setbrk(struct vasm_mem *m, int64_t addr);
+
+/**
+ * Clears the image and the stack and releases the heap and the thread stacks,
+ * which gives back all memory the previous program used.
+ */
+int vasm_mem_reset(struct vasm_mem *m);
+
+/**
+ * Makes the stack of green thread i accessible and returns its guest address
+ * or 0 on failure. The stack is zeroed.
+ */
+uint64_t vasm_mem_thread_stack(struct vasm_mem *m, size_t i);
+
+/**
+ * Gives the memory of the stack of green thread i back to the host.
+ */
+void vasm_mem_thread_release(struct vasm_mem *m, size_t i);
+
+/**
+ * Installs a handler that reports faults inside the given address space.
+ * It stays in use until the process dies, so this is only of use to programs
+ * that run a single guest. Exits on failure.
+ */
+void vasm_mem_guard(struct vasm_mem *m);
+
+
+/**
+ * Reserves the guest address space of the process and guards it. Exits on
+ * failure.
+ */
+uint8_t *vasm_mem_init(void);
+
+/**
+ * vasm_mem_setbrk on the address space of vasm_mem_init.
+ */
+int64_t vasm_mem_brk(int64_t addr);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef INTERPRETER_THREAD_H
+#define INTERPRETER_THREAD_H
+
+#include <stdint.h>
+#include "sstvm.h"
+
+
+/**
+ * Green threads share the memory of their program but have their own
+ * registers and stack. They only switch when one of them yields, joins,
+ * exits or does IO on a socket that would block, in which case it is parked
+ * until epoll reports the socket as ready. The syscall is then executed
+ * again.
+ *
+ * Thread 0 is the thread the program starts with and uses the regular stack.
+ * Sockets are non-blocking so only the thread using one has to wait for it.
+ *
+ * Syscalls:
+ * - 11 spawn(entry, arg, exit, detach): starts a thread at entry with arg in
+ *   r0. It returns to exit, which has to end the thread. Returns the id of
+ *   the thread or -1. Detached threads are released as soon as they end,
+ *   others once they are joined.
+ * - 12 yield()
+ * - 13 join(id): waits for a thread to end and returns its value
+ * - 14 exit(value): ends the thread that is running
+ */
+#define VM_THREAD_NONE	((size_t)-1)
+
+enum vm_thread_state {
+	VM_THREAD_FREE,
+	VM_THREAD_READY,
+	VM_THREAD_WAITING,
+	VM_THREAD_DONE,
+};
+
+struct vm_thread {
+	int64_t regs[32];
+	uint64_t ip;
+	enum vm_thread_state state;
+	int detached;
+	int64_t value;
+	size_t joiner;
+	// The next thread in the run queue, the same wait list or free list
+	size_t next;
+};
+
+struct vm_fd {
+	uint32_t events;
+	size_t waiting;
+};
+
+
+/**
+ * Sets up the threads of a freshly loaded program. Returns -1 on failure.
+ */
+int vm_threads_init(struct vm *vm);
+
+void vm_threads_free(struct vm *vm);
+
+/**
+ * Installs the thread syscalls and the IO syscalls that park a thread.
+ */
+void vm_threads_syscalls(struct vm *vm);
+
+/**
+ * Takes the running thread off the host after its syscall stopped the vm
+ * with state.
+ */
+void vm_thread_stop(struct vm *vm, enum vm_state state);
+
+/**
+ * Switches to the next thread that is ready. If none is, this waits for one
+ * when wait is set or returns -1 otherwise. -1 is also returned if the
+ * program ended because no thread can ever run again.
+ */
+int vm_thread_next(struct vm *vm, int wait);
+
+#endif
@@ -4,6 +4,13 @@
 #include <stddef.h>
 #include "vasm.h"
 
+/**
+ * Link binaries into an executable. output must be able to hold 9 bytes plus
+ * the combined length of the binaries.
+ *
+ * Labels starting with a '.' are local to the binary that defines them, so
+ * different binaries may use the same local labels.
+ */
 void linkobj(const char **vbins, size_t *vbinlens, size_t vbincount,
              const struct lblmap *maps, char *output, size_t *_outputlen);
 
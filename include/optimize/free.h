@@ -0,0 +1,8 @@
+#ifndef OPTIMIZE_FREE_H
+#define OPTIMIZE_FREE_H
+
+#include "func.h"
+
+int optimize_func_free(func f);
+
+#endif
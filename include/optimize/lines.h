@@ -18,8 +18,16 @@ extern enum optimize_lines_options {
 	PRECOMPUTE_MATH        = 1L << 11,
 	UNUSED_DECLARE         = 1L << 12,
 	IMMEDIATE_GOTO         = 1L << 13,
+	BRANCHES               = 1L << 14,
+	INSERT_FREE            = 1L << 15,
+	OPTIMIZE_VASM          = 1L << 16,
 } optimize_lines_options;
 
-int optimize_func_linear(func f);
+/**
+ * Applies the enabled line optimizations. Lines are visited again when
+ * something they depend on changed, in at most rounds passes over the
+ * function. 0 means until nothing changes anymore.
+ */
+int optimize_func_linear(func f, size_t rounds);
 
 #endif
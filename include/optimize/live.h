@@ -0,0 +1,13 @@
+#ifndef OPTIMIZE_LIVE_H
+#define OPTIMIZE_LIVE_H
+
+#include "func.h"
+
+/**
+ * Applies the optimizations that follow values across branches: constants are
+ * propagated, assignments whose value is never used are removed and variables
+ * are destroyed right after their last use.
+ */
+int optimize_func_live(func f);
+
+#endif
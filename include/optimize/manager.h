@@ -0,0 +1,47 @@
+#ifndef OPTIMIZE_MANAGER_H
+#define OPTIMIZE_MANAGER_H
+
+#include "func.h"
+#include "../vasm.h"
+
+
+/**
+ * The maximum amount of times the optimizations are applied to a function,
+ * each time a single pass over its lines followed by the branch and liveness
+ * optimizations. 0 means until nothing changes anymore.
+ */
+extern size_t optimize_iterations;
+
+
+/**
+ * Enables the optimizations of the given level (0 - 2). Higher levels are the
+ * same as 2.
+ */
+void optimize_level(int level);
+
+
+/**
+ * Enables or disables an optimization by name. Returns -1 if there is no
+ * optimization with that name.
+ */
+int optimize_pass(const char *name, int enable);
+
+
+/**
+ * Prints the names of all optimizations with ERROR.
+ */
+void optimize_print_passes(void);
+
+
+/**
+ * Applies the enabled optimizations to a function.
+ */
+void optimize_func(func f);
+
+
+/**
+ * Applies the enabled optimizations to the assembly of a function.
+ */
+void optimize_vasm(union vasm_all *vasms, size_t *vasmcount);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+
+#include <stddef.h>
+
+
+/**
+ * The number of threads used by parallel_for. 1 runs everything on the
+ * calling thread.
+ */
+extern size_t parallel_threads;
+
+
+/**
+ * Calls fn(i, arg) for every i in [0, count) and returns when all calls have
+ * finished. Each thread starts with an equal slice of the indices and steals
+ * half of the largest remaining slice once its own runs out.
+ */
+void parallel_for(size_t count, void (*fn)(size_t i, void *arg), void *arg);
+
+
+/**
+ * Returns the number of online processors.
+ */
+size_t parallel_cpus(void);
+
+
+#endif
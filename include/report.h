@@ -0,0 +1,134 @@
+#ifndef REPORT_H
+#define REPORT_H
+
+
+#include <stdint.h>
+#include <stdio.h>
+#include "util.h"
+
+
+/**
+ * The stages of the compiler, grouped by the phase they run in.
+ */
+enum report_stage {
+	// Preprocess
+	REPORT_TEXT2LINES,
+	// Immediate
+	REPORT_FINDBOUNDARIES,
+	REPORT_LINES2FUNC,
+	REPORT_FLOW,
+	REPORT_FINDCONST,
+	REPORT_UNUSED_ASSIGN,
+	REPORT_SUBSTITUTE_TEMP_VAR,
+	REPORT_SUBSTITUTE_VAR,
+	REPORT_UNUSED_DECLARE,
+	REPORT_INVERSE_MATH_IF,
+	REPORT_FAST_DIV,
+	REPORT_NOP_MATH,
+	REPORT_INVERT_IF,
+	REPORT_PRECOMPUTE_MATH,
+	REPORT_CONSTANT_IF,
+	REPORT_IMMEDIATE_GOTO,
+	REPORT_UNUSED_LABEL,
+	REPORT_EARLY_DESTROY,
+	REPORT_BRANCHES,
+	REPORT_FREE,
+	// Assembly
+	REPORT_FUNC2VASM,
+	REPORT_OPTIMIZEVASM,
+	// Binary
+	REPORT_VASM2VBIN,
+	// Link
+	REPORT_LINKOBJ,
+	REPORT_STAGES,
+};
+
+
+enum report_phase {
+	REPORT_PREPROCESS,
+	REPORT_IMMEDIATE,
+	REPORT_ASSEMBLY,
+	REPORT_BINARY,
+	REPORT_LINK,
+	REPORT_PHASES,
+};
+
+
+struct report_mark {
+	uint64_t ns;
+	uint64_t allocs, bytes;
+	uint64_t totalallocs, totalbytes;
+};
+
+
+/**
+ * Whether time and allocations are recorded. Set it before compiling.
+ */
+extern int report_enabled;
+
+
+void report_begin(struct report_mark *m);
+
+
+/**
+ * Counts an allocation for the stage the calling thread is in. The compiler
+ * counts its own allocations, libc's allocator is left alone.
+ */
+void report_alloc(size_t size);
+
+
+/**
+ * Adds the time and allocations of the calling thread since m to a stage and
+ * to the function the thread is working on, if any, and records the peak
+ * memory usage so far.
+ */
+void report_stage(enum report_stage s, const struct report_mark *m);
+
+
+/**
+ * Adds the wall time and the allocations of all threads since m to a phase
+ * and records the peak memory usage so far.
+ */
+void report_phase(enum report_phase p, const struct report_mark *m);
+
+
+/**
+ * Records that an optimization changed a function that had before lines and
+ * has after lines now.
+ */
+void report_changes(enum report_stage s, size_t before, size_t after);
+
+
+/**
+ * Sets the number of functions whose stages are recorded separately.
+ */
+void report_funcs(size_t count);
+
+
+/**
+ * Sets the function the calling thread is working on. -1 means none.
+ */
+void report_func(size_t i, const char *name);
+
+
+void report_print(FILE *f);
+
+
+/**
+ * Evaluates call and adds the time it took to a stage.
+ */
+#define REPORT(stage, call) ({				\
+	__typeof__(call) _r;				\
+	if (report_enabled) {				\
+		struct report_mark _m;			\
+		report_begin(&_m);			\
+		_r = (call);				\
+		report_stage(stage, &_m);		\
+	} else {					\
+		_r = (call);				\
+	}						\
+	_r;						\
+})
+
+
+#endif
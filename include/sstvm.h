@@ -0,0 +1,108 @@
+#ifndef SSTVM_H
+#define SSTVM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vbin.h"
+#include "interpreter/memory.h"
+
+
+/**
+ * A guest program and everything it needs to run. Any amount of them can
+ * exist in a single process, each with its own address space. Guest addresses
+ * are 32 bits wide, so a program can't reach outside of it, but accessing
+ * memory it didn't allocate still raises SIGSEGV in the host. A vm may be run
+ * by any thread, but only by one at a time.
+ *
+ * Syscalls are dispatched through the table, which vm_create fills with the
+ * host implementations. Entries may be replaced to sandbox or extend a guest:
+ * the handler finds the number and the arguments in regs[0] and up and stores
+ * the result in regs[0]. Setting state to anything but VM_READY stops the vm
+ * after the syscall.
+ *
+ * A program may run several green threads, see interpreter/thread.h. The
+ * registers and ip are those of the thread that is running.
+ */
+#define VM_SYSCALL_COUNT	64
+
+enum vm_state {
+	VM_READY,
+	VM_EXITED,
+	// Every thread waits for a file descriptor. epfd becomes readable once
+	// one of them is ready.
+	VM_BLOCKED,
+	// The thread gives up the host, only seen by syscall handlers
+	VM_YIELDED,
+	// The program raised a signal, usually by throwing an exception. Only
+	// this vm is stopped.
+	VM_ABORTED,
+};
+
+struct vm;
+typedef void (*vm_syscall_t)(struct vm *vm);
+
+struct vm {
+	int64_t regs[32];
+	uint64_t ip;
+	struct vasm_mem mem;
+	enum vbin_format format;
+	enum vm_state state;
+	int64_t exitcode;
+	// The amount of instructions executed, or of backward jumps and calls
+	// if built with NOPROF. Budgets are in the same unit.
+	size_t icounter;
+	vm_syscall_t syscalls[VM_SYSCALL_COUNT];
+	// Green threads
+	struct vm_thread *threads;
+	size_t threadcount, threadcap;
+	size_t current, freethread;
+	size_t runhead, runtail;
+	size_t switches, waiting;
+	struct vm_fd *fds;
+	size_t fdcount;
+	int epfd;
+	// Free for use by the host
+	void *data;
+};
+
+
+/**
+ * Creates a vm without a program. Returns NULL on failure.
+ */
+struct vm *vm_create(void);
+
+void vm_destroy(struct vm *vm);
+
+/**
+ * Loads an executable and resets the registers. Returns -1 if it isn't a
+ * valid executable.
+ */
+int vm_load(struct vm *vm, const void *vbin, size_t len);
+
+/**
+ * Runs the program until it exits or aborts. Waits for file descriptors if
+ * every thread is blocked.
+ */
+enum vm_state vm_run(struct vm *vm);
+
+/**
+ * Runs about n instructions. The vm is left in VM_READY if the program didn't
+ * exit yet and may be resumed with another call. VM_BLOCKED is returned
+ * instead of waiting for file descriptors, even if n is SIZE_MAX. Only vm_run
+ * waits.
+ *
+ * The budget is only checked on backward jumps and calls, so the program may
+ * run past it by as many instructions as there are in a straight run of
+ * code.
+ */
+enum vm_state vm_run_for(struct vm *vm, size_t n);
+
+/**
+ * Like vm_run_for, but also stops once the TSC (see _rdtsc) reaches the
+ * deadline. A deadline of 0 means there is none. The TSC is read at the same
+ * points as the budget is checked, but only once per thousand units of the
+ * budget.
+ */
+enum vm_state vm_run_until(struct vm *vm, size_t n, uint64_t deadline);
+
+#endif
@@ -10,7 +10,10 @@ int getop(const char *mnem);
 
 int parse_op_args(union vasm_all *v, const char *args);
 
-int text2vasm(char *buf, size_t len, union vasm_all *vasms, size_t *vasmcount);
+/**
+ * Parse assembly. The list of instructions is allocated with malloc.
+ */
+int text2vasm(char *buf, size_t len, union vasm_all **vasms, size_t *vasmcount);
 
 
 #endif
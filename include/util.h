@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 
 
@@ -65,6 +66,39 @@ static char *strprintf(const char *fmt, ...)
 	va_end(args);
 	return strclone(buf);
 }
+/**
+ * Read everything from a file descriptor into a NUL terminated buffer.
+ * Returns NULL on failure with errno set.
+ */
+static char *readall(int fd, size_t *len)
+{
+	size_t n = 0, cap = 1 << 16;
+	char *buf = malloc(cap);
+	if (buf == NULL)
+		return NULL;
+	for (;;) {
+		if (cap - n < 2) {
+			char *b = realloc(buf, cap *= 2);
+			if (b == NULL) {
+				free(buf);
+				return NULL;
+			}
+			buf = b;
+		}
+		ssize_t r = read(fd, buf + n, cap - n - 1);
+		if (r < 0) {
+			free(buf);
+			return NULL;
+		}
+		if (r == 0)
+			break;
+		n += r;
+	}
+	buf[n] = 0;
+	if (len != NULL)
+		*len = n;
+	return buf;
+}
 static int strend(const char *x, const char *y)
 {
 	size_t a = strlen(x), b = strlen(y);
@@ -72,7 +106,7 @@ static int strend(const char *x, const char *y)
 }
 #pragma GCC diagnostic pop
 
-#define streq(x,y) (strcmp(x,y) == 0)
+#define streq(x,y) ((x) == (y) || strcmp(x,y) == 0)
 #define strstart(x,y) (strncmp(x,y,strlen(y)) == 0)
 #define isnum(c) (('0' <= c && c <= '9') || c == '-')
 
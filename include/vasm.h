@@ -3,6 +3,7 @@
 
 
 #include <stddef.h>
+#include "vbin.h"
 
 
 enum vasm_op {
@@ -67,6 +68,26 @@ enum vasm_op {
 
 	OP_SYSCALL,
 
+	OP_PUSHM,
+	OP_POPM,
+
+	OP_ADDI,
+	OP_SUBI,
+	OP_MULI,
+	OP_ANDI,
+	OP_LSHIFTI,
+	OP_RSHIFTI,
+	OP_LESSI,
+
+	OP_JLT,
+	OP_JLE,
+	OP_JEQ,
+	OP_JNE,
+	OP_JLTB,
+	OP_JLEB,
+	OP_JEQB,
+	OP_JNEB,
+
 	OP_OP_LIMIT,
 
 	// Specials
@@ -113,6 +134,12 @@ struct vasm_reg_str {
 	const char *s;
 };
 
+struct vasm_reg2_str {
+	short op;
+	char  r0, r1;
+	const char *s;
+};
+
 union vasm_all {
 	short op;
 	struct vasm          a;
@@ -121,6 +148,7 @@ union vasm_all {
 	struct vasm_reg3     r3;
 	struct vasm_str      s;
 	struct vasm_reg_str  rs;
+	struct vasm_reg2_str r2s;
 };
 
 
@@ -131,10 +159,11 @@ struct lblpos {
 
 
 struct lblmap {
-	struct lblpos lbl2pos[4096];
-	size_t lbl2poscount;
-	struct lblpos pos2lbl[4096];
-	size_t pos2lblcount;
+	struct lblpos *lbl2pos;
+	size_t lbl2poscount, lbl2poscap;
+	struct lblpos *pos2lbl;
+	size_t pos2lblcount, pos2lblcap;
+	enum vbin_format format;
 };
 
 
@@ -153,6 +182,9 @@ enum vasm_args {
 	ARGS_TYPE_REGSHORT,
 	ARGS_TYPE_REGINT,
 	ARGS_TYPE_REGLONG,
+	ARGS_TYPE_REG2INT,
+	ARGS_TYPE_REG2BYTE,
+	ARGS_TYPE_REG2LONG,
 };
 
 
@@ -160,5 +192,12 @@ int get_vasm_args_type(int op);
 
 int vasm2str(union vasm_all a, char *buf, size_t bufsize);
 
+/**
+ * Append a label position to a map. The tables grow as needed.
+ */
+void lblmap_add_lbl2pos(struct lblmap *map, const char *lbl, size_t pos);
+
+void lblmap_add_pos2lbl(struct lblmap *map, const char *lbl, size_t pos);
+
 
 #endif
@@ -5,7 +5,16 @@
 #include "vasm.h"
 
 
-int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t *vbinlen, struct lblmap *map);
+/**
+ * The format of the binaries generated by vasm2vbin
+ */
+extern enum vbin_format vasm2vbin_format;
+
+
+/**
+ * Assemble a list of instructions. The binary is allocated with malloc.
+ */
+int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char **vbin, size_t *vbinlen, struct lblmap *map);
 
 
 int dumplbl(int fd, struct lblmap *map);
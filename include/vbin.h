@@ -0,0 +1,84 @@
+#ifndef VBIN_H
+#define VBIN_H
+
+
+#include <stdint.h>
+#include <endian.h>
+
+
+/**
+ * Executables and objects start with a 4 byte (big endian) magic number.
+ *
+ * The original format stores all immediates, jump targets and guest memory in
+ * big endian. The newer format stores them in little endian, which matches
+ * the hosts the interpreters run on and avoids a byte swap on every load and
+ * store.
+ */
+#define VBIN_MAGIC_EXEC_BE	0x55002019
+#define VBIN_MAGIC_EXEC_LE	0x55012019
+#define VBIN_MAGIC_OBJ_BE	0x55102019
+#define VBIN_MAGIC_OBJ_LE	0x55112019
+
+
+enum vbin_format {
+	VBIN_FORMAT_BE,
+	VBIN_FORMAT_LE,
+};
+
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+static const char *vbin_magic_exec(enum vbin_format f)
+{
+	return f == VBIN_FORMAT_LE ? "\x55\x01\x20\x19" : "\x55\x00\x20\x19";
+}
+static const char *vbin_magic_obj(enum vbin_format f)
+{
+	return f == VBIN_FORMAT_LE ? "\x55\x11\x20\x19" : "\x55\x10\x20\x19";
+}
+/**
+ * Returns the format of the given (raw) magic number or -1 if it is invalid.
+ * If isobj is not NULL, it is set to whether the magic belongs to an object.
+ */
+static int vbin_magic_format(uint32_t magic, int *isobj)
+{
+	int o = 0, f;
+	switch (be32toh(magic)) {
+	case VBIN_MAGIC_EXEC_BE: f = VBIN_FORMAT_BE; break;
+	case VBIN_MAGIC_EXEC_LE: f = VBIN_FORMAT_LE; break;
+	case VBIN_MAGIC_OBJ_BE : f = VBIN_FORMAT_BE; o = 1; break;
+	case VBIN_MAGIC_OBJ_LE : f = VBIN_FORMAT_LE; o = 1; break;
+	default: return -1;
+	}
+	if (isobj != NULL)
+		*isobj = o;
+	return f;
+}
+static uint16_t vbin16toh(enum vbin_format f, uint16_t v)
+{
+	return f == VBIN_FORMAT_LE ? le16toh(v) : be16toh(v);
+}
+static uint32_t vbin32toh(enum vbin_format f, uint32_t v)
+{
+	return f == VBIN_FORMAT_LE ? le32toh(v) : be32toh(v);
+}
+static uint64_t vbin64toh(enum vbin_format f, uint64_t v)
+{
+	return f == VBIN_FORMAT_LE ? le64toh(v) : be64toh(v);
+}
+static uint16_t htovbin16(enum vbin_format f, uint16_t v)
+{
+	return f == VBIN_FORMAT_LE ? htole16(v) : htobe16(v);
+}
+static uint32_t htovbin32(enum vbin_format f, uint32_t v)
+{
+	return f == VBIN_FORMAT_LE ? htole32(v) : htobe32(v);
+}
+static uint64_t htovbin64(enum vbin_format f, uint64_t v)
+{
+	return f == VBIN_FORMAT_LE ? htole64(v) : htobe64(v);
+}
+#pragma GCC diagnostic pop
+
+
+#endif
@@ -0,0 +1,142 @@
+#include <stdarg.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include "arena.h"
+#include "hashtbl.h"
+#include "report.h"
+
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+
+struct arena_block {
+	struct arena_block *prev;
+	size_t used, size;
+	alignas(max_align_t) char data[];
+};
+
+
+thread_local struct arena unit_arena;
+
+static thread_local struct arena   intern_arena;
+static thread_local struct hashtbl intern_tbl;
+
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	report_alloc(size);
+	size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+	struct arena_block *b = a->block;
+	if (b == NULL || b->size - b->used < size) {
+		// Oversized allocations get a block of their own
+		size_t s = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		b = calloc(sizeof *b + s, 1);
+		if (b == NULL)
+			EXITERRNO(3, "Failed to allocate arena block");
+		b->size = s;
+		if (a->block != NULL && size > ARENA_BLOCK_SIZE) {
+			// Don't throw away the space left in the current block
+			b->prev = a->block->prev;
+			a->block->prev = b;
+			b->used = size;
+			return b->data;
+		}
+		b->prev = a->block;
+		a->block = b;
+	}
+	void *p = b->data + b->used;
+	b->used += size;
+	return p;
+}
+
+
+char *arena_strndup(struct arena *a, const char *str, size_t max)
+{
+	size_t l = strnlen(str, max);
+	char *m = arena_alloc(a, l + 1);
+	memcpy(m, str, l);
+	return m;
+}
+
+
+char *arena_printf(struct arena *a, const char *fmt, ...)
+{
+	va_list args, copy;
+	va_start(args, fmt);
+	va_copy(copy, args);
+	int l = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	if (l < 0)
+		EXITERRNO(3, "Failed to format string");
+	char *m = arena_alloc(a, l + 1);
+	vsnprintf(m, l + 1, fmt, copy);
+	va_end(copy);
+	return m;
+}
+
+
+void arena_free(struct arena *a)
+{
+	struct arena_block *b = a->block;
+	while (b != NULL) {
+		struct arena_block *p = b->prev;
+		free(b);
+		b = p;
+	}
+	a->block = NULL;
+}
+
+
+const char *intern(const char *str)
+{
+	if (intern_tbl.len == 0 && h_create(&intern_tbl, 1024) < 0)
+		EXITERRNO(3, "Failed to create intern table");
+	const char *s;
+	if (h_get2(&intern_tbl, str, (size_t *)&s) == 0)
+		return s;
+	s = arena_strndup(&intern_arena, str, strlen(str));
+	if (h_add(&intern_tbl, s, (size_t)s) < 0)
+		EXITERRNO(3, "Failed to intern string");
+	return s;
+}
+
+
+const char *internn(const char *str, size_t max)
+{
+	char buf[256];
+	size_t l = strnlen(str, max);
+	if (l < sizeof buf) {
+		memcpy(buf, str, l);
+		buf[l] = 0;
+		return intern(buf);
+	}
+	char *m = strnclone(str, l);
+	const char *s = intern(m);
+	free(m);
+	return s;
+}
+
+
+const char *internf(const char *fmt, ...)
+{
+	char buf[256];
+	va_list args, copy;
+	va_start(args, fmt);
+	va_copy(copy, args);
+	int l = vsnprintf(buf, sizeof buf, fmt, args);
+	va_end(args);
+	if (l < 0)
+		EXITERRNO(3, "Failed to format string");
+	if ((size_t)l < sizeof buf) {
+		va_end(copy);
+		return intern(buf);
+	}
+	char *m = malloc(l + 1);
+	if (m == NULL)
+		EXITERRNO(3, "Failed to format string");
+	vsnprintf(m, l + 1, fmt, copy);
+	va_end(copy);
+	const char *s = intern(m);
+	free(m);
+	return s;
+}
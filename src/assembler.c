@@ -7,10 +7,10 @@
 #include "vasm2vbin.h"
 
 
-union vasm_all vasms[4096];
+union vasm_all *vasms;
 size_t vasmcount;
 
-char vbin[0x10000];
+char *vbin;
 size_t vbinlen;
 
 struct lblmap map;
@@ -18,22 +18,36 @@ struct lblmap map;
 
 int main(int argc, char **argv) {
 	
+	if (argc >= 2 && streq(argv[1], "-B")) {
+		// Use the legacy big endian format
+		vasm2vbin_format = VBIN_FORMAT_BE;
+		argv++, argc--;
+	}
+
 	if (argc < 3) {
-		fprintf(stderr, "Usage: %s <input> <output>", argv[0]);
+		fprintf(stderr, "Usage: %s [-B] <input> <output>", argv[0]);
 		return 1;
 	}
 
 	// Read source
-	char buf[0x10000];
 	int fd = open(argv[1], O_RDONLY);
-	size_t len = read(fd, buf, sizeof buf);
+	if (fd < 0) {
+		perror("open");
+		return 1;
+	}
+	size_t len;
+	char *buf = readall(fd, &len);
+	if (buf == NULL) {
+		perror("read");
+		return 1;
+	}
 	close(fd);
 
-	if (text2vasm(buf, len, vasms, &vasmcount) < 0)
+	if (text2vasm(buf, len, &vasms, &vasmcount) < 0)
 		return 1;
 
 
-	vasm2vbin(vasms, vasmcount, vbin, &vbinlen, &map);
+	vasm2vbin(vasms, vasmcount, &vbin, &vbinlen, &map);
 	DEBUG("Label to position mapping");
 	for (size_t i = 0; i < map.lbl2poscount; i++)
 		DEBUG("%-16s @ 0x%lx", map.lbl2pos[i].lbl, map.lbl2pos[i].pos);
@@ -72,7 +86,7 @@ int main(int argc, char **argv) {
 #endif
 
 	fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0755);
-	write(fd, "\x55\x10\x20\x19", 4); // Magic number
+	write(fd, vbin_magic_obj(vasm2vbin_format), 4); // Magic number
 	dumplbl(fd, &map);
 	write(fd, vbin, vbinlen);
 	close(fd);
@@ -0,0 +1,318 @@
+#include "cache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "arena.h"
+#include "util.h"
+
+
+/**
+ * Bump this when the format of any cached entry or the output of a cached
+ * stage changes.
+ */
+#define CACHE_VERSION	1
+
+
+const char *cache_dir;
+
+
+uint64_t cache_hash(uint64_t h, const void *data, size_t len)
+{
+	// FNV-1a
+	const unsigned char *c = data;
+	if (h == 0) {
+		// Entries made by a different build of the compiler may differ
+		static const char stamp[] = __DATE__ " " __TIME__;
+		h = 0xcbf29ce484222325 ^ CACHE_VERSION;
+		for (size_t i = 0; i < sizeof stamp; i++)
+			h = (h ^ (unsigned char)stamp[i]) * 0x100000001b3;
+	}
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ c[i]) * 0x100000001b3;
+	return h;
+}
+
+
+static void _path(char *buf, size_t size, const char *kind, uint64_t key)
+{
+	snprintf(buf, size, "%s/%s-%016lx", cache_dir, kind, key);
+}
+
+
+char *cache_get(const char *kind, uint64_t key, size_t *len)
+{
+	if (cache_dir == NULL)
+		return NULL;
+	char path[4096];
+	_path(path, sizeof path, kind, key);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	char *buf = readall(fd, len);
+	close(fd);
+	return buf;
+}
+
+
+void cache_put(const char *kind, uint64_t key, const void *data, size_t len)
+{
+	if (cache_dir == NULL)
+		return;
+	// Write to a temporary file first so that concurrent compilers never
+	// see a partial entry
+	static size_t counter;
+	char path[4096], tmp[4096 + 64];
+	_path(path, sizeof path, kind, key);
+	snprintf(tmp, sizeof tmp, "%s.%d.%lu.tmp", path, getpid(),
+	         __sync_fetch_and_add(&counter, 1));
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return;
+	const char *p = data;
+	while (len > 0) {
+		ssize_t w = write(fd, p, len);
+		if (w <= 0) {
+			close(fd);
+			unlink(tmp);
+			return;
+		}
+		p += w;
+		len -= w;
+	}
+	close(fd);
+	if (rename(tmp, path) < 0)
+		unlink(tmp);
+}
+
+
+/*
+ * Lines are stored as
+ *   u64 linecount
+ *   linecount * { u64 c, i32 x, i32 y, u32 len, char text[len] }
+ *   u64 stringcount
+ *   stringcount * { u32 len, char str[len] }
+ * where len includes the null terminator.
+ */
+
+
+static int _take(char **p, const char *end, void *dest, size_t n)
+{
+	if ((size_t)(end - *p) < n)
+		return -1;
+	memcpy(dest, *p, n);
+	*p += n;
+	return 0;
+}
+
+
+static int _take_str(char **p, const char *end, char **str)
+{
+	uint32_t l;
+	if (_take(p, end, &l, sizeof l) < 0 || l == 0 ||
+	    (size_t)(end - *p) < l || (*p)[l - 1] != 0)
+		return -1;
+	*str = *p;
+	*p += l;
+	return 0;
+}
+
+
+int cache_get_lines(uint64_t key, line_t **lines, size_t *linecount,
+                    char ***strings, size_t *stringcount)
+{
+	size_t len;
+	char *buf = cache_get("lines", key, &len);
+	if (buf == NULL)
+		return -1;
+	// The text of the lines points into buf, so it is never freed
+	char *p = buf, *end = buf + len;
+	line_t *lns = NULL;
+	char  **strs = NULL;
+	uint64_t lc, sc;
+	if (_take(&p, end, &lc, sizeof lc) < 0 || lc > len)
+		goto fail;
+	lns = malloc(lc * sizeof *lns);
+	if (lns == NULL)
+		goto fail;
+	for (size_t i = 0; i < lc; i++) {
+		uint64_t c;
+		int32_t x, y;
+		char *t;
+		if (_take(&p, end, &c, sizeof c) < 0 ||
+		    _take(&p, end, &x, sizeof x) < 0 ||
+		    _take(&p, end, &y, sizeof y) < 0 ||
+		    _take_str(&p, end, &t) < 0)
+			goto fail;
+		lns[i] = (line_t){ .text = t, .pos = { .c = c, .x = x, .y = y } };
+	}
+	if (_take(&p, end, &sc, sizeof sc) < 0 || sc > len)
+		goto fail;
+	strs = malloc(sc * sizeof *strs);
+	if (strs == NULL && sc > 0)
+		goto fail;
+	for (size_t i = 0; i < sc; i++) {
+		if (_take_str(&p, end, &strs[i]) < 0)
+			goto fail;
+	}
+	if (p != end)
+		goto fail;
+	*lines = lns;
+	*linecount = lc;
+	*strings = strs;
+	*stringcount = sc;
+	return 0;
+fail:
+	WARN("Ignoring corrupt cache entry lines-%016lx", key);
+	free(lns);
+	free(strs);
+	free(buf);
+	return -1;
+}
+
+
+static void _put(char **buf, size_t *len, size_t *cap, const void *data, size_t n)
+{
+	if (*len + n > *cap) {
+		*cap = (*len + n) * 2;
+		*buf = realloc(*buf, *cap);
+		if (*buf == NULL)
+			EXITERRNO(3, "Failed to grow cache entry");
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+
+static void _put_str(char **buf, size_t *len, size_t *cap, const char *str)
+{
+	uint32_t l = strlen(str) + 1;
+	_put(buf, len, cap, &l, sizeof l);
+	_put(buf, len, cap, str, l);
+}
+
+
+void cache_put_lines(uint64_t key, const line_t *lines, size_t linecount,
+                     char *const *strings, size_t stringcount)
+{
+	if (cache_dir == NULL)
+		return;
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	uint64_t n = linecount;
+	_put(&buf, &len, &cap, &n, sizeof n);
+	for (size_t i = 0; i < linecount; i++) {
+		uint64_t c = lines[i].pos.c;
+		int32_t x = lines[i].pos.x, y = lines[i].pos.y;
+		_put(&buf, &len, &cap, &c, sizeof c);
+		_put(&buf, &len, &cap, &x, sizeof x);
+		_put(&buf, &len, &cap, &y, sizeof y);
+		_put_str(&buf, &len, &cap, lines[i].text);
+	}
+	n = stringcount;
+	_put(&buf, &len, &cap, &n, sizeof n);
+	for (size_t i = 0; i < stringcount; i++)
+		_put_str(&buf, &len, &cap, strings[i]);
+	cache_put("lines", key, buf, len);
+	free(buf);
+}
+
+
+/*
+ * Binaries are stored as
+ *   u32 format
+ *   u64 vbinlen, char vbin[vbinlen]
+ *   u64 lbl2poscount, lbl2poscount * { u64 pos, u32 len, char lbl[len] }
+ *   u64 pos2lblcount, pos2lblcount * { u64 pos, u32 len, char lbl[len] }
+ */
+
+
+static int _take_lblpos(char **p, const char *end, struct lblpos **lp,
+                        size_t *count, size_t *cap)
+{
+	uint64_t n;
+	if (_take(p, end, &n, sizeof n) < 0 || n > (size_t)(end - *p))
+		return -1;
+	*lp = malloc(n * sizeof **lp);
+	if (*lp == NULL && n > 0)
+		return -1;
+	*count = *cap = n;
+	for (size_t i = 0; i < n; i++) {
+		uint64_t pos;
+		char *s;
+		if (_take(p, end, &pos, sizeof pos) < 0 || _take_str(p, end, &s) < 0)
+			return -1;
+		(*lp)[i] = (struct lblpos){ .lbl = intern(s), .pos = pos };
+	}
+	return 0;
+}
+
+
+int cache_get_vbin(uint64_t key, char **vbin, size_t *vbinlen,
+                   struct lblmap *map)
+{
+	size_t len;
+	char *buf = cache_get("vbin", key, &len);
+	if (buf == NULL)
+		return -1;
+	char *p = buf, *end = buf + len;
+	uint32_t fmt;
+	uint64_t l;
+	*map = (struct lblmap){};
+	*vbin = NULL;
+	if (_take(&p, end, &fmt, sizeof fmt) < 0 ||
+	    _take(&p, end, &l, sizeof l) < 0 || l > (size_t)(end - p))
+		goto fail;
+	*vbin = malloc(l);
+	if (*vbin == NULL && l > 0)
+		goto fail;
+	_take(&p, end, *vbin, l);
+	*vbinlen = l;
+	map->format = fmt;
+	if (_take_lblpos(&p, end, &map->lbl2pos, &map->lbl2poscount, &map->lbl2poscap) < 0 ||
+	    _take_lblpos(&p, end, &map->pos2lbl, &map->pos2lblcount, &map->pos2lblcap) < 0 ||
+	    p != end)
+		goto fail;
+	free(buf);
+	return 0;
+fail:
+	WARN("Ignoring corrupt cache entry vbin-%016lx", key);
+	free(*vbin);
+	free(map->lbl2pos);
+	free(map->pos2lbl);
+	free(buf);
+	return -1;
+}
+
+
+static void _put_lblpos(char **buf, size_t *len, size_t *cap,
+                        const struct lblpos *lp, size_t count)
+{
+	uint64_t n = count;
+	_put(buf, len, cap, &n, sizeof n);
+	for (size_t i = 0; i < count; i++) {
+		uint64_t pos = lp[i].pos;
+		_put(buf, len, cap, &pos, sizeof pos);
+		_put_str(buf, len, cap, lp[i].lbl);
+	}
+}
+
+
+void cache_put_vbin(uint64_t key, const char *vbin, size_t vbinlen,
+                    const struct lblmap *map)
+{
+	if (cache_dir == NULL)
+		return;
+	char *buf = NULL;
+	size_t len = 0, cap = 0;
+	uint32_t fmt = map->format;
+	uint64_t l = vbinlen;
+	_put(&buf, &len, &cap, &fmt, sizeof fmt);
+	_put(&buf, &len, &cap, &l, sizeof l);
+	_put(&buf, &len, &cap, vbin, vbinlen);
+	_put_lblpos(&buf, &len, &cap, map->lbl2pos, map->lbl2poscount);
+	_put_lblpos(&buf, &len, &cap, map->pos2lbl, map->pos2lblcount);
+	cache_put("vbin", key, buf, len);
+	free(buf);
+}
@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include "arena.h"
+#include "cache.h"
 #include "vasm.h"
 #include "func.h"
 #include "lines.h"
@@ -16,8 +18,9 @@
 #include "linkobj.h"
 #include "util.h"
 #include "optimize/lines.h"
-#include "optimize/vasm.h"
-#include "optimize/branch.h"
+#include "optimize/manager.h"
+#include "parallel.h"
+#include "report.h"
 #include "types.h"
 
 
@@ -33,8 +36,8 @@ enum output {
 
 const char *output_file;
 const char *input_file;
-const char *libraries[256];
-size_t      librarycount;
+const char **libraries;
+size_t       librarycount, librarycapacity;
 
 
 struct {
@@ -42,9 +45,26 @@ struct {
 	const line_t *lines;
 	size_t        count;
 	const char   *text;
+	// The binary of the function if it was found in the cache
+	uint64_t      key;
+	int           cached;
+	char         *vbin;
+	size_t        vbinlen;
+	struct lblmap map;
 } *lineranges;
 size_t linerangescount, linerangescapacity;
 
+// Hash of all declarations. A function only depends on its own body and the
+// declarations, so both together identify its binary.
+uint64_t declhash;
+
+
+
+static void _hash_decl(const char *text)
+{
+	declhash = cache_hash(declhash, text, strlen(text) + 1);
+}
+
 
 
 static void _add_func_range(func f, const line_t *lines, size_t count,
@@ -67,6 +87,7 @@ static void _add_func_range(func f, const line_t *lines, size_t count,
 	lineranges[i].lines = lines;
 	lineranges[i].count = count;
 	lineranges[i].text  = text;
+	lineranges[i].cached = 0;
 }
 
 
@@ -85,13 +106,15 @@ static size_t _find_func_length(const line_t *lines, size_t linecount, const cha
 		    strstart(t, "if "   ) ||
 		    strstart(t, "while ") ||
 		    streq   (t, "__asm")) {
-			nestlines[nestlvl] = i;
+			// Only the outer blocks are remembered for error messages
+			if (nestlvl < sizeof nestlines / sizeof *nestlines)
+				nestlines[nestlvl] = i;
 			nestlvl++;
 		}
 	}
 	if (nestlvl > 0) {
 		ERROR("Missing %lu 'end' statements", nestlvl);
-		for (size_t j = 0; j < nestlvl; j++) {
+		for (size_t j = 1; j < nestlvl && j < sizeof nestlines / sizeof *nestlines; j++) {
 			size_t k = nestlines[j];
 			PRINTLINE(lines[k]);
 		}	
@@ -104,16 +127,18 @@ static size_t _find_func_length(const line_t *lines, size_t linecount, const cha
 static void _parse_struct_or_class(const line_t *lines, size_t linecount, size_t *i, const char *text)
 {
 	line_t line = lines[*i];
+	_hash_decl(line.text);
 	int isclass = strstart(line.text, "class");
 	// Get class/struct name
-	const char *name = strclone(line.text + strlen(isclass ? "class " : "struct "));
+	const char *name = intern(line.text + strlen(isclass ? "class " : "struct "));
 	DEBUG("Parsing %s '%s'", isclass ? "class" : "struct", name);
 	// Find class end while adding members and functions
-	const char *mnames[1024], *mtypes[1024];
-	size_t mcount = 0;
+	const char **mnames = NULL, **mtypes = NULL;
+	size_t mcount = 0, mcap = 0;
 	(*i)++;
 	line = lines[(*i)++];
 	while (!streq(line.text, "end")) {
+		_hash_decl(line.text);
 		size_t l = strlen(line.text);
 		if (line.text[l - 1] == ')') {
 			// Add function
@@ -125,15 +150,15 @@ static void _parse_struct_or_class(const line_t *lines, size_t linecount, size_t
 			q++;
 			int constructor = streq(b, name);
 			if (constructor) {
-				line.text = strprintf("%s %s", name, line.text);
+				line.text = internf("%s %s", name, line.text);
 			} else {
-				line.text = strprintf("%s(%s this%s%s",
+				line.text = internf("%s(%s this%s%s",
 						b, name, *q == ')' ? "" : ",", q);
 			}
 			struct func *g = calloc(sizeof *g, 1);
 			parsefunc_header(g, line, text);
 			if (!constructor) {
-				g->name = strprintf("%s.%s", name, g->name);
+				g->name = internf("%s.%s", name, g->name);
 				g->functype = FUNC_REGULAR;
 			} else {
 				g->functype = isclass ? FUNC_CLASS : FUNC_STRUCT;
@@ -148,9 +173,16 @@ static void _parse_struct_or_class(const line_t *lines, size_t linecount, size_t
 			char *p = strchr(line.text, ' ');
 			if (p == NULL)
 				EXIT(1, "Expected member name");
-			mtypes[mcount] = strnclone(line.text, p - line.text);
+			if (mcount >= mcap) {
+				mcap   = mcap == 0 ? 16 : mcap * 2;
+				mnames = realloc(mnames, mcap * sizeof *mnames);
+				mtypes = realloc(mtypes, mcap * sizeof *mtypes);
+				if (mnames == NULL || mtypes == NULL)
+					EXITERRNO(3, "Failed to grow member list");
+			}
+			mtypes[mcount] = internn(line.text, p - line.text);
 			p++;
-			mnames[mcount] = strclone(p);
+			mnames[mcount] = intern(p);
 			DEBUG("Adding member '%s' of type '%s'", mnames[mcount], mtypes[mcount]);
 			mcount++;
 		}
@@ -173,6 +205,7 @@ static void _findboundaries(const line_t *lines, size_t linecount,
 	for (size_t i = 0; i < linecount; i++) {
 		line_t line = lines[i];
 		if (strstart(line.text, "extern ")) {
+			_hash_decl(line.text);
 			struct func *g = calloc(sizeof *g, 1);
 			parsefunc_header(g, line, text);
 			DEBUG("Adding external function '%s'", g->name);
@@ -184,6 +217,7 @@ static void _findboundaries(const line_t *lines, size_t linecount,
 		} else if (strstart(line.text, "class ") || strstart(line.text, "struct ")) {
 			_parse_struct_or_class(lines, linecount, &i, text);
 		} else {
+			_hash_decl(line.text);
 			struct func *g = calloc(sizeof *g, 1);
 			parsefunc_header(g, line, text);
 			DEBUG("Adding function '%s'", g->name);
@@ -199,35 +233,88 @@ static void _findboundaries(const line_t *lines, size_t linecount,
 
 static void _include(const char *f, hashtbl incltbl)
 {
-	DEBUG("Including %s", f);
-	char buf[0x10000];
-	char *b = buf;
-	for (const char *c = f; *c != 0; b++, c++)
+	char path[4096];
+	char *b = path + sprintf(path, "lib/"); // TODO
+	for (const char *c = f; *c != 0 && b < path + sizeof path - 5; b++, c++)
 		*b = *c == '.' ? '/' : *c;
 	strcpy(b, ".sst");
-	char cwd[4096];
-	getcwd(cwd, sizeof cwd);
-	chdir("lib"); // TODO
-	int fd = open(buf, O_RDONLY);
+
+	// Modules are only included once, no matter how they are reached
+	char canon[4096];
+	if (realpath(path, canon) == NULL)
+		EXIT(1, "Couldn't open '%s': %s", path, strerror(errno));
+	if (h_get2(incltbl, canon, &(size_t){0}) == 0) {
+		DEBUG("Skipping %s, already included", f);
+		return;
+	}
+	if (h_add(incltbl, intern(canon), 0) < 0)
+		EXITERRNO(3, "Failed to add include");
+	DEBUG("Including %s", f);
+
+	int fd = open(canon, O_RDONLY);
 	if (fd == -1)
-		EXIT(1, "Couldn't open '%s': %s", buf, strerror(errno));
-	size_t n = read(fd, buf, sizeof buf - 1);
-	buf[n] = 0;
+		EXIT(1, "Couldn't open '%s': %s", path, strerror(errno));
+	size_t len;
+	char *buf = readall(fd, &len);
+	if (buf == NULL)
+		EXITERRNO(3, "Failed to read include");
 	close(fd);
 
 	char  **strings;
 	line_t *lines;
 	size_t stringcount, linecount;
 
-	chdir(cwd); // TODO
+	uint64_t key = cache_hash(0, buf, len);
+	if (cache_get_lines(key, &lines, &linecount, &strings, &stringcount) < 0) {
+		if (text2lines(buf, &lines, &linecount, &strings, &stringcount) < 0)
+			EXIT(1, "Failed text to lines stage");
+		cache_put_lines(key, lines, linecount, strings, stringcount);
+	} else {
+		DEBUG("Using cached lines of %s", f);
+	}
+
+	_findboundaries(lines, linecount, incltbl, buf);
+}
 
-	if (text2lines(buf, &lines, &linecount, &strings, &stringcount) < 0)
-		EXIT(1, "Failed text to lines stage");
 
+/**
+ * Whether compiled functions are looked up in and added to the cache. The
+ * other outputs need the intermediate stages of every function.
+ */
+static int _cache_funcs(void)
+{
+	return cache_dir != NULL && (output_type == OBJECT || output_type == EXECUTABLE);
+}
 
-	_findboundaries(lines, linecount, incltbl, buf);
 
-	chdir(cwd);
+static void _lines2func(size_t i, void *arg)
+{
+#define l lineranges[i]
+	if (_cache_funcs()) {
+		uint64_t h = cache_hash(declhash, &vasm2vbin_format, sizeof vasm2vbin_format);
+		h = cache_hash(h, &optimize_lines_options, sizeof optimize_lines_options);
+		h = cache_hash(h, &optimize_iterations, sizeof optimize_iterations);
+		h = cache_hash(h, l.func->name, strlen(l.func->name) + 1);
+		for (size_t j = 0; j < l.count; j++)
+			h = cache_hash(h, l.lines[j].text, strlen(l.lines[j].text) + 1);
+		l.key = h;
+		if (cache_get_vbin(h, &l.vbin, &l.vbinlen, &l.map) == 0) {
+			DEBUG("Using cached binary of '%s'", l.func->name);
+			l.cached = 1;
+			return;
+		}
+	}
+	l.func->linecount = 0;
+	SETCURRENTFUNC(l.func);
+	report_func(i, l.func->name);
+	struct report_mark m;
+	report_begin(&m);
+	lines2func(l.lines, l.count, l.func, l.text);
+	report_stage(REPORT_LINES2FUNC, &m);
+	optimize_func(l.func);
+	report_func(-1, NULL);
+	CLEARCURRENTFUNC;
+#undef l
 }
 
 
@@ -237,22 +324,15 @@ static void _lines2funcs(const line_t *lines, size_t linecount,
 {
 	struct hashtbl incltbl;
 	h_create(&incltbl, 4);
+	struct report_mark m;
+	report_begin(&m);
 	_findboundaries(lines, linecount, &incltbl, text);
+	report_stage(REPORT_FINDBOUNDARIES, &m);
+	report_funcs(linerangescount);
 	DEBUG("%lu functions to be parsed", linerangescount);
-	for (size_t i = 0; i < linerangescount; i++) {
-#define l lineranges[i]
-		l.func->linecount = 0;
-		SETCURRENTFUNC(l.func);
-		lines2func(l.lines, l.count, l.func, l.text);
-		int changed;
-		do {
-			changed = 0;
-			changed |= optimize_func_linear(l.func);
-			changed |= optimize_func_branches(l.func);
-		} while (changed);
-		CLEARCURRENTFUNC;
-#undef l
-	}
+	// Types and function headers are known now, so the bodies can be
+	// compiled independently
+	parallel_for(linerangescount, _lines2func, NULL);
 	*funccount = linerangescount;
 	*funcs     = malloc(linerangescount * sizeof **funcs);
 	for (size_t i = 0; i < linerangescount; i++)
@@ -264,7 +344,7 @@ static void _lines2funcs(const line_t *lines, size_t linecount,
 
 static void _print_usage(int argc, char **argv, int code)
 {
-	ERROR("Usage: %s <input> [-o <output>] [-cSiE]", argc > 0 ? argv[0] : "compiler");
+	ERROR("Usage: %s <input> [-o <output>] [-j <threads>] [-C <dir>] [-O<level>] [-cSiEB]", argc > 0 ? argv[0] : "compiler");
 	ERROR("     <input>    The file to generate the output from");
 	ERROR("  -o <output>   The file to write the final binary to");
 	ERROR("  -c            Output object file");
@@ -272,6 +352,16 @@ static void _print_usage(int argc, char **argv, int code)
 	ERROR("  -i            Output immediate file");
 	ERROR("  -E            Output processed file");
 	ERROR("  -L            Link object or library");
+	ERROR("  -B            Use the legacy big endian binary format");
+	ERROR("  -j <threads>  Compile functions in parallel (0 = one per CPU)");
+	ERROR("  -C <dir>      Cache parsed modules and compiled functions in <dir>");
+	ERROR("  -O<level>     Optimization level (0 - 2, default 2, 3 is the same as 2)");
+	ERROR("  -f<pass>      Enable an optimization");
+	ERROR("  -fno-<pass>   Disable an optimization");
+	optimize_print_passes();
+	ERROR("  -foptimize-iterations=<n>");
+	ERROR("                Apply the optimizations at most n times (0 = until nothing changes)");
+	ERROR("  -ftime-report Print the time and memory spent in each stage");
 	exit(code);
 }
 
@@ -301,7 +391,49 @@ static void _parse_args(int argc, char **argv)
 				i++;
 				if (i >= argc)
 					EXIT(1, "-L must be followed by a file path");
+				if (librarycount >= librarycapacity) {
+					librarycapacity = librarycapacity * 2 + 4;
+					libraries = realloc(libraries, librarycapacity * sizeof *libraries);
+					if (libraries == NULL)
+						EXITERRNO(3, "Failed to grow library list");
+				}
 				libraries[librarycount++] = argv[i];
+			} else if (streq(v, "B")) {
+				vasm2vbin_format = VBIN_FORMAT_BE;
+			} else if (streq(v, "ftime-report")) {
+				report_enabled = 1;
+			} else if (strncmp(v, "foptimize-iterations=", 21) == 0) {
+				char *e;
+				optimize_iterations = strtoul(v + 21, &e, 10);
+				if (*e != 0 || v[21] == 0)
+					EXIT(1, "Invalid number of iterations '%s'", v + 21);
+			} else if (*v == 'O') {
+				if (v[1] < '0' || v[1] > '3' || v[2] != 0)
+					EXIT(1, "Invalid optimization level '%s'", v - 1);
+				optimize_level(v[1] - '0');
+			} else if (strncmp(v, "fno-", 4) == 0) {
+				if (optimize_pass(v + 4, 0) < 0)
+					EXIT(1, "Unknown optimization '%s'", v + 4);
+			} else if (*v == 'f') {
+				if (optimize_pass(v + 1, 1) < 0)
+					EXIT(1, "Unknown optimization '%s'", v + 1);
+			} else if (streq(v, "C")) {
+				i++;
+				if (i >= argc)
+					EXIT(1, "-C must be followed by a directory");
+				cache_dir = argv[i];
+				if (mkdir(cache_dir, 0755) < 0 && errno != EEXIST)
+					EXITERRNO(1, "Failed to create cache directory");
+			} else if (streq(v, "j")) {
+				i++;
+				if (i >= argc)
+					EXIT(1, "-j must be followed by a number of threads");
+				char *e;
+				parallel_threads = strtoul(argv[i], &e, 10);
+				if (*e != 0)
+					EXIT(1, "Invalid number of threads '%s'", argv[i]);
+				if (parallel_threads == 0)
+					parallel_threads = parallel_cpus();
 			} else if (streq(v, "h") || streq(v, "-help")) {
 				_print_usage(argc, argv, 0);
 			} else {
@@ -339,6 +471,67 @@ static void _parse_args(int argc, char **argv)
 }
 
 
+/**
+ * The per-function outputs of the assembly and binary stages.
+ */
+struct units {
+	struct func      *funcs;
+	union vasm_all  **vasms;
+	size_t           *vasmcount;
+	char            **vbins;
+	size_t           *vbinlens;
+	struct lblmap    *maps;
+};
+
+
+static void _func2vasm(size_t i, void *arg)
+{
+	struct units *u = arg;
+	if (lineranges[i].cached) {
+		u->vasms[i] = NULL;
+		u->vasmcount[i] = 0;
+		return;
+	}
+	DEBUG("Converting '%s'", u->funcs[i].name);
+	report_func(i, u->funcs[i].name);
+	struct report_mark m;
+	report_begin(&m);
+	func2vasm(&u->vasms[i], &u->vasmcount[i], &u->funcs[i]);
+	report_stage(REPORT_FUNC2VASM, &m);
+	optimize_vasm(u->vasms[i], &u->vasmcount[i]);
+	report_func(-1, NULL);
+}
+
+
+static void _vasm2vbin(size_t i, void *arg)
+{
+	struct units *u = arg;
+	struct report_mark m;
+	// The last unit holds the strings
+	if (i == linerangescount) {
+		report_begin(&m);
+		vasm2vbin(u->vasms[i], u->vasmcount[i], &u->vbins[i], &u->vbinlens[i], &u->maps[i]);
+		report_stage(REPORT_VASM2VBIN, &m);
+		return;
+	}
+#define l lineranges[i]
+	if (l.cached) {
+		u->vbins[i]    = l.vbin;
+		u->vbinlens[i] = l.vbinlen;
+		u->maps[i]     = l.map;
+		return;
+	}
+	report_func(i, l.func->name);
+	report_begin(&m);
+	vasm2vbin(u->vasms[i], u->vasmcount[i], &u->vbins[i], &u->vbinlens[i], &u->maps[i]);
+	report_stage(REPORT_VASM2VBIN, &m);
+	report_func(-1, NULL);
+	if (_cache_funcs())
+		cache_put_vbin(l.key, u->vbins[i], u->vbinlens[i], &u->maps[i]);
+#undef l
+}
+
+
 static void _init()
 {
 	if (add_type_number( "long" , 8, 1) < 0 ||
@@ -357,12 +550,9 @@ static void _init()
 
 int main(int argc, char **argv)
 {
+	optimize_level(2);
 	_parse_args(argc, argv);
 
-	// ALL THE WAAAY
-	optimize_lines_options = -1;
-	optimize_lines_options &= ~UNUSED_DECLARE;
-
 	char  **strings;
 	line_t *lines;
 	size_t stringcount, linecount;
@@ -372,26 +562,30 @@ int main(int argc, char **argv)
 	_init();
 
 	// Read source
-	char buf[0x10000];
 	int fd = streq(input_file, "-") ? STDIN_FILENO : open(input_file, O_RDONLY);
 	if (fd < 0)
 		EXITERRNO(1, "Failed to open input file");
-	size_t n = read(fd, buf, sizeof buf - 1);
-	if (n == -1)
+	char *buf = readall(fd, NULL);
+	if (buf == NULL)
 		EXITERRNO(3, "Failed to read input file");
-	buf[n] = 0;
 	close(fd);
 
 	// Preprocess source to a more consistent format
 	DEBUG("Preprocessing source");
+	struct report_mark m;
+	report_begin(&m);
 	if (text2lines(buf, &lines, &linecount, &strings, &stringcount) < 0)
 		EXIT(1, "Failed text to lines stage");
+	report_stage(REPORT_TEXT2LINES, &m);
+	report_phase(REPORT_PREPROCESS, &m);
 	if (output_type == PROCESSED)
 		goto end;
 
 	// Convert source lines to immediate
 	DEBUG("Converting source to immediate");
+	report_begin(&m);
 	_lines2funcs(lines, linecount, &funcs, &funccount, buf);
+	report_phase(REPORT_IMMEDIATE, &m);
 	if (output_type == IMMEDIATE)
 		goto end;
 
@@ -399,11 +593,10 @@ int main(int argc, char **argv)
 	union vasm_all **vasms = malloc(funccount * sizeof *vasms);
 	size_t *vasmcount = malloc(funccount * sizeof *vasmcount);
 	DEBUG("Converting immediate to assembly");
-	for (size_t i = 0; i < funccount; i++) {
-		DEBUG("Converting '%s'", funcs[i].name);
-		func2vasm(&vasms[i], &vasmcount[i], &funcs[i]);
-		optimizevasm(vasms[i], &vasmcount[i]);
-	}
+	report_begin(&m);
+	struct units units = { .funcs = funcs, .vasms = vasms, .vasmcount = vasmcount };
+	parallel_for(funccount, _func2vasm, &units);
+	report_phase(REPORT_ASSEMBLY, &m);
 	// Create extra assembly with string constants
 	vasms     = realloc(vasms    , (funccount + 1) * sizeof *vasms    );
 	vasmcount = realloc(vasmcount, (funccount + 1) * sizeof *vasmcount);
@@ -426,7 +619,7 @@ int main(int argc, char **argv)
 		a.s.s = num2str(l);
 		vasms[funccount][i * 3 + 0] = a;
 		a.s.op  = OP_LABEL;
-		a.s.s = strclone(b);
+		a.s.s = intern(b);
 		vasms[funccount][i * 3 + 1] = a;
 		a.s.op  = OP_RAW_STR;
 		a.s.s = strings[i];
@@ -436,46 +629,50 @@ int main(int argc, char **argv)
 		goto end;
 
 	// Convert assembly to binary
-	char *vbins[1 << 5];
-	size_t vbinlens[1 << 5];
-	struct lblmap *maps = malloc((funccount + 1 + librarycount) * sizeof *maps);
+	size_t vbincount = funccount + 1 + librarycount;
+	char **vbins = malloc(vbincount * sizeof *vbins);
+	size_t *vbinlens = malloc(vbincount * sizeof *vbinlens);
+	struct lblmap *maps = calloc(vbincount, sizeof *maps);
+	if (vbins == NULL || vbinlens == NULL || maps == NULL)
+		EXITERRNO(3, "Failed to allocate binaries");
 	DEBUG("Converting assembly to binary");
-	for (size_t i = 0; i < funccount + 1; i++) {
-		vbins[i] = malloc(1 << 20);
-		if (i != funccount)
-			DEBUG("Assembling '%s'", funcs[i].name);
-		else
-			DEBUG("Assembling strings");
-		vasm2vbin(vasms[i], vasmcount[i], vbins[i], &vbinlens[i], &maps[i]);
-		vbins[i] = realloc(vbins[i], vbinlens[i]);
-	}
+	report_begin(&m);
+	units = (struct units){ funcs, vasms, vasmcount, vbins, vbinlens, maps };
+	parallel_for(funccount + 1, _vasm2vbin, &units);
+	report_phase(REPORT_BINARY, &m);
 	if (output_type == RAW || output_type == OBJECT)
 		goto end;
 
 	// Link binary
-	char *vbin = malloc(1 << 20);
+	report_begin(&m);
 	size_t vbinlen;
-	const char *v[1 << 5];
-	for (size_t i = 0; i < funccount + 1; i++)
-		v[i] = vbins[i];
 	for (size_t i = 0; i < librarycount; i++) {
 		size_t k = i + funccount + 1;
 		int fd = open(libraries[i], O_RDONLY);
 		if (fd < 0)
 			EXITERRNO(1, "Failed to open object");
-		char buf[1 << 16];
-		size_t l = read(fd, buf, sizeof buf);
-		if (l == -1)
+		size_t l;
+		char *buf = readall(fd, &l);
+		if (buf == NULL)
 			EXITERRNO(3, "Failed to read object");
 		close(fd);
 		vbins[k] = malloc(l);
 		obj_parse(buf, l, vbins[k], &vbinlens[k], &maps[k]);
 		vbins[k] = realloc(vbins[k], vbinlens[k]);
-		v[k] = vbins[k];
+		free(buf);
 	}
+	size_t outputlen = 9;
+	for (size_t i = 0; i < vbincount; i++)
+		outputlen += vbinlens[i];
+	char *vbin = malloc(outputlen);
+	if (vbin == NULL)
+		EXITERRNO(3, "Failed to allocate executable");
 	DEBUG("Linking binary");
-	linkobj(v, vbinlens, funccount + 1 + librarycount, maps, vbin, &vbinlen);
-	vbin = realloc(vbin, vbinlen);
+	struct report_mark ml;
+	report_begin(&ml);
+	linkobj((const char **)vbins, vbinlens, vbincount, maps, vbin, &vbinlen);
+	report_stage(REPORT_LINKOBJ, &ml);
+	report_phase(REPORT_LINK, &m);
 	if (output_type == EXECUTABLE)
 		goto end;
 
@@ -490,12 +687,12 @@ end:
 	if (output_type == EXECUTABLE) {
 		DEBUG("Writing executable to '%s'", output_file);
 		int fd = fileno(_f);
-		write(fd, "\x55\x00\x20\x19", 4); // Magic number
+		write(fd, vbin_magic_exec(vasm2vbin_format), 4); // Magic number
 		write(fd, vbin, vbinlen);
 	} else if (output_type == OBJECT) {
 		DEBUG("Writing object to '%s'", output_file);
 		int fd = fileno(_f);
-		write(fd, "\x55\x10\x20\x19", 4); // Magic number
+		write(fd, vbin_magic_obj(vasm2vbin_format), 4); // Magic number
 		unsigned int l = (unsigned int)funccount;
 		write(fd, &l, 4);
 		for (size_t i = 0; i < funccount; i++) {
@@ -548,5 +745,7 @@ end:
 	if (output_type == EXECUTABLE && !streq(output_file, "-"))
 		chmod(output_file, 0766);
 
+	report_print(stderr);
+
 	return 0;
 }
@@ -37,16 +37,18 @@ int main(int argc, char **argv)
 	uint32_t magic;
 	size_t n = read(fd, &magic, sizeof magic);
 	ERROR_EOF(sizeof magic);
+	int isobj;
+	int fmt = vbin_magic_format(magic, &isobj);
 	magic = be32toh(magic);
 
-	struct lblpos lbl2pos[4096];
-	size_t lbl2poscount = 0;
-	struct lblpos pos2lbl[4096];
-	size_t pos2lblcount = 0;
+	struct lblmap map = {};
 
-	if (magic == 0x55002019) {
+	if (fmt < 0) {
+		fprintf(stderr, "Invalid magic number: 0x%08x\n", magic);
+		return 1;
+	} else if (!isobj) {
 		// yey
-	} else if (magic == 0x55102019) {
+	} else {
 		uint32_t l; 
 		// Pos to lbl
 		n = read(fd, &l, sizeof l);
@@ -64,9 +66,7 @@ int main(int argc, char **argv)
 			n = read(fd, &p, sizeof p);
 			ERROR_EOF(sizeof p);
 			p = be64toh(p);
-			lbl2pos[lbl2poscount].pos = p;
-			lbl2pos[lbl2poscount].lbl = strclone(b);
-			lbl2poscount++;
+			lblmap_add_lbl2pos(&map, strclone(b), p);
 		}
 		// Lbl to pos
 		n = read(fd, &l, sizeof l);
@@ -84,13 +84,8 @@ int main(int argc, char **argv)
 			n = read(fd, &p, sizeof p);
 			ERROR_EOF(sizeof p);
 			p = be64toh(p);
-			pos2lbl[pos2lblcount].pos = p;
-			pos2lbl[pos2lblcount].lbl = strclone(b);
-			pos2lblcount++;
+			lblmap_add_pos2lbl(&map, strclone(b), p);
 		}
-	} else {
-		fprintf(stderr, "Invalid magic number: 0x%08x\n", magic);
-		return 1;
 	}
 
 	size_t i = 0, k = 0;
@@ -118,9 +113,9 @@ int main(int argc, char **argv)
 
 		while (1) {
 
-			for (size_t j = 0; j < lbl2poscount; j++) {
-				if (lbl2pos[j].pos == k)
-					printf("%s:\n", lbl2pos[j].lbl);
+			for (size_t j = 0; j < map.lbl2poscount; j++) {
+				if (map.lbl2pos[j].pos == k)
+					printf("%s:\n", map.lbl2pos[j].lbl);
 			}
 
 			unsigned char op = buf[i];
@@ -159,7 +154,7 @@ int main(int argc, char **argv)
 			case ARGS_TYPE_SHORT:
 				CHECK(3);
 				u16 = *(uint16_t *)(buf + i);
-				u16 = be16toh(u16);
+				u16 = vbin16toh(fmt, u16);
 				i += 2;
 				snprintf(b, sizeof b, "0x%x  (%d, %u)", u16, (int16_t)u16, u16);
 				a.s.s = b;
@@ -167,7 +162,7 @@ int main(int argc, char **argv)
 			case ARGS_TYPE_INT:
 				CHECK(5);
 				u32 = *(uint32_t *)(buf + i);
-				u32 = be32toh(u32);
+				u32 = vbin32toh(fmt, u32);
 				i += 4;
 				snprintf(b, sizeof b, "0x%x  (%d, %u)", u32, (int32_t)u32, u32);
 				a.s.s = b;
@@ -175,7 +170,7 @@ int main(int argc, char **argv)
 			case ARGS_TYPE_LONG:
 				CHECK(9);
 				u64 = *(uint64_t *)(buf + i);
-				u64 = be64toh(u64);
+				u64 = vbin64toh(fmt, u64);
 				i += 8;
 				snprintf(b, sizeof b, "0x%lx  (%ld, %lu)", u64, (int64_t)u64, u64);
 				a.s.s = b;
@@ -191,7 +186,7 @@ int main(int argc, char **argv)
 				CHECK(4);
 				a.rs.r = buf[i++];
 				u16 = *(uint16_t *)(buf + i);
-				u16 = be16toh(u16);
+				u16 = vbin16toh(fmt, u16);
 				i += 2;
 				snprintf(b, sizeof b, "0x%x  (%d, %u)", u16, (int16_t)u16, u16);
 				a.rs.s = b;
@@ -200,7 +195,7 @@ int main(int argc, char **argv)
 				CHECK(6);
 				a.rs.r = buf[i++];
 				u32 = *(uint32_t *)(buf + i);
-				u32 = be32toh(u32);
+				u32 = vbin32toh(fmt, u32);
 				i += 4;
 				snprintf(b, sizeof b, "0x%x  (%d, %u)", u32, (int32_t)u32, u32);
 				a.rs.s = b;
@@ -209,11 +204,39 @@ int main(int argc, char **argv)
 				CHECK(10);
 				a.rs.r = buf[i++];
 				u64 = *(uint64_t *)(buf + i);
-				u64 = be64toh(u64);
+				u64 = vbin64toh(fmt, u64);
 				i += 8;
 				snprintf(b, sizeof b, "0x%lx  (%ld, %lu)", u64, (int64_t)u64, u64);
 				a.rs.s = b;
 				break;
+			case ARGS_TYPE_REG2INT:
+				CHECK(7);
+				a.r2s.r0 = buf[i++];
+				a.r2s.r1 = buf[i++];
+				u32 = *(uint32_t *)(buf + i);
+				u32 = vbin32toh(fmt, u32);
+				i += 4;
+				snprintf(b, sizeof b, "%d", (int32_t)u32);
+				a.r2s.s = b;
+				break;
+			case ARGS_TYPE_REG2BYTE:
+				CHECK(4);
+				a.r2s.r0 = buf[i++];
+				a.r2s.r1 = buf[i++];
+				u8 = buf[i++];
+				snprintf(b, sizeof b, "0x%x  (%d, %u)", u8, (int8_t)u8, u8);
+				a.r2s.s = b;
+				break;
+			case ARGS_TYPE_REG2LONG:
+				CHECK(11);
+				a.r2s.r0 = buf[i++];
+				a.r2s.r1 = buf[i++];
+				u64 = *(uint64_t *)(buf + i);
+				u64 = vbin64toh(fmt, u64);
+				i += 8;
+				snprintf(b, sizeof b, "0x%lx  (%ld, %lu)", u64, (int64_t)u64, u64);
+				a.r2s.s = b;
+				break;
 			case -1:
 			default:
 				CHECK(1);
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <string.h>
+#include "arena.h"
 #include "expr.h"
 #include "func.h"
 #include "hashtbl.h"
@@ -104,8 +105,9 @@ const char *parse_expr(func f, const char *str, char *istemp, const char *type,
 	// TODO
 	if (strstart(str, "new ")) {
 		// Forgive me for I am lazy
-		const char *v = new_temp_var(f, strclone(str + 4), "new", variables);
-		const char *l = strnclone(strchr(str, '[') + 1, 1); // *puke*
+		const char *v = new_temp_var(f, intern(str + 4), "new", variables);
+		const char *l = strchr(str, '[') + 1;
+		l = internn(l, strcspn(l, "]"));
 		const char *a[1] = { l };
 		line_function(f, v, "alloc", 1, a);
 		*istemp = 1;
@@ -122,7 +124,7 @@ const char *parse_expr(func f, const char *str, char *istemp, const char *type,
 		b[c - str] = 0;
 		func g = get_function(b, variables);
 		if (g != NULL) {
-			const char *x = strprintf("__e%ld", tempvarcounter++);
+			const char *x = internf("__e%ld", __sync_fetch_and_add(&tempvarcounter, 1));
 			line_declare(f, x, g->type, variables);
 			line_function_parse(f, x, str, variables);
 			*istemp = 1;
@@ -136,7 +138,7 @@ const char *parse_expr(func f, const char *str, char *istemp, const char *type,
 			goto notavar;
 	}
 	*istemp = 0;
-	return strclone(deref_var(str, f, variables, istemp));
+	return intern(deref_var(str, f, variables, istemp));
 
 notavar:;
 	// Put braces in accordance to order of precedence
@@ -293,7 +295,7 @@ done:
 	const char *z = parse_expr(f, vr, &itz, type, variables);
 
 	// Create a temporary variable
-	const char *x = strprintf("__e%ld", tempvarcounter++);
+	const char *x = internf("__e%ld", __sync_fetch_and_add(&tempvarcounter, 1));
 
 	// Declare it
 	line_declare(f, x, type, variables);
@@ -0,0 +1,555 @@
+#include "flow.h"
+#include <stdlib.h>
+#include <string.h>
+#include "types.h"
+#include "util.h"
+
+
+// A function call has at most 255 arguments and a variable
+#define MAXNAMES	256
+
+
+/**
+ * Stores the variables used by a line in n and returns how many there are.
+ */
+static size_t _uses(struct func_line *line, const char **n)
+{
+	union func_line_all_p l = { .line = line };
+	size_t k = 0;
+	switch (line->type) {
+	case ASSIGN:
+		n[k++] = l.a->value;
+		break;
+	case ASM:
+		for (size_t j = 0; j < l.as->incount; j++)
+			n[k++] = l.as->invars[j];
+		break;
+	case FUNC:
+		for (size_t j = 0; j < l.f->argcount; j++)
+			n[k++] = l.f->args[j];
+		break;
+	case IF:
+		n[k++] = l.i->var;
+		break;
+	case MATH:
+		n[k++] = l.m->y;
+		n[k++] = l.m->z;
+		break;
+	case RETURN:
+		n[k++] = l.r->val;
+		break;
+	case STORE:
+		n[k++] = l.s->var;
+		n[k++] = l.s->val;
+		n[k++] = l.s->index;
+		break;
+	default:
+		break;
+	}
+	return k;
+}
+
+
+/**
+ * Stores the variables defined by a line in n and returns how many there are.
+ */
+static size_t _defs(struct func_line *line, const char **n)
+{
+	union func_line_all_p l = { .line = line };
+	size_t k = 0;
+	switch (line->type) {
+	case ASSIGN:
+		n[k++] = l.a->var;
+		break;
+	case ASM:
+		for (size_t j = 0; j < l.as->outcount; j++)
+			n[k++] = l.as->outvars[j];
+		break;
+	case DECLARE:
+		n[k++] = l.d->var;
+		break;
+	case FUNC:
+		n[k++] = l.f->var;
+		break;
+	case MATH:
+		n[k++] = l.m->x;
+		break;
+	default:
+		break;
+	}
+	return k;
+}
+
+
+static void _track(struct flow *fl, struct hashtbl *structs, const char *var)
+{
+	if (var == NULL || strchr(var, '@') != NULL || h_get(structs, var) != -1 ||
+	    h_get(&fl->vars, var) != -1)
+		return;
+	if (h_add(&fl->vars, var, fl->varcount) < 0)
+		EXIT(3, "Failed to add variable to hashtable");
+	fl->varcount++;
+}
+
+
+/**
+ * Adds the variables of the function that fit in a register. Struct members
+ * are accessed both as a whole and one by one, so structs aren't tracked.
+ */
+static void _find_vars(struct flow *fl)
+{
+	func f = fl->f;
+	struct hashtbl structs;
+	struct type t;
+	h_create(&structs, 4);
+	for (size_t i = 0; i < f->argcount; i++) {
+		if (get_type(&t, f->args[i].type) < 0 || t.type == TYPE_STRUCT)
+			h_add(&structs, f->args[i].name, 0);
+	}
+	for (size_t i = 0; i < f->linecount; i++) {
+		union func_line_all_p l = { .line = f->lines[i] };
+		if (l.line->type == DECLARE &&
+		    (get_type(&t, l.d->type) < 0 || t.type == TYPE_STRUCT))
+			h_add(&structs, l.d->var, 0);
+	}
+
+	h_create(&fl->vars, 16);
+	fl->varcount = 0;
+	for (size_t i = 0; i < f->argcount; i++)
+		_track(fl, &structs, f->args[i].name);
+	for (size_t i = 0; i < f->linecount; i++) {
+		union func_line_all_p l = { .line = f->lines[i] };
+		if (l.line->type == DECLARE)
+			_track(fl, &structs, l.d->var);
+		else if (l.line->type == MATH)
+			_track(fl, &structs, l.m->x);
+	}
+	h_destroy(&structs);
+
+	fl->words = (fl->varcount + 63) / 64;
+	fl->names = malloc((fl->varcount + 1) * sizeof *fl->names);
+	if (fl->names == NULL)
+		EXITERRNO(3, "Failed to allocate variables");
+	for (size_t i = 0; i < fl->vars.len; i++) {
+		struct h_entry *e = &fl->vars.entries[i];
+		if (e->key != NULL)
+			fl->names[e->val] = e->key;
+	}
+}
+
+
+/**
+ * Converts the names to variable indices, skipping untracked names and
+ * duplicates, and appends them to vars. Returns the new amount.
+ */
+static size_t _add_vars(struct flow *fl, const char **n, size_t k,
+                        size_t **vars, size_t *cap, size_t count)
+{
+	size_t start = count;
+	for (size_t j = 0; j < k; j++) {
+		if (n[j] == NULL)
+			continue;
+		size_t v = h_get(&fl->vars, n[j]);
+		if (v == -1)
+			continue;
+		for (size_t p = start; p < count; p++) {
+			if ((*vars)[p] == v)
+				goto dup;
+		}
+		if (count >= *cap) {
+			*cap = *cap * 2 + 16;
+			*vars = realloc(*vars, *cap * sizeof **vars);
+			if (*vars == NULL)
+				EXITERRNO(3, "Failed to reallocate variables");
+		}
+		(*vars)[count++] = v;
+	dup:
+		continue;
+	}
+	return count;
+}
+
+
+static void _find_lines(struct flow *fl)
+{
+	func f = fl->f;
+	const char *n[MAXNAMES];
+	size_t usecap = 0, defcap = 0, uc = 0, dc = 0;
+	fl->useoff  = malloc((f->linecount + 1) * sizeof *fl->useoff);
+	fl->defoff  = malloc((f->linecount + 1) * sizeof *fl->defoff);
+	fl->usevars = fl->defvars = NULL;
+	if (fl->useoff == NULL || fl->defoff == NULL)
+		EXITERRNO(3, "Failed to allocate lines");
+	for (size_t i = 0; i < f->linecount; i++) {
+		fl->useoff[i] = uc;
+		fl->defoff[i] = dc;
+		size_t k = _uses(f->lines[i], n);
+		uc = _add_vars(fl, n, k, &fl->usevars, &usecap, uc);
+		k = _defs(f->lines[i], n);
+		dc = _add_vars(fl, n, k, &fl->defvars, &defcap, dc);
+	}
+	fl->useoff[f->linecount] = uc;
+	fl->defoff[f->linecount] = dc;
+}
+
+
+static int _ends_block(struct func_line *l)
+{
+	return l->type == IF || l->type == GOTO || l->type == RETURN ||
+	       l->type == THROW;
+}
+
+
+static void _find_blocks(struct flow *fl)
+{
+	func f = fl->f;
+	struct hashtbl labels;
+	size_t cap = 16;
+	h_create(&labels, 16);
+	fl->blockcount = 0;
+	fl->blocks = malloc(cap * sizeof *fl->blocks);
+	fl->block  = malloc((f->linecount + 1) * sizeof *fl->block);
+	if (fl->blocks == NULL || fl->block == NULL)
+		EXITERRNO(3, "Failed to allocate blocks");
+
+	for (size_t i = 0; i < f->linecount; i++) {
+		union func_line_all_p l = { .line = f->lines[i] };
+		if (i == 0 || l.line->type == LABEL || _ends_block(f->lines[i - 1])) {
+			if (fl->blockcount >= cap) {
+				cap *= 2;
+				fl->blocks = realloc(fl->blocks, cap * sizeof *fl->blocks);
+				if (fl->blocks == NULL)
+					EXITERRNO(3, "Failed to reallocate blocks");
+			}
+			fl->blocks[fl->blockcount].start = i;
+			fl->blockcount++;
+		}
+		fl->blocks[fl->blockcount - 1].end = i + 1;
+		fl->block[i] = fl->blockcount - 1;
+		if (l.line->type == LABEL)
+			h_add(&labels, l.l->label, i);
+	}
+
+	for (size_t b = 0; b < fl->blockcount; b++) {
+		struct flow_block *bl = &fl->blocks[b];
+		union func_line_all_p l = { .line = f->lines[bl->end - 1] };
+		size_t next = b + 1 < fl->blockcount ? b + 1 : FLOW_NONE;
+		size_t t;
+		bl->succ[0] = bl->succ[1] = FLOW_NONE;
+		switch (l.line->type) {
+		case GOTO:
+			t = h_get(&labels, l.g->label);
+			bl->succ[0] = t != -1 ? fl->block[t] : FLOW_NONE;
+			break;
+		case IF:
+			t = h_get(&labels, l.i->label);
+			bl->succ[0] = t != -1 ? fl->block[t] : FLOW_NONE;
+			bl->succ[1] = next;
+			break;
+		case RETURN:
+		case THROW:
+			break;
+		default:
+			bl->succ[0] = next;
+			break;
+		}
+	}
+	h_destroy(&labels);
+}
+
+
+static void _liveness(struct flow *fl)
+{
+	size_t w = fl->words, n = fl->blockcount;
+	uint64_t *use = calloc(n * w + 1, sizeof *use);
+	uint64_t *def = calloc(n * w + 1, sizeof *def);
+	fl->in  = calloc(n * w + 1, sizeof *fl->in);
+	fl->out = calloc(n * w + 1, sizeof *fl->out);
+	if (use == NULL || def == NULL || fl->in == NULL || fl->out == NULL)
+		EXITERRNO(3, "Failed to allocate live variables");
+
+	// A use is exposed if the variable isn't defined earlier in the block
+	for (size_t b = 0; b < n; b++) {
+		uint64_t *u = use + b * w, *d = def + b * w;
+		for (size_t i = fl->blocks[b].end; i-- > fl->blocks[b].start; ) {
+			flow_step(fl, i, u);
+			for (size_t k = fl->defoff[i]; k < fl->defoff[i + 1]; k++) {
+				size_t v = fl->defvars[k];
+				d[v / 64] |= 1UL << (v % 64);
+			}
+		}
+	}
+
+	// Blocks are visited in reverse as liveness flows backwards
+	int changed;
+	do {
+		changed = 0;
+		for (size_t b = n; b-- > 0; ) {
+			uint64_t *in = fl->in + b * w, *out = fl->out + b * w;
+			for (int s = 0; s < 2; s++) {
+				size_t t = fl->blocks[b].succ[s];
+				if (t == FLOW_NONE)
+					continue;
+				for (size_t k = 0; k < w; k++)
+					out[k] |= fl->in[t * w + k];
+			}
+			for (size_t k = 0; k < w; k++) {
+				uint64_t x = use[b * w + k] | (out[k] & ~def[b * w + k]);
+				if (x != in[k]) {
+					in[k] = x;
+					changed = 1;
+				}
+			}
+		}
+	} while (changed);
+
+	free(use);
+	free(def);
+}
+
+
+void flow_build(struct flow *fl, func f)
+{
+	fl->f = f;
+	fl->udoff = fl->udlines = fl->duoff = fl->dulines = NULL;
+	_find_vars(fl);
+	_find_lines(fl);
+	_find_blocks(fl);
+	_liveness(fl);
+}
+
+
+void flow_free(struct flow *fl)
+{
+	h_destroy(&fl->vars);
+	free(fl->names);
+	free(fl->blocks);
+	free(fl->block);
+	free(fl->useoff);
+	free(fl->usevars);
+	free(fl->defoff);
+	free(fl->defvars);
+	free(fl->in);
+	free(fl->out);
+	free(fl->udoff);
+	free(fl->udlines);
+	free(fl->duoff);
+	free(fl->dulines);
+}
+
+
+size_t flow_var(const struct flow *fl, const char *var)
+{
+	if (var == NULL)
+		return FLOW_NONE;
+	return h_get((struct hashtbl *)&fl->vars, var);
+}
+
+
+int flow_mentions(const struct flow *fl, size_t i, size_t v)
+{
+	for (size_t k = fl->useoff[i]; k < fl->useoff[i + 1]; k++) {
+		if (fl->usevars[k] == v)
+			return 1;
+	}
+	for (size_t k = fl->defoff[i]; k < fl->defoff[i + 1]; k++) {
+		if (fl->defvars[k] == v)
+			return 1;
+	}
+	return 0;
+}
+
+
+void flow_step(const struct flow *fl, size_t i, uint64_t *live)
+{
+	for (size_t k = fl->defoff[i]; k < fl->defoff[i + 1]; k++) {
+		size_t v = fl->defvars[k];
+		live[v / 64] &= ~(1UL << (v % 64));
+	}
+	for (size_t k = fl->useoff[i]; k < fl->useoff[i + 1]; k++) {
+		size_t v = fl->usevars[k];
+		live[v / 64] |= 1UL << (v % 64);
+	}
+}
+
+
+void flow_live_out(const struct flow *fl, size_t i, uint64_t *live)
+{
+	size_t b = fl->block[i];
+	memcpy(live, fl->out + b * fl->words, fl->words * sizeof *live);
+	for (size_t k = fl->blocks[b].end - 1; k > i; k--)
+		flow_step(fl, k, live);
+}
+
+
+/**
+ * Reaching definitions are numbered like defvars. The definition of variable
+ * v at the entry of the function is number defcount + v.
+ */
+void flow_chains(struct flow *fl)
+{
+	func f = fl->f;
+	size_t n = fl->blockcount;
+	size_t defcount = fl->defoff[f->linecount], usecount = fl->useoff[f->linecount];
+	size_t total = defcount + fl->varcount, w = (total + 63) / 64;
+
+	// The lines of all definitions of each variable
+	size_t *vdoff = calloc(fl->varcount + 2, sizeof *vdoff);
+	size_t *vd    = malloc((total + 1) * sizeof *vd);
+	size_t *line  = malloc((total + 1) * sizeof *line);
+	if (vdoff == NULL || vd == NULL || line == NULL)
+		EXITERRNO(3, "Failed to allocate definitions");
+	for (size_t i = 0; i < f->linecount; i++) {
+		for (size_t k = fl->defoff[i]; k < fl->defoff[i + 1]; k++) {
+			vdoff[fl->defvars[k] + 2]++;
+			line[k] = i;
+		}
+	}
+	for (size_t v = 0; v < fl->varcount; v++) {
+		vdoff[v + 2]++;
+		line[defcount + v] = FLOW_ENTRY;
+	}
+	for (size_t v = 0; v < fl->varcount; v++)
+		vdoff[v + 2] += vdoff[v + 1];
+	for (size_t d = 0; d < defcount; d++)
+		vd[vdoff[fl->defvars[d] + 1]++] = d;
+	for (size_t v = 0; v < fl->varcount; v++)
+		vd[vdoff[v + 1]++] = defcount + v;
+
+	// The last definition of each variable in a block is the only one of
+	// that variable that reaches the end of it
+	size_t *last = malloc((fl->varcount + 1) * sizeof *last);
+	uint64_t *in  = calloc(n * w + 1, sizeof *in);
+	uint64_t *out = malloc((w + 1) * sizeof *out);
+	if (last == NULL || in == NULL || out == NULL)
+		EXITERRNO(3, "Failed to allocate reaching definitions");
+	memset(last, 0xff, fl->varcount * sizeof *last);
+	if (n > 0) {
+		for (size_t v = 0; v < fl->varcount; v++)
+			in[(defcount + v) / 64] |= 1UL << ((defcount + v) % 64);
+	}
+	int changed;
+	do {
+		changed = 0;
+		for (size_t b = 0; b < n; b++) {
+			struct flow_block *bl = &fl->blocks[b];
+			memcpy(out, in + b * w, w * sizeof *out);
+			for (size_t k = fl->defoff[bl->start]; k < fl->defoff[bl->end]; k++) {
+				size_t v = fl->defvars[k];
+				if (last[v] == -1) {
+					for (size_t j = vdoff[v]; j < vdoff[v + 1]; j++)
+						out[vd[j] / 64] &= ~(1UL << (vd[j] % 64));
+				}
+				last[v] = k;
+			}
+			for (size_t k = fl->defoff[bl->end]; k-- > fl->defoff[bl->start]; ) {
+				size_t v = fl->defvars[k];
+				if (last[v] == k) {
+					out[k / 64] |= 1UL << (k % 64);
+					last[v] = -1;
+				}
+			}
+			for (int s = 0; s < 2; s++) {
+				size_t t = bl->succ[s];
+				if (t == FLOW_NONE)
+					continue;
+				for (size_t k = 0; k < w; k++) {
+					if (out[k] & ~in[t * w + k]) {
+						in[t * w + k] |= out[k];
+						changed = 1;
+					}
+				}
+			}
+		}
+	} while (changed);
+
+	// Walk each block and link every use to the definitions reaching it
+	size_t cap = usecount + 16, count = 0;
+	size_t *ud = malloc(cap * sizeof *ud);
+	fl->udoff = malloc((usecount + 1) * sizeof *fl->udoff);
+	if (ud == NULL || fl->udoff == NULL)
+		EXITERRNO(3, "Failed to allocate chains");
+	for (size_t b = 0; b < n; b++) {
+		struct flow_block *bl = &fl->blocks[b];
+		for (size_t i = bl->start; i < bl->end; i++) {
+			for (size_t u = fl->useoff[i]; u < fl->useoff[i + 1]; u++) {
+				size_t v = fl->usevars[u];
+				fl->udoff[u] = count;
+				if (count + vdoff[v + 1] - vdoff[v] >= cap) {
+					cap = cap * 2 + vdoff[v + 1] - vdoff[v];
+					ud = realloc(ud, cap * sizeof *ud);
+					if (ud == NULL)
+						EXITERRNO(3, "Failed to reallocate chains");
+				}
+				if (last[v] != -1) {
+					ud[count++] = last[v];
+					continue;
+				}
+				for (size_t j = vdoff[v]; j < vdoff[v + 1]; j++) {
+					size_t d = vd[j];
+					if (in[b * w + d / 64] >> (d % 64) & 1)
+						ud[count++] = d;
+				}
+			}
+			for (size_t k = fl->defoff[i]; k < fl->defoff[i + 1]; k++)
+				last[fl->defvars[k]] = k;
+		}
+		for (size_t k = fl->defoff[bl->start]; k < fl->defoff[bl->end]; k++)
+			last[fl->defvars[k]] = -1;
+	}
+	fl->udoff[usecount] = count;
+
+	// Invert the use-def chains
+	fl->duoff   = calloc(defcount + 2, sizeof *fl->duoff);
+	fl->dulines = malloc((count + 1) * sizeof *fl->dulines);
+	fl->udlines = malloc((count + 1) * sizeof *fl->udlines);
+	if (fl->duoff == NULL || fl->dulines == NULL || fl->udlines == NULL)
+		EXITERRNO(3, "Failed to allocate chains");
+	for (size_t k = 0; k < count; k++) {
+		if (ud[k] < defcount)
+			fl->duoff[ud[k] + 2]++;
+	}
+	for (size_t d = 0; d < defcount; d++)
+		fl->duoff[d + 2] += fl->duoff[d + 1];
+	for (size_t i = 0; i < f->linecount; i++) {
+		for (size_t u = fl->useoff[i]; u < fl->useoff[i + 1]; u++) {
+			for (size_t k = fl->udoff[u]; k < fl->udoff[u + 1]; k++) {
+				if (ud[k] < defcount)
+					fl->dulines[fl->duoff[ud[k] + 1]++] = i;
+				fl->udlines[k] = line[ud[k]];
+			}
+		}
+	}
+
+	free(ud);
+	free(vdoff);
+	free(vd);
+	free(line);
+	free(last);
+	free(in);
+	free(out);
+}
+
+
+size_t flow_defs(const struct flow *fl, size_t i, size_t v, const size_t **lines)
+{
+	for (size_t u = fl->useoff[i]; u < fl->useoff[i + 1]; u++) {
+		if (fl->usevars[u] == v) {
+			*lines = fl->udlines + fl->udoff[u];
+			return fl->udoff[u + 1] - fl->udoff[u];
+		}
+	}
+	return 0;
+}
+
+
+size_t flow_uses(const struct flow *fl, size_t i, size_t v, const size_t **lines)
+{
+	for (size_t d = fl->defoff[i]; d < fl->defoff[i + 1]; d++) {
+		if (fl->defvars[d] == v) {
+			*lines = fl->dulines + fl->duoff[d];
+			return fl->duoff[d + 1] - fl->duoff[d];
+		}
+	}
+	return 0;
+}
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include "arena.h"
 #include "expr.h"
 #include "func.h"
 #include "hashtbl.h"
@@ -12,6 +14,7 @@
 thread_local func _current_func;
 #endif
 struct hashtbl functions;
+static pthread_rwlock_t functionslock = PTHREAD_RWLOCK_INITIALIZER;
 
 /*****
  * Shorthand functions for common lines
@@ -34,7 +37,7 @@ void insert_line(func f, struct func_line *l)
 
 void line_assign(func f, const char *var, const char *val)
 {
-	struct func_line_assign *a = malloc(sizeof *a);
+	struct func_line_assign *a = arena_alloc(&unit_arena, sizeof *a);
 	a->type  = ASSIGN;
 	a->var   = var;
 	a->value = val;
@@ -47,7 +50,7 @@ void line_asm(func f, const char **vasms, size_t vasmcount,
               const char **invars , const char *inregs , size_t incount,
               const char **outvars, const char *outregs, size_t outcount)
 {
-	struct func_line_asm *a = malloc(sizeof *a);
+	struct func_line_asm *a = arena_alloc(&unit_arena, sizeof *a);
 	a->type      = ASM;
 	a->vasms     = vasms;
 	a->vasmcount = vasmcount;
@@ -68,7 +71,7 @@ void line_asm(func f, const char **vasms, size_t vasmcount,
 void line_declare(func f, const char *name, const char *type, hashtbl variables)
 {
 	assert(type != NULL);
-	struct func_line_declare *d = malloc(sizeof *d);
+	struct func_line_declare *d = arena_alloc(&unit_arena, sizeof *d);
 	d->_type = DECLARE;
 	d->var   = name;
 	d->type  = type;
@@ -81,7 +84,7 @@ void line_declare(func f, const char *name, const char *type, hashtbl variables)
 	if (t.type == TYPE_STRUCT) {
 		struct type_meta_struct *m = (void *)&t.meta;
 		for (size_t i = 0; i < m->count; i++) {
-			const char *n = strprintf("%s@%s", name, m->names[i]);
+			const char *n = internf("%s@%s", name, m->names[i]);
 			h_add(variables, n, (size_t)m->types[i]);
 		}
 	}
@@ -90,7 +93,7 @@ void line_declare(func f, const char *name, const char *type, hashtbl variables)
 
 void line_destroy(func f, const char *var, hashtbl variables)
 {
-	struct func_line_destroy *d = malloc(sizeof *d);
+	struct func_line_destroy *d = arena_alloc(&unit_arena, sizeof *d);
 	d->_type = DESTROY;
 	d->var   = var;
 	insert_line(f, (struct func_line *)d);
@@ -101,12 +104,12 @@ void line_destroy(func f, const char *var, hashtbl variables)
 void line_function(func f, const char *var, const char *func,
                    size_t argcount, const char **args)
 {
-	struct func_line_func *g = malloc(sizeof *g);
+	struct func_line_func *g = arena_alloc(&unit_arena, sizeof *g);
 	g->type     = FUNC;
 	g->var      = var;
 	g->name     = func;
 	g->argcount = argcount;
-	g->args     = malloc(argcount * sizeof *g->args);
+	g->args     = arena_alloc(&unit_arena, argcount * sizeof *g->args);
 	for (size_t i = 0; i < argcount; i++)
 		g->args[i] = args[i];
 	insert_line(f, (struct func_line *)g);
@@ -119,7 +122,7 @@ void line_function_parse(func f, const char *var, const char *str,
 	const char *c = str;
 	while (*c != ' ' && *c != 0)
 		c++;
-	const char *name = strnclone(str, c - str);
+	const char *name = internn(str, c - str);
 	func g = get_function(name, variables);
 	if (g == NULL)
 		EXIT(1, "Function '%s' not declared", name);
@@ -128,7 +131,7 @@ void line_function_parse(func f, const char *var, const char *str,
 	char        etemp[32] = {};
 	// If function call is part of a class, prepend the variable
 	if (!streq(g->name, name))
-		args[argcount++] = strnclone(name, strchr(name, '.') - name);
+		args[argcount++] = internn(name, strchr(name, '.') - name);
 	if (*c != 0) {
 		c++;
 		while (1) {
@@ -141,7 +144,7 @@ void line_function_parse(func f, const char *var, const char *str,
 			const char *type = g->args[argcount].type;
 			args[argcount] = parse_expr(f, b, &etemp[argcount], type, variables);
 			if (!etemp[argcount])
-				args[argcount] = strclone(args[argcount]);
+				args[argcount] = intern(args[argcount]);
 			argcount++;
 			if (*c == 0)
 				break;
@@ -159,7 +162,7 @@ void line_function_parse(func f, const char *var, const char *str,
 
 void line_goto(func f, const char *label)
 {
-	struct func_line_goto *g = malloc(sizeof *g);
+	struct func_line_goto *g = arena_alloc(&unit_arena, sizeof *g);
 	g->type  = GOTO;
 	g->label = label;
 	insert_line(f, (struct func_line *)g);
@@ -168,7 +171,7 @@ void line_goto(func f, const char *label)
 
 void line_if(func f, const char *val, const char *label, int inv)
 {
-	struct func_line_if *i = malloc(sizeof *i);
+	struct func_line_if *i = arena_alloc(&unit_arena, sizeof *i);
 	i->type  = IF;
 	i->label = label;
 	i->var   = val;
@@ -179,7 +182,7 @@ void line_if(func f, const char *val, const char *label, int inv)
 
 void line_label(func f, const char *label)
 {
-	struct func_line_label *l = malloc(sizeof *l);
+	struct func_line_label *l = arena_alloc(&unit_arena, sizeof *l);
 	l->type  = LABEL;
 	l->label = label;
 	insert_line(f, (struct func_line *)l);
@@ -194,7 +197,7 @@ void line_load(func f, const char *var, const char *pointer, const char *index)
 
 void line_math(func f, int op, const char *x, const char *y, const char *z)
 {
-	struct func_line_math *m = malloc(sizeof *m);
+	struct func_line_math *m = arena_alloc(&unit_arena, sizeof *m);
 	m->type = MATH;
 	m->op   = op;
 	m->x    = x;
@@ -206,7 +209,7 @@ void line_math(func f, int op, const char *x, const char *y, const char *z)
 
 void line_return(func f, const char *val)
 {
-	struct func_line_return *r = malloc(sizeof *r);
+	struct func_line_return *r = arena_alloc(&unit_arena, sizeof *r);
 	r->type = RETURN;
 	r->val  = val;
 	insert_line(f, (struct func_line *)r);
@@ -215,7 +218,7 @@ void line_return(func f, const char *val)
 
 void line_store(func f, const char *arr, const char *index, const char *val)
 {
-	struct func_line_store *s = malloc(sizeof *s);
+	struct func_line_store *s = arena_alloc(&unit_arena, sizeof *s);
 	s->type  = STORE;
 	s->var   = arr;
 	s->index = index;
@@ -225,7 +228,7 @@ void line_store(func f, const char *arr, const char *index, const char *val)
 
 void line_throw(func f, const char *expr)
 {
-	struct func_line *l = malloc(sizeof *l);
+	struct func_line *l = arena_alloc(&unit_arena, sizeof *l);
 	l->type = THROW;
 	insert_line(f, l);
 }
@@ -236,9 +239,9 @@ const char *new_temp_var(func f, const char *type, const char *name, hashtbl var
 	static int i = 0;
 	const char *v;
 	if (name != NULL)
-		v = strprintf("__%s%u", name, i++);
+		v = internf("__%s%u", name, __sync_fetch_and_add(&i, 1));
 	else
-		v = strprintf("__t%u", i++);
+		v = internf("__t%u", __sync_fetch_and_add(&i, 1));
 	line_declare(f, v, type, variables);
 	return v;
 }
@@ -262,7 +265,7 @@ struct func_line *copy_line(const struct func_line *l)
 	default:
 		EXIT(1, "Unknown line type (%d)", l->type);
 	}
-	a.a = malloc(s);
+	a.a = arena_alloc(&unit_arena, s);
 	memcpy(a.a, l, s);
 	return a.line;
 }
@@ -375,9 +378,12 @@ void line2str(struct func_line *l, char *buf, size_t bufsize)
 
 int add_function(func f)
 {
+	pthread_rwlock_wrlock(&functionslock);
 	if (functions.len == 0)
 		h_create(&functions, 32);
-	return h_add(&functions, f->name, (size_t)f);
+	int r = h_add(&functions, f->name, (size_t)f);
+	pthread_rwlock_unlock(&functionslock);
+	return r;
 }
 
 
@@ -387,8 +393,10 @@ func get_function(const char *str, hashtbl variables)
 	const char *name = get_function_name(str, variables);
 	if (name == NULL)
 		name = str;
-	func f;
-	if (h_get2(&functions, name, (size_t *)&f) < 0)
-		return NULL;
+	func f = NULL;
+	pthread_rwlock_rdlock(&functionslock);
+	if (functions.len > 0)
+		h_get2(&functions, name, (size_t *)&f);
+	pthread_rwlock_unlock(&functionslock);
 	return f;
 }
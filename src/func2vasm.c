@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "arena.h"
+#include "flow.h"
 #include "vasm.h"
 #include "func.h"
 #include "hashtbl.h"
@@ -36,7 +38,7 @@ static size_t _get_type_size(const char *type)
 
 
 
-static void _reserve_stack_space(union vasm_all **v, size_t *vc, char reg, const char *type)
+static int _reserve_stack_space(union vasm_all **v, size_t *vc, char reg, const char *type)
 {
 	const char *c = strchr(type, '[');
 	if (c != NULL) {
@@ -44,7 +46,7 @@ static void _reserve_stack_space(union vasm_all **v, size_t *vc, char reg, const
 		const char *d = strchr(c, ']');
 		if (c == d) {
 			// Dynamic array
-			return;
+			return 0;
 		} else {
 			// Fixed array
 			char b[21];
@@ -60,7 +62,7 @@ static void _reserve_stack_space(union vasm_all **v, size_t *vc, char reg, const
 
 			a.rs.op = OP_SET;
 			a.rs.r  = 29;
-			a.rs.s  = strprintf("%lu", l);
+			a.rs.s  = internf("%lu", l);
 			(*v)[(*vc)++] = a;
 
 			a.r2.op = OP_MOV;
@@ -73,8 +75,10 @@ static void _reserve_stack_space(union vasm_all **v, size_t *vc, char reg, const
 			a.r3.r1=31;
 			a.r3.r2=29;
 			(*v)[(*vc)++] = a;
+			return 1;
 		}
 	}
+	return 0;
 }
 
 
@@ -92,19 +96,734 @@ static const char *_get_var_type(func f, ssize_t k, const char *var)
 
 
 
+/**
+ * Registers that are never assigned to variables:
+ * - r20, r21 and r22 hold immediates and spilled variables for the duration of
+ *   a single line.
+ * - r29 is a scratch register for stack offsets.
+ * - r30 and r31 are the frame and stack pointer.
+ *
+ * Locations in the variable table below REG_SPILLED are registers, the others
+ * are spill slots relative to the frame pointer.
+ */
+#define REG_TMP_Y	20
+#define REG_TMP_Z	21
+#define REG_TMP_X	22
+#define REG_SCRATCH	29
+#define REG_SPILLED	32
+
+#define ISALLOCATABLE(r) ((r) < REG_TMP_Y || (REG_TMP_X < (r) && (r) < REG_SCRATCH))
+
+/**
+ * Calling convention: a callee may clobber r0 - r15 (r0 holds the returned
+ * value) and the temporaries. The other allocatable registers are preserved by
+ * the callee if it uses them.
+ */
+#define ISCALLEESAVED(r) (ISALLOCATABLE(r) && (r) >= 16)
+
+
+/**
+ * Returns the opcode with an immediate operand that computes the given math
+ * line or -1 if there is none. var and imm are set to the register and the
+ * immediate operand.
+ */
+static int _math_imm(struct func_line_math *m, const char **var, const char **imm)
+{
+	int op;
+	switch (m->op) {
+	case MATH_ADD   : op = OP_ADDI   ; break;
+	case MATH_SUB   : op = OP_SUBI   ; break;
+	case MATH_MUL   : op = OP_MULI   ; break;
+	case MATH_AND   : op = OP_ANDI   ; break;
+	case MATH_LSHIFT: op = OP_LSHIFTI; break;
+	case MATH_RSHIFT: op = OP_RSHIFTI; break;
+	case MATH_LESS  : op = OP_LESSI  ; break;
+	default:
+		return -1;
+	}
+	const char *y = m->y, *z = m->z;
+	if (isnum(*y) && (op == OP_ADDI || op == OP_MULI || op == OP_ANDI))
+		SWAP(const char *, y, z);
+	if (isnum(*y) || !isnum(*z))
+		return -1;
+	char *end;
+	long v = strtol(z, &end, 0);
+	if (*end != 0 || v < INT32_MIN || v > INT32_MAX)
+		return -1;
+	*var = y;
+	*imm = z;
+	return op;
+}
+
+
+/**
+ * Returns whether the math line at i is a comparison that only serves as the
+ * condition of the if line following it, in which case both can be replaced
+ * with a single compare and branch instruction.
+ */
+static int _cond_branch(struct func *f, size_t i)
+{
+	union func_line_all_p l, n;
+	if (i + 1 >= f->linecount)
+		return 0;
+	l.line = f->lines[i];
+	n.line = f->lines[i + 1];
+	if (l.line->type != MATH || n.line->type != IF)
+		return 0;
+	if (l.m->op != MATH_LESS && l.m->op != MATH_LESSE && l.m->op != MATH_SUB)
+		return 0;
+	return streq(l.m->x, n.i->var);
+}
+
+
+/**
+ * The live range of a variable. Positions are line indices + 1, position 0 is
+ * the function prologue.
+ */
+struct interval {
+	const char *var;
+	size_t start, end;
+	int    reg;
+	size_t slot;
+	char   fixed;
+	char   nospill;
+	char   crosscall;
+	// The index of the variable in the flow of the function
+	size_t flowvar;
+};
+
+struct intervals {
+	struct interval *iv;
+	size_t count, cap;
+	struct hashtbl index;
+};
+
+
+static void _add_interval(struct intervals *ivs, const char *var, size_t pos,
+                          int reg, char nospill)
+{
+	size_t k = h_get(&ivs->index, var);
+	if (k != -1) {
+		if (ivs->iv[k].start > pos)
+			ivs->iv[k].start = pos;
+		return;
+	}
+	if (ivs->count >= ivs->cap) {
+		ivs->cap = ivs->cap * 3 / 2 + 8;
+		ivs->iv  = realloc(ivs->iv, ivs->cap * sizeof *ivs->iv);
+		if (ivs->iv == NULL)
+			EXITERRNO(3, "Failed to reallocate intervals");
+	}
+	struct interval *i = &ivs->iv[ivs->count];
+	i->var     = var;
+	i->start   = i->end = pos;
+	i->reg     = reg;
+	i->fixed   = reg != -1;
+	i->nospill = nospill;
+	i->crosscall = 0;
+	if (h_add(&ivs->index, var, ivs->count++) < 0)
+		EXIT(3, "Failed to add variable to hashtable");
+}
+
+
+static void _touch(struct intervals *ivs, struct hashtbl *structs,
+                   const char *var, size_t pos)
+{
+	const char *type;
+	if (var == NULL || isnum(*var))
+		return;
+	if (h_get2(structs, var, (size_t *)&type) != -1) {
+		struct type t;
+		get_type(&t, type);
+		struct type_meta_struct *m = (void *)&t.meta;
+		for (size_t i = 0; i < m->count; i++)
+			_touch(ivs, structs, internf("%s@%s", var, m->names[i]), pos);
+		return;
+	}
+	size_t k = h_get(&ivs->index, var);
+	if (k == -1)
+		return;
+	if (ivs->iv[k].start > pos)
+		ivs->iv[k].start = pos;
+	if (ivs->iv[k].end < pos)
+		ivs->iv[k].end = pos;
+}
+
+
+static void _add_struct(struct intervals *ivs, struct hashtbl *structs,
+                        const char *var, const char *type, size_t pos, int *reg)
+{
+	struct type t;
+	get_type(&t, type);
+	if (h_get(structs, var) == -1 && h_add(structs, var, (size_t)type) < 0)
+		EXIT(3, "Failed to add variable to hashtable");
+	struct type_meta_struct *m = (void *)&t.meta;
+	for (size_t i = 0; i < m->count; i++) {
+		const char *n = internf("%s@%s", var, m->names[i]);
+		_add_interval(ivs, n, pos, reg != NULL ? (*reg)++ : -1, 1);
+	}
+}
+
+
+static void _parse_asm(union vasm_all *a, const char *line)
+{
+	char buf[32], *b = buf;
+	const char *c = line;
+	while (*c != ' ' && *c != 0)
+		*b++ = *c++;
+	*b = 0;
+	if (*c != 0)
+		c++;
+	a->op = getop(buf);
+	b = buf;
+	while (*c != 0)
+		*b++ = *c++;
+	*b = 0;
+	parse_op_args(a, buf);
+}
+
+
+/**
+ * Mark the registers that may be modified by inline assembly. Returns whether
+ * the assembly calls a function.
+ */
+static int _asm_clobbers(struct func_line_asm *as, char regs[32])
+{
+	int call = 0;
+	for (size_t i = 0; i < as->incount; i++)
+		regs[(int)as->inregs[i]] = 1;
+	for (size_t i = 0; i < as->outcount; i++)
+		regs[(int)as->outregs[i]] = 1;
+	for (size_t i = 0; i < as->vasmcount; i++) {
+		union vasm_all a;
+		_parse_asm(&a, as->vasms[i]);
+		switch (get_vasm_args_type(a.op)) {
+		case ARGS_TYPE_REG1:
+			regs[(int)a.r.r] = 1;
+			break;
+		case ARGS_TYPE_REG2:
+			regs[(int)a.r2.r0] = regs[(int)a.r2.r1] = 1;
+			break;
+		case ARGS_TYPE_REG3:
+			regs[(int)a.r3.r0] = regs[(int)a.r3.r1] = regs[(int)a.r3.r2] = 1;
+			break;
+		case ARGS_TYPE_REG2INT:
+			regs[(int)a.r2s.r0] = regs[(int)a.r2s.r1] = 1;
+			break;
+		case ARGS_TYPE_REGBYTE:
+		case ARGS_TYPE_REGSHORT:
+		case ARGS_TYPE_REGINT:
+		case ARGS_TYPE_REGLONG:
+			regs[(int)a.rs.r] = 1;
+			break;
+		default:
+			break;
+		}
+		if (a.op == OP_POPM) {
+			uint32_t mask = strtol(a.s.s, NULL, 0);
+			for (int r = 0; r < 32; r++)
+				regs[r] |= (mask >> r) & 1;
+		}
+		if (a.op == OP_CALL)
+			call = 1;
+	}
+	if (call) {
+		for (int r = 0; r < 32; r++) {
+			if (!ISCALLEESAVED(r) && r != 30 && r != 31)
+				regs[r] = 1;
+		}
+	}
+	return call;
+}
+
+
+/**
+ * Returns whether the value variable v has before line i is still needed
+ * after it, given the variables that are live after the line.
+ */
+static int _live_after(const struct flow *flow, size_t i, const uint64_t *live,
+                       size_t v)
+{
+	if (!flow_has(live, v))
+		return 0;
+	for (size_t k = flow->defoff[i]; k < flow->defoff[i + 1]; k++) {
+		if (flow->defvars[k] == v)
+			return 0;
+	}
+	return 1;
+}
+
+
+/**
+ * Determine the live range of every variable. A variable is live from its
+ * first to its last occurence. Ranges of variables that are live at the start
+ * of a loop are extended to the jump back to the start.
+ */
+static void _live_intervals(struct func *f, const struct flow *flow,
+                            struct intervals *ivs, struct hashtbl *structs,
+                            struct hashtbl *types)
+{
+	union func_line_all_p l;
+	struct type type;
+
+	// Function arguments are passed in r0, r1, ...
+	for (size_t i = 0, r = 0; i < f->argcount; i++) {
+		const char *ft = f->args[i].type, *fn = f->args[i].name;
+		if (get_type(&type, ft) < 0)
+			EXIT(3, "Type '%s' not declared", ft);
+		if (type.type == TYPE_STRUCT) {
+			int reg = r;
+			_add_struct(ivs, structs, fn, ft, 0, &reg);
+			r = reg;
+		} else {
+			_add_interval(ivs, fn, 0, r++, 0);
+			h_add(types, fn, (size_t)ft);
+		}
+		if (r > REG_TMP_Y)
+			EXIT(1, "Too many arguments for function '%s'", f->name);
+	}
+
+	// Find all variables
+	for (size_t i = 0; i < f->linecount; i++) {
+		l.line = f->lines[i];
+		switch (l.line->type) {
+		case DECLARE:
+			if (get_type(&type, l.d->type) < 0)
+				EXIT(3, "Type '%s' not declared", l.d->type);
+			if (type.type == TYPE_STRUCT) {
+				_add_struct(ivs, structs, l.d->var, l.d->type, i + 1, NULL);
+			} else {
+				_add_interval(ivs, l.d->var, i + 1, -1, 0);
+				h_add(types, l.d->var, (size_t)l.d->type);
+			}
+			break;
+		case MATH:
+			if (h_get(structs, l.m->x) == -1)
+				_add_interval(ivs, l.m->x, i + 1, -1, 0);
+			break;
+		default:
+			break;
+		}
+	}
+
+	// Find the first and last occurence of each variable
+	for (size_t i = 0; i < f->linecount; i++) {
+		size_t p = i + 1;
+		l.line = f->lines[i];
+		switch (l.line->type) {
+		case ASSIGN:
+			_touch(ivs, structs, l.a->var  , p);
+			_touch(ivs, structs, l.a->value, p);
+			break;
+		case ASM:
+			for (size_t j = 0; j < l.as->incount; j++)
+				_touch(ivs, structs, l.as->invars[j], p);
+			for (size_t j = 0; j < l.as->outcount; j++)
+				_touch(ivs, structs, l.as->outvars[j], p);
+			break;
+		case DECLARE:
+			_touch(ivs, structs, l.d->var, p);
+			break;
+		case FUNC:
+			_touch(ivs, structs, l.f->var, p);
+			for (size_t j = 0; j < l.f->argcount; j++)
+				_touch(ivs, structs, l.f->args[j], p);
+			break;
+		case IF:
+			_touch(ivs, structs, l.i->var, p);
+			break;
+		case MATH:
+			_touch(ivs, structs, l.m->x, p);
+			_touch(ivs, structs, l.m->y, p);
+			_touch(ivs, structs, l.m->z, p);
+			break;
+		case RETURN:
+			_touch(ivs, structs, l.r->val, p);
+			break;
+		case STORE:
+			_touch(ivs, structs, l.s->var  , p);
+			_touch(ivs, structs, l.s->val  , p);
+			_touch(ivs, structs, l.s->index, p);
+			break;
+		default:
+			break;
+		}
+	}
+
+	for (size_t k = 0; k < ivs->count; k++)
+		ivs->iv[k].flowvar = flow_var(flow, ivs->iv[k].var);
+
+	// Extend the ranges over loops
+	struct hashtbl labels;
+	h_create(&labels, 16);
+	for (size_t i = 0; i < f->linecount; i++) {
+		l.line = f->lines[i];
+		if (l.line->type == LABEL)
+			h_add(&labels, l.l->label, i + 1);
+	}
+	int changed;
+	do {
+		changed = 0;
+		for (size_t i = 0; i < f->linecount; i++) {
+			size_t t;
+			l.line = f->lines[i];
+			if (l.line->type == GOTO)
+				t = h_get(&labels, l.g->label);
+			else if (l.line->type == IF)
+				t = h_get(&labels, l.i->label);
+			else
+				continue;
+			if (t == -1 || t > i + 1)
+				continue;
+			const uint64_t *in = flow->in + flow->block[t - 1] * flow->words;
+			for (size_t k = 0; k < ivs->count; k++) {
+				struct interval *iv = &ivs->iv[k];
+				if (iv->start < t && t <= iv->end && iv->end < i + 1 &&
+				    flow_has(in, iv->flowvar)) {
+					iv->end = i + 1;
+					changed = 1;
+				}
+			}
+		}
+	} while (changed);
+	h_destroy(&labels);
+
+	// Find the ranges that need to survive a call
+	uint64_t *live = malloc((flow->words + 1) * sizeof *live);
+	if (live == NULL)
+		EXITERRNO(3, "Failed to allocate live variables");
+	for (size_t b = 0; b < flow->blockcount; b++) {
+		memcpy(live, flow->out + b * flow->words, flow->words * sizeof *live);
+		for (size_t i = flow->blocks[b].end; i-- > flow->blocks[b].start; ) {
+			char regs[32] = {};
+			l.line = f->lines[i];
+			if (l.line->type == FUNC ||
+			    (l.line->type == ASM && _asm_clobbers(l.as, regs))) {
+				for (size_t k = 0; k < ivs->count; k++) {
+					struct interval *iv = &ivs->iv[k];
+					if (iv->start < i + 1 && i + 1 < iv->end &&
+					    _live_after(flow, i, live, iv->flowvar))
+						iv->crosscall = 1;
+				}
+			}
+			flow_step(flow, i, live);
+		}
+	}
+	free(live);
+}
+
+
+static int _cmp_interval(const void *a, const void *b)
+{
+	const struct interval *x = a, *y = b;
+	if (x->start != y->start)
+		return x->start < y->start ? -1 : 1;
+	return y->fixed - x->fixed;
+}
+
+
+/**
+ * Assign a register or a spill slot to each interval. If no register is free,
+ * the interval that ends last is spilled. Intervals that live across a call
+ * prefer callee saved registers, the others prefer caller saved registers.
+ */
+static size_t _linear_scan(struct intervals *ivs)
+{
+	size_t slots = 0;
+	size_t active[32], activecount = 0;
+	char   used[32];
+	memset(used, 0, sizeof used);
+
+	qsort(ivs->iv, ivs->count, sizeof *ivs->iv, _cmp_interval);
+
+	for (size_t k = 0; k < ivs->count; k++) {
+		struct interval *c = &ivs->iv[k];
+
+		// Expire old intervals
+		for (size_t j = 0; j < activecount; ) {
+			struct interval *a = &ivs->iv[active[j]];
+			if (a->end < c->start) {
+				used[a->reg] = 0;
+				active[j] = active[--activecount];
+			} else {
+				j++;
+			}
+		}
+
+		if (!c->fixed) {
+			for (int r = 0; r < 32 && c->reg == -1; r++) {
+				if (ISALLOCATABLE(r) && !used[r] &&
+				    !ISCALLEESAVED(r) == !c->crosscall)
+					c->reg = r;
+			}
+			for (int r = 0; r < 32 && c->reg == -1; r++) {
+				if (ISALLOCATABLE(r) && !used[r])
+					c->reg = r;
+			}
+		}
+		if (c->reg != -1) {
+			assert(!used[c->reg]);
+			used[c->reg] = 1;
+			active[activecount++] = k;
+			continue;
+		}
+
+		// Spill the interval that ends last
+		size_t s = -1;
+		for (size_t j = 0; j < activecount; j++) {
+			struct interval *a = &ivs->iv[active[j]];
+			if (!a->nospill && (s == -1 || a->end > ivs->iv[active[s]].end))
+				s = j;
+		}
+		if (s != -1 && (c->nospill || ivs->iv[active[s]].end > c->end)) {
+			struct interval *a = &ivs->iv[active[s]];
+			c->reg    = a->reg;
+			a->reg    = -1;
+			a->slot   = slots++;
+			active[s] = k;
+		} else if (!c->nospill) {
+			c->slot = slots++;
+		} else {
+			EXIT(1, "Not enough registers for struct members");
+		}
+	}
+
+	return slots;
+}
+
+
+static void _stack_access(union vasm_all *v, size_t *vc, enum vasm_op op,
+                          int reg, size_t slot)
+{
+	union vasm_all a;
+	a.rs.op = OP_SET;
+	a.rs.r  = REG_SCRATCH;
+	a.rs.s  = internf("%lu", slot * 8);
+	v[(*vc)++] = a;
+	a.r3.op = op;
+	a.r3.r0 = reg;
+	a.r3.r1 = 30;
+	a.r3.r2 = REG_SCRATCH;
+	v[(*vc)++] = a;
+}
+
+
+/**
+ * Returns the register that holds the given variable. Spilled variables are
+ * loaded into tmp first. If var isn't a variable, -1 is returned.
+ */
+static int _use(union vasm_all *v, size_t *vc, struct hashtbl *tbl,
+                const char *var, int tmp)
+{
+	size_t loc = h_get(tbl, var);
+	if (loc == -1)
+		return -1;
+	if (loc < REG_SPILLED)
+		return loc;
+	_stack_access(v, vc, OP_LDLAT, tmp, loc - REG_SPILLED);
+	return tmp;
+}
+
+
+/**
+ * Returns the register a value for the given variable should be written to.
+ * _def_end must be called after writing.
+ */
+static int _def(struct hashtbl *tbl, const char *var, int tmp)
+{
+	size_t loc = h_get(tbl, var);
+	if (loc == -1)
+		return -1;
+	return loc < REG_SPILLED ? loc : tmp;
+}
+
+
+static void _def_end(union vasm_all *v, size_t *vc, struct hashtbl *tbl,
+                     const char *var, int reg)
+{
+	size_t loc = h_get(tbl, var);
+	if (loc != -1 && loc >= REG_SPILLED)
+		_stack_access(v, vc, OP_STRLAT, reg, loc - REG_SPILLED);
+}
+
+
+/**
+ * Returns the registers of variables that are live across line i, i.e. that
+ * need to be preserved around a call. Variables that are assigned at that line
+ * are excluded as their old value is dead.
+ */
+static uint32_t _live_across(struct intervals *ivs, const struct flow *flow,
+                             size_t i, const uint64_t *live,
+                             const char **defs, size_t defcount)
+{
+	uint32_t mask = 0;
+	for (size_t k = 0; k < ivs->count; k++) {
+		struct interval *iv = &ivs->iv[k];
+		if (iv->reg != -1 && iv->start < i + 1 && i + 1 < iv->end &&
+		    _live_after(flow, i, live, iv->flowvar))
+			mask |= 1U << iv->reg;
+		for (size_t j = 0; j < defcount; j++) {
+			if (iv->reg != -1 && streq(iv->var, defs[j]))
+				mask &= ~(1U << iv->reg);
+		}
+	}
+	return mask;
+}
+
+
+/**
+ * Determine the registers to preserve around each call and inline assembly
+ * line.
+ */
+static uint32_t *_call_saves(struct func *f, const struct flow *flow,
+                             struct intervals *ivs)
+{
+	uint32_t *saves = calloc(f->linecount + 1, sizeof *saves);
+	uint64_t *live = malloc((flow->words + 1) * sizeof *live);
+	if (saves == NULL || live == NULL)
+		EXITERRNO(3, "Failed to allocate live variables");
+	for (size_t b = 0; b < flow->blockcount; b++) {
+		memcpy(live, flow->out + b * flow->words, flow->words * sizeof *live);
+		for (size_t i = flow->blocks[b].end; i-- > flow->blocks[b].start; ) {
+			union func_line_all_p l = { .line = f->lines[i] };
+			if (l.line->type == ASM)
+				saves[i] = _live_across(ivs, flow, i, live,
+				                        l.as->outvars, l.as->outcount);
+			else if (l.line->type == FUNC)
+				saves[i] = _live_across(ivs, flow, i, live,
+				                        &l.f->var, l.f->var != NULL);
+			flow_step(flow, i, live);
+		}
+	}
+	free(live);
+	return saves;
+}
+
+
+static void _mask_regs(uint32_t mask, char regs[32])
+{
+	for (int r = 0; r < 32; r++)
+		regs[r] = mask >> r & 1;
+}
+
+
+
+/**
+ * Push the given registers in ascending order. A single register is pushed
+ * with a plain push as it is shorter.
+ */
+static void _push_regs(union vasm_all *v, size_t *vc, const char regs[32])
+{
+	union vasm_all a;
+	uint32_t mask = 0;
+	for (int r = 0; r < 32; r++) {
+		if (regs[r])
+			mask |= 1U << r;
+	}
+	if (mask == 0)
+		return;
+	if ((mask & (mask - 1)) == 0) {
+		a.r.op  = OP_PUSH;
+		a.r.r   = __builtin_ctz(mask);
+	} else {
+		a.s.op  = OP_PUSHM;
+		a.s.s   = internf("0x%x", mask);
+	}
+	v[(*vc)++] = a;
+}
+
+
+static void _pop_mask(union vasm_all *v, size_t *vc, uint32_t mask)
+{
+	union vasm_all a;
+	if (mask == 0)
+		return;
+	if ((mask & (mask - 1)) == 0) {
+		a.r.op  = OP_POP;
+		a.r.r   = __builtin_ctz(mask);
+	} else {
+		a.s.op  = OP_POPM;
+		a.s.s   = internf("0x%x", mask);
+	}
+	v[(*vc)++] = a;
+}
+
+
+/**
+ * Pop the registers pushed by _push_regs. The slots of registers in skip are
+ * discarded instead as they hold a newer value.
+ */
+static void _pop_regs(union vasm_all *v, size_t *vc, const char regs[32],
+                      const char *skip)
+{
+	union vasm_all a;
+	uint32_t mask = 0;
+	for (int r = 31; r >= 0; r--) {
+		if (!regs[r])
+			continue;
+		if (skip == NULL || !skip[r]) {
+			mask |= 1U << r;
+			continue;
+		}
+		_pop_mask(v, vc, mask);
+		mask = 0;
+		a.rs.op = OP_SET;
+		a.rs.r  = REG_SCRATCH;
+		a.rs.s  = "8";
+		v[(*vc)++] = a;
+		a.r3.op = OP_SUB;
+		a.r3.r0 = 31;
+		a.r3.r1 = 31;
+		a.r3.r2 = REG_SCRATCH;
+		v[(*vc)++] = a;
+	}
+	_pop_mask(v, vc, mask);
+}
+
+
+/**
+ * Restore the stack pointer, the frame pointer and the callee saved registers
+ * (all of which are in saved) and return.
+ */
+static void _epilogue(union vasm_all *v, size_t *vc, const char saved[32])
+{
+	union vasm_all a;
+	a.r2.op = OP_MOV;
+	a.r2.r0 = 31;
+	a.r2.r1 = 30;
+	v[(*vc)++] = a;
+	_pop_regs(v, vc, saved, NULL);
+	v[(*vc)++].op = OP_RET;
+}
+
+
+
+/**
+ * Make sure there is room for at least n more instructions.
+ */
+static void _reserve(union vasm_all **v, size_t *vs, size_t vc, size_t n)
+{
+	if (vc + n <= *vs)
+		return;
+	while (*vs < vc + n)
+		*vs *= 2;
+	*v = realloc(*v, *vs * sizeof **v);
+	if (*v == NULL)
+		EXITERRNO(3, "Failed to grow instruction list");
+}
+
+
 int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 	size_t vc = 0, vs = 1024;
 	union vasm_all *v = malloc(vs * sizeof *v);
 	union vasm_all a;
 	union func_line_all_p l;
 
-	*vasms = malloc(1024 * sizeof **vasms);
-
 	a.s.op  = OP_LABEL;
 	if (streq(f->name, "main"))
 		a.s.s = "main";
 	else
-		a.s.s = strprintf("%s_%u", f->name, f->argcount);
+		a.s.s = internf("%s_%u", f->name, f->argcount);
 	v[vc++] = a;
 
 	struct hashtbl tbl;
@@ -113,126 +832,166 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 		return -1;
 	}
 
-	char allocated_regs[32];
-	const char *regs_types[32];
-	char is_const_reg_zero[32];
-	memset(allocated_regs, 0, sizeof allocated_regs);
-	memset(is_const_reg_zero, 0, sizeof is_const_reg_zero);
+	char live_regs[32];
+	char arg_regs[32];
+	char saved_regs[32];
 
-	struct hashtbl structs;
+	struct hashtbl structs, types;
 	h_create(&structs, 1);
-
-	// Add function arguments
-	for (size_t i = 0, r = 0; i < f->argcount; i++) {
-		; struct type type;
-		const char *ft = f->args[i].type, *fn = f->args[i].name;
-		if (get_type(&type, ft) < 0)
-			EXIT(3, "Type '%s' not declared", ft);
-		if (type.type == TYPE_STRUCT) {
-			if (h_add(&structs, fn, (size_t)ft) < 0)
-				EXIT(3, "Failed to add variable to hashtable");
-			struct type_meta_struct *m = (void *)&type.meta;
-			for (size_t j = 0; j < m->count; j++) {
-				const char *n = strprintf("%s@%s", fn, m->names[j]);
-				if (h_add(&tbl, n, r) < 0)
-					EXIT(3, "Failed to add variable to hashtable");
-				allocated_regs[r++] = 1;
-			}
-		} else {
-			if (h_add(&tbl, fn, r) < 0)
-				EXIT(3, "Failed to add variable to hashtable");
-			allocated_regs[r++] = 1;
-		}
-	}
+	h_create(&types, 16);
 
 	// Add constants (if not too many)
 	size_t consts[8];
 	size_t constcount = 0;
-	for (size_t i = f->argcount; i < f->linecount && constcount < sizeof consts / sizeof *consts; i++) {
+	for (size_t i = 0; i < f->linecount && constcount < sizeof consts / sizeof *consts; i++) {
 		l.line = f->lines[i];
-		switch (l.line->type) {
-		case ASSIGN:
-			if (l.a->cons)
-				consts[constcount++] = i;
-			break;
-		case MATH:
+		const char *var, *imm;
+		if (l.line->type == MATH &&
+		    (_cond_branch(f, i) || _math_imm(l.m, &var, &imm) == -1)) {
 			if (isnum(*l.m->y))
 				consts[constcount++] = i;
 			if (l.m->z != NULL && isnum(*l.m->z))
 				consts[constcount++] = i;
-			break;
-		default:
-			break;
 		}
 	}
 
 	if (constcount >= sizeof consts / sizeof *consts)
 		constcount = 0;
 
-	// Preserve stack pointer
-	a.r.op = OP_PUSH;
-	a.r.r  = 30;
-	v[vc++] = a;
-	a.r2.op = OP_MOV;
-	a.r2.r0= 30;
-	a.r2.r1= 31;
-	v[vc++] = a;
-
 	struct hashtbl constvalh;
 	h_create(&constvalh, 16);
-	for (size_t i = f->argcount; i < constcount; i++) {
+	const char *constkeys[8], *constvals[8];
+	size_t constkeycount = 0;
+	for (size_t i = 0; i < constcount; i++) {
 		l.line   = f->lines[consts[i]];
-		a.op     = OP_SET;
-		a.rs.r   = i;
-		const char *key, *val;
+		const char *key, *val, *okey;
 		static size_t bc = 0;
-		char use_y;
-		switch (l.line->type) {
-		case ASSIGN:
-			key = l.a->var;
-			val = l.a->value;
-			break;
-		case MATH:
-			key = strprintf("__const_%lu", bc);
-			bc++;
-			if (isnum(*l.m->y)) {
-				use_y = 1;
-				val = l.m->y;
-				l.m->y = key;
-			} else {
-				use_y = 0;
-				val = l.m->z;
-				l.m->z = key;
-			}
-			break;
-		default:
-			break;
+		key = internf("__const_%lu", __sync_fetch_and_add(&bc, 1));
+		if (isnum(*l.m->y)) {
+			val = l.m->y;
+			l.m->y = key;
+		} else {
+			val = l.m->z;
+			l.m->z = key;
 		}
-		const char *okey = NULL;
 		if (h_get2(&constvalh, val, (size_t *)&okey) != -1) {
-			switch (l.line->type) {
-			case ASSIGN:
-				break;
-			case MATH:
-				if (use_y)
-					l.m->y = okey;
-				else
-					l.m->z = okey;
-				break;
-			default:
-				break;
-			}
+			if (l.m->y == key)
+				l.m->y = okey;
+			else
+				l.m->z = okey;
 		} else {
-			a.rs.s = val;
-			h_add(&tbl, key, i);
 			h_add(&constvalh, val, (size_t)key);
-			allocated_regs[i] = 1;
-			is_const_reg_zero[i] =
-				!(isnum(*val) && strtol(val, NULL, 0) == 0);
-			v[vc++] = a;
+			constkeys[constkeycount] = key;
+			constvals[constkeycount] = val;
+			constkeycount++;
+		}
+	}
+
+	// Allocate registers
+	struct intervals ivs = { .iv = NULL, .count = 0, .cap = 0 };
+	h_create(&ivs.index, 16);
+	for (size_t i = 0; i < constkeycount; i++)
+		_add_interval(&ivs, constkeys[i], 0, -1, 0);
+	struct flow flow;
+	flow_build(&flow, f);
+	_live_intervals(f, &flow, &ivs, &structs, &types);
+
+	// Find the conditions that don't need to be stored in a register. The
+	// operands are now used by the if line instead. The condition may not be
+	// used anywhere else, only declared right before.
+	char *fused = calloc(f->linecount, 1);
+	for (size_t i = 0; i < f->linecount; i++) {
+		if (!_cond_branch(f, i))
+			continue;
+		l.line = f->lines[i];
+		size_t k = h_get(&ivs.index, l.m->x);
+		if (k == -1 || ivs.iv[k].start < i || ivs.iv[k].end > i + 2)
+			continue;
+		if (ivs.iv[k].start == i) {
+			union func_line_all_p d;
+			if (i == 0)
+				continue;
+			d.line = f->lines[i - 1];
+			if (d.line->type != DECLARE || !streq(d.d->var, l.m->x))
+				continue;
+		}
+		fused[i] = 1;
+		ivs.iv[k].end = ivs.iv[k].start;
+		_touch(&ivs, &structs, l.m->y, i + 2);
+		_touch(&ivs, &structs, l.m->z, i + 2);
+	}
+	size_t slots = _linear_scan(&ivs);
+	uint32_t *saves = _call_saves(f, &flow, &ivs);
+	flow_free(&flow);
+	for (size_t k = 0; k < ivs.count; k++) {
+		struct interval *iv = &ivs.iv[k];
+		size_t loc = iv->reg != -1 ? iv->reg : REG_SPILLED + iv->slot;
+		if (h_add(&tbl, iv->var, loc) < 0)
+			EXIT(3, "Failed to add variable to hashtable");
+		DEBUG("%s: %lu-%lu -> %s%lu", iv->var, iv->start, iv->end,
+		      iv->reg != -1 ? "r" : "slot ",
+		      iv->reg != -1 ? (size_t)iv->reg : iv->slot);
+	}
+
+	// Preserve the callee saved registers that are used
+	memset(saved_regs, 0, sizeof saved_regs);
+	for (size_t k = 0; k < ivs.count; k++) {
+		if (ivs.iv[k].reg != -1)
+			saved_regs[ivs.iv[k].reg] = 1;
+	}
+	for (size_t i = 0; i < f->linecount; i++) {
+		l.line = f->lines[i];
+		if (l.line->type == ASM)
+			_asm_clobbers(l.as, saved_regs);
+	}
+	for (int r = 0; r < 32; r++)
+		saved_regs[r] &= ISCALLEESAVED(r);
+
+	// Preserve stack pointer
+	_reserve(&v, &vs, vc, 64 + 2 * ivs.count + 2 * constkeycount);
+	saved_regs[30] = 1;
+	_push_regs(v, &vc, saved_regs);
+	a.r2.op = OP_MOV;
+	a.r2.r0= 30;
+	a.r2.r1= 31;
+	v[vc++] = a;
+
+	// Reserve space for spilled variables
+	if (slots > 0) {
+		a.rs.op = OP_SET;
+		a.rs.r  = REG_SCRATCH;
+		a.rs.s  = internf("%lu", slots * 8);
+		v[vc++] = a;
+		a.r3.op = OP_ADD;
+		a.r3.r0 = 31;
+		a.r3.r1 = 31;
+		a.r3.r2 = REG_SCRATCH;
+		v[vc++] = a;
+	}
+
+	// Store spilled arguments
+	for (size_t k = 0; k < ivs.count; k++) {
+		struct interval *iv = &ivs.iv[k];
+		if (iv->fixed && iv->reg == -1) {
+			size_t r = 0;
+			for ( ; r < f->argcount; r++) {
+				if (streq(f->args[r].name, iv->var))
+					break;
+			}
+			_stack_access(v, &vc, OP_STRLAT, r, iv->slot);
 		}
 	}
 
+	// Load constants
+	for (size_t i = 0; i < constkeycount; i++) {
+		int reg = _def(&tbl, constkeys[i], REG_TMP_X);
+		a.rs.op = OP_SET;
+		a.rs.r  = reg;
+		a.rs.s  = constvals[i];
+		v[vc++] = a;
+		_def_end(v, &vc, &tbl, constkeys[i], reg);
+	}
+
 	for (size_t i = 0; i < f->linecount; i++) {
 		union  func_line_all_p   fl = { .line = f->lines[i] };
 		struct func_line_func   *flf;
@@ -241,44 +1000,53 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 		struct func_line_label  *fll;
 		struct func_line_math   *flm;
 		size_t ra, rb, reg;
+		// The longest sequences come from inline assembly and calls
+		size_t n = 256;
+		if (fl.line->type == ASM)
+			n += fl.as->vasmcount + 4 * (fl.as->incount + fl.as->outcount);
+		else if (fl.line->type == FUNC)
+			n += 8 * fl.f->argcount;
+		_reserve(&v, &vs, vc, n);
 		switch (f->lines[i]->type) {
 		case ASSIGN:
-			if (fl.a->cons && h_get(&tbl, fl.a->var) != -1)
-				break;
-			reg = h_get(&tbl, fl.a->var);
-			if (reg == -1)
-				ENOTDECLARED(fl.a->var);
 			if (isnum(*fl.a->var))
 				EXIT(1, "You can't assign to a number");
+			reg = _def(&tbl, fl.a->var, REG_TMP_X);
+			if (reg == -1)
+				ENOTDECLARED(fl.a->var);
 			if (isnum(*fl.a->value)) {
 				a.rs.op = OP_SET;
 				a.rs.r  = reg;
 				a.rs.s  = fl.a->value;
+				v[vc++] = a;
 			} else {
 				a.r2.op = OP_MOV;
 				a.r2.r0 = reg;
-				a.r2.r1 = h_get(&tbl, fl.a->value);
+				a.r2.r1 = _use(v, &vc, &tbl, fl.a->value, reg);
 				if (a.r2.r1 == -1) {
 					//ENOTDECLARED(fl.a->value);
 					a.rs.op = OP_SET;
 					a.rs.r  = reg;
 					a.rs.s  = fl.a->value;
+					v[vc++] = a;
+				} else if (a.r2.r1 != reg) {
+					v[vc++] = a;
 				}
 			}
-			v[vc++] = a;
+			_def_end(v, &vc, &tbl, fl.a->var, reg);
 			break;
 		case ASM:
-			// Preserve register contents
-			for (size_t i = 0; i < 32; i++) {
-				if (allocated_regs[i]) {
-					a.r.op  = OP_PUSH;
-					a.r.r   = i;
-					v[vc++] = a;
-				}
-			}
+			// Preserve register contents that are clobbered
+			_mask_regs(saves[i], live_regs);
+			memset(arg_regs, 0, sizeof arg_regs);
+			_asm_clobbers(fl.as, arg_regs);
+			for (size_t i = 0; i < 32; i++)
+				live_regs[i] &= arg_regs[i];
+			_push_regs(v, &vc, live_regs);
 			// In arguments
 			for (size_t i = fl.as->incount - 1; i != -1; i--) {
-				if (h_get2(&tbl, fl.as->invars[i], &reg) == -1)
+				reg = _use(v, &vc, &tbl, fl.as->invars[i], REG_TMP_X);
+				if (reg == -1)
 					ENOTDECLARED(fl.as->invars[i]);
 				a.r.op  = OP_PUSH;
 				a.r.r   = reg;
@@ -289,24 +1057,12 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 				a.r.r   = fl.as->inregs[i];
 				v[vc++] = a;
 			}
-			// Insert assembly (TODO)
+			// Insert assembly
 			for (size_t i = 0; i < fl.as->vasmcount; i++) {
-				char buf[32], *b = buf;
-				const char *c = fl.as->vasms[i];
-				while (*c != ' ' && *c != 0)
-					*b++ = *c++;
-				*b = 0;
-				if (*c != 0)
-					c++;
-				a.op = getop(buf);
-				b = buf;
-				while (*c != 0)
-					*b++ = *c++;
-				*b = 0;
-				parse_op_args(&a, buf);
+				_parse_asm(&a, fl.as->vasms[i]);
 				v[vc++] = a;
 			}
-			char arg_regs[32] = {};
+			memset(arg_regs, 0, sizeof arg_regs);
 			// Out arguments
 			for (size_t i = 0; i < fl.as->outcount; i++) {
 				a.r.op  = OP_PUSH;
@@ -314,92 +1070,41 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 				v[vc++] = a;
 			}
 			for (size_t i = fl.as->outcount - 1; i != -1; i--) {
-				if (h_get2(&tbl, fl.as->outvars[i], &reg) == -1)
+				reg = _def(&tbl, fl.as->outvars[i], REG_TMP_X);
+				if (reg == -1)
 					ENOTDECLARED(fl.as->outvars[i]);
 				a.r.op  = OP_POP;
 				a.r.r   = reg;
 				v[vc++] = a;
+				_def_end(v, &vc, &tbl, fl.as->outvars[i], reg);
 				arg_regs[reg] = 1;
 			}
 			// Pop register contents
-			for (size_t i = 31; i != -1; i--) {
-				if (allocated_regs[i]) {
-					if (arg_regs[i]) {
-						a.rs.op = OP_SET;
-						a.rs.r  = 29;
-						a.rs.s  = "8";
-						v[vc++] = a;
-						a.r3.op = OP_SUB;
-						a.r3.r0 = 31;
-						a.r3.r1 = 31;
-						a.r3.r2 = 29;
-						v[vc++] = a;
-					} else {
-						a.r.op  = OP_POP;
-						a.r.r   = i;
-						v[vc++] = a;
-					}
-				}
-			}
+			_pop_regs(v, &vc, live_regs, arg_regs);
 			break;
 		case DECLARE:
-			; struct type type;
-			if (get_type(&type, fl.d->type) < 0)
-				EXIT(3, "Type '%s' not declared", fl.d->type);
-			if (type.type == TYPE_STRUCT) {
-				if (h_add(&structs, fl.d->var, (size_t)fl.d->type) < 0)
-					EXIT(3, "Failed to add variable to hashtable");
-				struct type_meta_struct *m = (void *)&type.meta;
-				for (size_t i = 0; i < m->count; i++) {
-					for (reg = 0; reg < sizeof allocated_regs / sizeof *allocated_regs; reg++) {
-						if (!allocated_regs[reg]) {
-							allocated_regs[reg] = 1;
-							break;
-						}
-					}
-					const char *n = strprintf("%s@%s", fl.d->var, m->names[i]);
-					if (h_add(&tbl, n, reg) < 0)
-						EXIT(3, "Failed to add variable to hashtable");
-					regs_types[reg] = fl.d->type;
-				}
-			} else {
-				for (reg = 0; reg < sizeof allocated_regs / sizeof *allocated_regs; reg++) {
-					if (!allocated_regs[reg]) {
-						allocated_regs[reg] = 1;
-						break;
-					}
-				}
-				if (h_add(&tbl, fl.d->var, reg) < 0)
-					EXIT(3, "Failed to add variable to hashtable");
-				regs_types[reg] = fl.d->type;
-			}
-			_reserve_stack_space(&v, &vc, reg, fl.d->type);
+			reg = _def(&tbl, fl.d->var, REG_TMP_X);
+			if (reg == -1)
+				break;
+			if (_reserve_stack_space(&v, &vc, reg, fl.d->type))
+				_def_end(v, &vc, &tbl, fl.d->var, reg);
 			break;
 		case DESTROY:
-			// TODO
-			if (fl.d->var[1] == '.')
-				break;
-			reg = h_get(&tbl, fl.d->var);
-			if (reg == -1)
-				ENOTDECLARED(fl.d->var);
-			allocated_regs[reg] = 0;
-			h_rem(&tbl, fl.d->var);
+			// Handled by the register allocator
 			break;
 		case FUNC:
 			flf = (struct func_line_func *)f->lines[i];
 
-			// Push registers that are in use
-			for (size_t j = 0; j < 32; j++) {
-				if (allocated_regs[j]) {
-					a.r.op = OP_PUSH;
-					a.r.r  = j;
-					v[vc++] = a;
-				}
-			}
+			// Push caller saved registers that are still needed
+			// after the call
+			_mask_regs(saves[i], live_regs);
+			for (size_t j = 0; j < 32; j++)
+				live_regs[j] &= !ISCALLEESAVED(j);
+			_push_regs(v, &vc, live_regs);
 
 			// Push the needed arguments
 			for (size_t j = flf->argcount - 1; j != -1; j--) {
-				int r = h_get(&tbl, flf->args[j]);
+				int r = _use(v, &vc, &tbl, flf->args[j], REG_TMP_X);
 				if (r != -1 && r != j) {
 					a.r.op  = OP_PUSH;
 					a.r.r   = r;
@@ -446,10 +1151,10 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			if (streq(flf->name, "main"))
 				a.s.s = "main";
 			else
-				a.s.s = strprintf("%s_%u", flf->name, flf->argcount);
+				a.s.s = internf("%s_%u", flf->name, flf->argcount);
 			v[vc++] = a;
 
-			/*char arg_regs[32] = {}; */memset(arg_regs, 0, sizeof arg_regs);
+			memset(arg_regs, 0, sizeof arg_regs);
 
 			// Check if function assigns to var
 			if (flf->var != NULL) {
@@ -474,6 +1179,9 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 						v[vc++] = a;
 						arg_regs[r] = 1;
 					}
+				} else if (r >= REG_SPILLED) {
+					// Store the returned value
+					_def_end(v, &vc, &tbl, flf->var, 0);
 				} else {
 					// Move the returned value to the variable
 					a.r2.op = OP_MOV;
@@ -485,25 +1193,7 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			}
 
 			// Pop registers
-			for (size_t j = 31; j != -1; j--) {
-				if (allocated_regs[j]) {
-					if (arg_regs[j]) {
-						a.rs.op = OP_SET;
-						a.rs.r  = 29;
-						a.rs.s  = "8";
-						v[vc++] = a;
-						a.r3.op = OP_SUB;
-						a.r3.r0 = 31;
-						a.r3.r1 = 31;
-						a.r3.r2 = 29;
-						v[vc++] = a;
-					} else {
-						a.r.op  = OP_POP;
-						a.r.r   = j;
-						v[vc++] = a;
-					}
-				}
-			}
+			_pop_regs(v, &vc, live_regs, arg_regs);
 
 			break;
 		case GOTO:
@@ -514,13 +1204,58 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			break;
 		case IF:
 			fli = (struct func_line_if *)f->lines[i];
+			if (i > 0 && fused[i - 1]) {
+				flm = (struct func_line_math *)f->lines[i - 1];
+				if (isnum(*flm->y)) {
+					a.rs.op  = OP_SET;
+					a.rs.r   = ra = REG_TMP_Y;
+					a.rs.s   = flm->y;
+					v[vc++] = a;
+				} else {
+					ra = _use(v, &vc, &tbl, flm->y, REG_TMP_Y);
+					if (ra == -1)
+						ENOTDECLARED(flm->y);
+				}
+				if (isnum(*flm->z)) {
+					a.rs.op  = OP_SET;
+					a.rs.r   = rb = REG_TMP_Z;
+					a.rs.s   = flm->z;
+					v[vc++] = a;
+				} else {
+					rb = _use(v, &vc, &tbl, flm->z, REG_TMP_Z);
+					if (rb == -1)
+						ENOTDECLARED(flm->z);
+				}
+				// The if jumps when the condition is not zero, or
+				// when it is zero if inverted
+				a.r2s.r0 = ra;
+				a.r2s.r1 = rb;
+				switch (flm->op) {
+				case MATH_LESS:
+					a.r2s.op = fli->inv ? OP_JLE : OP_JLT;
+					break;
+				case MATH_LESSE:
+					a.r2s.op = fli->inv ? OP_JLT : OP_JLE;
+					break;
+				default:
+					a.r2s.op = fli->inv ? OP_JEQ : OP_JNE;
+					break;
+				}
+				if (fli->inv && flm->op != MATH_SUB) {
+					a.r2s.r0 = rb;
+					a.r2s.r1 = ra;
+				}
+				a.r2s.s  = fli->label;
+				v[vc++] = a;
+				break;
+			}
 			if (isnum(*fli->var)) {
 				a.rs.op  = OP_SET;
-				a.rs.r   = ra = 20;
+				a.rs.r   = ra = REG_TMP_Y;
 				a.rs.s = fli->var;
 				v[vc++] = a;
 			} else {
-				ra = h_get(&tbl, fli->var);
+				ra = _use(v, &vc, &tbl, fli->var, REG_TMP_Y);
 				if (ra == -1)
 					ENOTDECLARED(fl.i->var);
 			}
@@ -537,27 +1272,48 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			break;
 		case MATH:
 			flm = (struct func_line_math *)f->lines[i];
+			if (fused[i])
+				break;
 			if (isnum(*flm->x))
 				EXIT(1, "You can't assign to a number");
+			const char *var, *imm;
+			int op = _math_imm(flm, &var, &imm);
+			if (op != -1) {
+				ra = _use(v, &vc, &tbl, var, REG_TMP_Y);
+				if (ra == -1)
+					ENOTDECLARED(var);
+				reg = _def(&tbl, flm->x, REG_TMP_X);
+				if (reg == -1)
+					ENOTDECLARED(flm->x);
+				a.r2s.op = op;
+				a.r2s.r0 = reg;
+				a.r2s.r1 = ra;
+				a.r2s.s  = imm;
+				v[vc++] = a;
+				_def_end(v, &vc, &tbl, flm->x, reg);
+				break;
+			}
 			if (isnum(*flm->y)) {
 				a.rs.op  = OP_SET;
-				a.rs.r   = ra = 20;
+				a.rs.r   = ra = REG_TMP_Y;
 				a.rs.s = flm->y;
 				v[vc++] = a;
 			} else {
-				ra = h_get(&tbl, flm->y);
+				ra = _use(v, &vc, &tbl, flm->y, REG_TMP_Y);
 				if (ra == -1)
 					ENOTDECLARED(flm->y);
 			}
+			reg = _def(&tbl, flm->x, REG_TMP_X);
+			if (reg == -1)
+				ENOTDECLARED(flm->x);
 			if (flm->op != MATH_INV && flm->op != MATH_NOT) {
 				if (isnum(*flm->z)) {
 					a.rs.op  = OP_SET;
-					a.rs.r   = rb = 21;
+					a.rs.r   = rb = REG_TMP_Z;
 					a.rs.s = flm->z;
 					v[vc++] = a;
 				} else {
-					// TODO
-					rb = h_get(&tbl, flm->z);
+					rb = _use(v, &vc, &tbl, flm->z, REG_TMP_Z);
 					if (rb == -1)
 						ENOTDECLARED(flm->z);
 				}
@@ -574,48 +1330,18 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 				} else {
 					a.r3.op = flm->op;
 				}
-				a.r3.r0 = h_get(&tbl, flm->x);
+				a.r3.r0 = reg;
 				a.r3.r1 = ra;
 				a.r3.r2 = rb;
-				if (a.r3.r0 == -1) {
-					for ( ; reg < sizeof allocated_regs / sizeof *allocated_regs; reg++) {
-						if (!allocated_regs[reg]) {
-							allocated_regs[reg] = 1;
-							break;
-						}
-					}
-					a.r3.r0 = reg;
-					h_add(&tbl, flm->x, reg);
-				}
 			} else {
-				if (h_get2(&tbl, flm->x, &reg) < 0)
-					ENOTDECLARED(flm->x);
-				a.r2.op   = flm->op;
-				a.r2.r0 = h_get(&tbl, flm->x);
+				a.r2.op = flm->op;
+				a.r2.r0 = reg;
 				a.r2.r1 = ra;
-				if (a.r2.r0 == -1) {
-					size_t reg = 0;
-					for ( ; reg < sizeof allocated_regs / sizeof *allocated_regs; reg++) {
-						if (!allocated_regs[reg]) {
-							allocated_regs[reg] = 1;
-							break;
-						}
-					}
-					a.r2.r0 = reg;
-					h_add(&tbl, flm->x, reg);
-				}
 			}
 			v[vc++] = a;
+			_def_end(v, &vc, &tbl, flm->x, reg);
 			break;
 		case RETURN:
-			// Restore stack pointer
-			a.r2.op = OP_MOV;
-			a.r2.r0 = 31;
-			a.r2.r1 = 30;
-			v[vc++] = a;
-			a.r.op  = OP_POP;
-			a.r.r   = 30;
-			v[vc++] = a;
 			if (isnum(*fl.r->val)) {
 				a.rs.op = OP_SET;
 				a.rs.r  = 0;
@@ -624,7 +1350,7 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			} else {
 				a.r2.op = OP_MOV;
 				a.r2.r0 = 0;
-				a.r2.r1 = h_get(&tbl, fl.r->val);
+				a.r2.r1 = _use(v, &vc, &tbl, fl.r->val, 0);
 				if (a.r2.r1 == -1) {
 					// Get the struct's members
 					const char *type;
@@ -655,36 +1381,50 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 							v[vc++] = a;
 						}
 					}
-				} else {
+				} else if (a.r2.r1 != 0) {
 					v[vc++] = a;
 				}
 			}
-			v[vc++].op = OP_RET;
+			_epilogue(v, &vc, saved_regs);
 			break;
 		case STORE:
 			if (isnum(*fl.s->var))
 				EXIT(1, "You can't index a number");
 			if (isnum(*fl.s->val)) {
 				a.rs.op  = OP_SET;
-				a.rs.r   = ra = 20;
+				a.rs.r   = ra = REG_TMP_Y;
 				a.rs.s = fl.s->val;
 				v[vc++] = a;
 			} else {
-				ra = h_get(&tbl, fl.s->val);
+				ra = _use(v, &vc, &tbl, fl.s->val, REG_TMP_Y);
 				if (ra == -1)
 					ENOTDECLARED(fl.s->val);
 			}
+			// Use the type of the array's elements. Only the value tells
+			// how much to store through anything else.
+			const char *t = (const char *)h_get(&types, fl.s->var);
+			if (t != (const char *)-1 && strchr(t, '[') != NULL)
+				t = internn(t, strchr(t, '[') - t);
+			else if (!isnum(*fl.s->val))
+				t = (const char *)h_get(&types, fl.s->val);
+			else
+				t = (const char *)-1;
+			if (t == (const char *)-1)
+				EXIT(4, "TODO: all kinds of store stuff");
 			if (isnum(*fl.s->index)) {
 				a.rs.op  = OP_SET;
-				a.rs.r   = rb = 21;
+				a.rs.r   = rb = REG_TMP_Z;
 				a.rs.s = fl.s->index;
 				v[vc++] = a;
 			} else {
-				rb = h_get(&tbl, fl.s->index);
+				rb = _use(v, &vc, &tbl, fl.s->index, REG_TMP_Z);
 				if (rb == -1)
 					ENOTDECLARED(fl.s->index);
 			}
-			switch(_get_type_size(regs_types[ra])) {
+			reg = _use(v, &vc, &tbl, fl.s->var, REG_TMP_X);
+			if (reg == -1)
+				ENOTDECLARED(fl.s->var);
+			switch(_get_type_size(t)) {
 			case 1: a.r3.op = OP_STRBAT; break;
 			case 2: a.r3.op = OP_STRSAT; break;
 			case 4: a.r3.op = OP_STRIAT; break;
@@ -692,10 +1432,8 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			default: EXIT(4, "TODO: all kinds of store stuff");
 			}
 			a.r3.r0 = ra;
-			a.r3.r1 = h_get(&tbl, fl.s->var);
+			a.r3.r1 = reg;
 			a.r3.r2 = rb;
-			if (a.r2.r1 == -1)
-				ENOTDECLARED(fl.s->var);
 			v[vc++] = a;
 			break;
 		case THROW:
@@ -714,15 +1452,13 @@ int func2vasm(union vasm_all **vasms, size_t *vasmcount, struct func *f) {
 			EXIT(1, "Unknown line type (%d)", f->lines[i]->type);
 		}
 	}
-	// Restore stack pointer
-	a.r2.op = OP_MOV;
-	a.r2.r0= 31;
-	a.r2.r1= 30;
-	v[vc++] = a;
-	a.r.op = OP_POP;
-	a.r.r  = 30;
-	v[vc++] = a;
-	v[vc++].op = OP_RET;
+	_reserve(&v, &vs, vc, 64);
+	_epilogue(v, &vc, saved_regs);
+	free(fused);
+	free(saves);
+	free(ivs.iv);
+	h_destroy(&ivs.index);
+	h_destroy(&types);
 	*vasms     = realloc(v, vc * sizeof *v);
 	*vasmcount = vc;
 	return 0;
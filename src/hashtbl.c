@@ -2,164 +2,157 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "hashtbl.h"
+#include "util.h"
 
 
-static size_t h_hash_str(const char *str)
+static uint32_t h_hash_str(const char *str)
 {
-	size_t h = 0;
-	for (const char *c = str; *c != 0; c++) {
-		h += *c;
-	}
+	// FNV-1a followed by the MurmurHash3 finalizer to spread the bits
+	uint64_t h = 0xcbf29ce484222325;
+	for (const unsigned char *c = (const unsigned char *)str; *c != 0; c++)
+		h = (h ^ *c) * 0x100000001b3;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccd;
+	h ^= h >> 33;
+	h *= 0xc4ceb93e185a21a5;
+	h ^= h >> 33;
 	return h;
 }
 
 
+/**
+ * Returns the index of the entry with the given key or -1 if there is none.
+ */
+static size_t h_find(struct hashtbl *tbl, const char *str, uint32_t h)
+{
+	if (tbl->len == 0)
+		return -1;
+	size_t mask = tbl->len - 1;
+	for (size_t i = h & mask, d = 0; ; i = (i + 1) & mask, d++) {
+		struct h_entry *e = &tbl->entries[i];
+		// If the key were present it would have displaced this entry
+		if (e->key == NULL || e->dist < d)
+			return -1;
+		if (e->key == str || (e->hash == h && strcmp(e->key, str) == 0))
+			return i;
+	}
+}
+
+
 int h_create(struct hashtbl *tbl, size_t size)
 {
-	tbl->len    = size;
-	tbl->count  = 0;
-	tbl->arrays = calloc(size, sizeof *tbl->arrays);
-	return tbl->arrays == NULL ? -1 : 0;
+	size_t len = 8;
+	while (len * 3 < size * 4)
+		len *= 2;
+	tbl->len     = len;
+	tbl->count   = 0;
+	tbl->entries = calloc(len, sizeof *tbl->entries);
+	return tbl->entries == NULL ? -1 : 0;
 }
 
 
 void h_destroy(struct hashtbl *tbl)
 {
-	for (size_t i = 0; i < tbl->len; i++)
-		free(tbl->arrays[i]);
-	free(tbl->arrays);
+	free(tbl->entries);
 }
 
 
-int h_add(struct hashtbl *tbl, const char *str, size_t val);
+static void h_insert(struct hashtbl *tbl, struct h_entry e)
+{
+	size_t mask = tbl->len - 1;
+	for (size_t i = e.hash & mask; ; i = (i + 1) & mask, e.dist++) {
+		struct h_entry *f = &tbl->entries[i];
+		if (f->key == NULL) {
+			*f = e;
+			return;
+		}
+		// Take the slot from entries that are closer to their home
+		if (f->dist < e.dist)
+			SWAP(struct h_entry, *f, e);
+	}
+}
 
 
 int h_resize(struct hashtbl *tbl, size_t newlen)
 {
-	struct hashtbl ntbl;
-	if (h_create(&ntbl, newlen) < 0)
+	size_t len = 8;
+	while (len < newlen)
+		len *= 2;
+	if (len * 3 < tbl->count * 4)
+		return -1;
+
+	struct h_entry *old = tbl->entries;
+	size_t oldlen = tbl->len;
+	tbl->entries = calloc(len, sizeof *tbl->entries);
+	if (tbl->entries == NULL) {
+		tbl->entries = old;
 		return -1;
-	for (size_t i = 0; i < tbl->len; i++) {
-		void **a = tbl->arrays[i];
-		if (a == NULL)
-			continue;
-		size_t l = *(size_t *)a;
-		size_t /*lcap = l & 0xffffffff,*/ lcount = l >> 32L;
-		for (size_t j = 0; j < lcount; j++) {
-			if (h_add(&ntbl, (const char *)a[1 + l * 2], (size_t)a[1 + l * 2 + 1]) < 0) {
-				h_destroy(&ntbl);
-				// TODO restore old table
-				return -1;
-			}
+	}
+	tbl->len = len;
+
+	for (size_t i = 0; i < oldlen; i++) {
+		if (old[i].key != NULL) {
+			old[i].dist = 0;
+			h_insert(tbl, old[i]);
 		}
-		free(a);
-		tbl->arrays[i] = NULL;
 	}
-	h_destroy(tbl);
-	*tbl = ntbl;
+	free(old);
 	return 0;
 }
 
 
 int h_add(struct hashtbl *tbl, const char *str, size_t val)
 {
-	size_t k = h_hash_str(str) % tbl->len;
-	void **a = tbl->arrays[k];
-
-	if (a == NULL) {
-		a = calloc(sizeof(size_t) + 2 * sizeof(void *), 1);
-		if (a == NULL)
-			return -1;
-		*(size_t *)a = 1L;
-		tbl->arrays[k] = a;
-	}
-
-	size_t l = *(size_t *)a;
-	size_t lcap = l & 0xffffffff, lcount = l >> 32L;
+	uint32_t h = h_hash_str(str);
 
-	if (l >= 4 && tbl->len < tbl->count * 2) {
-		if (h_resize(tbl, tbl->count * 2) < 0)
-			return -1;
-		k = h_hash_str((const char *)a[l]) % tbl->len;
-		a = tbl->arrays[k];
-		l = *(size_t *)a;
-		lcap = l & 0xffffffff, lcount = l >> 32L;
-	}
+	// Lookups always returned the first value added for a key
+	if (h_find(tbl, str, h) != -1)
+		return 0;
 
-	if (lcount >= lcap) {
-		size_t nlcap = lcap * 2;
-		void **b = realloc(a, sizeof(size_t) + 2 * nlcap * sizeof(void *));
-		if (b == NULL)
+	if ((tbl->count + 1) * 4 > tbl->len * 3) {
+		if (h_resize(tbl, tbl->len * 2) < 0)
 			return -1;
-		tbl->arrays[k] = a = b;
-		lcap = nlcap;
 	}
 
-	((const char **)a)[1 + lcount * 2    ] = str;
-	((size_t      *)a)[1 + lcount * 2 + 1] = val;
-	lcount++;
-	((size_t      *)a)[0] = lcap | (lcount << 32L);
-
+	struct h_entry e = { .key = str, .val = val, .hash = h, .dist = 0 };
+	h_insert(tbl, e);
+	tbl->count++;
 	return 0;
 }
 
 
 size_t h_get(struct hashtbl *tbl, const char *str)
 {
-	size_t k = h_hash_str(str) % tbl->len;
-	void **a = tbl->arrays[k];
-	if (a == NULL)
-		return -1;
-
-	size_t l = *(size_t *)a;
-	size_t lcount = l >> 32L;
-
-	for (size_t i = 0; i < lcount; i++) {
-		if (strcmp(a[1 + i * 2], str) == 0)
-			return (size_t)a[1 + i * 2 + 1];
-	}
-	
-	return -1;
+	size_t i = h_find(tbl, str, h_hash_str(str));
+	return i == -1 ? -1 : tbl->entries[i].val;
 }
 
 
 int h_get2(struct hashtbl *tbl, const char *str, size_t *val)
 {
-	size_t k = h_hash_str(str) % tbl->len;
-	void **a = tbl->arrays[k];
-	if (a == NULL)
+	size_t i = h_find(tbl, str, h_hash_str(str));
+	if (i == -1)
 		return -1;
-
-	size_t l = *(size_t *)a;
-	size_t lcount = l >> 32L;
-
-	for (size_t i = 0; i < lcount; i++) {
-		if (strcmp(a[1 + i * 2], str) == 0) {
-			*val = (size_t)a[1 + i * 2 + 1];
-			return 0;
-		}
-	}
-	
-	return -1;
+	*val = tbl->entries[i].val;
+	return 0;
 }
 
 
 void h_rem(struct hashtbl *tbl, const char *str)
 {
-	size_t k = h_hash_str(str) % tbl->len;
-	void **a = tbl->arrays[k];
-	if (a == NULL)
+	size_t i = h_find(tbl, str, h_hash_str(str));
+	if (i == -1)
 		return;
 
-	size_t l = *(size_t *)a;
-	size_t lcount = l >> 32L;
-
-	for (size_t i = 0; i < lcount; i++) {
-		if (strcmp(a[1 + i * 2], str) == 0) {
-			lcount--;
-			memmove(a + 1 + i * 2, a + 1 + (i + 1) * 2, (lcount - i) * 2 * sizeof *a);
-			l = (lcount << 32L) | (l & 0xFFFFFFFF);
-			*(size_t *)a = l;
-		}
+	// Shift the following entries back so no tombstones are needed
+	size_t mask = tbl->len - 1;
+	for (size_t j = (i + 1) & mask; ; i = j, j = (j + 1) & mask) {
+		struct h_entry *e = &tbl->entries[j];
+		if (e->key == NULL || e->dist == 0)
+			break;
+		tbl->entries[i] = *e;
+		tbl->entries[i].dist--;
 	}
+	memset(&tbl->entries[i], 0, sizeof tbl->entries[i]);
+	tbl->count--;
 }
@@ -10,9 +10,10 @@
 #include <x86intrin.h>
 #include "vasm.h"
 #include "util.h"
+#include "interpreter/memory.h"
 
 
-static char    mem[0x100000];
+static char   *mem;
 static int64_t regs[32];
 
 
@@ -111,6 +112,54 @@ static int64_t regs[32];
 	}						\
 } while (0)
 
+// The target is converted to host order the first time it is executed
+#define JUMPIF2_BE(host) do {				\
+	mem[ip-1] = host;				\
+	*(uint64_t *)(mem + ip + 2) = be64toh(*(uint64_t *)(mem + ip + 2));\
+} while (0)
+#define H_JUMPIF2(m,c) do {				\
+	REG2;						\
+	if (c) {					\
+		ip = *(size_t *)(mem + ip);		\
+		DEBUG("H_" m "\tr%d,r%d,0x%lx\t(true)",	\
+		      regi, regj, ip);			\
+	} else {					\
+		DEBUG("H_" m "\tr%d,r%d\t(false)",	\
+		      regi, regj);			\
+		ip += sizeof ip;			\
+	}						\
+} while (0)
+
+#define LOAD(m,t,conv) do {				\
+	REG2;						\
+	REGI = *(t *)(mem + REGJ);			\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d\t(%lu <-- 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+
+#define LOADAT(m,t,conv) do {				\
+	REG3;						\
+	REGI = *(t *)(mem + REGJ + REGK);		\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+
+#define STORE(m,t,conv) do {				\
+	REG2;						\
+	*(t *)(mem + REGJ) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d\t(%lu --> 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+
+#define STOREAT(m,t,conv) do {				\
+	REG3;						\
+	*(t *)(mem + REGJ + REGK) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+
 #define JUMPRELIF(m,c,t,conv) do {				\
 	REG1;							\
 	if (c) {						\
@@ -131,6 +180,32 @@ static int64_t regs[32];
 
 #define sp regs[31]
 
+#define JUMPRELIF2(m,c) do {					\
+	REG2;							\
+	if (c) {						\
+		ip += (int8_t)mem[ip];				\
+		DEBUG(m "\tr%d,r%d\t(true, 0x%lx)",		\
+		      regi, regj, ip);				\
+	} else {						\
+		DEBUG(m "\tr%d,r%d\t(false)", regi, regj);	\
+		ip++;						\
+	}							\
+} while (0)
+
+
+// The immediate is converted to host order the first time it is executed
+#define REG2IOP_BE(host) do {				\
+	mem[ip-1] = host;				\
+	*(uint32_t *)(mem + ip + 2) = be32toh(*(uint32_t *)(mem + ip + 2));\
+} while (0)
+#define REG2IOP(m,op) do {				\
+	REG2;						\
+	int32_t _i = *(uint32_t *)(mem + ip);		\
+	ip += sizeof _i;				\
+	REGI = REGJ op (int64_t)_i;			\
+	DEBUG(m "\tr%d,r%d,%d\t(%ld)", regi, regj, _i, REGI);\
+} while (0)
+
 
 #ifndef NOPROF
 static size_t icounter;
@@ -177,6 +252,10 @@ static void vasm_syscall() {
 		DEBUG("read(%lu, 0x%lx, %lu) = %ld",
 		        regs[1], regs[2], regs[3], regs[0]);
 		break;
+	case 10: // brk(addr)
+		regs[0] = vasm_mem_brk(regs[1]);
+		DEBUG("brk(0x%lx) = 0x%lx", regs[1], regs[0]);
+		break;
 	case 3: // connect(ip6, port)
 	case 4: // listen(ip6, port)
 	case 5: // accept(fd)
@@ -210,10 +289,23 @@ enum host_op {
 	HOST_JP,
 	HOST_JPZ,
 	HOST_CALL,
+	HOST_PUSHM,
+	HOST_POPM,
+	HOST_ADDI,
+	HOST_SUBI,
+	HOST_MULI,
+	HOST_ANDI,
+	HOST_LSHIFTI,
+	HOST_RSHIFTI,
+	HOST_LESSI,
+	HOST_JLT,
+	HOST_JLE,
+	HOST_JEQ,
+	HOST_JNE,
 };
 
 
-static void run() {
+static void run(enum vbin_format format) {
 
 #ifndef NOPROF
 	rstart = _rdtsc();
@@ -234,6 +326,14 @@ static void run() {
 		[OP_JNZB] = &&op_jnzb,
 		[OP_JPB] = &&op_jpb,
 		[OP_JPZB] = &&op_jpzb,
+		[OP_JLT] = &&op_jlt,
+		[OP_JLE] = &&op_jle,
+		[OP_JEQ] = &&op_jeq,
+		[OP_JNE] = &&op_jne,
+		[OP_JLTB] = &&op_jltb,
+		[OP_JLEB] = &&op_jleb,
+		[OP_JEQB] = &&op_jeqb,
+		[OP_JNEB] = &&op_jneb,
 
 		[OP_LDL] = &&op_ldl,
 		[OP_LDI] = &&op_ldi,
@@ -281,6 +381,17 @@ static void run() {
 
 		[OP_SYSCALL] = &&op_syscall,
 
+		[OP_PUSHM] = &&op_pushm,
+		[OP_POPM] = &&op_popm,
+
+		[OP_ADDI] = &&op_addi,
+		[OP_SUBI] = &&op_subi,
+		[OP_MULI] = &&op_muli,
+		[OP_ANDI] = &&op_andi,
+		[OP_LSHIFTI] = &&op_lshifti,
+		[OP_RSHIFTI] = &&op_rshifti,
+		[OP_LESSI] = &&op_lessi,
+
 		[HOST_SETL] = &&host_setl,
 		[HOST_SETI] = &&host_seti,
 		[HOST_SETS] = &&host_sets,
@@ -290,8 +401,59 @@ static void run() {
 		[HOST_JP]   = &&host_jp,
 		[HOST_JPZ]  = &&host_jpz,
 		[HOST_CALL] = &&host_call,
+		[HOST_PUSHM] = &&host_pushm,
+		[HOST_POPM] = &&host_popm,
+		[HOST_ADDI] = &&host_addi,
+		[HOST_SUBI] = &&host_subi,
+		[HOST_MULI] = &&host_muli,
+		[HOST_ANDI] = &&host_andi,
+		[HOST_LSHIFTI] = &&host_lshifti,
+		[HOST_RSHIFTI] = &&host_rshifti,
+		[HOST_LESSI] = &&host_lessi,
+		[HOST_JLT] = &&host_jlt,
+		[HOST_JLE] = &&host_jle,
+		[HOST_JEQ] = &&host_jeq,
+		[HOST_JNE] = &&host_jne,
 	};
 
+	// The little endian format doesn't need patching
+	if (format == VBIN_FORMAT_LE) {
+		table[OP_SETL]   = &&host_setl;
+		table[OP_SETI]   = &&host_seti;
+		table[OP_SETS]   = &&host_sets;
+		table[OP_JMP]    = &&host_jmp;
+		table[OP_JZ]     = &&host_jz;
+		table[OP_JNZ]    = &&host_jnz;
+		table[OP_JP]     = &&host_jp;
+		table[OP_JPZ]    = &&host_jpz;
+		table[OP_CALL]   = &&host_call;
+		table[OP_PUSHM]  = &&host_pushm;
+		table[OP_POPM]   = &&host_popm;
+		table[OP_ADDI]   = &&host_addi;
+		table[OP_SUBI]   = &&host_subi;
+		table[OP_MULI]   = &&host_muli;
+		table[OP_ANDI]   = &&host_andi;
+		table[OP_LSHIFTI] = &&host_lshifti;
+		table[OP_RSHIFTI] = &&host_rshifti;
+		table[OP_LESSI]  = &&host_lessi;
+		table[OP_JLT]    = &&host_jlt;
+		table[OP_JLE]    = &&host_jle;
+		table[OP_JEQ]    = &&host_jeq;
+		table[OP_JNE]    = &&host_jne;
+		table[OP_LDL]    = &&op_ldl_le;
+		table[OP_LDI]    = &&op_ldi_le;
+		table[OP_LDS]    = &&op_lds_le;
+		table[OP_LDLAT]  = &&op_ldlat_le;
+		table[OP_LDIAT]  = &&op_ldiat_le;
+		table[OP_LDSAT]  = &&op_ldsat_le;
+		table[OP_STRL]   = &&op_strl_le;
+		table[OP_STRI]   = &&op_stri_le;
+		table[OP_STRS]   = &&op_strs_le;
+		table[OP_STRLAT] = &&op_strlat_le;
+		table[OP_STRIAT] = &&op_striat_le;
+		table[OP_STRSAT] = &&op_strsat_le;
+	}
+
 	uint64_t ip = 0;
 
 	while (1) {
@@ -310,6 +472,7 @@ static void run() {
 
 		unsigned char regi, regj, regk;
 		size_t addr, val;
+		uint32_t mask;
 
 	op_nop:
 		DEBUG("nop");
@@ -425,25 +588,68 @@ static void run() {
 		JUMPRELIF("jpzb", REGI >= 0, int8_t, (int8_t));
 		continue;
 
+	op_jlt:
+		JUMPIF2_BE(HOST_JLT);
+	host_jlt:
+		H_JUMPIF2("jlt", REGI < REGJ);
+		continue;
+
+	op_jle:
+		JUMPIF2_BE(HOST_JLE);
+	host_jle:
+		H_JUMPIF2("jle", REGI <= REGJ);
+		continue;
+
+	op_jeq:
+		JUMPIF2_BE(HOST_JEQ);
+	host_jeq:
+		H_JUMPIF2("jeq", REGI == REGJ);
+		continue;
+
+	op_jne:
+		JUMPIF2_BE(HOST_JNE);
+	host_jne:
+		H_JUMPIF2("jne", REGI != REGJ);
+		continue;
+
+	op_jltb:
+		JUMPRELIF2("jltb", REGI < REGJ);
+		continue;
+
+	op_jleb:
+		JUMPRELIF2("jleb", REGI <= REGJ);
+		continue;
+
+	op_jeqb:
+		JUMPRELIF2("jeqb", REGI == REGJ);
+		continue;
+
+	op_jneb:
+		JUMPRELIF2("jneb", REGI != REGJ);
+		continue;
+
 	op_ldl:
-		REG2;
-		REGI = *(uint64_t *)(mem + REGJ);
-		REGI = be64toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("ldl", uint64_t, be64toh);
+		continue;
+
+	op_ldl_le:
+		LOAD("ldl", uint64_t, le64toh);
 		continue;
 
 	op_ldi:
-		REG2;
-		REGI = *(uint32_t *)(mem + REGJ);
-		REGI = be32toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("ldi", uint32_t, be32toh);
+		continue;
+
+	op_ldi_le:
+		LOAD("ldi", uint32_t, le32toh);
 		continue;
 
 	op_lds:
-		REG2;
-		REGI = *(uint16_t *)(mem + REGJ);
-		REGI = be16toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("lds", uint16_t, be16toh);
+		continue;
+
+	op_lds_le:
+		LOAD("lds", uint16_t, le16toh);
 		continue;
 
 	op_ldb:
@@ -453,27 +659,27 @@ static void run() {
 		continue;
 
 	op_ldlat:
-		REG3;
-		REGI = *(uint64_t *)(mem + REGJ + REGK);
-		REGI = be64toh(REGI);
-		DEBUG("ldlat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldlat", uint64_t, be64toh);
+		continue;
+
+	op_ldlat_le:
+		LOADAT("ldlat", uint64_t, le64toh);
 		continue;
 
 	op_ldiat:
-		REG3;
-		REGI = *(uint32_t *)(mem + REGJ + REGK);
-		REGI = be32toh(REGI);
-		DEBUG("ldiat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldiat", uint32_t, be32toh);
+		continue;
+
+	op_ldiat_le:
+		LOADAT("ldiat", uint32_t, le32toh);
 		continue;
 
 	op_ldsat:
-		REG3;
-		REGI = *(uint16_t *)(mem + REGJ + REGK);
-		REGI = be16toh(REGI);
-		DEBUG("ldsat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldsat", uint16_t, be16toh);
+		continue;
+
+	op_ldsat_le:
+		LOADAT("ldsat", uint16_t, le16toh);
 		continue;
 
 	op_ldbat:
@@ -484,21 +690,27 @@ static void run() {
 		continue;
 
 	op_strl:
-		REG2;
-		*(uint64_t *)(mem + REGJ) = htobe64(REGI);
-		DEBUG("strl\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("strl", uint64_t, htobe64);
+		continue;
+
+	op_strl_le:
+		STORE("strl", uint64_t, htole64);
 		continue;
 
 	op_stri:
-		REG2;
-		*(uint32_t *)(mem + REGJ) = htobe32(REGI);
-		DEBUG("stri\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("stri", uint32_t, htobe32);
+		continue;
+
+	op_stri_le:
+		STORE("stri", uint32_t, htole32);
 		continue;
 
 	op_strs:
-		REG2;
-		*(uint16_t *)(mem + REGJ) = htobe16(REGI);
-		DEBUG("strs\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("strs", uint16_t, htobe16);
+		continue;
+
+	op_strs_le:
+		STORE("strs", uint16_t, htole16);
 		continue;
 
 	op_strb:
@@ -508,24 +720,27 @@ static void run() {
 		continue;
 
 	op_strlat:
-		REG3;
-		*(uint64_t *)(mem + REGJ + REGK) = htobe64(REGI);
-		DEBUG("strlat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("strlat", uint64_t, htobe64);
+		continue;
+
+	op_strlat_le:
+		STOREAT("strlat", uint64_t, htole64);
 		continue;
 
 	op_striat:
-		REG3;
-		*(uint32_t *)(mem + REGJ + REGK) = htobe32(REGI);
-		DEBUG("striat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("striat", uint32_t, htobe32);
+		continue;
+
+	op_striat_le:
+		STOREAT("striat", uint32_t, htole32);
 		continue;
 
 	op_strsat:
-		REG3;
-		*(uint16_t *)(mem + REGJ + REGK) = htobe16(REGI);
-		DEBUG("strsat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("strsat", uint16_t, htobe16);
+		continue;
+
+	op_strsat_le:
+		STOREAT("strsat", uint16_t, htole16);
 		continue;
 
 	op_strbat:
@@ -549,6 +764,37 @@ static void run() {
 		DEBUG("pop\tr%d\t(%ld)", regi, REGI);
 		continue;
 
+	// Registers are pushed in ascending and popped in descending order
+	op_pushm:
+		mem[ip-1] = HOST_PUSHM;
+		*(uint32_t *)(mem + ip) = be32toh(*(uint32_t *)(mem + ip));
+	host_pushm:
+		mask = *(uint32_t *)(mem + ip);
+		ip += 4;
+		DEBUG("pushm\t0x%x", mask);
+		while (mask) {
+			int r = __builtin_ctz(mask);
+			mask &= mask - 1;
+			*(size_t *)(mem + sp) = regs[r];
+			sp += sizeof regs[r];
+		}
+		continue;
+
+	op_popm:
+		mem[ip-1] = HOST_POPM;
+		*(uint32_t *)(mem + ip) = be32toh(*(uint32_t *)(mem + ip));
+	host_popm:
+		mask = *(uint32_t *)(mem + ip);
+		ip += 4;
+		DEBUG("popm\t0x%x", mask);
+		while (mask) {
+			int r = 31 - __builtin_clz(mask);
+			mask &= ~(1U << r);
+			sp -= sizeof regs[r];
+			regs[r] = *(size_t *)(mem + sp);
+		}
+		continue;
+
 	op_mov:
 		REG2;
 		REGI = REGJ;
@@ -672,6 +918,48 @@ static void run() {
 		REG3OP("lesse", <=);
 		continue;
 
+	op_addi:
+		REG2IOP_BE(HOST_ADDI);
+	host_addi:
+		REG2IOP("addi", +);
+		continue;
+
+	op_subi:
+		REG2IOP_BE(HOST_SUBI);
+	host_subi:
+		REG2IOP("subi", -);
+		continue;
+
+	op_muli:
+		REG2IOP_BE(HOST_MULI);
+	host_muli:
+		REG2IOP("muli", *);
+		continue;
+
+	op_andi:
+		REG2IOP_BE(HOST_ANDI);
+	host_andi:
+		REG2IOP("andi", &);
+		continue;
+
+	op_lshifti:
+		REG2IOP_BE(HOST_LSHIFTI);
+	host_lshifti:
+		REG2IOP("lshifti", <<);
+		continue;
+
+	op_rshifti:
+		REG2IOP_BE(HOST_RSHIFTI);
+	host_rshifti:
+		REG2IOP("rshifti", >>);
+		continue;
+
+	op_lessi:
+		REG2IOP_BE(HOST_LESSI);
+	host_lessi:
+		REG2IOP("lessi", <);
+		continue;
+
 	op_rrot:
 		REG3OPSTRFUNC("rrot", RROT64, "RR", "%lx");
 		continue;
@@ -705,11 +993,18 @@ int main(int argc, char **argv) {
 	
 	// Read source
 	int fd = open(argv[1], O_RDONLY);
-	int magic;
+	uint32_t magic;
 	read(fd, &magic, sizeof magic);
-	read(fd, mem, sizeof mem);
+	mem = (char *)vasm_mem_init();
+	read(fd, mem, VASM_MEM_IMAGE_SIZE);
 	close(fd);
 
 	// Magic
-	run();
+	int isobj;
+	int format = vbin_magic_format(magic, &isobj);
+	if (format < 0 || isobj) {
+		fprintf(stderr, "Invalid magic number (0x%08x)\n", be32toh(magic));
+		return 1;
+	}
+	run(format);
 }
@@ -1,5 +1,6 @@
 /**
- * This interpreter first converts all CISC instructions to RISC and executes these.
+ * This interpreter converts CISC instructions to RISC and executes these. Code
+ * is converted one block at a time, when it is executed for the first time.
  *
  * The RISC instructions are 4 bytes long and have two formats:
  *
@@ -17,15 +18,18 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <endian.h>
+#include <sys/mman.h>
 #include <x86intrin.h>
 #include "vasm.h"
 #include "util.h"
 #include "interpreter/syscall.h"
+#include "interpreter/memory.h"
 
 
-static char    mem[0x100000];
+static char   *mem;
 static int64_t regs[32];
 static size_t  programlen;
+static enum vbin_format format;
 
 
 #ifdef NDEBUG
@@ -97,6 +101,36 @@ static size_t  programlen;
 } while (0);
 #endif
 
+#define LOAD(m,t,conv) do {				\
+	REG2;						\
+	REGI = *(t *)(mem + REGJ);			\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d\t(%lu <-- 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+
+#define LOADAT(m,t,conv) do {				\
+	REG3;						\
+	REGI = *(t *)(mem + REGJ + REGK);		\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+
+#define STORE(m,t,conv) do {				\
+	REG2;						\
+	*(t *)(mem + REGJ) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d\t(%lu --> 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+
+#define STOREAT(m,t,conv) do {				\
+	REG3;						\
+	*(t *)(mem + REGJ + REGK) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+
 #define JUMPIF(m,c) do {				\
 	REG1;						\
 	if (c) {					\
@@ -110,9 +144,30 @@ static size_t  programlen;
 	}						\
 } while (0)
 
+#define JUMPIF2(m,c) do {				\
+	REG2;						\
+	if (c) {					\
+		ip = (uint32_t *)*(uint64_t *)ip;	\
+		DEBUG(m "\tr%d,r%d,0x%lx\t(true)",	\
+		      regi, regj, (uint64_t)ip);	\
+	} else {					\
+		DEBUG(m "\tr%d,r%d\t(false)",		\
+		      regi, regj);			\
+		ip += 2;				\
+	}						\
+} while (0)
+
 #define sp regs[31]
 
 
+// The (sign extended) immediate follows the instruction
+#define REG2IOP(m,op) do {				\
+	REG2;						\
+	REGI = REGJ op (int64_t)(int32_t)*ip++;		\
+	DEBUG(m "\tr%d,r%d\t(%ld)", regi, regj, REGI);	\
+} while (0)
+
+
 #ifndef NOPROF
 static size_t icounter;
 static size_t rstart;
@@ -141,6 +196,10 @@ enum risc_op {
 	RISC_JNZ,
 	RISC_JP,
 	RISC_JPZ,
+	RISC_JLT,
+	RISC_JLE,
+	RISC_JEQ,
+	RISC_JNE,
 	RISC_CALL,
 	RISC_RET,
 
@@ -164,6 +223,8 @@ enum risc_op {
 
 	RISC_PUSH,
 	RISC_POP,
+	RISC_PUSHM,
+	RISC_POPM,
 	RISC_MOV,
 	RISC_SETL,
 	RISC_SETI,
@@ -185,14 +246,57 @@ enum risc_op {
 	RISC_INV,
 	RISC_LESS,
 	RISC_LESSE,
+	RISC_ADDI,
+	RISC_SUBI,
+	RISC_MULI,
+	RISC_ANDI,
+	RISC_LSHIFTI,
+	RISC_RSHIFTI,
+	RISC_LESSI,
 
 	RISC_SYSCALL,
 
-	RISC_CRASH
+	RISC_CRASH,
+	RISC_TRANSLATE,
+
+	// Variants for the little endian format
+	RISC_LDL_LE,
+	RISC_LDI_LE,
+	RISC_LDS_LE,
+	RISC_STRL_LE,
+	RISC_STRI_LE,
+	RISC_STRS_LE,
+	RISC_LDLAT_LE,
+	RISC_LDIAT_LE,
+	RISC_LDSAT_LE,
+	RISC_STRLAT_LE,
+	RISC_STRIAT_LE,
+	RISC_STRSAT_LE,
 };
 
 
-static uint32_t risc[0x1000];
+/**
+ * The RISC code is translated lazily, one block at a time, the first time it
+ * is jumped to. Branches to code that hasn't been translated yet point at a
+ * stub instead:
+ *
+ *   | RISC_TRANSLATE | 64 CISC address | 64 address of the branch slot |
+ *
+ * Translated code never moves as branches point directly at it, so the
+ * translation area is reserved up front. Code grows from the start of it and
+ * stubs grow from the end. A CISC instruction is at least one byte and takes
+ * at most 3 words, a stub of 5 words and the 3 word jump that may end its
+ * block, which bounds the size of the area.
+ */
+#define RISC_MAX_PER_BYTE	11
+
+static uint32_t *risc;
+static size_t    risccap, risclen, stubs;
+// The offset + 1 of the translation of each CISC instruction, 0 if it has
+// none yet. Offsets take half the space of pointers, which matters as there
+// is an entry for every byte of the program.
+static uint32_t *c2r;
+static void     **handlers;
 
 
 static enum risc_op cisc2risc_op(enum vasm_op cop)
@@ -209,6 +313,14 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 	case OP_JP     : return RISC_JP     ;
 	case OP_JPZB   :
 	case OP_JPZ    : return RISC_JPZ    ;
+	case OP_JLTB   :
+	case OP_JLT    : return RISC_JLT    ;
+	case OP_JLEB   :
+	case OP_JLE    : return RISC_JLE    ;
+	case OP_JEQB   :
+	case OP_JEQ    : return RISC_JEQ    ;
+	case OP_JNEB   :
+	case OP_JNE    : return RISC_JNE    ;
 	case OP_CALL   : return RISC_CALL   ;
 	case OP_RET    : return RISC_RET    ;
 
@@ -231,6 +343,8 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 
 	case OP_PUSH   : return RISC_PUSH   ;
 	case OP_POP    : return RISC_POP    ;
+	case OP_PUSHM  : return RISC_PUSHM  ;
+	case OP_POPM   : return RISC_POPM   ;
 	case OP_SETL   : return RISC_SETL   ;
 	case OP_SETI   :
 	case OP_SETS   :
@@ -254,6 +368,13 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 	case OP_INV    : return RISC_INV    ;
 	case OP_LESS   : return RISC_LESS   ;
 	case OP_LESSE  : return RISC_LESSE  ;
+	case OP_ADDI   : return RISC_ADDI   ;
+	case OP_SUBI   : return RISC_SUBI   ;
+	case OP_MULI   : return RISC_MULI   ;
+	case OP_ANDI   : return RISC_ANDI   ;
+	case OP_LSHIFTI: return RISC_LSHIFTI;
+	case OP_RSHIFTI: return RISC_RSHIFTI;
+	case OP_LESSI  : return RISC_LESSI  ;
 
 	case OP_SYSCALL: return RISC_SYSCALL;
 
@@ -275,7 +396,27 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 }
 
 
-static void cisc2risc(void **tbl, size_t tbllen)
+static enum risc_op risc_op_le(enum risc_op rop)
+{
+	switch (rop) {
+	case RISC_LDL   : return RISC_LDL_LE   ;
+	case RISC_LDI   : return RISC_LDI_LE   ;
+	case RISC_LDS   : return RISC_LDS_LE   ;
+	case RISC_STRL  : return RISC_STRL_LE  ;
+	case RISC_STRI  : return RISC_STRI_LE  ;
+	case RISC_STRS  : return RISC_STRS_LE  ;
+	case RISC_LDLAT : return RISC_LDLAT_LE ;
+	case RISC_LDIAT : return RISC_LDIAT_LE ;
+	case RISC_LDSAT : return RISC_LDSAT_LE ;
+	case RISC_STRLAT: return RISC_STRLAT_LE;
+	case RISC_STRIAT: return RISC_STRIAT_LE;
+	case RISC_STRSAT: return RISC_STRSAT_LE;
+	default         : return rop;
+	}
+}
+
+
+static void cisc2risc_init(void **tbl, size_t tbllen)
 {
 	// Make sure the prefix on all labels match
 	DEBUG("Checking jump table prefixes");
@@ -292,20 +433,83 @@ static void cisc2risc(void **tbl, size_t tbllen)
 	}
 	DEBUG("Test passed");
 
-	size_t n = 0, i = 0;
+	handlers = tbl;
+	risccap  = (programlen + 1) * RISC_MAX_PER_BYTE;
+	risc = mmap(NULL, risccap * sizeof *risc, PROT_READ | PROT_WRITE,
+	            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (risc == MAP_FAILED) {
+		perror("Failed to reserve translation area");
+		abort();
+	}
+	stubs = risccap;
+	c2r = calloc(programlen + 1, sizeof *c2r);
+	if (c2r == NULL) {
+		perror("Failed to allocate translation table");
+		abort();
+	}
+}
 
 
-	struct {
-		size_t cpos, rpos;
-	} c2r[0x10000], r2c[0x1000];
-	size_t c2rc = 0, r2cc = 0;
+static uint32_t risc_instr(enum risc_op rop, uint8_t rx, uint8_t ry, uint8_t rz)
+{
+	uint32_t instr = 0;
+	instr |= ((size_t)handlers[rop]) & 0x0000FFFF;
+	instr |= (rx  << 16) & 0x001F0000;
+	instr |= (ry  << 21) & 0x03E00000;
+	instr |= (rz  << 26) & 0x7C000000;
+	return instr;
+}
 
-	
-	while (i < programlen) {
 
-		c2r[c2rc].cpos = i;
-		c2r[c2rc].rpos = n;
-		c2rc++;
+/**
+ * Point the branch slot at the translation of cpos or at a stub that
+ * translates it when the branch is taken for the first time.
+ */
+static void risc_branch(uint32_t *slot, size_t cpos)
+{
+	if (cpos < programlen && c2r[cpos] != 0) {
+		*(uint64_t *)slot = (uint64_t)(risc + c2r[cpos] - 1);
+		return;
+	}
+	stubs -= 5;
+	uint32_t *stub = risc + stubs;
+	stub[0] = risc_instr(RISC_TRANSLATE, 0, 0, 0);
+	*(uint64_t *)(stub + 1) = cpos;
+	*(uint64_t *)(stub + 3) = (uint64_t)slot;
+	*(uint64_t *)slot = (uint64_t)stub;
+}
+
+
+/**
+ * Translate the CISC instructions starting at cpos up to the first
+ * unconditional jump or return, or up to an instruction that has been
+ * translated already. Returns the translation of cpos.
+ */
+static uint32_t *cisc2risc(size_t cpos)
+{
+	if (cpos < programlen && c2r[cpos] != 0)
+		return risc + c2r[cpos] - 1;
+
+	DEBUG("Translating block at 0x%lx", cpos);
+	size_t n = risclen, i = cpos;
+	uint32_t *start = risc + n;
+
+	while (1) {
+
+		if (n + RISC_MAX_PER_BYTE > stubs)
+			abort();
+
+		if (i >= programlen) {
+			risc[n++] = risc_instr(RISC_CRASH, 0, 0, 0);
+			break;
+		}
+		if (c2r[i] != 0) {
+			risc[n++] = risc_instr(RISC_JMP, 0, 0, 0);
+			*(uint64_t *)(risc + n) = (uint64_t)(risc + c2r[i] - 1);
+			n += 2;
+			break;
+		}
+		c2r[i] = n + 1;
 
 		enum vasm_op op = mem[i++];
 		uint8_t rx = 0, ry = 0, rz = 0;
@@ -334,19 +538,19 @@ static void cisc2risc(void **tbl, size_t tbllen)
 		case ARGS_TYPE_SHORT:
 			vallen = 2;
 			val    = *(uint16_t *)(mem + i);
-			val    = be16toh(val);
+			val    = vbin16toh(format, val);
 			i += 2;
 			break;
 		case ARGS_TYPE_INT:
 			vallen = 4;
 			val    = *(uint32_t *)(mem + i);
-			val    = be32toh(val);
+			val    = vbin32toh(format, val);
 			i += 4;
 			break;
 		case ARGS_TYPE_LONG:
 			vallen = 8;
 			val    = *(uint64_t *)(mem + i);
-			val    = be64toh(val);
+			val    = vbin64toh(format, val);
 			i += 8;
 			break;
 		case ARGS_TYPE_REGBYTE:
@@ -358,82 +562,103 @@ static void cisc2risc(void **tbl, size_t tbllen)
 			rx = mem[i++];
 			vallen = 2;
 			val    = *(uint16_t *)(mem + i);
-			val    = be16toh(val);
+			val    = vbin16toh(format, val);
 			i += 2;
 			break;
 		case ARGS_TYPE_REGINT:
 			rx = mem[i++];
 			vallen = 4;
 			val    = *(uint32_t *)(mem + i);
-			val    = be32toh(val);
+			val    = vbin32toh(format, val);
 			i += 4;
 			break;
 		case ARGS_TYPE_REGLONG:
 			rx = mem[i++];
 			vallen = 8;
 			val    = *(uint64_t *)(mem + i);
-			val    = be64toh(val);
+			val    = vbin64toh(format, val);
 			i += 8;
 			break;
+		case ARGS_TYPE_REG2BYTE:
+			rx = mem[i++];
+			ry = mem[i++];
+			vallen = 1;
+			val    = (uint8_t)mem[i++];
+			break;
+		case ARGS_TYPE_REG2LONG:
+			rx = mem[i++];
+			ry = mem[i++];
+			vallen = 8;
+			val    = *(uint64_t *)(mem + i);
+			val    = vbin64toh(format, val);
+			i += 8;
+			break;
+		case ARGS_TYPE_REG2INT:
+			rx = mem[i++];
+			ry = mem[i++];
+			vallen = 4;
+			val    = *(uint32_t *)(mem + i);
+			val    = vbin32toh(format, val);
+			i += 4;
+			break;
 		default:
 			DEBUG("Unknown OP @ %lx  (%d)", i - 1, op);
 			op = RISC_CRASH;
 			break;
 		}
 
-		uint32_t instr = 0;
 		enum risc_op rop = cisc2risc_op(op);
-		instr |= ((size_t)tbl[rop]) & 0x0000FFFF;
-
-		instr |= (rx  << 16) & 0x001F0000;
-		instr |= (ry  << 21) & 0x03E00000;
-		instr |= (rz  << 26) & 0x7C000000;
-
-		risc[n++] = instr;
+		if (format == VBIN_FORMAT_LE)
+			rop = risc_op_le(rop);
+		risc[n++] = risc_instr(rop, rx, ry, rz);
 
 		if (op == OP_JMP ||
 		    op == OP_JZ  ||
 		    op == OP_JNZ ||
 		    op == OP_JP  ||
 		    op == OP_JPZ ||
+		    op == OP_JLT ||
+		    op == OP_JLE ||
+		    op == OP_JEQ ||
+		    op == OP_JNE ||
 		    op == OP_CALL) {
-			r2c[r2cc].cpos = val;
-			r2c[r2cc].rpos = n;
-			r2cc++;
-			val = -1;
-			vallen = 8;
-		}
-		if (op == OP_JMPRB ||
-		    op == OP_JZB   ||
-		    op == OP_JNZB  ||
-		    op == OP_JPB   ||
-		    op == OP_JPZB ) {
-			r2c[r2cc].cpos = i - 1 + (int8_t)val;
-			r2c[r2cc].rpos = n;
-			r2cc++;
-			val = -1;
-			vallen = 8;
-		}
-
-		if (vallen == 8) {
+			risc_branch(risc + n, val);
+			n += 2;
+		} else if (op == OP_JMPRB ||
+		           op == OP_JZB   ||
+		           op == OP_JNZB  ||
+		           op == OP_JPB   ||
+		           op == OP_JPZB  ||
+		           op == OP_JLTB  ||
+		           op == OP_JLEB  ||
+		           op == OP_JEQB  ||
+		           op == OP_JNEB ) {
+			risc_branch(risc + n, i - 1 + (int8_t)val);
+			n += 2;
+		} else if (vallen == 8) {
 			*(uint64_t *)(risc + n) = val;
 			n += 2;
 		} else if (vallen > 0) {
 			risc[n++] = val;
 		}
+
+		if (op == OP_JMP || op == OP_JMPRB || op == OP_RET)
+			break;
 	}
 
+	risclen = n;
+	return start;
+}
 
-	for (size_t i = 0; i < r2cc; i++) {
-		size_t j;
-		for (j = 0; j < c2rc; j++) {
-			if (r2c[i].cpos == c2r[j].cpos)
-				goto found;
-		}
-		abort();
-	found:
-		*(uint64_t *)(risc + r2c[i].rpos) = (uint64_t)(risc + c2r[j].rpos);
-	}
+
+/**
+ * Translate the target of a stub and patch the branch that jumped to it.
+ */
+static uint32_t *cisc2risc_stub(uint32_t *stub)
+{
+	uint32_t *r = cisc2risc(*(uint64_t *)(stub + 1));
+	**(uint64_t **)(stub + 3) = (uint64_t)r;
+	return r;
 }
 
 
@@ -456,6 +681,10 @@ static void run()
 		[RISC_JNZ]     = &&op_jnz,
 		[RISC_JP]      = &&op_jp,
 		[RISC_JPZ]     = &&op_jpz,
+		[RISC_JLT]     = &&op_jlt,
+		[RISC_JLE]     = &&op_jle,
+		[RISC_JEQ]     = &&op_jeq,
+		[RISC_JNE]     = &&op_jne,
 		[RISC_CALL]    = &&op_call,
 		[RISC_RET]     = &&op_ret,
 
@@ -479,6 +708,8 @@ static void run()
 
 		[RISC_PUSH]    = &&op_push,
 		[RISC_POP]     = &&op_pop,
+		[RISC_PUSHM]   = &&op_pushm,
+		[RISC_POPM]    = &&op_popm,
 		[RISC_MOV]     = &&op_mov,
 		[RISC_SETL]    = &&op_setl,
 		[RISC_SETI]    = &&op_seti,
@@ -500,15 +731,36 @@ static void run()
 		[RISC_INV]     = &&op_inv,
 		[RISC_LESS]    = &&op_less,
 		[RISC_LESSE]   = &&op_lesse,
+		[RISC_ADDI]    = &&op_addi,
+		[RISC_SUBI]    = &&op_subi,
+		[RISC_MULI]    = &&op_muli,
+		[RISC_ANDI]    = &&op_andi,
+		[RISC_LSHIFTI] = &&op_lshifti,
+		[RISC_RSHIFTI] = &&op_rshifti,
+		[RISC_LESSI]   = &&op_lessi,
 
 		[RISC_SYSCALL] = &&op_syscall,
 
 		[RISC_CRASH]   = &&crash,
+		[RISC_TRANSLATE] = &&op_translate,
+
+		[RISC_LDL_LE]    = &&op_ldl_le,
+		[RISC_LDI_LE]    = &&op_ldi_le,
+		[RISC_LDS_LE]    = &&op_lds_le,
+		[RISC_STRL_LE]   = &&op_strl_le,
+		[RISC_STRI_LE]   = &&op_stri_le,
+		[RISC_STRS_LE]   = &&op_strs_le,
+		[RISC_LDLAT_LE]  = &&op_ldlat_le,
+		[RISC_LDIAT_LE]  = &&op_ldiat_le,
+		[RISC_LDSAT_LE]  = &&op_ldsat_le,
+		[RISC_STRLAT_LE] = &&op_strlat_le,
+		[RISC_STRIAT_LE] = &&op_striat_le,
+		[RISC_STRSAT_LE] = &&op_strsat_le,
 	};
 
-	cisc2risc(table, sizeof table / sizeof *table);
+	cisc2risc_init(table, sizeof table / sizeof *table);
 
-	uint32_t *ip = risc;
+	uint32_t *ip = cisc2risc(0);
 
 #ifdef GUARANTEE_BELOW_0x10000
 #define prefix 0
@@ -529,6 +781,7 @@ static void run()
 		uint32_t      instr = *ip++;
 		size_t        addr  = ((instr      ) & 0xFFFF) + prefix;
 		unsigned char regi, regj, regk;
+		uint32_t mask;
 #ifdef PRECOMPUTE_REGI
 # define PREREGI regi = (instr >> 16) & 0x1F;
 #else
@@ -581,25 +834,44 @@ static void run()
 		JUMPIF("jpz", REGI >= 0);
 		continue;
 
+	op_jlt:
+		JUMPIF2("jlt", REGI < REGJ);
+		continue;
+
+	op_jle:
+		JUMPIF2("jle", REGI <= REGJ);
+		continue;
+
+	op_jeq:
+		JUMPIF2("jeq", REGI == REGJ);
+		continue;
+
+	op_jne:
+		JUMPIF2("jne", REGI != REGJ);
+		continue;
+
 	op_ldl:
-		REG2;
-		REGI = *(uint64_t *)(mem + REGJ);
-		REGI = be64toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("ldl", uint64_t, be64toh);
+		continue;
+
+	op_ldl_le:
+		LOAD("ldl", uint64_t, le64toh);
 		continue;
 
 	op_ldi:
-		REG2;
-		REGI = *(uint32_t *)(mem + REGJ);
-		REGI = be32toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("ldi", uint32_t, be32toh);
+		continue;
+
+	op_ldi_le:
+		LOAD("ldi", uint32_t, le32toh);
 		continue;
 
 	op_lds:
-		REG2;
-		REGI = *(uint16_t *)(mem + REGJ);
-		REGI = be16toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("lds", uint16_t, be16toh);
+		continue;
+
+	op_lds_le:
+		LOAD("lds", uint16_t, le16toh);
 		continue;
 
 	op_ldb:
@@ -609,27 +881,27 @@ static void run()
 		continue;
 
 	op_ldlat:
-		REG3;
-		REGI = *(uint64_t *)(mem + REGJ + REGK);
-		REGI = be64toh(REGI);
-		DEBUG("ldlat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldlat", uint64_t, be64toh);
+		continue;
+
+	op_ldlat_le:
+		LOADAT("ldlat", uint64_t, le64toh);
 		continue;
 
 	op_ldiat:
-		REG3;
-		REGI = *(uint32_t *)(mem + REGJ + REGK);
-		REGI = be32toh(REGI);
-		DEBUG("ldiat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldiat", uint32_t, be32toh);
+		continue;
+
+	op_ldiat_le:
+		LOADAT("ldiat", uint32_t, le32toh);
 		continue;
 
 	op_ldsat:
-		REG3;
-		REGI = *(uint16_t *)(mem + REGJ + REGK);
-		REGI = be16toh(REGI);
-		DEBUG("ldsat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldsat", uint16_t, be16toh);
+		continue;
+
+	op_ldsat_le:
+		LOADAT("ldsat", uint16_t, le16toh);
 		continue;
 
 	op_ldbat:
@@ -640,21 +912,27 @@ static void run()
 		continue;
 
 	op_strl:
-		REG2;
-		*(uint64_t *)(mem + REGJ) = htobe64(REGI);
-		DEBUG("strl\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("strl", uint64_t, htobe64);
+		continue;
+
+	op_strl_le:
+		STORE("strl", uint64_t, htole64);
 		continue;
 
 	op_stri:
-		REG2;
-		*(uint32_t *)(mem + REGJ) = htobe32(REGI);
-		DEBUG("stri\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("stri", uint32_t, htobe32);
+		continue;
+
+	op_stri_le:
+		STORE("stri", uint32_t, htole32);
 		continue;
 
 	op_strs:
-		REG2;
-		*(uint16_t *)(mem + REGJ) = htobe16(REGI);
-		DEBUG("strs\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("strs", uint16_t, htobe16);
+		continue;
+
+	op_strs_le:
+		STORE("strs", uint16_t, htole16);
 		continue;
 
 	op_strb:
@@ -664,24 +942,27 @@ static void run()
 		continue;
 
 	op_strlat:
-		REG3;
-		*(uint64_t *)(mem + REGJ + REGK) = htobe64(REGI);
-		DEBUG("strlat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("strlat", uint64_t, htobe64);
+		continue;
+
+	op_strlat_le:
+		STOREAT("strlat", uint64_t, htole64);
 		continue;
 
 	op_striat:
-		REG3;
-		*(uint32_t *)(mem + REGJ + REGK) = htobe32(REGI);
-		DEBUG("striat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("striat", uint32_t, htobe32);
+		continue;
+
+	op_striat_le:
+		STOREAT("striat", uint32_t, htole32);
 		continue;
 
 	op_strsat:
-		REG3;
-		*(uint16_t *)(mem + REGJ + REGK) = htobe16(REGI);
-		DEBUG("strsat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("strsat", uint16_t, htobe16);
+		continue;
+
+	op_strsat_le:
+		STOREAT("strsat", uint16_t, htole16);
 		continue;
 
 	op_strbat:
@@ -705,6 +986,29 @@ static void run()
 		DEBUG("pop\tr%d\t(%ld)", regi, REGI);
 		continue;
 
+	// Registers are pushed in ascending and popped in descending order
+	op_pushm:
+		mask = *ip++;
+		DEBUG("pushm\t0x%x", mask);
+		while (mask) {
+			int r = __builtin_ctz(mask);
+			mask &= mask - 1;
+			*(size_t *)(mem + sp) = regs[r];
+			sp += sizeof regs[r];
+		}
+		continue;
+
+	op_popm:
+		mask = *ip++;
+		DEBUG("popm\t0x%x", mask);
+		while (mask) {
+			int r = 31 - __builtin_clz(mask);
+			mask &= ~(1U << r);
+			sp -= sizeof regs[r];
+			regs[r] = *(size_t *)(mem + sp);
+		}
+		continue;
+
 	op_mov:
 		REG2;
 		REGI = REGJ;
@@ -776,6 +1080,34 @@ static void run()
 		REG3OP("lesse", <=);
 		continue;
 
+	op_addi:
+		REG2IOP("addi", +);
+		continue;
+
+	op_subi:
+		REG2IOP("subi", -);
+		continue;
+
+	op_muli:
+		REG2IOP("muli", *);
+		continue;
+
+	op_andi:
+		REG2IOP("andi", &);
+		continue;
+
+	op_lshifti:
+		REG2IOP("lshifti", <<);
+		continue;
+
+	op_rshifti:
+		REG2IOP("rshifti", >>);
+		continue;
+
+	op_lessi:
+		REG2IOP("lessi", <);
+		continue;
+
 	op_rrot:
 		REG3OPSTRFUNC("rrot", RROT64, "RR", "%lx");
 		continue;
@@ -801,6 +1133,11 @@ static void run()
 		vasm_syscall(regs, mem);
 		continue;
 
+	op_translate:
+		ip = cisc2risc_stub(ip - 1);
+		DEBUG("translate\t0x%lx", (uint64_t)ip);
+		continue;
+
 	crash:
 		fprintf(stderr, "Invalid OP executed");
 		fprintf(stderr, "Crashing");
@@ -815,11 +1152,19 @@ int main(int argc, char **argv) {
 	
 	// Read source
 	int fd = open(argv[1], O_RDONLY);
-	int magic;
+	uint32_t magic;
 	read(fd, &magic, sizeof magic);
-	programlen = read(fd, mem, sizeof mem);
+	mem = (char *)vasm_mem_init();
+	programlen = read(fd, mem, VASM_MEM_IMAGE_SIZE);
 	close(fd);
 
 	// Magic
+	int isobj;
+	int f = vbin_magic_format(magic, &isobj);
+	if (f < 0 || isobj) {
+		fprintf(stderr, "Invalid magic number (0x%08x)\n", be32toh(magic));
+		return 1;
+	}
+	format = f;
 	run();
 }
@@ -8,6 +8,14 @@
  *
  * The op is the lower 16 bits of a goto pointer.
  * r[xyz] are registers to (optionally) use.
+ *
+ * After translation, pairs of adjacent instructions listed in FUSED_OPS are
+ * fused: the handler of the first instruction is replaced with one that
+ * executes both, which saves a dispatch. The second instruction is left
+ * untouched so it can still be used as a jump target.
+ *
+ * With -C <dir> as the first arguments, the translation is cached in that
+ * directory and mapped directly on the next run of the same program.
  */
 
 
@@ -17,15 +25,23 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <x86intrin.h>
 #include "vasm.h"
 #include "util.h"
 #include "interpreter/syscall.h"
+#include "interpreter/memory.h"
 
 
-static char    mem[0x100000];
+static char   *mem;
 static int64_t regs[32];
 static size_t  programlen;
+static enum vbin_format format;
+// The directory translations are cached in. Caching is disabled if it is NULL.
+static const char *cache_dir;
 
 
 #ifdef NDEBUG
@@ -110,6 +126,19 @@ static size_t  programlen;
 	}						\
 } while (0)
 
+#define JUMPIF2(m,c) do {				\
+	REG2;						\
+	if (c) {					\
+		ip = (uint64_t *)*(uint64_t *)ip;	\
+		DEBUG(m "\tr%d,r%d,0x%lx\t(true)",	\
+		      regi, regj, (uint64_t)ip);	\
+	} else {					\
+		DEBUG(m "\tr%d,r%d\t(false)",		\
+		      regi, regj);			\
+		ip++;					\
+	}						\
+} while (0)
+
 #define sp regs[31]
 
 
@@ -133,6 +162,25 @@ static size_t rstart;
 
 
 
+/**
+ * Pairs of instructions that are fused into a single handler.
+ *
+ * The format is: first op, second op, first handler, second handler
+ */
+#define FUSED_OPS(X)				\
+	X(LESS  , JZ  , less  , jz  )		\
+	X(LESS  , JNZ , less  , jnz )		\
+	X(LESSE , JZ  , lesse , jz  )		\
+	X(LESSE , JNZ , lesse , jnz )		\
+	X(SUB   , JZ  , sub   , jz  )		\
+	X(SUB   , JNZ , sub   , jnz )		\
+	X(SETL  , ADD , setl  , add )		\
+	X(SETL  , LESS, setl  , less)		\
+	X(ADD   , JMP , add   , jmp )		\
+	X(LDLAT , ADD , ldlat , add )		\
+	X(LDLAT_LE, ADD, ldlat_le, add)
+
+
 enum risc_op {
 	RISC_NOP,
 
@@ -141,6 +189,10 @@ enum risc_op {
 	RISC_JNZ,
 	RISC_JP,
 	RISC_JPZ,
+	RISC_JLT,
+	RISC_JLE,
+	RISC_JEQ,
+	RISC_JNE,
 	RISC_CALL,
 	RISC_RET,
 
@@ -164,6 +216,8 @@ enum risc_op {
 
 	RISC_PUSH,
 	RISC_POP,
+	RISC_PUSHM,
+	RISC_POPM,
 	RISC_MOV,
 	RISC_SETL,
 
@@ -184,14 +238,57 @@ enum risc_op {
 	RISC_INV,
 	RISC_LESS,
 	RISC_LESSE,
+	RISC_ADDI,
+	RISC_SUBI,
+	RISC_MULI,
+	RISC_ANDI,
+	RISC_LSHIFTI,
+	RISC_RSHIFTI,
+	RISC_LESSI,
 
 	RISC_SYSCALL,
 
-	RISC_CRASH
+	RISC_CRASH,
+
+	// Variants for the little endian format
+	RISC_LDL_LE,
+	RISC_LDI_LE,
+	RISC_LDS_LE,
+	RISC_STRL_LE,
+	RISC_STRI_LE,
+	RISC_STRS_LE,
+	RISC_LDLAT_LE,
+	RISC_LDIAT_LE,
+	RISC_LDSAT_LE,
+	RISC_STRLAT_LE,
+	RISC_STRIAT_LE,
+	RISC_STRSAT_LE,
+
+#define X(a,b,c,d) RISC_##a##_##b,
+	FUSED_OPS(X)
+#undef X
 };
 
 
-static uint64_t risc[0x1000];
+static uint64_t *risc;
+
+
+/**
+ * Grow an array so that it can hold at least n elements.
+ */
+#define GROW(a, n, cap) do {						\
+	if ((n) > (cap)) {						\
+		(cap) = (n) * 2 > 1024 ? (n) * 2 : 1024;		\
+		(a) = realloc((a), (cap) * sizeof *(a));		\
+		if ((a) == NULL)					\
+			EXITERRNO(3, "Failed to grow translation tables");\
+	}								\
+} while (0)
+
+
+struct c2r {
+	size_t cpos, rpos;
+};
 
 
 static enum risc_op cisc2risc_op(enum vasm_op cop)
@@ -208,6 +305,14 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 	case OP_JP     : return RISC_JP     ;
 	case OP_JPZB   :
 	case OP_JPZ    : return RISC_JPZ    ;
+	case OP_JLTB   :
+	case OP_JLT    : return RISC_JLT    ;
+	case OP_JLEB   :
+	case OP_JLE    : return RISC_JLE    ;
+	case OP_JEQB   :
+	case OP_JEQ    : return RISC_JEQ    ;
+	case OP_JNEB   :
+	case OP_JNE    : return RISC_JNE    ;
 	case OP_CALL   : return RISC_CALL   ;
 	case OP_RET    : return RISC_RET    ;
 
@@ -230,6 +335,8 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 
 	case OP_PUSH   : return RISC_PUSH   ;
 	case OP_POP    : return RISC_POP    ;
+	case OP_PUSHM  : return RISC_PUSHM  ;
+	case OP_POPM   : return RISC_POPM   ;
 	case OP_SETL   :
 	case OP_SETI   :
 	case OP_SETS   :
@@ -253,6 +360,13 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 	case OP_INV    : return RISC_INV    ;
 	case OP_LESS   : return RISC_LESS   ;
 	case OP_LESSE  : return RISC_LESSE  ;
+	case OP_ADDI   : return RISC_ADDI   ;
+	case OP_SUBI   : return RISC_SUBI   ;
+	case OP_MULI   : return RISC_MULI   ;
+	case OP_ANDI   : return RISC_ANDI   ;
+	case OP_LSHIFTI: return RISC_LSHIFTI;
+	case OP_RSHIFTI: return RISC_RSHIFTI;
+	case OP_LESSI  : return RISC_LESSI  ;
 
 	case OP_SYSCALL: return RISC_SYSCALL;
 
@@ -274,7 +388,56 @@ static enum risc_op cisc2risc_op(enum vasm_op cop)
 }
 
 
-static void cisc2risc(void **tbl, size_t tbllen)
+static enum risc_op risc_op_le(enum risc_op rop)
+{
+	switch (rop) {
+	case RISC_LDL   : return RISC_LDL_LE   ;
+	case RISC_LDI   : return RISC_LDI_LE   ;
+	case RISC_LDS   : return RISC_LDS_LE   ;
+	case RISC_STRL  : return RISC_STRL_LE  ;
+	case RISC_STRI  : return RISC_STRI_LE  ;
+	case RISC_STRS  : return RISC_STRS_LE  ;
+	case RISC_LDLAT : return RISC_LDLAT_LE ;
+	case RISC_LDIAT : return RISC_LDIAT_LE ;
+	case RISC_LDSAT : return RISC_LDSAT_LE ;
+	case RISC_STRLAT: return RISC_STRLAT_LE;
+	case RISC_STRIAT: return RISC_STRIAT_LE;
+	case RISC_STRSAT: return RISC_STRSAT_LE;
+	default         : return rop;
+	}
+}
+
+
+static const struct {
+	enum risc_op first, second, fused;
+} fused_ops[] = {
+#define X(a,b,c,d) { RISC_##a, RISC_##b, RISC_##a##_##b },
+	FUSED_OPS(X)
+#undef X
+};
+
+
+static void fuse(void **tbl, const enum risc_op *rops,
+                 const struct c2r *c2r, size_t c2rc)
+{
+	size_t n = 0;
+	for (size_t i = 0; i + 1 < c2rc; i++) {
+		for (size_t j = 0; j < sizeof fused_ops / sizeof *fused_ops; j++) {
+			if (fused_ops[j].first  == rops[i    ] &&
+			    fused_ops[j].second == rops[i + 1]) {
+				uint64_t *instr = risc + c2r[i].rpos;
+				*instr &= ~0xFFFFFFFFL;
+				*instr |= ((size_t)tbl[fused_ops[j].fused]) & 0xFFFFFFFFL;
+				n++;
+				break;
+			}
+		}
+	}
+	DEBUG("Fused %lu instructions", n);
+}
+
+
+static void check_prefixes(void **tbl, size_t tbllen)
 {
 	// Make sure the prefix on all labels match
 	DEBUG("Checking jump table prefixes");
@@ -290,18 +453,209 @@ static void cisc2risc(void **tbl, size_t tbllen)
 #endif
 	}
 	DEBUG("Test passed");
+}
+
+
+/**
+ * A translation is cached in a file that is mapped directly on the next run:
+ *
+ *   struct risc_cache
+ *   u64 words[wordcount]
+ *   u32 relocs[reloccount]
+ *
+ * The words are stored as they are when the file is mapped at RISC_CACHE_BASE
+ * and the first handler is at tbl0, so usually they can be used as is.
+ * Otherwise the words listed in relocs are adjusted: branch targets (marked
+ * with RELOC_BRANCH) move with the code and instructions with the handlers.
+ *
+ * The key covers the program and the build of the interpreter, including the
+ * offsets of the handlers, so only the base addresses can differ.
+ */
+struct risc_cache {
+	uint64_t magic;
+	uint64_t key;
+	uint64_t tbl0;
+	uint64_t wordcount;
+	uint64_t reloccount;
+};
+
+#define RISC_CACHE_MAGIC	0x3168637369727373UL	// "ssrisch1"
+#define RISC_CACHE_BASE		0x200000000000UL
+#define RELOC_BRANCH		0x80000000U
+
+static uint64_t cache_key;
+
+
+static uint64_t hash(uint64_t h, const void *data, size_t len)
+{
+	// FNV-1a, a word at a time as the whole program is hashed on startup
+	const unsigned char *c = data;
+	for ( ; len >= 8; c += 8, len -= 8) {
+		uint64_t w;
+		memcpy(&w, c, sizeof w);
+		h = (h ^ w) * 0x100000001b3;
+	}
+	for ( ; len > 0; c++, len--)
+		h = (h ^ *c) * 0x100000001b3;
+	return h;
+}
+
+
+static void cache_path(char *buf, size_t size)
+{
+	snprintf(buf, size, "%s/risc-%016lx", cache_dir, cache_key);
+}
+
+
+/**
+ * Maps a cached translation of the program. Returns -1 if there is none or if
+ * it doesn't fit the program.
+ */
+static int cache_get(void **tbl, size_t tbllen)
+{
+	static const char stamp[] = __DATE__ " " __TIME__;
+	uint64_t h = hash(0xcbf29ce484222325, stamp, sizeof stamp);
+	for (size_t i = 0; i < tbllen; i++) {
+		uint64_t off = (uint64_t)tbl[i] - (uint64_t)tbl[0];
+		h = hash(h, &off, sizeof off);
+	}
+	h = hash(h, &format, sizeof format);
+	cache_key = hash(h, mem, programlen);
+
+	char path[4096];
+	cache_path(path, sizeof path);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	// An instruction is translated to at most 2 words and has at most 2
+	// relocations. Bounding the counts keeps the size from overflowing
+	struct risc_cache hdr;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || read(fd, &hdr, sizeof hdr) != sizeof hdr ||
+	    hdr.magic != RISC_CACHE_MAGIC || hdr.key != cache_key ||
+	    hdr.wordcount > 2 * programlen ||
+	    hdr.reloccount > 2 * hdr.wordcount ||
+	    (uint64_t)st.st_size != sizeof hdr + hdr.wordcount * sizeof *risc +
+	                            hdr.reloccount * sizeof(uint32_t)) {
+		close(fd);
+		return -1;
+	}
+	char *map = mmap((void *)RISC_CACHE_BASE, st.st_size,
+	                 PROT_READ | PROT_WRITE,
+	                 MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0);
+	if (map == MAP_FAILED)
+		map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	uint64_t *words = (uint64_t *)(map + sizeof hdr);
+
+	// Every relocation has to be inside the translation and every branch
+	// has to stay in it, else the entry is damaged and thrown away
+	const uint32_t *relocs = (uint32_t *)(words + hdr.wordcount);
+	uint64_t base = RISC_CACHE_BASE + sizeof hdr;
+	for (size_t i = 0; i < hdr.reloccount; i++) {
+		uint64_t r = relocs[i] & ~RELOC_BRANCH;
+		if (r >= hdr.wordcount ||
+		    ((relocs[i] & RELOC_BRANCH) &&
+		     (words[r] < base || words[r] - base >= hdr.wordcount * 8 ||
+		      (words[r] - base) % 8 != 0))) {
+			DEBUG("Relocation %lu of the cached translation is invalid",
+			      i);
+			munmap(map, st.st_size);
+			return -1;
+		}
+	}
+	risc = words;
+
+	uint64_t dbranch = (uint64_t)map - RISC_CACHE_BASE;
+	uint64_t dtbl    = (uint64_t)tbl[0] - hdr.tbl0;
+	DEBUG("Mapped cached translation, relocating by 0x%lx and 0x%lx",
+	      dbranch, dtbl);
+	if (dbranch == 0 && dtbl == 0)
+		return 0;
+	for (size_t i = 0; i < hdr.reloccount; i++) {
+		uint64_t *w = risc + (relocs[i] & ~RELOC_BRANCH);
+		if (relocs[i] & RELOC_BRANCH)
+			*w += dbranch;
+		else
+			*w = (*w & ~0xFFFFFFFFL) | ((*w + dtbl) & 0xFFFFFFFFL);
+	}
+	return 0;
+}
+
 
+/**
+ * Stores the translation of the program. Failing to store it is not an error.
+ */
+static void cache_put(void **tbl, size_t n, const struct c2r *c2r, size_t c2rc,
+                      const struct c2r *r2c, size_t r2cc)
+{
+	struct risc_cache hdr = {
+		.magic      = RISC_CACHE_MAGIC,
+		.key        = cache_key,
+		.tbl0       = (uint64_t)tbl[0],
+		.wordcount  = n,
+		.reloccount = c2rc + r2cc,
+	};
+	size_t len = sizeof hdr + n * sizeof *risc +
+	             hdr.reloccount * sizeof(uint32_t);
+	char *buf = malloc(len);
+	if (buf == NULL)
+		return;
+	memcpy(buf, &hdr, sizeof hdr);
+	uint64_t *words  = (uint64_t *)(buf + sizeof hdr);
+	uint32_t *relocs = (uint32_t *)(words + n);
+	uint64_t  base   = RISC_CACHE_BASE + sizeof hdr;
+	memcpy(words, risc, n * sizeof *risc);
+	for (size_t i = 0; i < c2rc; i++)
+		*relocs++ = c2r[i].rpos;
+	for (size_t i = 0; i < r2cc; i++) {
+		words[r2c[i].rpos] += base - (uint64_t)risc;
+		*relocs++ = r2c[i].rpos | RELOC_BRANCH;
+	}
+
+	// Write to a temporary file first so that concurrent interpreters
+	// never see a partial entry
+	char path[4096], tmp[4096 + 32];
+	cache_path(path, sizeof path);
+	snprintf(tmp, sizeof tmp, "%s.%d.tmp", path, getpid());
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		const char *p = buf;
+		ssize_t w = 1;
+		while (len > 0 && (w = write(fd, p, len)) > 0) {
+			p   += w;
+			len -= w;
+		}
+		close(fd);
+		if (w <= 0 || rename(tmp, path) < 0)
+			unlink(tmp);
+	}
+	free(buf);
+}
+
+
+static void cisc2risc(void **tbl, size_t tbllen)
+{
 	size_t n = 0, i = 0;
 
 
-	struct {
-		size_t cpos, rpos;
-	} c2r[0x10000], r2c[0x1000];
-	size_t c2rc = 0, r2cc = 0;
+	struct c2r *c2r = NULL, *r2c = NULL;
+	size_t c2rc = 0, r2cc = 0, c2rcap = 0, r2ccap = 0, risccap = 0;
+	enum risc_op *rops = NULL;
+	size_t ropscap = 0;
 
 	
 	while (i < programlen) {
 
+		// An instruction takes at most 2 words
+		GROW(risc, n + 2, risccap);
+		GROW(c2r, c2rc + 1, c2rcap);
+		GROW(r2c, r2cc + 1, r2ccap);
+		GROW(rops, c2rc + 1, ropscap);
+
 		c2r[c2rc].cpos = i;
 		c2r[c2rc].rpos = n;
 		c2rc++;
@@ -333,19 +687,19 @@ static void cisc2risc(void **tbl, size_t tbllen)
 		case ARGS_TYPE_SHORT:
 			vallen = 2;
 			val    = *(uint16_t *)(mem + i);
-			val    = be16toh(val);
+			val    = vbin16toh(format, val);
 			i += 2;
 			break;
 		case ARGS_TYPE_INT:
 			vallen = 4;
 			val    = *(uint32_t *)(mem + i);
-			val    = be32toh(val);
+			val    = vbin32toh(format, val);
 			i += 4;
 			break;
 		case ARGS_TYPE_LONG:
 			vallen = 8;
 			val    = *(uint64_t *)(mem + i);
-			val    = be64toh(val);
+			val    = vbin64toh(format, val);
 			i += 8;
 			break;
 		case ARGS_TYPE_REGBYTE:
@@ -357,23 +711,45 @@ static void cisc2risc(void **tbl, size_t tbllen)
 			rx = mem[i++];
 			vallen = 2;
 			val    = *(uint16_t *)(mem + i);
-			val    = be16toh(val);
+			val    = vbin16toh(format, val);
 			i += 2;
 			break;
 		case ARGS_TYPE_REGINT:
 			rx = mem[i++];
 			vallen = 4;
 			val    = *(uint32_t *)(mem + i);
-			val    = be32toh(val);
+			val    = vbin32toh(format, val);
 			i += 4;
 			break;
 		case ARGS_TYPE_REGLONG:
 			rx = mem[i++];
 			vallen = 8;
 			val    = *(uint64_t *)(mem + i);
-			val    = be64toh(val);
+			val    = vbin64toh(format, val);
 			i += 8;
 			break;
+		case ARGS_TYPE_REG2BYTE:
+			rx = mem[i++];
+			ry = mem[i++];
+			vallen = 1;
+			val    = (uint8_t)mem[i++];
+			break;
+		case ARGS_TYPE_REG2LONG:
+			rx = mem[i++];
+			ry = mem[i++];
+			vallen = 8;
+			val    = *(uint64_t *)(mem + i);
+			val    = vbin64toh(format, val);
+			i += 8;
+			break;
+		case ARGS_TYPE_REG2INT:
+			rx = mem[i++];
+			ry = mem[i++];
+			vallen = 4;
+			val    = *(uint32_t *)(mem + i);
+			val    = vbin32toh(format, val);
+			i += 4;
+			break;
 		default:
 			DEBUG("Unknown OP @ %lx  (%d)", i - 1, op);
 			op = RISC_CRASH;
@@ -382,6 +758,9 @@ static void cisc2risc(void **tbl, size_t tbllen)
 
 		uint64_t instr = 0;
 		enum risc_op rop = cisc2risc_op(op);
+		if (format == VBIN_FORMAT_LE)
+			rop = risc_op_le(rop);
+		rops[c2rc - 1] = rop;
 		instr |= ((size_t)tbl[rop]) & 0x00000000FFFFFFFFL;
 
 		instr |= (rx  << 32) & 0x000000FF00000000L;
@@ -395,6 +774,10 @@ static void cisc2risc(void **tbl, size_t tbllen)
 		    op == OP_JNZ ||
 		    op == OP_JP  ||
 		    op == OP_JPZ ||
+		    op == OP_JLT ||
+		    op == OP_JLE ||
+		    op == OP_JEQ ||
+		    op == OP_JNE ||
 		    op == OP_CALL) {
 			r2c[r2cc].cpos = val;
 			r2c[r2cc].rpos = n;
@@ -406,7 +789,11 @@ static void cisc2risc(void **tbl, size_t tbllen)
 		    op == OP_JZB   ||
 		    op == OP_JNZB  ||
 		    op == OP_JPB   ||
-		    op == OP_JPZB ) {
+		    op == OP_JPZB  ||
+		    op == OP_JLTB  ||
+		    op == OP_JLEB  ||
+		    op == OP_JEQB  ||
+		    op == OP_JNEB ) {
 			r2c[r2cc].cpos = i - 1 + (int8_t)val;
 			r2c[r2cc].rpos = n;
 			r2cc++;
@@ -420,20 +807,90 @@ static void cisc2risc(void **tbl, size_t tbllen)
 	}
 
 
+	// c2r is sorted by position, so the targets can be found with a
+	// binary search
 	for (size_t i = 0; i < r2cc; i++) {
-		size_t j;
-		for (j = 0; j < c2rc; j++) {
-			if (r2c[i].cpos == c2r[j].cpos)
-				goto found;
+		size_t lo = 0, hi = c2rc;
+		while (lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			if (c2r[mid].cpos < r2c[i].cpos)
+				lo = mid + 1;
+			else
+				hi = mid;
 		}
-		abort();
-	found:
-		*(uint64_t *)(risc + r2c[i].rpos) = (uint64_t)(risc + c2r[j].rpos);
+		if (lo == c2rc || c2r[lo].cpos != r2c[i].cpos)
+			abort();
+		*(uint64_t *)(risc + r2c[i].rpos) = (uint64_t)(risc + c2r[lo].rpos);
 	}
+
+	fuse(tbl, rops, c2r, c2rc);
+	if (cache_dir != NULL)
+		cache_put(tbl, n, c2r, c2rc, r2c, r2cc);
+	free(rops);
+	free(r2c);
+	free(c2r);
 }
 
 
 
+#define BODY_jmp do {					\
+	ip = (uint64_t *)*(uint64_t *)ip;		\
+	DEBUG("jmp\t0x%lx", (uint64_t)ip);		\
+} while (0)
+#define BODY_jz    JUMPIF("jz", !REGI)
+#define BODY_jnz   JUMPIF("jnz", REGI)
+#define LOAD(m,t,conv) do {				\
+	REG2;						\
+	REGI = *(t *)(mem + REGJ);			\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d\t(%lu <-- 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+#define LOADAT(m,t,conv) do {				\
+	REG3;						\
+	REGI = *(t *)(mem + REGJ + REGK);		\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+#define STORE(m,t,conv) do {				\
+	REG2;						\
+	*(t *)(mem + REGJ) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d\t(%lu --> 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+#define STOREAT(m,t,conv) do {				\
+	REG3;						\
+	*(t *)(mem + REGJ + REGK) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+#define BODY_ldlat    LOADAT("ldlat", uint64_t, be64toh)
+#define BODY_ldlat_le LOADAT("ldlat", uint64_t, le64toh)
+#define BODY_setl do {					\
+	REG1;						\
+	REGI = *ip++;					\
+	DEBUG("setl\tr%d,%lu\t(%lx)", regi, REGI, REGI);\
+} while (0)
+#define BODY_add   REG3OP("add", +)
+#define BODY_sub   REG3OP("sub", -)
+#define BODY_less  REG3OP("less", <)
+#define BODY_lesse REG3OP("lesse", <=)
+// The (sign extended) immediate follows the instruction
+#define REG2IOP(m,op) do {				\
+	REG2;						\
+	REGI = REGJ op (int64_t)(int32_t)*ip++;		\
+	DEBUG(m "\tr%d,r%d\t(%ld)", regi, regj, REGI);	\
+} while (0)
+
+// Skip the instruction word of the second instruction of a fused pair
+#ifdef PRECOMPUTE_REGI
+# define NEXT_FUSED do { ip++; regi = ((uint8_t *)ip)[-4]; } while (0)
+#else
+# define NEXT_FUSED ip++
+#endif
+
+
 #pragma GCC push_options
 #pragma GCC optimize ("align-functions=16")
 
@@ -452,6 +909,10 @@ static void run()
 		[RISC_JNZ]     = &&op_jnz,
 		[RISC_JP]      = &&op_jp,
 		[RISC_JPZ]     = &&op_jpz,
+		[RISC_JLT]     = &&op_jlt,
+		[RISC_JLE]     = &&op_jle,
+		[RISC_JEQ]     = &&op_jeq,
+		[RISC_JNE]     = &&op_jne,
 		[RISC_CALL]    = &&op_call,
 		[RISC_RET]     = &&op_ret,
 
@@ -475,6 +936,8 @@ static void run()
 
 		[RISC_PUSH]    = &&op_push,
 		[RISC_POP]     = &&op_pop,
+		[RISC_PUSHM]   = &&op_pushm,
+		[RISC_POPM]    = &&op_popm,
 		[RISC_MOV]     = &&op_mov,
 		[RISC_SETL]    = &&op_setl,
 
@@ -495,13 +958,40 @@ static void run()
 		[RISC_INV]     = &&op_inv,
 		[RISC_LESS]    = &&op_less,
 		[RISC_LESSE]   = &&op_lesse,
+		[RISC_ADDI]    = &&op_addi,
+		[RISC_SUBI]    = &&op_subi,
+		[RISC_MULI]    = &&op_muli,
+		[RISC_ANDI]    = &&op_andi,
+		[RISC_LSHIFTI] = &&op_lshifti,
+		[RISC_RSHIFTI] = &&op_rshifti,
+		[RISC_LESSI]   = &&op_lessi,
 
 		[RISC_SYSCALL] = &&op_syscall,
 
 		[RISC_CRASH]   = &&crash,
+
+		[RISC_LDL_LE]    = &&op_ldl_le,
+		[RISC_LDI_LE]    = &&op_ldi_le,
+		[RISC_LDS_LE]    = &&op_lds_le,
+		[RISC_STRL_LE]   = &&op_strl_le,
+		[RISC_STRI_LE]   = &&op_stri_le,
+		[RISC_STRS_LE]   = &&op_strs_le,
+		[RISC_LDLAT_LE]  = &&op_ldlat_le,
+		[RISC_LDIAT_LE]  = &&op_ldiat_le,
+		[RISC_LDSAT_LE]  = &&op_ldsat_le,
+		[RISC_STRLAT_LE] = &&op_strlat_le,
+		[RISC_STRIAT_LE] = &&op_striat_le,
+		[RISC_STRSAT_LE] = &&op_strsat_le,
+
+#define X(a,b,c,d) [RISC_##a##_##b] = &&op_##c##_##d,
+		FUSED_OPS(X)
+#undef X
 	};
 
-	cisc2risc(table, sizeof table / sizeof *table);
+	check_prefixes(table, sizeof table / sizeof *table);
+	if (cache_dir == NULL ||
+	    cache_get(table, sizeof table / sizeof *table) < 0)
+		cisc2risc(table, sizeof table / sizeof *table);
 
 	uint64_t *ip = risc;
 
@@ -527,6 +1017,7 @@ static void run()
 #endif
 		size_t        addr  = ((instr      ) & 0xFFFFFFFFL) + prefix;
 		unsigned char regi, regj, regk;
+		uint32_t mask;
 #ifdef PRECOMPUTE_REGI
 # define PREREGI regi = ((uint8_t *)ip)[-4];
 #else
@@ -561,16 +1052,15 @@ static void run()
 		continue;
 
 	op_jmp:
-		ip = (uint64_t *)*(uint64_t *)ip;
-		DEBUG("jmp\t0x%lx", (uint64_t)ip);
+		BODY_jmp;
 		continue;
 
 	op_jz:
-		JUMPIF("jz", !REGI);
+		BODY_jz;
 		continue;
 
 	op_jnz:
-		JUMPIF("jnz", REGI);
+		BODY_jnz;
 		continue;
 
 	op_jp:
@@ -581,25 +1071,44 @@ static void run()
 		JUMPIF("jpz", REGI >= 0);
 		continue;
 
+	op_jlt:
+		JUMPIF2("jlt", REGI < REGJ);
+		continue;
+
+	op_jle:
+		JUMPIF2("jle", REGI <= REGJ);
+		continue;
+
+	op_jeq:
+		JUMPIF2("jeq", REGI == REGJ);
+		continue;
+
+	op_jne:
+		JUMPIF2("jne", REGI != REGJ);
+		continue;
+
 	op_ldl:
-		REG2;
-		REGI = *(uint64_t *)(mem + REGJ);
-		REGI = be64toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("ldl", uint64_t, be64toh);
+		continue;
+
+	op_ldl_le:
+		LOAD("ldl", uint64_t, le64toh);
 		continue;
 
 	op_ldi:
-		REG2;
-		REGI = *(uint32_t *)(mem + REGJ);
-		REGI = be32toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("ldi", uint32_t, be32toh);
+		continue;
+
+	op_ldi_le:
+		LOAD("ldi", uint32_t, le32toh);
 		continue;
 
 	op_lds:
-		REG2;
-		REGI = *(uint16_t *)(mem + REGJ);
-		REGI = be16toh(REGI);
-		DEBUG("ldl\tr%d,r%d\t(%lu <-- 0x%lx)", regi, regj, REGI, REGJ);
+		LOAD("lds", uint16_t, be16toh);
+		continue;
+
+	op_lds_le:
+		LOAD("lds", uint16_t, le16toh);
 		continue;
 
 	op_ldb:
@@ -609,27 +1118,27 @@ static void run()
 		continue;
 
 	op_ldlat:
-		REG3;
-		REGI = *(uint64_t *)(mem + REGJ + REGK);
-		REGI = be64toh(REGI);
-		DEBUG("ldlat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		BODY_ldlat;
+		continue;
+
+	op_ldlat_le:
+		BODY_ldlat_le;
 		continue;
 
 	op_ldiat:
-		REG3;
-		REGI = *(uint32_t *)(mem + REGJ + REGK);
-		REGI = be32toh(REGI);
-		DEBUG("ldiat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldiat", uint32_t, be32toh);
+		continue;
+
+	op_ldiat_le:
+		LOADAT("ldiat", uint32_t, le32toh);
 		continue;
 
 	op_ldsat:
-		REG3;
-		REGI = *(uint16_t *)(mem + REGJ + REGK);
-		REGI = be16toh(REGI);
-		DEBUG("ldsat\tr%d,r%d,r%d\t(%lu <-- 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		LOADAT("ldsat", uint16_t, be16toh);
+		continue;
+
+	op_ldsat_le:
+		LOADAT("ldsat", uint16_t, le16toh);
 		continue;
 
 	op_ldbat:
@@ -640,21 +1149,27 @@ static void run()
 		continue;
 
 	op_strl:
-		REG2;
-		*(uint64_t *)(mem + REGJ) = htobe64(REGI);
-		DEBUG("strl\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("strl", uint64_t, htobe64);
+		continue;
+
+	op_strl_le:
+		STORE("strl", uint64_t, htole64);
 		continue;
 
 	op_stri:
-		REG2;
-		*(uint32_t *)(mem + REGJ) = htobe32(REGI);
-		DEBUG("stri\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("stri", uint32_t, htobe32);
+		continue;
+
+	op_stri_le:
+		STORE("stri", uint32_t, htole32);
 		continue;
 
 	op_strs:
-		REG2;
-		*(uint16_t *)(mem + REGJ) = htobe16(REGI);
-		DEBUG("strs\tr%d,r%d\t(%lu --> 0x%lx)", regi, regj, REGI, REGJ);
+		STORE("strs", uint16_t, htobe16);
+		continue;
+
+	op_strs_le:
+		STORE("strs", uint16_t, htole16);
 		continue;
 
 	op_strb:
@@ -664,24 +1179,27 @@ static void run()
 		continue;
 
 	op_strlat:
-		REG3;
-		*(uint64_t *)(mem + REGJ + REGK) = htobe64(REGI);
-		DEBUG("strlat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("strlat", uint64_t, htobe64);
+		continue;
+
+	op_strlat_le:
+		STOREAT("strlat", uint64_t, htole64);
 		continue;
 
 	op_striat:
-		REG3;
-		*(uint32_t *)(mem + REGJ + REGK) = htobe32(REGI);
-		DEBUG("striat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("striat", uint32_t, htobe32);
+		continue;
+
+	op_striat_le:
+		STOREAT("striat", uint32_t, htole32);
 		continue;
 
 	op_strsat:
-		REG3;
-		*(uint16_t *)(mem + REGJ + REGK) = htobe16(REGI);
-		DEBUG("strsat\tr%d,r%d,r%d\t(%lu --> 0x%lx + 0x%ld)",
-		      regi, regj, regk, REGI, REGJ, REGK);
+		STOREAT("strsat", uint16_t, htobe16);
+		continue;
+
+	op_strsat_le:
+		STOREAT("strsat", uint16_t, htole16);
 		continue;
 
 	op_strbat:
@@ -705,6 +1223,29 @@ static void run()
 		DEBUG("pop\tr%d\t(%ld)", regi, REGI);
 		continue;
 
+	// Registers are pushed in ascending and popped in descending order
+	op_pushm:
+		mask = *ip++;
+		DEBUG("pushm\t0x%x", mask);
+		while (mask) {
+			int r = __builtin_ctz(mask);
+			mask &= mask - 1;
+			*(size_t *)(mem + sp) = regs[r];
+			sp += sizeof regs[r];
+		}
+		continue;
+
+	op_popm:
+		mask = *ip++;
+		DEBUG("popm\t0x%x", mask);
+		while (mask) {
+			int r = 31 - __builtin_clz(mask);
+			mask &= ~(1U << r);
+			sp -= sizeof regs[r];
+			regs[r] = *(size_t *)(mem + sp);
+		}
+		continue;
+
 	op_mov:
 		REG2;
 		REGI = REGJ;
@@ -712,17 +1253,15 @@ static void run()
 		continue;
 
 	op_setl:
-		REG1;
-		REGI = *ip++;
-		DEBUG("setl\tr%d,%lu\t(%lx)", regi, REGI, REGI);
+		BODY_setl;
 		continue;
 
 	op_add:
-		REG3OP("add", +);
+		BODY_add;
 		continue;
 
 	op_sub:
-		REG3OP("sub", -);
+		BODY_sub;
 		continue;
 
 	op_mul:
@@ -762,11 +1301,39 @@ static void run()
 		continue;
 
 	op_less:
-		REG3OP("less", <);
+		BODY_less;
 		continue;
 
 	op_lesse:
-		REG3OP("lesse", <=);
+		BODY_lesse;
+		continue;
+
+	op_addi:
+		REG2IOP("addi", +);
+		continue;
+
+	op_subi:
+		REG2IOP("subi", -);
+		continue;
+
+	op_muli:
+		REG2IOP("muli", *);
+		continue;
+
+	op_andi:
+		REG2IOP("andi", &);
+		continue;
+
+	op_lshifti:
+		REG2IOP("lshifti", <<);
+		continue;
+
+	op_rshifti:
+		REG2IOP("rshifti", >>);
+		continue;
+
+	op_lessi:
+		REG2IOP("lessi", <);
 		continue;
 
 	op_rrot:
@@ -794,6 +1361,15 @@ static void run()
 		vasm_syscall(regs, mem);
 		continue;
 
+#define X(a,b,c,d)		\
+	op_##c##_##d:		\
+		BODY_##c;	\
+		NEXT_FUSED;	\
+		BODY_##d;	\
+		continue;
+		FUSED_OPS(X)
+#undef X
+
 	crash:
 		fprintf(stderr, "Invalid OP executed");
 		fprintf(stderr, "Crashing");
@@ -806,13 +1382,31 @@ static void run()
 
 int main(int argc, char **argv) {
 	
+	// Cache translations in the given directory
+	if (argc >= 3 && strcmp(argv[1], "-C") == 0) {
+		cache_dir = argv[2];
+		if (mkdir(cache_dir, 0755) < 0 && errno != EEXIST) {
+			perror("Failed to create cache directory");
+			return 1;
+		}
+		argv += 2;
+	}
+
 	// Read source
 	int fd = open(argv[1], O_RDONLY);
-	int magic;
+	uint32_t magic;
 	read(fd, &magic, sizeof magic);
-	programlen = read(fd, mem, sizeof mem);
+	mem = (char *)vasm_mem_init();
+	programlen = read(fd, mem, VASM_MEM_IMAGE_SIZE);
 	close(fd);
 
 	// Magic
+	int isobj;
+	int f = vbin_magic_format(magic, &isobj);
+	if (f < 0 || isobj) {
+		fprintf(stderr, "Invalid magic number (0x%08x)\n", be32toh(magic));
+		return 1;
+	}
+	format = f;
 	run();
 }
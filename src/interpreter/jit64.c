@@ -0,0 +1,838 @@
+/**
+ * This interpreter translates the CISC instructions to x86-64 machine code
+ * before executing them.
+ *
+ * Only code reachable from the entry point and from jump or call targets is
+ * translated, so data embedded in the executable is never decoded.
+ *
+ * While running the generated code, the following host registers are fixed:
+ *
+ *   - rbx: pointer to the register file
+ *   - r12: pointer to the start of the guest memory
+ *
+ * rax, rcx, rdx, rdi and rsi are used as scratch registers. The guest
+ * registers live in memory, so each instruction loads its operands, operates
+ * on them and stores the result back.
+ *
+ * 'call' stores the guest address of the next instruction on the guest stack,
+ * like the other interpreters do, so programs may inspect and change it. 'ret'
+ * looks the address up in the table of translated instructions, which is
+ * kept around for that, and crashes if nothing was translated there.
+ */
+
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/mman.h>
+#include "vasm.h"
+#include "util.h"
+#include "interpreter/syscall.h"
+#include "interpreter/memory.h"
+
+
+static uint8_t *mem;
+static int64_t regs[32];
+static size_t  programlen;
+static enum vbin_format format;
+
+
+#ifdef DEBUG
+# undef DEBUG
+#endif
+#ifndef NDEBUG
+# define DEBUG(m, ...) fprintf(stderr, m "\n", ##__VA_ARGS__)
+#else
+# define DEBUG(m, ...) NULL
+#endif
+
+
+#define RAX 0
+#define RCX 1
+#define RDX 2
+
+#define SP  31
+
+
+static uint8_t *code;
+static size_t   codelen, codecap;
+
+static int32_t *c2n;
+static size_t   crash;
+
+static struct fixup {
+	size_t npos, cpos;
+} *fixups;
+static size_t fixupcount, fixupcap;
+
+static size_t *worklist;
+static size_t  workcount, workcap;
+
+
+
+static void jit_crash(void)
+{
+	fprintf(stderr, "Invalid OP executed\n");
+	fprintf(stderr, "Crashing\n");
+	exit(1);
+}
+
+
+static void *map_code(size_t len)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return p;
+}
+
+
+/**
+ * The code only refers to itself relative to the current instruction, so the
+ * buffer can be moved when it has to grow.
+ */
+static void emit(const void *bytes, size_t len)
+{
+	if (codelen + len > codecap) {
+		size_t cap = codecap * 2 + len;
+		uint8_t *c = map_code(cap);
+		memcpy(c, code, codelen);
+		munmap(code, codecap);
+		code    = c;
+		codecap = cap;
+	}
+	memcpy(code + codelen, bytes, len);
+	codelen += len;
+}
+
+#define EMIT(...) do {					\
+	uint8_t _b[] = { __VA_ARGS__ };			\
+	emit(_b, sizeof _b);				\
+} while (0)
+
+static void emit32(uint32_t v)
+{
+	emit(&v, sizeof v);
+}
+
+static void emit64(uint64_t v)
+{
+	emit(&v, sizeof v);
+}
+
+
+/**
+ * Emit the ModRM byte and displacement for [rbx + 8 * r]
+ */
+static void emit_modrm_reg(int hreg, int r)
+{
+	int d = r * 8;
+	if (d < 0x80) {
+		EMIT(0x43 | (hreg << 3), d);
+	} else {
+		EMIT(0x83 | (hreg << 3));
+		emit32(d);
+	}
+}
+
+/**
+ * op hreg, [rbx + 8 * r]
+ */
+static void emit_op_load(uint8_t op, int hreg, int r)
+{
+	EMIT(0x48, op);
+	emit_modrm_reg(hreg, r);
+}
+
+#define LOAD(h,r)  emit_op_load(0x8B, h, r)
+#define STORE(r,h) emit_op_load(0x89, h, r)
+
+
+static void add_fixup(size_t cpos)
+{
+	if (fixupcount >= fixupcap) {
+		fixupcap = fixupcap ? fixupcap * 2 : 256;
+		fixups = realloc(fixups, fixupcap * sizeof *fixups);
+	}
+	fixups[fixupcount].npos = codelen;
+	fixups[fixupcount].cpos = cpos;
+	fixupcount++;
+	if (cpos < programlen && c2n[cpos] == -1) {
+		if (workcount >= workcap) {
+			workcap = workcap ? workcap * 2 : 256;
+			worklist = realloc(worklist, workcap * sizeof *worklist);
+		}
+		worklist[workcount++] = cpos;
+	}
+	emit32(0);
+}
+
+
+static void emit_jmp(size_t cpos)
+{
+	EMIT(0xE9);
+	add_fixup(cpos);
+}
+
+
+/**
+ * cmp qword [r], 0; j<cc> target
+ */
+static void emit_jcc(uint8_t cc, int r, size_t cpos)
+{
+	EMIT(0x48, 0x83);
+	emit_modrm_reg(7, r);
+	EMIT(0x00);
+	EMIT(0x0F, cc);
+	add_fixup(cpos);
+}
+
+
+/**
+ * mov rax, [x]; cmp rax, [y]; j<cc> target
+ */
+static void emit_jcc2(uint8_t cc, int x, int y, size_t cpos)
+{
+	LOAD(RAX, x);
+	emit_op_load(0x3B, RAX, y);
+	EMIT(0x0F, cc);
+	add_fixup(cpos);
+}
+
+
+static void emit_call_abs(void *f)
+{
+	EMIT(0x48, 0xB8);
+	emit64((uint64_t)f);
+	EMIT(0xFF, 0xD0);
+}
+
+
+/**
+ * x = y op z for ops that can take a memory operand
+ */
+static void emit_alu(uint8_t op, int x, int y, int z)
+{
+	LOAD(RAX, y);
+	emit_op_load(op, RAX, z);
+	STORE(x, RAX);
+}
+
+
+static void emit_imul(int x, int y, int z)
+{
+	LOAD(RAX, y);
+	EMIT(0x48, 0x0F, 0xAF);
+	emit_modrm_reg(RAX, z);
+	STORE(x, RAX);
+}
+
+
+static void emit_div(int x, int y, int z, int hreg)
+{
+	LOAD(RAX, y);
+	EMIT(0x48, 0x99);
+	EMIT(0x48, 0xF7);
+	emit_modrm_reg(7, z);
+	STORE(x, hreg);
+}
+
+
+static void emit_shift(int ext, int x, int y, int z)
+{
+	LOAD(RAX, y);
+	LOAD(RCX, z);
+	EMIT(0x48, 0xD3, 0xC0 | (ext << 3));
+	STORE(x, RAX);
+}
+
+
+static void emit_setcc(uint8_t cc, int x, int y, int z)
+{
+	LOAD(RAX, y);
+	EMIT(0x31, 0xC9);
+	emit_op_load(0x3B, RAX, z);
+	EMIT(0x0F, cc, 0xC1);
+	STORE(x, RCX);
+}
+
+
+/**
+ * op rax, imm32 where op is given as the ModRM reg field of opcode 0x81
+ */
+static void emit_alui(int ext, int x, int y, int32_t imm)
+{
+	LOAD(RAX, y);
+	EMIT(0x48, 0x81, 0xC0 | (ext << 3));
+	emit32(imm);
+	STORE(x, RAX);
+}
+
+
+static void emit_imuli(int x, int y, int32_t imm)
+{
+	LOAD(RAX, y);
+	EMIT(0x48, 0x69, 0xC0);
+	emit32(imm);
+	STORE(x, RAX);
+}
+
+
+static void emit_shifti(int ext, int x, int y, int32_t imm)
+{
+	LOAD(RAX, y);
+	EMIT(0x48, 0xC1, 0xC0 | (ext << 3), imm & 63);
+	STORE(x, RAX);
+}
+
+
+static void emit_lessi(int x, int y, int32_t imm)
+{
+	LOAD(RAX, y);
+	EMIT(0x31, 0xC9);
+	EMIT(0x48, 0x3D);
+	emit32(imm);
+	EMIT(0x0F, 0x9C, 0xC1);
+	STORE(x, RCX);
+}
+
+
+static void emit_set(int x, uint64_t val)
+{
+	if (val < 0x80000000UL) {
+		EMIT(0x48, 0xC7);
+		emit_modrm_reg(0, x);
+		emit32(val);
+	} else {
+		EMIT(0x48, 0xB8);
+		emit64(val);
+		STORE(x, RAX);
+	}
+}
+
+
+/**
+ * rax = address (without the base) to load from / store to
+ */
+static void emit_addr(int y, int z, int has_z)
+{
+	LOAD(RAX, y);
+	if (has_z)
+		emit_op_load(0x03, RAX, z);
+}
+
+
+static void emit_load(enum vasm_op op, int x, int y, int z, int has_z)
+{
+	emit_addr(y, z, has_z);
+	switch (op) {
+	case OP_LDL:
+	case OP_LDLAT:
+		EMIT(0x49, 0x8B, 0x04, 0x04);
+		if (format == VBIN_FORMAT_BE)
+			EMIT(0x48, 0x0F, 0xC8);
+		break;
+	case OP_LDI:
+	case OP_LDIAT:
+		EMIT(0x41, 0x8B, 0x04, 0x04);
+		if (format == VBIN_FORMAT_BE)
+			EMIT(0x0F, 0xC8);
+		break;
+	case OP_LDS:
+	case OP_LDSAT:
+		EMIT(0x41, 0x0F, 0xB7, 0x04, 0x04);
+		if (format == VBIN_FORMAT_BE)
+			EMIT(0x66, 0xC1, 0xC0, 0x08);
+		break;
+	case OP_LDB:
+	case OP_LDBAT:
+		EMIT(0x41, 0x0F, 0xB6, 0x04, 0x04);
+		break;
+	default:
+		abort();
+	}
+	STORE(x, RAX);
+}
+
+
+static void emit_store(enum vasm_op op, int x, int y, int z, int has_z)
+{
+	emit_addr(y, z, has_z);
+	LOAD(RCX, x);
+	switch (op) {
+	case OP_STRL:
+	case OP_STRLAT:
+		if (format == VBIN_FORMAT_BE)
+			EMIT(0x48, 0x0F, 0xC9);
+		EMIT(0x49, 0x89, 0x0C, 0x04);
+		break;
+	case OP_STRI:
+	case OP_STRIAT:
+		if (format == VBIN_FORMAT_BE)
+			EMIT(0x0F, 0xC9);
+		EMIT(0x41, 0x89, 0x0C, 0x04);
+		break;
+	case OP_STRS:
+	case OP_STRSAT:
+		if (format == VBIN_FORMAT_BE)
+			EMIT(0x66, 0xC1, 0xC1, 0x08);
+		EMIT(0x66, 0x41, 0x89, 0x0C, 0x04);
+		break;
+	case OP_STRB:
+	case OP_STRBAT:
+		EMIT(0x41, 0x88, 0x0C, 0x04);
+		break;
+	default:
+		abort();
+	}
+}
+
+
+static void emit_push(int r)
+{
+	LOAD(RAX, SP);
+	LOAD(RCX, r);
+	EMIT(0x49, 0x89, 0x0C, 0x04);
+	EMIT(0x48, 0x83);
+	emit_modrm_reg(0, SP);
+	EMIT(0x08);
+}
+
+
+static void emit_pop(int r)
+{
+	LOAD(RAX, SP);
+	EMIT(0x48, 0x83, 0xE8, 0x08);
+	STORE(SP, RAX);
+	EMIT(0x49, 0x8B, 0x0C, 0x04);
+	STORE(r, RCX);
+}
+
+
+// Registers are pushed in ascending and popped in descending order
+static void emit_pushm(uint32_t mask)
+{
+	int32_t off = 0;
+	LOAD(RAX, SP);
+	for (int r = 0; r < 32; r++) {
+		if (!(mask & (1U << r)))
+			continue;
+		LOAD(RCX, r);
+		EMIT(0x49, 0x89, 0x8C, 0x04);
+		emit32(off);
+		off += 8;
+	}
+	EMIT(0x48, 0x05);
+	emit32(off);
+	STORE(SP, RAX);
+}
+
+
+static void emit_popm(uint32_t mask)
+{
+	int32_t off = __builtin_popcount(mask) * 8;
+	LOAD(RAX, SP);
+	EMIT(0x48, 0x2D);
+	emit32(off);
+	STORE(SP, RAX);
+	for (int r = 31; r >= 0; r--) {
+		if (!(mask & (1U << r)))
+			continue;
+		off -= 8;
+		EMIT(0x49, 0x8B, 0x8C, 0x04);
+		emit32(off);
+		STORE(r, RCX);
+	}
+}
+
+
+/**
+ * j<cc> to the code that crashes
+ */
+static void emit_jcc_crash(uint8_t cc)
+{
+	EMIT(0x0F, cc);
+	emit32(crash - (codelen + 4));
+}
+
+
+static void emit_call(size_t cpos, size_t next)
+{
+	LOAD(RAX, SP);
+	EMIT(0x48, 0xB9);
+	emit64(htovbin64(format, next));
+	EMIT(0x49, 0x89, 0x0C, 0x04);
+	EMIT(0x48, 0x83, 0xC0, 0x08);
+	STORE(SP, RAX);
+	emit_jmp(cpos);
+}
+
+
+static void emit_ret(void)
+{
+	LOAD(RAX, SP);
+	EMIT(0x48, 0x83, 0xE8, 0x08);
+	STORE(SP, RAX);
+	EMIT(0x49, 0x8B, 0x04, 0x04);
+	if (format == VBIN_FORMAT_BE)
+		EMIT(0x48, 0x0F, 0xC8);
+	// cmp rax, programlen; jae crash
+	EMIT(0x48, 0x3D);
+	emit32(programlen);
+	emit_jcc_crash(0x83);
+	// movsxd rax, [c2n + 4 * rax]; cmp rax, -1; je crash
+	EMIT(0x48, 0xB9);
+	emit64((uint64_t)c2n);
+	EMIT(0x48, 0x63, 0x04, 0x81);
+	EMIT(0x48, 0x83, 0xF8, 0xFF);
+	emit_jcc_crash(0x84);
+	// lea rcx, [rip - codelen]; add rax, rcx; jmp rax
+	EMIT(0x48, 0x8D, 0x0D);
+	emit32(-(int32_t)(codelen + 4));
+	EMIT(0x48, 0x01, 0xC8);
+	EMIT(0xFF, 0xE0);
+}
+
+
+static void emit_syscall(void)
+{
+	EMIT(0x48, 0x89, 0xDF);
+	EMIT(0x4C, 0x89, 0xE6);
+	emit_call_abs(vasm_syscall);
+}
+
+
+
+/**
+ * Translate a sequence of instructions starting at the given position until
+ * an unconditional control transfer or an already translated instruction is
+ * encountered.
+ */
+static void translate_block(size_t i)
+{
+	while (1) {
+		if (i >= programlen) {
+			emit_call_abs(jit_crash);
+			return;
+		}
+		if (c2n[i] != -1) {
+			emit_jmp(i);
+			return;
+		}
+
+		size_t start = i;
+		c2n[start] = codelen;
+
+		enum vasm_op op = mem[i++];
+		int rx = 0, ry = 0, rz = 0;
+		uint64_t val = 0;
+
+		switch (get_vasm_args_type(op)) {
+		case ARGS_TYPE_NONE:
+			break;
+		case ARGS_TYPE_REG1:
+			rx = mem[i++];
+			break;
+		case ARGS_TYPE_REG2:
+			rx = mem[i++];
+			ry = mem[i++];
+			break;
+		case ARGS_TYPE_REG3:
+			rx = mem[i++];
+			ry = mem[i++];
+			rz = mem[i++];
+			break;
+		case ARGS_TYPE_BYTE:
+			val = mem[i++];
+			break;
+		case ARGS_TYPE_INT:
+			val = vbin32toh(format, *(uint32_t *)(mem + i));
+			i += 4;
+			break;
+		case ARGS_TYPE_LONG:
+			val = vbin64toh(format, *(uint64_t *)(mem + i));
+			i += 8;
+			break;
+		case ARGS_TYPE_REGBYTE:
+			rx  = mem[i++];
+			val = mem[i++];
+			break;
+		case ARGS_TYPE_REGSHORT:
+			rx  = mem[i++];
+			val = vbin16toh(format, *(uint16_t *)(mem + i));
+			i += 2;
+			break;
+		case ARGS_TYPE_REGINT:
+			rx  = mem[i++];
+			val = vbin32toh(format, *(uint32_t *)(mem + i));
+			i += 4;
+			break;
+		case ARGS_TYPE_REGLONG:
+			rx  = mem[i++];
+			val = vbin64toh(format, *(uint64_t *)(mem + i));
+			i += 8;
+			break;
+		case ARGS_TYPE_REG2BYTE:
+			rx  = mem[i++];
+			ry  = mem[i++];
+			val = mem[i++];
+			break;
+		case ARGS_TYPE_REG2LONG:
+			rx  = mem[i++];
+			ry  = mem[i++];
+			val = vbin64toh(format, *(uint64_t *)(mem + i));
+			i += 8;
+			break;
+		case ARGS_TYPE_REG2INT:
+			rx  = mem[i++];
+			ry  = mem[i++];
+			val = vbin32toh(format, *(uint32_t *)(mem + i));
+			i += 4;
+			break;
+		default:
+			DEBUG("Unknown OP @ %lx  (%d)", start, op);
+			emit_call_abs(jit_crash);
+			return;
+		}
+
+		if (rx >= 32 || ry >= 32 || rz >= 32) {
+			DEBUG("Invalid register @ %lx", start);
+			emit_call_abs(jit_crash);
+			return;
+		}
+
+		DEBUG("%6lx --> %6lx  (%d)", start, codelen, op);
+
+		// Byte-relative jumps are relative to the offset byte
+		size_t rel = i - 1 + (int8_t)val;
+
+		switch (op) {
+		case OP_NOP:
+			break;
+
+		case OP_JMP:
+			emit_jmp(val);
+			return;
+		case OP_JMPRB:
+			emit_jmp(rel);
+			return;
+		case OP_JZ:
+		case OP_JZB:
+			emit_jcc(0x84, rx, op == OP_JZ ? val : rel);
+			break;
+		case OP_JNZ:
+		case OP_JNZB:
+			emit_jcc(0x85, rx, op == OP_JNZ ? val : rel);
+			break;
+		case OP_JP:
+		case OP_JPB:
+			emit_jcc(0x8F, rx, op == OP_JP ? val : rel);
+			break;
+		case OP_JPZ:
+		case OP_JPZB:
+			emit_jcc(0x8D, rx, op == OP_JPZ ? val : rel);
+			break;
+		case OP_JLT:
+		case OP_JLTB:
+			emit_jcc2(0x8C, rx, ry, op == OP_JLT ? val : rel);
+			break;
+		case OP_JLE:
+		case OP_JLEB:
+			emit_jcc2(0x8E, rx, ry, op == OP_JLE ? val : rel);
+			break;
+		case OP_JEQ:
+		case OP_JEQB:
+			emit_jcc2(0x84, rx, ry, op == OP_JEQ ? val : rel);
+			break;
+		case OP_JNE:
+		case OP_JNEB:
+			emit_jcc2(0x85, rx, ry, op == OP_JNE ? val : rel);
+			break;
+		case OP_CALL:
+			emit_call(val, i);
+			break;
+		case OP_RET:
+			emit_ret();
+			return;
+
+		case OP_LDL:
+		case OP_LDI:
+		case OP_LDS:
+		case OP_LDB:
+			emit_load(op, rx, ry, 0, 0);
+			break;
+		case OP_LDLAT:
+		case OP_LDIAT:
+		case OP_LDSAT:
+		case OP_LDBAT:
+			emit_load(op, rx, ry, rz, 1);
+			break;
+		case OP_STRL:
+		case OP_STRI:
+		case OP_STRS:
+		case OP_STRB:
+			emit_store(op, rx, ry, 0, 0);
+			break;
+		case OP_STRLAT:
+		case OP_STRIAT:
+		case OP_STRSAT:
+		case OP_STRBAT:
+			emit_store(op, rx, ry, rz, 1);
+			break;
+
+		case OP_PUSH:
+			emit_push(rx);
+			break;
+		case OP_POP:
+			emit_pop(rx);
+			break;
+		case OP_PUSHM:
+			emit_pushm(val);
+			break;
+		case OP_POPM:
+			emit_popm(val);
+			break;
+		case OP_MOV:
+			LOAD(RAX, ry);
+			STORE(rx, RAX);
+			break;
+		case OP_SETL:
+		case OP_SETI:
+		case OP_SETS:
+		case OP_SETB:
+			emit_set(rx, val);
+			break;
+
+		case OP_ADD   : emit_alu(0x03, rx, ry, rz); break;
+		case OP_SUB   : emit_alu(0x2B, rx, ry, rz); break;
+		case OP_AND   : emit_alu(0x23, rx, ry, rz); break;
+		case OP_OR    : emit_alu(0x0B, rx, ry, rz); break;
+		case OP_XOR   : emit_alu(0x33, rx, ry, rz); break;
+		case OP_MUL   : emit_imul(rx, ry, rz); break;
+		case OP_DIV   : emit_div(rx, ry, rz, RAX); break;
+		case OP_MOD   :
+		case OP_REM   : emit_div(rx, ry, rz, RDX); break;
+		case OP_LSHIFT: emit_shift(4, rx, ry, rz); break;
+		case OP_RSHIFT: emit_shift(7, rx, ry, rz); break;
+		case OP_LROT  : emit_shift(0, rx, ry, rz); break;
+		case OP_RROT  : emit_shift(1, rx, ry, rz); break;
+		case OP_LESS  : emit_setcc(0x9C, rx, ry, rz); break;
+		case OP_LESSE : emit_setcc(0x9E, rx, ry, rz); break;
+		case OP_ADDI   : emit_alui(0, rx, ry, val); break;
+		case OP_SUBI   : emit_alui(5, rx, ry, val); break;
+		case OP_ANDI   : emit_alui(4, rx, ry, val); break;
+		case OP_MULI   : emit_imuli(rx, ry, val); break;
+		case OP_LSHIFTI: emit_shifti(4, rx, ry, val); break;
+		case OP_RSHIFTI: emit_shifti(7, rx, ry, val); break;
+		case OP_LESSI  : emit_lessi(rx, ry, val); break;
+		case OP_NOT:
+			LOAD(RAX, ry);
+			EMIT(0x48, 0xF7, 0xD0);
+			STORE(rx, RAX);
+			break;
+		case OP_INV:
+			EMIT(0x31, 0xC0);
+			EMIT(0x48, 0x83);
+			emit_modrm_reg(7, ry);
+			EMIT(0x00);
+			EMIT(0x0F, 0x94, 0xC0);
+			STORE(rx, RAX);
+			break;
+
+		case OP_SYSCALL:
+			emit_syscall();
+			break;
+
+		default:
+			DEBUG("Unknown OP @ %lx  (%d)", start, op);
+			emit_call_abs(jit_crash);
+			return;
+		}
+	}
+}
+
+
+static void (*translate(void))(int64_t *, uint8_t *)
+{
+	codecap = programlen * 32 + 4096;
+	code = map_code(codecap);
+	c2n = malloc((programlen + 1) * sizeof *c2n);
+	memset(c2n, 0xFF, (programlen + 1) * sizeof *c2n);
+
+	// push rbx; push r12; push rbp; mov rbx, rdi; mov r12, rsi
+	EMIT(0x53, 0x41, 0x54, 0x55);
+	EMIT(0x48, 0x89, 0xFB);
+	EMIT(0x49, 0x89, 0xF4);
+	emit_jmp(0);
+
+	// Jumps to addresses outside the program end up here
+	crash = codelen;
+	emit_call_abs(jit_crash);
+
+	while (workcount > 0) {
+		size_t i = worklist[--workcount];
+		if (c2n[i] == -1)
+			translate_block(i);
+	}
+
+	for (size_t i = 0; i < fixupcount; i++) {
+		size_t npos = fixups[i].npos;
+		size_t cpos = fixups[i].cpos;
+		size_t target = cpos < programlen ? c2n[cpos] : crash;
+		int32_t rel = target - (npos + 4);
+		memcpy(code + npos, &rel, sizeof rel);
+	}
+
+	DEBUG("Translated %lu bytes to %lu bytes", programlen, codelen);
+
+	free(fixups);
+	free(worklist);
+
+	if (mprotect(code, codecap, PROT_READ | PROT_EXEC) < 0) {
+		perror("mprotect");
+		exit(1);
+	}
+	return (void (*)(int64_t *, uint8_t *))code;
+}
+
+
+int main(int argc, char **argv) {
+
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s <file>\n", argv[0]);
+		return 1;
+	}
+
+	// Read source
+	int fd = open(argv[1], O_RDONLY);
+	if (fd < 0)
+		EXITERRNO(1, "Failed to open executable");
+	uint32_t magic = 0;
+	ssize_t n = read(fd, &magic, sizeof magic);
+	if (n < 0)
+		EXITERRNO(1, "Failed to read executable");
+	mem = vasm_mem_init();
+	n = read(fd, mem, VASM_MEM_IMAGE_SIZE);
+	if (n < 0)
+		EXITERRNO(1, "Failed to read executable");
+	programlen = n;
+	close(fd);
+
+	// Magic
+	int isobj;
+	int f = vbin_magic_format(magic, &isobj);
+	if (f < 0 || isobj) {
+		fprintf(stderr, "Invalid magic number (0x%08x)\n", be32toh(magic));
+		return 1;
+	}
+	format = f;
+
+	translate()(regs, mem);
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "interpreter/memory.h"
+#include "util.h"
+
+
+// The memory of the interpreters that run a single program
+static struct vasm_mem global;
+// The memory faults are reported for
+static struct vasm_mem *guarded;
+static uint64_t pagesize;
+
+
+#define PAGEUP(x) (((x) + pagesize - 1) & ~(pagesize - 1))
+
+
+static void _segv_handler(int sig, siginfo_t *info, void *ctx)
+{
+	uint8_t *addr = info->si_addr, *mem = guarded->base;
+	if (mem <= addr && addr < mem + VASM_MEM_SIZE + VASM_MEM_GUARD) {
+		uint64_t a = addr - mem;
+		char buf[128];
+		int l;
+		if (VASM_MEM_STACK + VASM_MEM_STACK_SIZE <= a && a < VASM_MEM_HEAP)
+			l = snprintf(buf, sizeof buf,
+			             "Stack overflow (address 0x%lx)\n", a);
+		else
+			l = snprintf(buf, sizeof buf,
+			             "Invalid memory access (address 0x%lx)\n", a);
+		write(STDERR_FILENO, buf, l);
+	}
+	// Let the fault happen again with the default action
+	signal(SIGSEGV, SIG_DFL);
+}
+
+
+int vasm_mem_create(struct vasm_mem *m)
+{
+	pagesize = sysconf(_SC_PAGESIZE);
+
+	m->brk  = VASM_MEM_HEAP;
+	m->base = mmap(NULL, VASM_MEM_SIZE + VASM_MEM_GUARD, PROT_NONE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m->base == MAP_FAILED) {
+		m->base = NULL;
+		return -1;
+	}
+
+	if (mprotect(m->base, VASM_MEM_IMAGE_SIZE, PROT_READ | PROT_WRITE) < 0 ||
+	    mprotect(m->base + VASM_MEM_STACK, VASM_MEM_STACK_SIZE,
+	             PROT_READ | PROT_WRITE) < 0) {
+		vasm_mem_destroy(m);
+		return -1;
+	}
+	return 0;
+}
+
+
+void vasm_mem_destroy(struct vasm_mem *m)
+{
+	if (m->base != NULL)
+		munmap(m->base, VASM_MEM_SIZE + VASM_MEM_GUARD);
+	m->base = NULL;
+}
+
+
+int64_t vasm_mem_setbrk(struct vasm_mem *m, int64_t addr)
+{
+	if (addr == 0)
+		return m->brk;
+	if (addr < VASM_MEM_HEAP || addr > VASM_MEM_SIZE)
+		return -1;
+
+	uint64_t old = PAGEUP(m->brk), new = PAGEUP((uint64_t)addr);
+	if (new > old) {
+		if (mprotect(m->base + old, new - old, PROT_READ | PROT_WRITE) < 0)
+			return -1;
+	} else if (new < old) {
+		// Give the pages back to the host
+		if (mmap(m->base + new, old - new, PROT_NONE,
+		         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		         -1, 0) == MAP_FAILED)
+			return -1;
+	}
+	m->brk = addr;
+	return m->brk;
+}
+
+
+int vasm_mem_reset(struct vasm_mem *m)
+{
+	if (vasm_mem_setbrk(m, VASM_MEM_HEAP) < 0)
+		return -1;
+	// The pages are zero again on the next access
+	if (madvise(m->base, VASM_MEM_IMAGE_SIZE, MADV_DONTNEED) < 0 ||
+	    madvise(m->base + VASM_MEM_STACK, VASM_MEM_STACK_SIZE,
+	            MADV_DONTNEED) < 0)
+		return -1;
+	if (mmap(m->base + VASM_MEM_THREADS, VASM_MEM_HEAP - VASM_MEM_THREADS,
+	         PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+	         -1, 0) == MAP_FAILED)
+		return -1;
+	return 0;
+}
+
+
+uint64_t vasm_mem_thread_stack(struct vasm_mem *m, size_t i)
+{
+	uint64_t a = VASM_MEM_THREADS + i * VASM_MEM_THREAD_STACK;
+	if (i >= VASM_MEM_THREAD_COUNT ||
+	    mprotect(m->base + a, VASM_MEM_THREAD_STACK - pagesize,
+	             PROT_READ | PROT_WRITE) < 0)
+		return 0;
+	return a;
+}
+
+
+void vasm_mem_thread_release(struct vasm_mem *m, size_t i)
+{
+	uint64_t a = VASM_MEM_THREADS + i * VASM_MEM_THREAD_STACK;
+	madvise(m->base + a, VASM_MEM_THREAD_STACK - pagesize, MADV_DONTNEED);
+}
+
+
+void vasm_mem_guard(struct vasm_mem *m)
+{
+	guarded = m;
+	struct sigaction sa;
+	sa.sa_sigaction = _segv_handler;
+	sa.sa_flags     = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, NULL) < 0)
+		EXITERRNO(1, "Failed to install SIGSEGV handler");
+}
+
+
+uint8_t *vasm_mem_init(void)
+{
+	if (vasm_mem_create(&global) < 0)
+		EXITERRNO(1, "Failed to reserve guest memory");
+	vasm_mem_guard(&global);
+	return global.base;
+}
+
+
+int64_t vasm_mem_brk(int64_t addr)
+{
+	return vasm_mem_setbrk(&global, addr);
+}
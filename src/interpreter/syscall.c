@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "interpreter/syscall.h"
+#include "interpreter/memory.h"
 #include "util.h"
 
 #ifndef NDEBUG
@@ -16,44 +18,67 @@
 void vasm_syscall(int64_t regs[32], uint8_t *mem) {
 	int fd;
 	struct sockaddr_in6 addr;
+	uint64_t len;
+	void *buf;
 	switch (regs[0]) {
 	case 0: // exit(code)
 		exit(regs[1]);
 		break;
 	case 1: // read(fd, buf, length)
-		regs[0] = write(regs[1], (char *)(mem + regs[2]), regs[3]);
+		len = regs[3];
+		buf = vasm_mem_buf(mem, regs[2], &len);
+		regs[0] = write(regs[1], buf, len);
 		DEBUG("write(%lu, 0x%lx, %lu) = %ld",
 		        regs[1], regs[2], regs[3], regs[0]);
 		break;
 	case 2: // write(fd, buf, length)
-		regs[0] = read(regs[1], (char *)(mem + regs[2]), regs[3]);
+		len = regs[3];
+		buf = vasm_mem_buf(mem, regs[2], &len);
+		regs[0] = read(regs[1], buf, len);
 		DEBUG("read(%lu, 0x%lx, %lu) = %ld",
 		        regs[1], regs[2], regs[3], regs[0]);
 		break;
 	case 3: // connect(ip6, port)
-		goto _default;
 	case 4: // listen(ip6, port)
+		len = sizeof addr.sin6_addr;
+		buf = vasm_mem_buf(mem, regs[1], &len);
+		if (len < sizeof addr.sin6_addr)
+			goto _default;
 		fd = socket(AF_INET6, SOCK_STREAM, 0);
 		if (fd < 0)
 			goto _default;
+		memset(&addr, 0, sizeof addr);
 		addr.sin6_family = AF_INET6;
 		addr.sin6_port   = htons(regs[2]);
-		memcpy(&addr.sin6_addr, (void *)(mem + regs[3]), 16);
+		memcpy(&addr.sin6_addr, buf, sizeof addr.sin6_addr);
 #ifndef NDEBUG
-		char buf[64];
-		inet_ntop(AF_INET6, &addr.sin6_addr, buf, sizeof buf);
+		char ip[64];
+		inet_ntop(AF_INET6, &addr.sin6_addr, ip, sizeof ip);
 #endif
+		if (regs[0] == 3) {
+			if (connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+				close(fd);
+				DEBUG("connect(\"%s\", %lu) = -1", ip, regs[2]);
+				goto _default;
+			}
+			DEBUG("connect(\"%s\", %lu) = %d", ip, regs[2], fd);
+			regs[0] = fd;
+			break;
+		}
+		// Connections of a previous server may still be lingering
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
 		if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
 			close(fd);
-			DEBUG("listen(\"%s\", %lu) = -1", buf, regs[2]);
+			DEBUG("listen(\"%s\", %lu) = -1", ip, regs[2]);
 			goto _default;
 		}
-		if (listen(fd, 5) < 0) {
+		if (listen(fd, SOMAXCONN) < 0) {
 			close(fd);
-			DEBUG("listen(\"%s\", %lu) = -1", buf, regs[2]);
+			DEBUG("listen(\"%s\", %lu) = -1", ip, regs[2]);
 			goto _default;
 		}
-		DEBUG("listen(\"%s\", %lu) = %d", buf, regs[2], fd);
+		DEBUG("listen(\"%s\", %lu) = %d", ip, regs[2], fd);
 		regs[0] = fd;
 		break;
 	case 5: // accept(fd)
@@ -79,6 +104,10 @@ void vasm_syscall(int64_t regs[32], uint8_t *mem) {
 			regs[0] = -1;
 			return;
 		}
+	case 10: // brk(addr)
+		regs[0] = vasm_mem_brk(regs[1]);
+		DEBUG("brk(0x%lx) = 0x%lx", regs[1], regs[0]);
+		break;
 	default:
 	_default:
 		regs[0] = -1;
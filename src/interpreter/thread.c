@@ -0,0 +1,393 @@
+#include "interpreter/thread.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include "interpreter/memory.h"
+#include "interpreter/syscall.h"
+#include "util.h"
+
+#ifndef NDEBUG
+# ifdef DEBUG
+#  undef DEBUG
+# endif
+# define DEBUG(m, ...) fprintf(stderr, m "\n", ##__VA_ARGS__)
+#endif
+
+
+// Ready threads are run in between polls for at most this many switches
+#define POLL_INTERVAL	64
+
+
+static void _enqueue(struct vm *vm, size_t tid)
+{
+	vm->threads[tid].next = VM_THREAD_NONE;
+	if (vm->runtail == VM_THREAD_NONE)
+		vm->runhead = tid;
+	else
+		vm->threads[vm->runtail].next = tid;
+	vm->runtail = tid;
+}
+
+
+static void _wake(struct vm *vm, size_t tid)
+{
+	vm->threads[tid].state = VM_THREAD_READY;
+	_enqueue(vm, tid);
+}
+
+
+static void _wake_fd(struct vm *vm, int fd)
+{
+	if ((size_t)fd >= vm->fdcount)
+		return;
+	struct vm_fd *f = &vm->fds[fd];
+	for (size_t t = f->waiting; t != VM_THREAD_NONE; ) {
+		size_t next = vm->threads[t].next;
+		_wake(vm, t);
+		vm->waiting--;
+		t = next;
+	}
+	f->waiting = VM_THREAD_NONE;
+	f->events  = 0;
+}
+
+
+/**
+ * Parks the running thread until fd has one of the events. If that isn't
+ * possible the syscall fails instead.
+ */
+static void _wait_fd(struct vm *vm, int fd, uint32_t events)
+{
+	if (vm->epfd < 0 && (vm->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+		goto fail;
+	if ((size_t)fd >= vm->fdcount) {
+		size_t n = fd * 2 + 16;
+		struct vm_fd *fds = realloc(vm->fds, n * sizeof *fds);
+		if (fds == NULL)
+			goto fail;
+		for (size_t i = vm->fdcount; i < n; i++) {
+			fds[i].events  = 0;
+			fds[i].waiting = VM_THREAD_NONE;
+		}
+		vm->fds     = fds;
+		vm->fdcount = n;
+	}
+
+	// The registration is one-shot, so it is armed again for every wait
+	struct vm_fd *f = &vm->fds[fd];
+	if ((f->events | events) != f->events) {
+		struct epoll_event e = {
+			.events  = f->events | events | EPOLLONESHOT,
+			.data.fd = fd,
+		};
+		if (epoll_ctl(vm->epfd, EPOLL_CTL_MOD, fd, &e) < 0 &&
+		    (errno != ENOENT ||
+		     epoll_ctl(vm->epfd, EPOLL_CTL_ADD, fd, &e) < 0))
+			goto fail;
+		f->events |= events;
+	}
+
+	struct vm_thread *t = &vm->threads[vm->current];
+	t->state   = VM_THREAD_WAITING;
+	t->next    = f->waiting;
+	f->waiting = vm->current;
+	vm->waiting++;
+	vm->state  = VM_BLOCKED;
+	return;
+fail:
+	vm->regs[0] = -1;
+}
+
+
+/**
+ * Returns whether the syscall failed only because fd isn't ready, in which
+ * case the thread is parked.
+ */
+static int _would_block(struct vm *vm, int64_t r, int fd, uint32_t events)
+{
+	if (r >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		return 0;
+	_wait_fd(vm, fd, events);
+	return vm->state == VM_BLOCKED;
+}
+
+
+static void _release(struct vm *vm, size_t tid)
+{
+	struct vm_thread *t = &vm->threads[tid];
+	if (tid != 0)
+		vasm_mem_thread_release(&vm->mem, tid - 1);
+	t->state = VM_THREAD_FREE;
+	t->next  = vm->freethread;
+	vm->freethread = tid;
+}
+
+
+static void _sys_write(struct vm *vm)
+{
+	int64_t *regs = vm->regs;
+	uint64_t len = regs[3];
+	void *buf = vasm_mem_buf(vm->mem.base, regs[2], &len);
+	int64_t r = write(regs[1], buf, len);
+	if (!_would_block(vm, r, regs[1], EPOLLOUT))
+		regs[0] = r;
+	DEBUG("write(%lu, 0x%lx, %lu) = %ld", regs[1], regs[2], regs[3], r);
+}
+
+
+static void _sys_read(struct vm *vm)
+{
+	int64_t *regs = vm->regs;
+	uint64_t len = regs[3];
+	void *buf = vasm_mem_buf(vm->mem.base, regs[2], &len);
+	int64_t r = read(regs[1], buf, len);
+	if (!_would_block(vm, r, regs[1], EPOLLIN))
+		regs[0] = r;
+	DEBUG("read(%lu, 0x%lx, %lu) = %ld", regs[1], regs[2], regs[3], r);
+}
+
+
+/**
+ * connect and listen. Connecting still blocks the whole vm, only the socket
+ * that results is non-blocking.
+ */
+static void _sys_socket(struct vm *vm)
+{
+	vasm_syscall(vm->regs, vm->mem.base);
+	if (vm->regs[0] >= 0)
+		fcntl(vm->regs[0], F_SETFL, O_NONBLOCK);
+}
+
+
+static void _sys_accept(struct vm *vm)
+{
+	int64_t *regs = vm->regs;
+	int64_t r = accept(regs[1], NULL, NULL);
+	if (_would_block(vm, r, regs[1], EPOLLIN))
+		return;
+	if (r >= 0)
+		fcntl(r, F_SETFL, O_NONBLOCK);
+	regs[0] = r;
+	DEBUG("accept(%ld) = %ld", regs[1], r);
+}
+
+
+static void _sys_close(struct vm *vm)
+{
+	// The threads waiting for it get an error when they try again
+	_wake_fd(vm, vm->regs[1]);
+	vasm_syscall(vm->regs, vm->mem.base);
+}
+
+
+static void _sys_spawn(struct vm *vm)
+{
+	int64_t *regs = vm->regs;
+	size_t tid = vm->freethread;
+	if (tid != VM_THREAD_NONE) {
+		vm->freethread = vm->threads[tid].next;
+	} else {
+		if (vm->threadcount > VASM_MEM_THREAD_COUNT)
+			goto fail;
+		if (vm->threadcount >= vm->threadcap) {
+			size_t n = vm->threadcap * 2;
+			struct vm_thread *t = realloc(vm->threads, n * sizeof *t);
+			if (t == NULL)
+				goto fail;
+			vm->threads   = t;
+			vm->threadcap = n;
+		}
+		tid = vm->threadcount++;
+	}
+	uint64_t stack = vasm_mem_thread_stack(&vm->mem, tid - 1);
+	if (stack == 0) {
+		vm->threads[tid].state = VM_THREAD_FREE;
+		vm->threads[tid].next  = vm->freethread;
+		vm->freethread = tid;
+		goto fail;
+	}
+
+	// Start as if the entry was called from exit
+	struct vm_thread *t = &vm->threads[tid];
+	memset(t->regs, 0, sizeof t->regs);
+	*(uint64_t *)(vm->mem.base + stack) = htovbin64(vm->format, regs[3]);
+	t->regs[0]  = regs[2];
+	t->regs[31] = stack + sizeof (uint64_t);
+	t->ip       = regs[1];
+	t->detached = regs[4] != 0;
+	t->joiner   = VM_THREAD_NONE;
+	_wake(vm, tid);
+	DEBUG("spawn(0x%lx, %ld) = %lu", regs[1], regs[2], tid);
+	regs[0] = tid;
+	return;
+fail:
+	regs[0] = -1;
+}
+
+
+static void _sys_yield(struct vm *vm)
+{
+	vm->regs[0] = 0;
+	vm->state   = VM_YIELDED;
+}
+
+
+static void _sys_join(struct vm *vm)
+{
+	int64_t *regs = vm->regs;
+	size_t tid = regs[1];
+	if (tid >= vm->threadcount || tid == vm->current)
+		goto fail;
+	struct vm_thread *t = &vm->threads[tid];
+	if (t->state == VM_THREAD_FREE || t->detached ||
+	    (t->joiner != VM_THREAD_NONE && t->joiner != vm->current))
+		goto fail;
+	if (t->state == VM_THREAD_DONE) {
+		regs[0] = t->value;
+		_release(vm, tid);
+		return;
+	}
+	t->joiner = vm->current;
+	vm->threads[vm->current].state = VM_THREAD_WAITING;
+	vm->state = VM_BLOCKED;
+	return;
+fail:
+	regs[0] = -1;
+}
+
+
+static void _sys_exit_thread(struct vm *vm)
+{
+	struct vm_thread *t = &vm->threads[vm->current];
+	DEBUG("exit_thread(%ld) [%lu]", vm->regs[1], vm->current);
+	t->value = vm->regs[1];
+	t->state = VM_THREAD_DONE;
+	if (t->joiner != VM_THREAD_NONE)
+		_wake(vm, t->joiner);
+	if (t->detached)
+		_release(vm, vm->current);
+	vm->state = VM_YIELDED;
+}
+
+
+int vm_threads_init(struct vm *vm)
+{
+	vm_threads_free(vm);
+	vm->threadcap = 16;
+	vm->threads   = malloc(vm->threadcap * sizeof *vm->threads);
+	if (vm->threads == NULL)
+		return -1;
+	vm->threads[0].state    = VM_THREAD_READY;
+	vm->threads[0].detached = 0;
+	vm->threads[0].joiner   = VM_THREAD_NONE;
+	vm->threadcount = 1;
+	vm->current     = 0;
+	return 0;
+}
+
+
+void vm_threads_free(struct vm *vm)
+{
+	free(vm->threads);
+	free(vm->fds);
+	if (vm->epfd >= 0)
+		close(vm->epfd);
+	vm->threads     = NULL;
+	vm->threadcount = vm->threadcap = 0;
+	vm->current     = VM_THREAD_NONE;
+	vm->freethread  = VM_THREAD_NONE;
+	vm->runhead     = vm->runtail = VM_THREAD_NONE;
+	vm->fds         = NULL;
+	vm->fdcount     = 0;
+	vm->waiting     = 0;
+	vm->epfd        = -1;
+}
+
+
+void vm_threads_syscalls(struct vm *vm)
+{
+	vm->syscalls[1]  = _sys_write;
+	vm->syscalls[2]  = _sys_read;
+	vm->syscalls[3]  = _sys_socket;
+	vm->syscalls[4]  = _sys_socket;
+	vm->syscalls[5]  = _sys_accept;
+	vm->syscalls[7]  = _sys_close;
+	vm->syscalls[11] = _sys_spawn;
+	vm->syscalls[12] = _sys_yield;
+	vm->syscalls[13] = _sys_join;
+	vm->syscalls[14] = _sys_exit_thread;
+}
+
+
+void vm_thread_stop(struct vm *vm, enum vm_state state)
+{
+	struct vm_thread *t = &vm->threads[vm->current];
+	memcpy(t->regs, vm->regs, sizeof t->regs);
+	// A blocked thread executes the syscall again once it is woken up
+	t->ip = state == VM_BLOCKED ? vm->ip - 1 : vm->ip;
+	if (t->state == VM_THREAD_READY)
+		_enqueue(vm, vm->current);
+	vm->current = VM_THREAD_NONE;
+}
+
+
+/**
+ * Wakes the threads whose file descriptors are ready. Returns -1 if the
+ * wait failed.
+ */
+static int _poll(struct vm *vm, int timeout)
+{
+	struct epoll_event e[64];
+	int n = epoll_wait(vm->epfd, e, sizeof e / sizeof *e, timeout);
+	if (n < 0)
+		return errno == EINTR ? 0 : -1;
+	for (int i = 0; i < n; i++)
+		_wake_fd(vm, e[i].data.fd);
+	return 0;
+}
+
+
+int vm_thread_next(struct vm *vm, int wait)
+{
+	if (vm->waiting > 0 &&
+	    (vm->runhead == VM_THREAD_NONE || ++vm->switches % POLL_INTERVAL == 0) &&
+	    _poll(vm, 0) < 0)
+		goto end;
+	while (vm->runhead == VM_THREAD_NONE) {
+		if (vm->waiting == 0 || !wait)
+			break;
+		if (_poll(vm, -1) < 0)
+			goto end;
+	}
+	if (vm->runhead == VM_THREAD_NONE) {
+		if (vm->waiting > 0)
+			return -1;
+		goto end;
+	}
+
+	size_t tid = vm->runhead;
+	struct vm_thread *t = &vm->threads[tid];
+	vm->runhead = t->next;
+	if (vm->runhead == VM_THREAD_NONE)
+		vm->runtail = VM_THREAD_NONE;
+	memcpy(vm->regs, t->regs, sizeof vm->regs);
+	vm->ip      = t->ip;
+	vm->current = tid;
+	return 0;
+
+end:
+	// No thread can ever run again. It's a deadlock unless all of them ended.
+	vm->exitcode = 0;
+	for (size_t i = 0; i < vm->threadcount; i++) {
+		if (vm->threads[i].state == VM_THREAD_READY ||
+		    vm->threads[i].state == VM_THREAD_WAITING)
+			vm->exitcode = 1;
+	}
+	vm->state = VM_EXITED;
+	return -1;
+}
@@ -0,0 +1,1087 @@
+/**
+ * The byte code interpreter of libsstvm. All state of a program lives in its
+ * struct vm, so any amount of them can run in the same process.
+ */
+
+#include "sstvm.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <endian.h>
+#include <x86intrin.h>
+#include "vasm.h"
+#include "util.h"
+#include "interpreter/syscall.h"
+#include "interpreter/memory.h"
+#include "interpreter/thread.h"
+
+
+#ifdef NDEBUG
+# undef assert
+# define assert(c, ...) if (!(c)) __builtin_unreachable()
+#endif
+
+
+#ifdef DEBUG
+# undef DEBUG
+#endif
+#ifndef NDEBUG
+# define DEBUG(m, ...) fprintf(stderr, m "\n", ##__VA_ARGS__)
+#else
+# define DEBUG(m, ...) NULL
+#endif
+
+
+#ifdef UNSAFE
+# define _CHECKREG assert(regi < 32 && regj < 32 && regk < 32)
+#else
+# define _CHECKREG NULL
+#endif
+#define REG1 do { regi = mem[ip++]; _CHECKREG; } while (0)
+#define REG2 do { regi = mem[ip++]; regj = mem[ip++]; _CHECKREG; } while (0)
+#define REG3 do { regi = mem[ip++]; regj = mem[ip++]; regk = mem[ip++]; _CHECKREG; } while (0)
+#define REGI regs[regi]
+#define REGJ regs[regj]
+#define REGK regs[regk]
+
+// Guest addresses are 32 bits wide, so no value leads outside the address space
+#define GUEST(a) (mem + (uint32_t)(a))
+
+#ifdef NDEBUG
+# define REG3OP(m,op) \
+	do { \
+		REG3; \
+		REGI = REGJ op REGK; \
+	} while (0)
+# define REG3OPSTR(m,op,opstr) REG3OP(m,op)
+# define REG3OPSTRFUNC(m,func,opstr,fmt) do {		\
+	REG3;						\
+	REGI = func(REGJ, REGK);			\
+} while (0);
+#else
+# define REG3OP(m,op)							\
+	do {								\
+		REG3;							\
+		size_t _v = REGJ, _w = REGK;				\
+		REGI = REGJ op REGK;					\
+		DEBUG(m "\tr%d,r%d,r%d\t(%ld = %ld " #op " %ld)",	\
+		      regi, regj, regk, REGI, _v, _w);			\
+	} while (0)
+# define REG3OPSTR(m,op,opstr)						\
+	do {								\
+		REG3;							\
+		size_t _v = REGJ, _w = REGK;				\
+		REGI = REGJ op REGK;					\
+		DEBUG(m "\tr%d,r%d,r%d\t(%ld = %ld " opstr " %ld)",	\
+		      regi, regj, regk, REGI, _v, _w);			\
+	} while (0)
+# define REG3OPSTRFUNC(m,func,opstr,fmt) do {		\
+	REG3;						\
+	size_t _v = REGJ;				\
+	REGI = func(REGJ, REGK);			\
+	DEBUG(m "\tr%d,r%d,r%d\t"			\
+	      "(" fmt " = " fmt " " opstr " " fmt ")",	\
+	      regi, regj, regk, REGI, _v, REGK);	\
+} while (0);
+#endif
+
+/**
+ * Returns to run's preemption check if the next one is due. This is only done
+ * on backward jumps and calls: every loop and every recursion passes one, so
+ * a program can't get far past its budget while all other instructions stay
+ * free of checks.
+ */
+#ifdef NOPROF
+// Counting every instruction is too slow, so only the checks are counted
+# define PREEMPT do {					\
+	if (++icount >= check)				\
+		goto preempt;				\
+} while (0)
+#else
+# define PREEMPT do {					\
+	if (icount >= check)				\
+		goto preempt;				\
+} while (0)
+#endif
+
+#define JUMPIF(m,c,conv) do {			\
+	REG1;						\
+	if (c) {					\
+		size_t _from = ip;			\
+		ip = *(size_t *)(mem + ip);		\
+		ip = (uint32_t)conv(ip);		\
+		DEBUG(m "\t0x%lx,r%d\t(%ld, true)",	\
+		      ip, regi, REGI);			\
+		if (ip < _from)				\
+			PREEMPT;			\
+	} else {					\
+		DEBUG(m "\t0x%lx,r%d\t(%ld, false)",	\
+		      ip, regi, REGI);			\
+		ip += sizeof ip;			\
+	}						\
+} while (0)
+
+#define JUMPIF2(m,c,conv) do {				\
+	REG2;						\
+	if (c) {					\
+		size_t _from = ip;			\
+		ip = *(size_t *)(mem + ip);		\
+		ip = (uint32_t)conv(ip);		\
+		DEBUG(m "\tr%d,r%d,0x%lx\t(true)",	\
+		      regi, regj, ip);			\
+		if (ip < _from)				\
+			PREEMPT;			\
+	} else {					\
+		DEBUG(m "\tr%d,r%d\t(false)",		\
+		      regi, regj);			\
+		ip += sizeof ip;			\
+	}						\
+} while (0)
+
+#define CALL(conv,convh) do {				\
+	addr = convh(ip + sizeof ip);			\
+	*(size_t *)GUEST(sp) = addr;			\
+	sp += sizeof ip;				\
+	ip = *(size_t *)(mem + ip);			\
+	ip = (uint32_t)conv(ip);			\
+	DEBUG("call\t0x%lx", ip);			\
+	PREEMPT;					\
+} while (0)
+
+#define RET(conv) do {					\
+	sp -= sizeof ip;				\
+	ip = *(size_t *)GUEST(sp);			\
+	ip = (uint32_t)conv(ip);			\
+	DEBUG("ret\t\t(0x%lx)", ip);			\
+} while (0)
+
+#define JMP(conv) do {					\
+	size_t _from = ip;				\
+	ip = *(size_t *)(mem + ip);			\
+	ip = (uint32_t)conv(ip);			\
+	DEBUG("jmp\t0x%lx", ip);			\
+	if (ip < _from)					\
+		PREEMPT;				\
+} while (0)
+
+#define LOAD(m,t,conv) do {				\
+	REG2;						\
+	REGI = *(t *)GUEST(REGJ);			\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d\t(%ld <-- 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+
+#define LOADAT(m,t,conv) do {				\
+	REG3;						\
+	REGI = *(t *)GUEST(REGJ + REGK);		\
+	REGI = conv(REGI);				\
+	DEBUG(m "\tr%d,r%d,r%d\t(%ld <-- 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+
+#define STORE(m,t,conv) do {				\
+	REG2;						\
+	*(t *)GUEST(REGJ) = conv(REGI);			\
+	DEBUG(m "\tr%d,r%d\t(%ld --> 0x%lx)",		\
+	      regi, regj, REGI, REGJ);			\
+} while (0)
+
+#define STOREAT(m,t,conv) do {				\
+	REG3;						\
+	*(t *)GUEST(REGJ + REGK) = conv(REGI);		\
+	DEBUG(m "\tr%d,r%d,r%d\t(%ld --> 0x%lx + 0x%ld)",\
+	      regi, regj, regk, REGI, REGJ, REGK);	\
+} while (0)
+
+#define SET(m,t,conv) do {				\
+	REG1;						\
+	val = *(t *)(mem + ip);				\
+	val = conv(val);				\
+	ip += sizeof (t);				\
+	REGI = val;					\
+	DEBUG(m "\tr%d,%ld\t(%ld)", regi, val, REGI);	\
+} while (0)
+
+#define JUMPRELIF(m,c,t,conv) do {				\
+	REG1;							\
+	if (c) {						\
+		t v = conv((t)mem[ip]);				\
+		ip += v;					\
+		DEBUG(m "\t%s0x%x,r%d\t(%ld, true, 0x%lx)",	\
+		      v < 0 ? "-" : "", v < 0 ? -v : v,		\
+		      regi, REGI, ip);				\
+		if (v < 0)					\
+			PREEMPT;				\
+	} else {						\
+		t v = conv((t)mem[ip]);				\
+		DEBUG(m "\t%s0x%x,r%d\t(%ld, false, 0x%lx)",	\
+		      v < 0 ? "-" : "", v < 0 ? -v : v,		\
+		      regi, REGI, ip);				\
+		ip += sizeof (t);				\
+	}							\
+} while (0)
+
+#define JUMPRELIF2(m,c) do {					\
+	REG2;							\
+	if (c) {						\
+		int8_t v = mem[ip];				\
+		ip += v;					\
+		DEBUG(m "\tr%d,r%d\t(true, 0x%lx)",		\
+		      regi, regj, ip);				\
+		if (v < 0)					\
+			PREEMPT;				\
+	} else {						\
+		DEBUG(m "\tr%d,r%d\t(false)", regi, regj);	\
+		ip++;						\
+	}							\
+} while (0)
+
+
+#define sp regs[31]
+
+
+#define REG2IOP(m,op,conv) do {				\
+	REG2;						\
+	int32_t _i = conv(*(uint32_t *)(mem + ip));	\
+	ip += sizeof _i;				\
+	REGI = REGJ op (int64_t)_i;			\
+	DEBUG(m "\tr%d,r%d,%d\t(%ld)", regi, regj, _i, REGI);\
+} while (0)
+
+
+// Registers are pushed in ascending and popped in descending order
+#define PUSHM(conv) do {				\
+	uint32_t _m = *(uint32_t *)(mem + ip);		\
+	_m = conv(_m);					\
+	ip += sizeof _m;				\
+	DEBUG("pushm\t0x%x", _m);			\
+	while (_m) {					\
+		int _r = __builtin_ctz(_m);		\
+		_m &= _m - 1;				\
+		*(size_t *)GUEST(sp) = regs[_r];	\
+		sp += sizeof regs[_r];			\
+	}						\
+} while (0)
+
+#define POPM(conv) do {					\
+	uint32_t _m = *(uint32_t *)(mem + ip);		\
+	_m = conv(_m);					\
+	ip += sizeof _m;				\
+	DEBUG("popm\t0x%x", _m);			\
+	while (_m) {					\
+		int _r = 31 - __builtin_clz(_m);	\
+		_m &= ~(1U << _r);			\
+		sp -= sizeof regs[_r];			\
+		regs[_r] = *(size_t *)GUEST(sp);	\
+	}						\
+} while (0)
+
+
+#define RROT(t,x,y) (((t)x >> (t)y) | ((t)x << ((sizeof(t) * 8) - (t)y)))
+#define LROT(t,x,y) (((t)x << (t)y) | ((t)x >> ((sizeof(t) * 8) - (t)y)))
+#define RROT64(x,y) RROT(uint64_t,x,y)
+#define LROT64(x,y) LROT(uint64_t,x,y)
+#define RROT32(x,y) RROT(uint32_t,x,y)
+#define LROT32(x,y) LROT(uint32_t,x,y)
+#define RROT16(x,y) RROT(uint16_t,x,y)
+#define LROT16(x,y) LROT(uint16_t,x,y)
+#define RROT8(x,y)  RROT(uint8_t,x,y)
+#define LROT8(x,y)  LROT(uint8_t,x,y)
+
+
+
+#define VM_DEADLINE_STRIDE	1024
+
+
+/**
+ * Runs the program until it exits, about budget instructions are executed or
+ * the TSC passes the deadline, if it isn't 0.
+ */
+static enum vm_state run(struct vm *vm, size_t budget, uint64_t deadline) {
+
+	int64_t *regs = vm->regs;
+	uint8_t *mem = vm->mem.base;
+
+	static void *const be[] = {
+		[OP_NOP] = &&op_nop,
+
+		[OP_JMP] = &&op_jmp,
+		[OP_JZ] = &&op_jz,
+		[OP_JNZ] = &&op_jnz,
+		[OP_JP] = &&op_jp,
+		[OP_JPZ] = &&op_jpz,
+		[OP_CALL] = &&op_call,
+		[OP_RET] = &&op_ret,
+		[OP_JMPRB] = &&op_jmprb,
+		[OP_JZB] = &&op_jzb,
+		[OP_JNZB] = &&op_jnzb,
+		[OP_JPB] = &&op_jpb,
+		[OP_JPZB] = &&op_jpzb,
+		[OP_JLT] = &&op_jlt,
+		[OP_JLE] = &&op_jle,
+		[OP_JEQ] = &&op_jeq,
+		[OP_JNE] = &&op_jne,
+		[OP_JLTB] = &&op_jltb,
+		[OP_JLEB] = &&op_jleb,
+		[OP_JEQB] = &&op_jeqb,
+		[OP_JNEB] = &&op_jneb,
+
+		[OP_LDL] = &&op_ldl,
+		[OP_LDI] = &&op_ldi,
+		[OP_LDS] = &&op_lds,
+		[OP_LDB] = &&op_ldb,
+		[OP_STRL] = &&op_strl,
+		[OP_STRI] = &&op_stri,
+		[OP_STRS] = &&op_strs,
+		[OP_STRB] = &&op_strb,
+
+		[OP_LDLAT] = &&op_ldlat,
+		[OP_LDIAT] = &&op_ldiat,
+		[OP_LDSAT] = &&op_ldsat,
+		[OP_LDBAT] = &&op_ldbat,
+		[OP_STRLAT] = &&op_strlat,
+		[OP_STRIAT] = &&op_striat,
+		[OP_STRSAT] = &&op_strsat,
+		[OP_STRBAT] = &&op_strbat,
+
+		[OP_PUSH] = &&op_push,
+		[OP_POP] = &&op_pop,
+		[OP_MOV] = &&op_mov,
+		[OP_SETL] = &&op_setl,
+		[OP_SETI] = &&op_seti,
+		[OP_SETS] = &&op_sets,
+		[OP_SETB] = &&op_setb,
+
+		[OP_ADD] = &&op_add,
+		[OP_SUB] = &&op_sub,
+		[OP_MUL] = &&op_mul,
+		[OP_DIV] = &&op_div,
+		[OP_MOD] = &&op_mod,
+		[OP_REM] = &&op_rem,
+		[OP_LSHIFT] = &&op_lshift,
+		[OP_RSHIFT] = &&op_rshift,
+		[OP_LROT] = &&op_lrot,
+		[OP_RROT] = &&op_rrot,
+		[OP_AND] = &&op_and,
+		[OP_OR] = &&op_or,
+		[OP_XOR] = &&op_xor,
+		[OP_NOT] = &&op_not,
+		[OP_INV] = &&op_inv,
+		[OP_LESS] = &&op_less,
+		[OP_LESSE] = &&op_lesse,
+
+		[OP_SYSCALL] = &&op_syscall,
+
+		[OP_PUSHM] = &&op_pushm,
+		[OP_POPM] = &&op_popm,
+
+		[OP_ADDI] = &&op_addi,
+		[OP_SUBI] = &&op_subi,
+		[OP_MULI] = &&op_muli,
+		[OP_ANDI] = &&op_andi,
+		[OP_LSHIFTI] = &&op_lshifti,
+		[OP_RSHIFTI] = &&op_rshifti,
+		[OP_LESSI] = &&op_lessi,
+	};
+
+	// The table is copied as programs of both formats may run at once
+	void *table[sizeof be / sizeof *be];
+	memcpy(table, be, sizeof be);
+	if (vm->format == VBIN_FORMAT_LE) {
+		table[OP_CALL]   = &&op_call_le;
+		table[OP_RET]    = &&op_ret_le;
+		table[OP_JMP]    = &&op_jmp_le;
+		table[OP_JZ]     = &&op_jz_le;
+		table[OP_JNZ]    = &&op_jnz_le;
+		table[OP_JP]     = &&op_jp_le;
+		table[OP_JPZ]    = &&op_jpz_le;
+		table[OP_JLT]    = &&op_jlt_le;
+		table[OP_JLE]    = &&op_jle_le;
+		table[OP_JEQ]    = &&op_jeq_le;
+		table[OP_JNE]    = &&op_jne_le;
+		table[OP_LDL]    = &&op_ldl_le;
+		table[OP_LDI]    = &&op_ldi_le;
+		table[OP_LDS]    = &&op_lds_le;
+		table[OP_LDLAT]  = &&op_ldlat_le;
+		table[OP_LDIAT]  = &&op_ldiat_le;
+		table[OP_LDSAT]  = &&op_ldsat_le;
+		table[OP_STRL]   = &&op_strl_le;
+		table[OP_STRI]   = &&op_stri_le;
+		table[OP_STRS]   = &&op_strs_le;
+		table[OP_STRLAT] = &&op_strlat_le;
+		table[OP_STRIAT] = &&op_striat_le;
+		table[OP_STRSAT] = &&op_strsat_le;
+		table[OP_SETL]   = &&op_setl_le;
+		table[OP_SETI]   = &&op_seti_le;
+		table[OP_SETS]   = &&op_sets_le;
+		table[OP_PUSHM]  = &&op_pushm_le;
+		table[OP_POPM]   = &&op_popm_le;
+		table[OP_ADDI]   = &&op_addi_le;
+		table[OP_SUBI]   = &&op_subi_le;
+		table[OP_MULI]   = &&op_muli_le;
+		table[OP_ANDI]   = &&op_andi_le;
+		table[OP_LSHIFTI] = &&op_lshifti_le;
+		table[OP_RSHIFTI] = &&op_rshifti_le;
+		table[OP_LESSI]  = &&op_lessi_le;
+	}
+
+	// The instructions are counted from the start of the program. The TSC
+	// is only read every VM_DEADLINE_STRIDE instructions as it is a lot
+	// slower than a compare.
+	size_t icount = vm->icounter;
+	size_t limit  = icount + budget < icount ? SIZE_MAX : icount + budget;
+	size_t check  = limit;
+	if (deadline != 0 && check - icount > VM_DEADLINE_STRIDE)
+		check = icount + VM_DEADLINE_STRIDE;
+
+	uint64_t ip = vm->ip;
+
+	while (1) {
+#ifndef NOPROF
+		icount++;
+#endif
+#ifndef NDEBUG
+		fprintf(stderr, "0x%06lx:\t", ip);
+#endif
+#ifdef THROTTLE
+		usleep(THROTTLE * 1000);
+#endif
+		enum vasm_op op = mem[ip];
+		ip++;
+		goto *table[op];
+
+		unsigned char regi, regj, regk;
+		size_t addr, val;
+
+	preempt:
+		if (icount >= limit || (deadline != 0 && _rdtsc() >= deadline)) {
+			vm->ip       = ip;
+			vm->icounter = icount;
+			return VM_READY;
+		}
+		check = limit - icount > VM_DEADLINE_STRIDE
+		      ? icount + VM_DEADLINE_STRIDE : limit;
+		continue;
+
+	op_nop:
+		DEBUG("nop");
+		continue;
+
+	op_call:
+		CALL(be64toh, htobe64);
+		continue;
+
+	op_call_le:
+		CALL(le64toh, htole64);
+		continue;
+
+	op_ret:
+		RET(be64toh);
+		continue;
+
+	op_ret_le:
+		RET(le64toh);
+		continue;
+
+	op_jmp:
+		JMP(be64toh);
+		continue;
+
+	op_jmp_le:
+		JMP(le64toh);
+		continue;
+
+	op_jz:
+		JUMPIF("jz", !REGI, be64toh);
+		continue;
+
+	op_jz_le:
+		JUMPIF("jz", !REGI, le64toh);
+		continue;
+
+	op_jnz:
+		JUMPIF("jnz", REGI, be64toh);
+		continue;
+
+	op_jnz_le:
+		JUMPIF("jnz", REGI, le64toh);
+		continue;
+
+	op_jp:
+		JUMPIF("jp", REGI > 0, be64toh);
+		continue;
+
+	op_jp_le:
+		JUMPIF("jp", REGI > 0, le64toh);
+		continue;
+
+	op_jpz:
+		JUMPIF("jpz", REGI >= 0, be64toh);
+		continue;
+
+	op_jpz_le:
+		JUMPIF("jpz", REGI >= 0, le64toh);
+		continue;
+
+	op_jmprb:
+#ifndef NDEBUG
+		{
+			int8_t c = mem[ip];
+			if (c >= 0)
+				DEBUG("jmprb\t0x%x\t(0x%lx)",
+				      (uint8_t)c, ip + c);
+			else
+				DEBUG("jmprb\t0x%x\t(0x%lx)",
+				      (uint8_t)c, ip + c);
+			ip += c;
+			if (c < 0)
+				PREEMPT;
+		}
+#else
+		{
+			int8_t c = mem[ip];
+			ip += c;
+			if (c < 0)
+				PREEMPT;
+		}
+#endif
+		continue;
+
+	op_jzb:
+		JUMPRELIF("jzb", !REGI, int8_t, (int8_t));
+		continue;
+
+	op_jnzb:
+		JUMPRELIF("jnzb", REGI, int8_t, (int8_t));
+		continue;
+
+	op_jpb:
+		JUMPRELIF("jpb", REGI > 0, int8_t, (int8_t));
+		continue;
+
+	op_jpzb:
+		JUMPRELIF("jpzb", REGI >= 0, int8_t, (int8_t));
+		continue;
+
+	op_jlt:
+		JUMPIF2("jlt", REGI < REGJ, be64toh);
+		continue;
+
+	op_jlt_le:
+		JUMPIF2("jlt", REGI < REGJ, le64toh);
+		continue;
+
+	op_jle:
+		JUMPIF2("jle", REGI <= REGJ, be64toh);
+		continue;
+
+	op_jle_le:
+		JUMPIF2("jle", REGI <= REGJ, le64toh);
+		continue;
+
+	op_jeq:
+		JUMPIF2("jeq", REGI == REGJ, be64toh);
+		continue;
+
+	op_jeq_le:
+		JUMPIF2("jeq", REGI == REGJ, le64toh);
+		continue;
+
+	op_jne:
+		JUMPIF2("jne", REGI != REGJ, be64toh);
+		continue;
+
+	op_jne_le:
+		JUMPIF2("jne", REGI != REGJ, le64toh);
+		continue;
+
+	op_jltb:
+		JUMPRELIF2("jltb", REGI < REGJ);
+		continue;
+
+	op_jleb:
+		JUMPRELIF2("jleb", REGI <= REGJ);
+		continue;
+
+	op_jeqb:
+		JUMPRELIF2("jeqb", REGI == REGJ);
+		continue;
+
+	op_jneb:
+		JUMPRELIF2("jneb", REGI != REGJ);
+		continue;
+
+	op_ldl:
+		LOAD("ldl", uint64_t, be64toh);
+		continue;
+
+	op_ldl_le:
+		LOAD("ldl", uint64_t, le64toh);
+		continue;
+
+	op_ldi:
+		LOAD("ldi", uint32_t, be32toh);
+		continue;
+
+	op_ldi_le:
+		LOAD("ldi", uint32_t, le32toh);
+		continue;
+
+	op_lds:
+		LOAD("lds", uint16_t, be16toh);
+		continue;
+
+	op_lds_le:
+		LOAD("lds", uint16_t, le16toh);
+		continue;
+
+	op_ldb:
+		REG2;
+		REGI = *(uint8_t *)GUEST(REGJ);
+		DEBUG("ldl\tr%d,r%d\t(%ld <-- 0x%lx)", regi, regj, REGI, REGJ);
+		continue;
+
+	op_ldlat:
+		LOADAT("ldlat", uint64_t, be64toh);
+		continue;
+
+	op_ldlat_le:
+		LOADAT("ldlat", uint64_t, le64toh);
+		continue;
+
+	op_ldiat:
+		LOADAT("ldiat", uint32_t, be32toh);
+		continue;
+
+	op_ldiat_le:
+		LOADAT("ldiat", uint32_t, le32toh);
+		continue;
+
+	op_ldsat:
+		LOADAT("ldsat", uint16_t, be16toh);
+		continue;
+
+	op_ldsat_le:
+		LOADAT("ldsat", uint16_t, le16toh);
+		continue;
+
+	op_ldbat:
+		REG3;
+		REGI = *(uint8_t *)GUEST(REGJ + REGK);
+		DEBUG("ldbat\tr%d,r%d,r%d\t(%ld <-- 0x%lx + 0x%ld)",
+		      regi, regj, regk, REGI, REGJ, REGK);
+		continue;
+
+	op_strl:
+		STORE("strl", uint64_t, htobe64);
+		continue;
+
+	op_strl_le:
+		STORE("strl", uint64_t, htole64);
+		continue;
+
+	op_stri:
+		STORE("stri", uint32_t, htobe32);
+		continue;
+
+	op_stri_le:
+		STORE("stri", uint32_t, htole32);
+		continue;
+
+	op_strs:
+		STORE("strs", uint16_t, htobe16);
+		continue;
+
+	op_strs_le:
+		STORE("strs", uint16_t, htole16);
+		continue;
+
+	op_strb:
+		REG2;
+		*(uint8_t *)GUEST(REGJ) = REGI;
+		DEBUG("strb\tr%d,r%d\t(%ld --> 0x%lx)", regi, regj, REGI, REGJ);
+		continue;
+
+	op_strlat:
+		STOREAT("strlat", uint64_t, htobe64);
+		continue;
+
+	op_strlat_le:
+		STOREAT("strlat", uint64_t, htole64);
+		continue;
+
+	op_striat:
+		STOREAT("striat", uint32_t, htobe32);
+		continue;
+
+	op_striat_le:
+		STOREAT("striat", uint32_t, htole32);
+		continue;
+
+	op_strsat:
+		STOREAT("strsat", uint16_t, htobe16);
+		continue;
+
+	op_strsat_le:
+		STOREAT("strsat", uint16_t, htole16);
+		continue;
+
+	op_strbat:
+		REG3;
+		*(uint8_t *)GUEST(REGJ + REGK) = REGI;
+		DEBUG("strbat\tr%d,r%d,r%d\t(%ld --> 0x%lx + 0x%ld)",
+		      regi, regj, regk, REGI, REGJ, REGK);
+		continue;
+
+	op_push:
+		REG1;
+		*(size_t *)GUEST(sp) = REGI;
+		DEBUG("push\tr%d\t(%ld)", regi, *(size_t *)GUEST(sp));
+		sp += sizeof regs[regi];
+		continue;
+
+	op_pop:
+		REG1;
+		sp -= sizeof REGI;
+		REGI = *(size_t *)GUEST(sp);
+		DEBUG("pop\tr%d\t(%ld)", regi, REGI);
+		continue;
+
+	op_pushm:
+		PUSHM(be32toh);
+		continue;
+
+	op_pushm_le:
+		PUSHM(le32toh);
+		continue;
+
+	op_popm:
+		POPM(be32toh);
+		continue;
+
+	op_popm_le:
+		POPM(le32toh);
+		continue;
+
+	op_mov:
+		REG2;
+		REGI = REGJ;
+		DEBUG("mov\tr%d,r%d\t(%ld)", regi, regj, REGI);
+		continue;
+
+	op_setl:
+		SET("setl", uint64_t, be64toh);
+		continue;
+
+	op_setl_le:
+		SET("setl", uint64_t, le64toh);
+		continue;
+
+	op_seti:
+		SET("seti", uint32_t, be32toh);
+		continue;
+
+	op_seti_le:
+		SET("seti", uint32_t, le32toh);
+		continue;
+
+	op_sets:
+		SET("sets", uint16_t, be16toh);
+		continue;
+
+	op_sets_le:
+		SET("sets", uint16_t, le16toh);
+		continue;
+
+	op_setb:
+		REG1;
+		val = *(uint8_t *)(mem + ip);
+		ip += 1;
+		REGI = val;
+		DEBUG("setb\tr%d,%ld\t(%ld)", regi, val, REGI);
+		continue;
+
+	op_add:
+		REG3OP("add", +);
+		continue;
+
+	op_sub:
+		REG3OP("sub", -);
+		continue;
+
+	op_mul:
+		REG3OP("mul", *);
+		continue;
+
+	op_div:
+		REG3OP("div", /);
+		continue;
+
+	op_mod:
+		REG3OPSTR("mod", %, "%%");
+		continue;
+
+	op_rem:
+		REG3OPSTR("rem", %, "%%");
+		continue;
+
+	op_and:
+		REG3OP("and", &);
+		continue;
+
+	op_or:
+		REG3OP("or", |);
+		continue;
+
+	op_xor:
+		REG3OP("xor", ^);
+		continue;
+
+	op_lshift:
+		REG3OP("lshift", <<);
+		continue;
+
+	op_rshift:
+		REG3OP("rshift", >>);
+		continue;
+
+	op_less:
+		REG3OP("less", <);
+		continue;
+
+	op_lesse:
+		REG3OP("lesse", <=);
+		continue;
+
+	op_addi:
+		REG2IOP("addi", +, be32toh);
+		continue;
+
+	op_addi_le:
+		REG2IOP("addi", +, le32toh);
+		continue;
+
+	op_subi:
+		REG2IOP("subi", -, be32toh);
+		continue;
+
+	op_subi_le:
+		REG2IOP("subi", -, le32toh);
+		continue;
+
+	op_muli:
+		REG2IOP("muli", *, be32toh);
+		continue;
+
+	op_muli_le:
+		REG2IOP("muli", *, le32toh);
+		continue;
+
+	op_andi:
+		REG2IOP("andi", &, be32toh);
+		continue;
+
+	op_andi_le:
+		REG2IOP("andi", &, le32toh);
+		continue;
+
+	op_lshifti:
+		REG2IOP("lshifti", <<, be32toh);
+		continue;
+
+	op_lshifti_le:
+		REG2IOP("lshifti", <<, le32toh);
+		continue;
+
+	op_rshifti:
+		REG2IOP("rshifti", >>, be32toh);
+		continue;
+
+	op_rshifti_le:
+		REG2IOP("rshifti", >>, le32toh);
+		continue;
+
+	op_lessi:
+		REG2IOP("lessi", <, be32toh);
+		continue;
+
+	op_lessi_le:
+		REG2IOP("lessi", <, le32toh);
+		continue;
+
+	op_rrot:
+		REG3OPSTRFUNC("rrot", RROT64, "RR", "%lx");
+		continue;
+
+	op_lrot:
+		REG3OPSTRFUNC("rrot", LROT64, "RR", "%lx");
+		continue;
+
+	op_not:
+		REG2;
+		REGI = ~REGJ;
+		DEBUG("not\tr%d,r%d\t(%ld)", regi, regj, REGI);
+		continue;
+
+	op_inv:
+		REG2;
+		REGI = !REGJ;
+		DEBUG("inv\tr%d,r%d\t(%ld)", regi, regj, REGI);
+		continue;
+
+	op_syscall:
+		DEBUG("syscall");
+		vm->icounter = icount;
+		if ((uint64_t)regs[0] < VM_SYSCALL_COUNT &&
+		    vm->syscalls[regs[0]] != NULL)
+			vm->syscalls[regs[0]](vm);
+		else
+			regs[0] = -1;
+		if (vm->state != VM_READY) {
+			vm->ip = ip;
+			return vm->state;
+		}
+		continue;
+	}
+}
+
+
+
+static void _sys_exit(struct vm *vm)
+{
+	vm->exitcode = vm->regs[1];
+	vm->state    = VM_EXITED;
+}
+
+
+/**
+ * The host implementation aborts the process, which would take every other vm
+ * along.
+ */
+static void _sys_signal(struct vm *vm)
+{
+	if (vm->regs[1] != SIGKILL) {
+		vm->regs[0] = -1;
+		return;
+	}
+	DEBUG("signal(%ld)", vm->regs[1]);
+	vm->exitcode = 128 + SIGABRT;
+	vm->state    = VM_ABORTED;
+}
+
+
+static void _sys_brk(struct vm *vm)
+{
+	vm->regs[0] = vasm_mem_setbrk(&vm->mem, vm->regs[1]);
+	DEBUG("brk(0x%lx) = 0x%lx", vm->regs[1], vm->regs[0]);
+}
+
+
+static void _sys_host(struct vm *vm)
+{
+	vasm_syscall(vm->regs, vm->mem.base);
+}
+
+
+struct vm *vm_create(void)
+{
+	struct vm *vm = calloc(1, sizeof *vm);
+	if (vm == NULL)
+		return NULL;
+	if (vasm_mem_create(&vm->mem) < 0) {
+		free(vm);
+		return NULL;
+	}
+	vm->state = VM_EXITED;
+	vm->epfd  = -1;
+	vm_threads_free(vm);
+	for (size_t i = 0; i < VM_SYSCALL_COUNT; i++)
+		vm->syscalls[i] = _sys_host;
+	vm->syscalls[0]  = _sys_exit;
+	vm->syscalls[9]  = _sys_signal;
+	vm->syscalls[10] = _sys_brk;
+	vm_threads_syscalls(vm);
+	return vm;
+}
+
+
+void vm_destroy(struct vm *vm)
+{
+	if (vm == NULL)
+		return;
+	vm_threads_free(vm);
+	vasm_mem_destroy(&vm->mem);
+	free(vm);
+}
+
+
+int vm_load(struct vm *vm, const void *vbin, size_t len)
+{
+	uint32_t magic;
+	int isobj;
+	if (len < sizeof magic)
+		return -1;
+	memcpy(&magic, vbin, sizeof magic);
+	int format = vbin_magic_format(magic, &isobj);
+	if (format < 0 || isobj)
+		return -1;
+	len -= sizeof magic;
+	if (len > VASM_MEM_IMAGE_SIZE)
+		len = VASM_MEM_IMAGE_SIZE;
+	if (vasm_mem_reset(&vm->mem) < 0 || vm_threads_init(vm) < 0)
+		return -1;
+	memcpy(vm->mem.base, (const uint8_t *)vbin + sizeof magic, len);
+
+	memset(vm->regs, 0, sizeof vm->regs);
+	vm->ip       = 0;
+	vm->format   = format;
+	vm->state    = VM_READY;
+	vm->exitcode = 0;
+	vm->icounter = 0;
+	return 0;
+}
+
+
+/**
+ * Schedules the threads of the program until it stops, the budget or the
+ * deadline is used up or, unless wait is set, every thread is blocked.
+ */
+static enum vm_state _run(struct vm *vm, size_t n, uint64_t deadline, int wait)
+{
+	size_t limit = vm->icounter + n < vm->icounter ? SIZE_MAX : vm->icounter + n;
+	while (vm->state == VM_READY) {
+		if (vm->current == VM_THREAD_NONE && vm_thread_next(vm, wait) < 0)
+			return vm->state == VM_READY ? VM_BLOCKED : vm->state;
+		if (vm->icounter >= limit ||
+		    (deadline != 0 && _rdtsc() >= deadline))
+			return VM_READY;
+		enum vm_state s = run(vm, limit - vm->icounter, deadline);
+		if (s != VM_YIELDED && s != VM_BLOCKED)
+			return s;
+		vm->state = VM_READY;
+		vm_thread_stop(vm, s);
+	}
+	return vm->state;
+}
+
+
+enum vm_state vm_run(struct vm *vm)
+{
+	return _run(vm, SIZE_MAX, 0, 1);
+}
+
+
+enum vm_state vm_run_for(struct vm *vm, size_t n)
+{
+	return _run(vm, n, 0, 0);
+}
+
+
+enum vm_state vm_run_until(struct vm *vm, size_t n, uint64_t deadline)
+{
+	return _run(vm, n, deadline, 0);
+}
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "arena.h"
 #include "expr.h"
 #include "func.h"
 #include "hashtbl.h"
@@ -19,8 +20,8 @@ static int is_array_dereference(const char *str, const char **arr, const char **
 		const char *q = strchr(p, ']');
 		if (q == NULL)
 			EXIT(1, "Expected ']'");
-		*arr   = strnclone(str, p - str - 1);
-		*index = strnclone(p, q - p);
+		*arr   = internn(str, p - str - 1);
+		*index = internn(p, q - p);
 		return 1;
 	}
 	return 0;
@@ -31,8 +32,8 @@ static int is_member_dereference(const char *str, const char **parent, const cha
 {
 	const char *p = strchr(str, '.');
 	if (p != NULL) {
-		*parent = strnclone(str, p - str);
-		*member = strclone(p + 1);
+		*parent = internn(str, p - str);
+		*member = intern(p + 1);
 		return 1;
 	}
 	return 0;
@@ -66,7 +67,7 @@ int parsefunc_header(struct func *f, const line_t line, const char *text)
 			EXIT(1, "");
 		}
 	}
-	f->type = strnclone(t + i, j - i);
+	f->type = internn(t + i, j - i);
 
 	// Skip whitespace
 	while (t[j] == ' ')
@@ -82,7 +83,7 @@ int parsefunc_header(struct func *f, const line_t line, const char *text)
 			EXIT(1, "");
 		}
 	}
-	f->name = strnclone(t + i, j - i);
+	f->name = internn(t + i, j - i);
 
 	// Skip whitespace
 	while (t[j] == ' ')
@@ -105,13 +106,13 @@ int parsefunc_header(struct func *f, const line_t line, const char *text)
 		// Get type
 		while (t[j] != ' ')
 			j++;
-		f->args[k].type = strnclone(t + i, j - i);
+		f->args[k].type = internn(t + i, j - i);
 		j++;
 		i = j;
 		// Get name
 		while (t[j] != ',' && t[j] != ')')
 			j++;
-		f->args[k].name = strnclone(t + i, j - i);
+		f->args[k].name = internn(t + i, j - i);
 		k++;
 		// Argument list done
 		if (t[j] == ')')
@@ -142,9 +143,11 @@ void lines2func(const line_t *lines, size_t linecount,
 		const char *_else;
 		const char *ends;
 		int type;
-	} loop[16];
+	} *loop = NULL;
+	// Labels are global, so the counters are shared between threads
 	static int loopcounter = 0;
 	int loopcount   = 0;
+	int loopcap     = 0;
 
 	// Add function parameters to variables
 	for (size_t i = 0; i < f->argcount; i++) {
@@ -156,9 +159,9 @@ void lines2func(const line_t *lines, size_t linecount,
 		if (t.type == TYPE_STRUCT) {
 			struct type_meta_struct *m = (void *)&t.meta;
 			for (size_t j = 0; j < m->count; j++) {
-				const char *name = strprintf("%s@%s",
+				const char *name = internf("%s@%s",
 						f->args[i].name, m->names[j]);
-				h_add(&variables, name, (size_t)strclone(m->types[j]));
+				h_add(&variables, name, (size_t)intern(m->types[j]));
 			}
 		}
 	}
@@ -168,7 +171,7 @@ void lines2func(const line_t *lines, size_t linecount,
 		size_t size;
 		if (get_type_size(f->type, &size) < 0)
 			EXIT(3, "But how?");
-		const char *arg = strprintf("%ld", size);
+		const char *arg = internf("%ld", size);
 		line_declare(f, "this", f->name, &variables);
 		line_function(f, "this", "__alloc", 1, &arg);
 	} else if (f->functype == FUNC_STRUCT) {
@@ -187,14 +190,21 @@ void lines2func(const line_t *lines, size_t linecount,
 	const char *_ptr = ptr;			\
 	while (*ptr != ' ' && *ptr != 0)	\
 		ptr++;				\
-	memcpy(word, _ptr, ptr - _ptr);		\
-	word[ptr - _ptr] = 0;			\
+	word = internn(_ptr, ptr - _ptr);	\
 	if (*ptr != 0)				\
 		ptr++;				\
 } while (0)
 
+		// There may be a new loop or if on this line
+		if (loopcount >= loopcap) {
+			loopcap = loopcap == 0 ? 16 : loopcap * 2;
+			loop = realloc(loop, loopcap * sizeof *loop);
+			if (loop == NULL)
+				EXITERRNO(3, "Failed to allocate loops");
+		}
+
 		// Parse first word
-		char word[32];
+		const char *word;
 		const char *ptr = line.text, *oldptr;
 		NEXTWORD;
 		
@@ -264,7 +274,7 @@ void lines2func(const line_t *lines, size_t linecount,
 
 			NEXTWORD;
 
-			const char *var = strclone(word);
+			const char *var = intern(word);
 			const char *iterator = var;
 
 			NEXTWORD;
@@ -278,20 +288,18 @@ void lines2func(const line_t *lines, size_t linecount,
 			while (!strstart(ptr, " to ")) {
 				ptr++;
 				if (*ptr == 0) {
-					fromarray = strclone(p);
+					fromarray = intern(p);
 					fromval   = "0";
-					toval     = strprintf("%s.length", p);
+					toval     = internf("%s.length", p);
 					static size_t iteratorcount = 0;
-					iterator = strprintf("_for_iterator_%ld", iteratorcount);;
-					iteratorcount++;
+					iterator = internf("_for_iterator_%ld",
+					                   __sync_fetch_and_add(&iteratorcount, 1));
 					goto isfromarray;
 				}
 			}
-			memcpy(word, p, ptr - p);
-			word[ptr - p] = 0;
-
 			char istemp;
-			fromval = parse_expr(f, word, &istemp, "long", &variables);
+			fromval = parse_expr(f, internn(p, ptr - p), &istemp, "long",
+			                     &variables);
 			//if (istemp)
 			//	line_destroy(f, fromval);
 
@@ -307,9 +315,10 @@ void lines2func(const line_t *lines, size_t linecount,
 			line_assign(f, iterator, fromval);
 
 			// Create the labels
-		       	const char *lbl  = strprintf(".for_%d"     , loopcounter),
-		       	           *lbll = strprintf(".for_%d_else", loopcounter),
-		       	           *lble = strprintf(".for_%d_end" , loopcounter);
+			int n = __sync_fetch_and_add(&loopcounter, 1);
+		       	const char *lbl  = internf(".for_%d"     , n),
+		       	           *lbll = internf(".for_%d_else", n),
+		       	           *lble = internf(".for_%d_end" , n);
 
 			// Indicate the start of the loop
 			line_label(f, lbl);
@@ -318,7 +327,7 @@ void lines2func(const line_t *lines, size_t linecount,
 			char expr[64];
 			snprintf(expr, sizeof expr, "%s == %s", iterator, toval);
 			const char *e = parse_expr(f, expr, &istemp, "long", &variables);
-			line_if(f, e, strclone(lbll), 0);
+			line_if(f, e, intern(lbll), 0);
 			if (istemp)
 				line_destroy(f, e, &variables);
 
@@ -333,7 +342,7 @@ void lines2func(const line_t *lines, size_t linecount,
 				const char *tq = strrchr(type, '[');
 				if (tq == NULL)
 					EXIT(1, "Variable '%s' of type '%s' cannot be iterated", fromarray, type);
-				type = strnclone(type, tq - type);
+				type = internn(type, tq - type);
 				// Add lines
 				line_declare(f, var, type, &variables);
 				line_math(f, MATH_LOADAT, var, fromarray, iterator);
@@ -358,11 +367,11 @@ void lines2func(const line_t *lines, size_t linecount,
 
 			// Increment counters
 			loopcount++;
-			loopcounter++;
 		} else if (streq(word, "while")) {
-			const char *lbl  = strprintf(".while_%d"     , loopcounter),
-			           *lbll = strprintf(".while_%d_else", loopcounter),
-			           *lble = strprintf(".while_%d_end" , loopcounter);
+			int n = __sync_fetch_and_add(&loopcounter, 1);
+			const char *lbl  = internf(".while_%d"     , n),
+			           *lbll = internf(".while_%d_else", n),
+			           *lble = internf(".while_%d_end" , n);
 			
 			line_label(f, lbl);
 
@@ -378,10 +387,10 @@ void lines2func(const line_t *lines, size_t linecount,
 			loop[loopcount].type  = END_WHILE;
 
 			loopcount++;
-			loopcounter++;
 		} else if (streq(word, "if")) {
-			const char *lbll = strprintf(".if_%d_else", loopcounter),
-			           *lble = strprintf(".if_%d_end" , loopcounter);
+			int n = __sync_fetch_and_add(&loopcounter, 1);
+			const char *lbll = internf(".if_%d_else", n),
+			           *lble = internf(".if_%d_end" , n);
 
 			char istemp;
 			const char *e = parse_expr(f, ptr, &istemp, "bool", &variables);
@@ -394,7 +403,6 @@ void lines2func(const line_t *lines, size_t linecount,
 			loop[loopcount].type  = END_IF;
 
 			loopcount++;
-			loopcounter++;
 		} else if (streq(word, "return")) {
 			char istemp;
 			const char *e = parse_expr(f, ptr, &istemp, f->type, &variables);
@@ -407,7 +415,7 @@ void lines2func(const line_t *lines, size_t linecount,
 			const char *invars[32] , *outvars[32] ;
 			char        inregs[32] ,  outregs[32] ;
 			size_t      incount = 0,  outcount = 0;
-			const char**vasms = malloc(64 * sizeof *vasms);
+			const char**vasms;
 			size_t      vasmcount = 0;
 			const char *l, *t;
 			// Get input vars
@@ -441,6 +449,10 @@ void lines2func(const line_t *lines, size_t linecount,
 					PRINTLINEX(lines[li], l - t, text);
 					EXIT(1, "There are only 32 registers defined in the SS ISA");
 				}
+				if (incount >= sizeof inregs) {
+					PRINTLINEX(lines[li], l - t, text);
+					EXIT(1, "There can be at most 32 inputs");
+				}
 				inregs[incount] = r;
 				// Check for equal sign
 				q++; // ' '
@@ -458,7 +470,7 @@ void lines2func(const line_t *lines, size_t linecount,
 					}
 					q++;
 				}
-				invars[incount] = strnclone(p, q - p);
+				invars[incount] = internn(p, q - p);
 				// Next
 				incount++;
 				if (*lp == 0)
@@ -484,7 +496,11 @@ void lines2func(const line_t *lines, size_t linecount,
 					}
 					q++;
 				}
-				outvars[outcount] = strnclone(p, q - p);
+				if (outcount >= sizeof outregs) {
+					PRINTLINEX(lines[li], lp - t, text);
+					EXIT(1, "There can be at most 32 outputs");
+				}
+				outvars[outcount] = internn(p, q - p);
 				// Check for equal sign
 				q++; // ' '
 				if (*q != '=') {
@@ -521,19 +537,24 @@ void lines2func(const line_t *lines, size_t linecount,
 			}
 			// Insert ops
 			li++;
-			while (!streq(lines[li].text, "end"))
-				vasms[vasmcount++] = lines[li++].text;
+			while (!streq(lines[li + vasmcount].text, "end"))
+				vasmcount++;
+			vasms = malloc((vasmcount + 1) * sizeof *vasms);
+			if (vasms == NULL)
+				EXITERRNO(3, "Failed to allocate asm lines");
+			for (size_t i = 0; i < vasmcount; i++)
+				vasms[i] = lines[li++].text;
 			line_asm(f, vasms, vasmcount, invars, inregs, incount, outvars, outregs, outcount);
 		} else if (is_type(word)) {
-			char *type = strclone(word);
+			const char *type = intern(word);
 			NEXTWORD;
-			char *name = strclone(word);
+			const char *name = intern(word);
 			line_declare(f, name, type, &variables);
 			h_add(&variables, name, (size_t)type);
 		} else if (get_function(word, &variables) != NULL) {
 			line_function_parse(f, NULL, oldptr, &variables);
 		} else {
-			const char *name = strclone(word);
+			const char *name = intern(word);
 			NEXTWORD;
 
 			if (streq(word, "=")) {
@@ -586,7 +607,7 @@ void lines2func(const line_t *lines, size_t linecount,
 							size_t o;
 							if (get_member_offset(t.name, member, &o) < 0)
 								EXIT(1, "Type '%s' is not declared", t.name);
-							line_store(f, parent, strprintf("%ld", o), e);
+							line_store(f, parent, internf("%ld", o), e);
 						} else {
 							EXIT(1, "Type '%s' is not a struct or class", type);
 						}
@@ -606,7 +627,7 @@ void lines2func(const line_t *lines, size_t linecount,
 				const char *p = line.text;
 				while (!strstart(p, " = "))
 					p++;
-				const char *var = strnclone(line.text, p - line.text);
+				const char *var = internn(line.text, p - line.text);
 				const char *val = p + 3;
 				assign_var(f, var, val, &variables);
 			} else {
@@ -620,6 +641,8 @@ void lines2func(const line_t *lines, size_t linecount,
 		line = lines[li];
 	}
 
+	free(loop);
+
 	if (f->functype == FUNC_CLASS || f->functype == FUNC_STRUCT) {
 		line_return(f, "this");
 	}
@@ -16,24 +16,50 @@ int main(int argc, char **argv) {
 		DEBUG("Usage: %s <input ...> output", argv[0]);
 	}
 
-	char buf[0x10000];
 	struct hashtbl lbl2pos;
-	struct lblpos  pos2lbl[0x10000];
-	char vbin[0x10000];
+	size_t pos2lblcap = 256;
+	struct lblpos *pos2lbl = malloc(pos2lblcap * sizeof *pos2lbl);
+	char *vbin = malloc(9);
+	if (pos2lbl == NULL || vbin == NULL) {
+		perror("malloc");
+		return 1;
+	}
 	vbin[0] = OP_JMP;
 	pos2lbl[0].lbl = "_start";
 	pos2lbl[0].pos = 1;
 	size_t vbinlen = 9;
 	size_t pos2lblcount = 1;
+	int format = -1;
 
 	h_create(&lbl2pos, 32);
 
 	for (size_t i = 1; i < argc - 1; i++) {
 		DEBUG("%s:", argv[i]);
 		int fd = open(argv[i], O_RDONLY);
-		size_t len = read(fd, buf, sizeof buf);
+		if (fd < 0) {
+			perror(argv[i]);
+			return 1;
+		}
+		size_t len;
+		char *buf = readall(fd, &len);
+		if (buf == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
 		close(fd);
 
+		int isobj;
+		int f = len < 4 ? -1 : vbin_magic_format(*(uint32_t *)buf, &isobj);
+		if (f < 0 || !isobj) {
+			fprintf(stderr, "%s: not an object\n", argv[i]);
+			return 1;
+		}
+		if (format != -1 && f != format) {
+			fprintf(stderr, "%s: can't link objects with different endianness\n", argv[i]);
+			return 1;
+		}
+		format = f;
+
 		char *ptr = buf + 4;
 
 		DEBUG("  lbl2pos:");
@@ -78,27 +104,44 @@ int main(int argc, char **argv) {
 			pos = be64toh(pos);
 			ptr += sizeof pos;
 			DEBUG("    %lu (%lu + %lu) = %s", pos + vbinlen, vbinlen, pos, s);
+			if (pos2lblcount >= pos2lblcap) {
+				pos2lblcap *= 2;
+				pos2lbl = realloc(pos2lbl, pos2lblcap * sizeof *pos2lbl);
+				if (pos2lbl == NULL) {
+					perror("realloc");
+					return 1;
+				}
+			}
 			pos2lbl[pos2lblcount].lbl = s;
 			pos2lbl[pos2lblcount].pos = pos + vbinlen;
 			pos2lblcount++;
 		}
 
 		len -= ptr - buf;
+		vbin = realloc(vbin, vbinlen + len);
+		if (vbin == NULL) {
+			perror("realloc");
+			return 1;
+		}
 		memcpy(vbin + vbinlen, ptr, len);
 		vbinlen += len;
+		free(buf);
 	}
 
+	if (format == -1)
+		format = VBIN_FORMAT_LE;
+
 	DEBUG("%s", argv[argc - 1]);
 	for (size_t i = 0; i < pos2lblcount; i++) {
 		size_t pos = h_get(&lbl2pos, pos2lbl[i].lbl);
-		*(size_t *)(vbin + pos2lbl[i].pos) = htobe64(pos);
+		*(size_t *)(vbin + pos2lbl[i].pos) = htovbin64(format, pos);
 		DEBUG("  %s @ %lu (0x%lx) --> %lu (0x%lx)", pos2lbl[i].lbl,
 		       pos2lbl[i].pos, pos2lbl[i].pos, pos, pos);
 	}
 
 	// Write binary shit
 	int fd = open(argv[argc - 1], O_WRONLY | O_CREAT | O_TRUNC, 0755);
-	write(fd, "\x55\x00\x20\x19", 4); // Magic number
+	write(fd, vbin_magic_exec(format), 4); // Magic number
 	write(fd, vbin, vbinlen);
 	close(fd);
 
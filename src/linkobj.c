@@ -12,36 +12,65 @@ void linkobj(const char **vbins, size_t *vbinlens, size_t vbincount,
              const struct lblmap *maps, char *output, size_t *_outputlen)
 {
 	struct hashtbl lbl2pos;
-	struct lblpos  pos2lbl[0x10000];
+	size_t n = 1, m = 0;
+	for (size_t i = 0; i < vbincount; i++) {
+		n += maps[i].pos2lblcount;
+		m += maps[i].lbl2poscount;
+	}
+	struct lblpos *pos2lbl = malloc(n * sizeof *pos2lbl);
+	if (pos2lbl == NULL)
+		EXITERRNO(3, "Failed to allocate relocations");
 	output[0] = OP_JMP;
 	pos2lbl[0].lbl = "_start";
 	pos2lbl[0].pos = 1;
 	size_t outputlen = 9;
 	size_t pos2lblcount = 1;
 
-	h_create(&lbl2pos, 32);
+	h_create(&lbl2pos, m);
+
+	enum vbin_format fmt = vbincount > 0 ? maps[0].format : VBIN_FORMAT_LE;
 
 	for (size_t i = 0; i < vbincount; i++) {
 
+		if (maps[i].format != fmt)
+			EXIT(1, "Can't link objects with different endianness");
+
 		size_t len      = vbinlens[i];
 		const char *ptr = vbins[i];
+		struct hashtbl local = {};
+
+		memcpy(output + outputlen, ptr, len);
 
 		for (size_t j = 0; j < maps[i].lbl2poscount; j++) {
 			const char *s = maps[i].lbl2pos[j].lbl;
 			size_t pos    = maps[i].lbl2pos[j].pos;
-			if (h_add(&lbl2pos, s, pos + outputlen))
+			if (*s == '.') {
+				if (local.len == 0)
+					h_create(&local, 16);
+				if (h_add(&local, s, pos + outputlen))
+					EXITERRNO(3, "h_add");
+			} else if (h_add(&lbl2pos, s, pos + outputlen)) {
 				EXITERRNO(3, "h_add");
+			}
 		}
 
 		for (size_t j = 0; j < maps[i].pos2lblcount; j++) {
 			const char *s = maps[i].pos2lbl[j].lbl;
 			size_t pos    = maps[i].pos2lbl[j].pos;
+			if (*s == '.') {
+				size_t p;
+				if (h_get2(&local, s, &p) < 0)
+					EXIT(1, "Local symbol '%s' not defined", s);
+				*(size_t *)(output + outputlen + pos) = htovbin64(fmt, p);
+				continue;
+			}
 			pos2lbl[pos2lblcount].lbl = s;
 			pos2lbl[pos2lblcount].pos = pos + outputlen;
 			pos2lblcount++;
 		}
 
-		memcpy(output + outputlen, ptr, len);
+		if (local.len > 0)
+			h_destroy(&local);
 		outputlen += len;
 	}
 
@@ -49,9 +78,11 @@ void linkobj(const char **vbins, size_t *vbinlens, size_t vbincount,
 		size_t pos;
 		if (h_get2(&lbl2pos, pos2lbl[i].lbl, &pos) < 0)
 			EXIT(1, "Symbol '%s' not defined", pos2lbl[i].lbl);
-		*(size_t *)(output + pos2lbl[i].pos) = htobe64(pos);
+		*(size_t *)(output + pos2lbl[i].pos) = htovbin64(fmt, pos);
 	}
 
+	free(pos2lbl);
+	h_destroy(&lbl2pos);
 	*_outputlen = outputlen;
 }
 
@@ -59,9 +90,20 @@ void linkobj(const char **vbins, size_t *vbinlens, size_t vbincount,
 void obj_parse(const char *bin, size_t len, char *output, size_t *outputlen,
                struct lblmap *map)
 {
+	if (len < 4)
+		EXIT(1, "Object is too short");
+	int isobj;
+	int fmt = vbin_magic_format(*(uint32_t *)bin, &isobj);
+	if (fmt < 0 || !isobj)
+		EXIT(1, "Invalid object magic number (0x%08x)", be32toh(*(uint32_t *)bin));
+	map->format = fmt;
+
 	const char *ptr = bin + 4;
 
-	map->lbl2poscount = be32toh(*(uint32_t *)ptr);
+	map->lbl2poscount = map->lbl2poscap = be32toh(*(uint32_t *)ptr);
+	map->lbl2pos = malloc(map->lbl2poscap * sizeof *map->lbl2pos);
+	if (map->lbl2pos == NULL && map->lbl2poscap > 0)
+		EXITERRNO(3, "malloc");
 	ptr += 4;
 	for (size_t i = 0; i < map->lbl2poscount; i++) {
 		uint8_t strl = *ptr;
@@ -79,7 +121,10 @@ void obj_parse(const char *bin, size_t len, char *output, size_t *outputlen,
 		map->lbl2pos[i].pos = pos;
 	}
 
-	map->pos2lblcount = be32toh(*(uint32_t *)ptr);
+	map->pos2lblcount = map->pos2lblcap = be32toh(*(uint32_t *)ptr);
+	map->pos2lbl = malloc(map->pos2lblcap * sizeof *map->pos2lbl);
+	if (map->pos2lbl == NULL && map->pos2lblcap > 0)
+		EXITERRNO(3, "malloc");
 	ptr += 4;
 	for (size_t i = 0; i < map->pos2lblcount; i++) {
 		uint8_t strl = *ptr;
@@ -359,7 +359,10 @@ static int _unroll(struct branch **ba, size_t *bac, size_t *i)
 int optimize_func_branches(func f)
 {
 	FDEBUG("Applying branch optimization");
-	struct branch b[256];
+	// Every line starts at most one new block
+	struct branch *b = malloc((f->linecount + 2) * sizeof *b);
+	if (b == NULL)
+		EXITERRNO(3, "Failed to allocate blocks");
 	size_t bc = 0;
 	struct hashtbl labels;
 	h_create(&labels, 4);
@@ -460,7 +463,9 @@ int optimize_func_branches(func f)
 	}
 
 	// Optimization time!
-	struct branch *bn[2048];
+	struct branch **bn = malloc((bc + 1) * 2 * sizeof *bn);
+	if (bn == NULL)
+		EXITERRNO(3, "Failed to allocate blocks");
 	size_t bnc = 0;
 	for (size_t i = 0; i < bc; i++)
 		bn[bnc++] = &b[i];
@@ -494,5 +499,8 @@ int optimize_func_branches(func f)
 		}
 	}
 
+	free(bn);
+	free(b);
+	h_destroy(&labels);
 	return haschanged;
 }
@@ -0,0 +1,106 @@
+#include "optimize/free.h"
+#include <stdlib.h>
+#include <string.h>
+#include "func.h"
+#include "util.h"
+
+
+/**
+ * Returns whether the line is the result of a heap allocation.
+ */
+static int _is_alloc(union func_line_all_p fl)
+{
+	return fl.line->type == FUNC && fl.f->var != NULL &&
+	       fl.f->argcount == 1 &&
+	       (streq(fl.f->name, "alloc") || streq(fl.f->name, "__alloc"));
+}
+
+
+/**
+ * Find the line at which the block allocated at line i dies. This is either
+ * a destroy or a return statement in the same basic block. If the pointer
+ * escapes (i.e. it is copied, passed to a function, stored in memory or
+ * returned) before that point or the block ends early, -1 is returned.
+ */
+static size_t _find_end(func f, size_t i)
+{
+	union func_line_all_p fl = { .line = f->lines[i] };
+	const char *v = fl.f->var;
+	for (size_t k = i + 1; k < f->linecount; k++) {
+		fl.line = f->lines[k];
+		switch (fl.line->type) {
+		case DESTROY:
+			if (streq(fl.d->var, v))
+				return k;
+			break;
+		case RETURN:
+			if (fl.r->val != NULL && streq(fl.r->val, v))
+				return -1;
+			return k;
+		case ASSIGN:
+			if (streq(fl.a->var, v) || streq(fl.a->value, v))
+				return -1;
+			break;
+		case FUNC:
+			if (fl.f->var != NULL && streq(fl.f->var, v))
+				return -1;
+			for (size_t j = 0; j < fl.f->argcount; j++) {
+				if (streq(fl.f->args[j], v))
+					return -1;
+			}
+			break;
+		case MATH:
+			if (streq(fl.m->x, v))
+				return -1;
+			// Only loads don't let the pointer escape
+			if (fl.m->op == MATH_LOADAT) {
+				if (fl.m->z != NULL && streq(fl.m->z, v))
+					return -1;
+			} else if (streq(fl.m->y, v) ||
+			           (fl.m->z != NULL && streq(fl.m->z, v))) {
+				return -1;
+			}
+			break;
+		case STORE:
+			if (streq(fl.s->val, v) ||
+			    (fl.s->index != NULL && streq(fl.s->index, v)))
+				return -1;
+			break;
+		case DECLARE:
+		case NONE:
+			break;
+		default:
+			// Anything else may be a branch, a throw or inline assembly
+			return -1;
+		}
+	}
+	return -1;
+}
+
+
+/**
+ * Insert calls to __free for heap blocks whose lifetime is known, i.e. the
+ * pointer doesn't escape and the block dies in the same basic block in which
+ * it is allocated.
+ */
+int optimize_func_free(func f)
+{
+	int changed = 0;
+	for (size_t i = 0; i < f->linecount; i++) {
+		union func_line_all_p fl = { .line = f->lines[i] };
+		if (!_is_alloc(fl))
+			continue;
+		size_t k = _find_end(f, i);
+		if (k == -1)
+			continue;
+		DEBUG("Freeing '%s' at line %lu", fl.f->var, k);
+		const char *args[1] = { fl.f->var };
+		line_function(f, NULL, "__free", 1, args);
+		struct func_line *l = f->lines[f->linecount - 1];
+		memmove(f->lines + k + 1, f->lines + k,
+		        (f->linecount - 1 - k) * sizeof *f->lines);
+		f->lines[k] = l;
+		changed = 1;
+	}
+	return changed;
+}
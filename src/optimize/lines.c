@@ -4,28 +4,375 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include "arena.h"
 #include "func.h"
 #include "hashtbl.h"
+#include "report.h"
 #include "util.h"
 
 
 enum optimize_lines_options optimize_lines_options;
 
 
-#define REMOVEAT(x) do {					\
-	f->linecount--;						\
-	memmove(f->lines + (x), f->lines + (x) + 1,		\
-	        (f->linecount - (x)) * sizeof f->lines[(x)]);	\
-} while (0)
+/**
+ * The lines of a function while it is being optimized.
+ *
+ * Lines are linked in order through their slot in f->lines. Removing a line
+ * unlinks it and clears its slot instead of shifting all lines after it. The
+ * array is compacted once the optimizations are done.
+ *
+ * Only lines on the worklist are visited. When a line changes, the lines that
+ * may be optimized because of it are put back on the worklist: its neighbours,
+ * the previous and next line that use the same variables or labels and, if it
+ * is a branch, the assignments before it. Lines after the one being visited
+ * are visited in the same round, lines before it in the next round.
+ *
+ * The def-use chains map each variable and label to the slots of the lines
+ * that use it. The chains aren't updated when a name disappears from a line,
+ * so every slot in them has to be checked.
+ *
+ * Small functions don't have chains and simply have all their lines visited
+ * again after a change, which is cheaper than tracking what depends on it.
+ */
+struct lines {
+	func f;
+	size_t count;
+	size_t *next, *prev;
+	uint64_t *now, *later;
+	size_t words;
+	size_t current;
+	int chains;
+	struct hashtbl names;
+	struct uses {
+		size_t *slots;
+		size_t count, capacity;
+	} *uses;
+	size_t usecount, usecapacity;
+};
+
+#define END	((size_t)-1)
+
+// Patterns span up to four lines
+#define WINDOW	3
+
+// It's cheaper to walk the lines than a long chain, as variables that are
+// used often tend to be used close to each other
+#define SHORTCHAIN	64
+
+#define SMALLFUNC	256
+
+// A function call has at most 255 arguments and a variable
+#define MAXNAMES	256
+
+
+/**
+ * Stores the variables and labels used by a line in n and returns how many
+ * there are.
+ */
+static size_t _names(struct func_line *line, const char **n)
+{
+	union func_line_all_p l = { .line = line };
+	size_t k = 0;
+	switch (line->type) {
+	case ASSIGN:
+		n[k++] = l.a->var;
+		n[k++] = l.a->value;
+		break;
+	case ASM:
+		for (size_t j = 0; j < l.as->incount; j++)
+			n[k++] = l.as->invars[j];
+		for (size_t j = 0; j < l.as->outcount; j++)
+			n[k++] = l.as->outvars[j];
+		break;
+	case DECLARE:
+	case DESTROY:
+		n[k++] = l.d->var;
+		break;
+	case FUNC:
+		n[k++] = l.f->var;
+		for (size_t j = 0; j < l.f->argcount; j++)
+			n[k++] = l.f->args[j];
+		break;
+	case GOTO:
+		n[k++] = l.g->label;
+		break;
+	case IF:
+		n[k++] = l.i->var;
+		n[k++] = l.i->label;
+		break;
+	case LABEL:
+		n[k++] = l.l->label;
+		break;
+	case MATH:
+		n[k++] = l.m->x;
+		n[k++] = l.m->y;
+		n[k++] = l.m->z;
+		break;
+	case RETURN:
+		n[k++] = l.r->val;
+		break;
+	case STORE:
+		n[k++] = l.s->var;
+		n[k++] = l.s->val;
+		n[k++] = l.s->index;
+		break;
+	default:
+		break;
+	}
+	// Constants don't need to be tracked
+	size_t m = 0;
+	for (size_t j = 0; j < k; j++) {
+		if (n[j] != NULL && *n[j] != 0 && !isnum(*n[j]))
+			n[m++] = n[j];
+	}
+	return m;
+}
+
+
+static int _mentions(struct func_line *line, const char *name)
+{
+	const char *n[MAXNAMES];
+	size_t k = _names(line, n);
+	for (size_t j = 0; j < k; j++) {
+		if (streq(n[j], name))
+			return 1;
+	}
+	return 0;
+}
+
+
+static struct uses *_uses(struct lines *c, const char *name, int create)
+{
+	size_t i;
+	if (h_get2(&c->names, name, &i) == 0)
+		return &c->uses[i];
+	if (!create)
+		return NULL;
+	if (c->usecount >= c->usecapacity) {
+		c->usecapacity = c->usecapacity * 2 + 16;
+		c->uses = realloc(c->uses, c->usecapacity * sizeof *c->uses);
+		if (c->uses == NULL)
+			EXITERRNO(3, "Failed to grow def-use chains");
+	}
+	i = c->usecount++;
+	c->uses[i] = (struct uses){ NULL, 0, 0 };
+	if (h_add(&c->names, name, i) < 0)
+		EXIT(3, "Failed to add def-use chain");
+	return &c->uses[i];
+}
+
+
+/**
+ * Adds a line to the chains of the names it uses.
+ */
+static void _register(struct lines *c, size_t s)
+{
+	if (!c->chains)
+		return;
+	const char *n[MAXNAMES];
+	size_t k = _names(c->f->lines[s], n);
+	for (size_t j = 0; j < k; j++) {
+		struct uses *u = _uses(c, n[j], 1);
+		if (u->count > 0 && u->slots[u->count - 1] == s)
+			continue;
+		if (u->count >= u->capacity) {
+			u->capacity = u->capacity * 2 + 4;
+			u->slots = realloc(u->slots, u->capacity * sizeof *u->slots);
+			if (u->slots == NULL)
+				EXITERRNO(3, "Failed to grow def-use chain");
+		}
+		u->slots[u->count++] = s;
+	}
+}
+
+
+static void _queue(struct lines *c, size_t s)
+{
+	if (s == END || c->f->lines[s] == NULL)
+		return;
+	uint64_t *b = s > c->current ? c->now : c->later;
+	b[s / 64] |= 1UL << (s % 64);
+}
+
+
+/**
+ * Puts the closest lines before and after slot s that use name on the
+ * worklist. The closest slots in a short chain are used as is, it doesn't
+ * matter if a line is put on the worklist needlessly.
+ */
+static void _queue_users(struct lines *c, size_t s, const char *name)
+{
+	struct uses *u = _uses(c, name, 0);
+	if (u == NULL)
+		return;
+	if (u->count > SHORTCHAIN) {
+		size_t k;
+		for (k = c->prev[s]; k != END && !_mentions(c->f->lines[k], name); k = c->prev[k])
+			;
+		_queue(c, k);
+		for (k = c->next[s]; k != END && !_mentions(c->f->lines[k], name); k = c->next[k])
+			;
+		_queue(c, k);
+		return;
+	}
+	size_t p = END, n = END;
+	for (size_t j = 0; j < u->count; j++) {
+		size_t k = u->slots[j];
+		if (c->f->lines[k] == NULL)
+			continue;
+		if (k < s && (p == END || k > p))
+			p = k;
+		else if (k > s && k < n)
+			n = k;
+	}
+	_queue(c, p);
+	_queue(c, n);
+}
+
+
+/**
+ * Puts the lines that may be optimized because line s changed on the
+ * worklist. If the change removes names from the line, this has to be called
+ * before the change too.
+ */
+static void _touch(struct lines *c, size_t s)
+{
+	func f = c->f;
+	size_t p = s, n = s;
+	if (!c->chains) {
+		for (size_t w = 0; w < c->words; w++) {
+			c->later[w] = -1;
+			if (w > c->current / 64)
+				c->now[w] = -1;
+		}
+		c->now[c->current / 64] |= -2UL << (c->current % 64);
+		if (c->count % 64 != 0) {
+			c->now  [c->words - 1] &= (1UL << (c->count % 64)) - 1;
+			c->later[c->words - 1] &= (1UL << (c->count % 64)) - 1;
+		}
+		return;
+	}
+	_queue(c, s);
+	for (size_t k = 0; k < WINDOW; k++) {
+		if (p != END)
+			_queue(c, p = c->prev[p]);
+		if (n != END)
+			_queue(c, n = c->next[n]);
+	}
+
+	const char *names[MAXNAMES];
+	size_t k = _names(f->lines[s], names);
+	for (size_t j = 0; j < k; j++)
+		_queue_users(c, s, names[j]);
+
+	// If statements skip declares and destroys to find a goto
+	for (p = c->prev[s]; p != END; p = c->prev[p]) {
+		if (f->lines[p]->type != DECLARE && f->lines[p]->type != DESTROY) {
+			_queue(c, p);
+			break;
+		}
+	}
+
+	// Assignments are assumed to be used by the first branch after them
+	if (f->lines[s]->type == IF || f->lines[s]->type == GOTO) {
+		for (p = c->prev[s]; p != END; p = c->prev[p]) {
+			if (f->lines[p]->type == IF || f->lines[p]->type == GOTO)
+				break;
+			_queue(c, p);
+		}
+	}
+}
+
+
+/**
+ * Must be called after a line has been modified or replaced.
+ */
+static void _changed(struct lines *c, size_t s)
+{
+	_register(c, s);
+	_touch(c, s);
+}
+
+
+static void _remove(struct lines *c, size_t s)
+{
+	func f = c->f;
+	_touch(c, s);
+	if (c->prev[s] != END)
+		c->next[c->prev[s]] = c->next[s];
+	if (c->next[s] != END)
+		c->prev[c->next[s]] = c->prev[s];
+	f->lines[s] = NULL;
+	f->linecount--;
+}
 
-// x inclusive, y exclusive
-#define REMOVERANGE(x, y) do {					\
-	assert((y) >= (x));					\
-	memmove(f->lines + (x), f->lines + (y),			\
-	        (f->linecount - (y)) * sizeof f->lines[(x)]);	\
-	f->linecount -= (y) - (x);				\
-} while (0)
 
+/**
+ * Returns the slot n lines after s or END if there is no such line.
+ */
+static size_t _after(struct lines *c, size_t s, size_t n)
+{
+	while (n-- > 0 && s != END)
+		s = c->next[s];
+	return s;
+}
+
+
+static size_t _before(struct lines *c, size_t s, size_t n)
+{
+	while (n-- > 0 && s != END)
+		s = c->prev[s];
+	return s;
+}
+
+
+static int _cmp_slot(const void *a, const void *b)
+{
+	size_t x = *(const size_t *)a, y = *(const size_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Returns the slots after s of the lines that use v or w in order. The array
+ * has to be freed.
+ */
+static size_t *_users_after(struct lines *c, size_t s, const char *v, const char *w, size_t *count)
+{
+	size_t n, k = 0, *r;
+	if (!c->chains) {
+		r = malloc((c->count + 1) * sizeof *r);
+		if (r == NULL)
+			EXITERRNO(3, "Failed to allocate users");
+		for (size_t j = c->next[s]; j != END; j = c->next[j]) {
+			if (_mentions(c->f->lines[j], v) || _mentions(c->f->lines[j], w))
+				r[k++] = j;
+		}
+		*count = k;
+		return r;
+	}
+	struct uses *uv = _uses(c, v, 0), *uw = _uses(c, w, 0);
+	n = (uv != NULL ? uv->count : 0) + (uw != NULL ? uw->count : 0);
+	r = malloc((n + 1) * sizeof *r);
+	if (r == NULL)
+		EXITERRNO(3, "Failed to allocate users");
+	for (size_t j = 0; uv != NULL && j < uv->count; j++) {
+		if (uv->slots[j] > s && c->f->lines[uv->slots[j]] != NULL)
+			r[k++] = uv->slots[j];
+	}
+	for (size_t j = 0; uw != NULL && j < uw->count; j++) {
+		if (uw->slots[j] > s && c->f->lines[uw->slots[j]] != NULL)
+			r[k++] = uw->slots[j];
+	}
+	qsort(r, k, sizeof *r, _cmp_slot);
+	n = 0;
+	for (size_t j = 0; j < k; j++) {
+		if (n == 0 || r[n - 1] != r[j])
+			r[n++] = r[j];
+	}
+	*count = n;
+	return r;
+}
 
 
 
@@ -34,10 +381,11 @@ enum optimize_lines_options optimize_lines_options;
  * overwritten before it is used.
  * This also works for math and function assignments.
  */
-static int _unused_assign(struct func *f, size_t *i, struct hashtbl *h_const)
+static int _unused_assign(struct lines *c, size_t i, struct hashtbl *h_const)
 {
+	func f = c->f;
 	const char *v;
-	union func_line_all_p l = { .line = f->lines[*i] };
+	union func_line_all_p l = { .line = f->lines[i] };
 	int isfunc;
 
 	// Determine how to extract needed variable based on line type
@@ -53,7 +401,7 @@ static int _unused_assign(struct func *f, size_t *i, struct hashtbl *h_const)
 	// TODO handle structs properly
 	if (strchr(v, '@') != NULL)
 		return 0;
-	for (size_t k = *i + 1; k < f->linecount; k++) {
+	for (size_t k = c->next[i]; k != END; k = c->next[k]) {
 		l.line = f->lines[k];
 		switch (l.line->type) {
 		case ASSIGN:
@@ -62,6 +410,12 @@ static int _unused_assign(struct func *f, size_t *i, struct hashtbl *h_const)
 			if (streq(v, l.a->var))
 				goto notused;
 			break;
+		case ASM:
+			for (size_t j = 0; j < l.as->incount; j++) {
+				if (streq(v, l.as->invars[j]))
+					goto used;
+			}
+			break;
 		case GOTO:
 		case IF:
 			// Assume used for now
@@ -97,10 +451,11 @@ static int _unused_assign(struct func *f, size_t *i, struct hashtbl *h_const)
 	}
 notused:
 	if (isfunc) {
-		l.line   = f->lines[*i];
+		_touch(c, i);
+		l.line   = f->lines[i];
 		l.f->var = NULL;
 	} else {
-		REMOVEAT(*i);
+		_remove(c, i);
 	}
 	return 1;
 used:
@@ -108,105 +463,27 @@ used:
 }
 
 
-/**
- * TODO: Labels & goto statements should also be checked
- * Move a destroy statement as much up as possible without altering program
- * behaviour to potentially free up registers and make other optimizations
- * feasible.
- */
-static int _early_destroy(struct func *f, size_t *i)
-{
-	// Find the last occurence of the variable
-	size_t lastk  = *i;
-	struct func_line_declare *dl = (struct func_line_declare *)f->lines[*i];
-	union  func_line_all_p    fl;
-	const char *v = dl->var;
-	for (size_t k = lastk + 1; k < f->linecount; k++) {
-		fl.line = f->lines[k];
-		switch(fl.line->type) {
-		case ASSIGN:
-			if (streq(v, fl.a->value) || streq(v, fl.a->var))
-				lastk = k;
-			break;
-		case DECLARE:
-			if (streq(v, fl.d->var)) {
-				// This shouldn't happen before a destroy statement is encountered
-				ERROR("Double declare for variable '%s'", v);
-				abort();
-			}
-			break;
-		case DESTROY:
-			if (streq(v, fl.d->var)) {
-				// Can the destroy statement be moved up?
-				if (lastk + 1 != k) {
-					REMOVEAT(k);
-					goto move_destroy;
-				} else {
-					goto already_destroyed;
-				}
-			}
-			break;
-		case FUNC:
-			if (fl.f->var != NULL && streq(v, fl.f->var)) {
-				lastk = k;
-			} else {
-				for (size_t p = 0; p < fl.f->argcount; p++) {
-					if (streq(v, fl.f->args[p])) {
-						lastk = k;
-						break;
-					}
-				}
-			}
-			break;
-		case IF:
-			if (streq(v, fl.i->var))
-				lastk = k;
-			break;
-		case MATH:
-			if (streq(v, fl.m->x) || streq(v, fl.m->y) ||
-			    (fl.m->z != NULL && streq(v, fl.m->z))) {
-				lastk = k;
-			}
-			break;
-		default:
-			break;
-		}
-	}
-	// No destroy line found, so create one
-	fl.line       = calloc(sizeof *fl.d, 1);
-	fl.line->type = DESTROY;
-	fl.d->var     = (char *)v;
-move_destroy:
-	memmove(f->lines + lastk + 2, f->lines + lastk + 1,
-		(f->linecount - lastk - 1) * sizeof *f->lines);
-	f->linecount++;
-	f->lines[lastk + 1] = fl.line;
-	return 1;
-already_destroyed:
-	return 0;
-}
-
-
 /**
  * Replace if statements that use constant values with goto statements or remove
  * them altogether.
  */
-static int _constant_if(struct func *f, size_t *i, struct hashtbl *h_const)
+static int _constant_if(struct lines *c, size_t i, struct hashtbl *h_const)
 {
 	size_t j;
-	union func_line_all_p fl = { .line = f->lines[*i] };
+	union func_line_all_p fl = { .line = c->f->lines[i] };
 	if (isnum(*fl.i->var) || h_get2(h_const, fl.i->var, &j) != -1) {
 		if (isnum(*fl.i->var))
 			j = atoi(fl.i->var);
 		if ((j == 0) == fl.i->inv) {
 			const char *lbl = fl.i->label;
 			struct func_line_goto *g;
-			g            = calloc(sizeof *fl.g, 1);
+			g            = arena_alloc(&unit_arena, sizeof *fl.g);
 			g->type = GOTO;
 			g->label     = lbl;
-			f->lines[*i] = (struct func_line *)g;
+			c->f->lines[i] = (struct func_line *)g;
+			_changed(c, i);
 		} else {
-			REMOVEAT(*i);
+			_remove(c, i);
 		}
 		return 1;
 	}
@@ -218,9 +495,9 @@ static int _constant_if(struct func *f, size_t *i, struct hashtbl *h_const)
  * Replace (usually) slow 'mod' and 'div' instructions with faster 'and' or
  * 'rshift' instructions if feasible.
  */
-static int _fast_div(struct func *f, size_t *i)
+static int _fast_div(struct lines *c, size_t i)
 {
-	union func_line_all_p fl = { .line = f->lines[*i] };
+	union func_line_all_p fl = { .line = c->f->lines[i] };
 	if (fl.m->z != NULL && isnum(*fl.m->z)) {
 		if (fl.m->op == MATH_DIV) {
 			size_t n = 0, l;
@@ -234,7 +511,8 @@ static int _fast_div(struct func *f, size_t *i)
 			}
 			if (n == 1) {
 				fl.m->op = MATH_RSHIFT;
-				fl.m->z  = strprintf("%lu", l);
+				fl.m->z  = internf("%lu", l);
+				_changed(c, i);
 				return 1;
 			}
 		} else if (fl.m->op == MATH_MOD) {
@@ -247,7 +525,8 @@ static int _fast_div(struct func *f, size_t *i)
 			}
 			if (n == 1) {
 				fl.m->op = MATH_AND;
-				fl.m->z  = strprintf("0x%lx", oz - 1);
+				fl.m->z  = internf("0x%lx", oz - 1);
+				_changed(c, i);
 				return 1;
 			}
 		}
@@ -260,9 +539,9 @@ static int _fast_div(struct func *f, size_t *i)
  * Replace math statements that are effectively the same as assignments
  * with 'assign' statements.
  */
-static int _nop_math(struct func *f, size_t *i)
+static int _nop_math(struct lines *c, size_t i)
 {
-	struct func_line_math *l = (struct func_line_math *)f->lines[*i];
+	struct func_line_math *l = (struct func_line_math *)c->f->lines[i];
 	if (l->op == MATH_ADD) {
 		if (!streq(l->z, "0"))
 			return 0;
@@ -280,11 +559,12 @@ static int _nop_math(struct func *f, size_t *i)
 	}
 	const char *var = l->x,
 	           *val = l->y;
-	struct func_line_assign *a = calloc(sizeof *a, 1);
+	struct func_line_assign *a = arena_alloc(&unit_arena, sizeof *a);
 	a->type  = ASSIGN;
 	a->var   = l->x;
 	a->value = l->y;
-	f->lines[*i] = (struct func_line *)a;
+	c->f->lines[i] = (struct func_line *)a;
+	_changed(c, i);
 	return 1;
 }
 
@@ -298,22 +578,27 @@ static int _nop_math(struct func *f, size_t *i)
  * In this case x can as well be replaced by y since it effectively takes over it's role.
  * If a second declare would clash with the replaced variable that variable gets a suffix.
  */
-static int _substitute_var(struct func *f, size_t *i)
+static int _substitute_var(struct lines *c, size_t i)
 {
-	if (*i >= f->linecount - 2)
+	func f = c->f;
+	size_t i1 = _after(c, i, 1), i2 = _after(c, i, 2);
+	if (i2 == END)
 		return 0;
-	union func_line_all_p fl0 = { .line = f->lines[*i + 0] },
-	                      fl1 = { .line = f->lines[*i + 1] },
-	                      fl2 = { .line = f->lines[*i + 2] };
+	union func_line_all_p fl0 = { .line = f->lines[i ] },
+	                      fl1 = { .line = f->lines[i1] },
+	                      fl2 = { .line = f->lines[i2] };
 	if (fl1.line->type == ASSIGN  &&
 	    fl2.line->type == DESTROY) {
 		if (streq(fl0.d->var, fl1.a->var) &&
 		    streq(fl1.a->value, fl2.d->var)) {
 			const char *v = fl0.d->var, *w = fl2.d->var;
-			const char *u = strprintf("%s_s", w);
-			f->lines[*i] = f->lines[*i + 1];
-			REMOVERANGE(*i, *i + 3);
-			for (size_t j = *i; j < f->linecount; j++) {
+			const char *u = internf("%s_s", w);
+			_remove(c, i);
+			_remove(c, i1);
+			_remove(c, i2);
+			size_t n, *users = _users_after(c, i2, v, w, &n);
+			for (size_t k = 0; k < n; k++) {
+				size_t j = users[k];
 				union func_line_all_p l = { .line = f->lines[j] };
 				switch (l.line->type) {
 				case ASSIGN:
@@ -353,7 +638,7 @@ static int _substitute_var(struct func *f, size_t *i)
 					else if (streq(l.m->x, w))
 						l.m->x = u;
 					if (streq(l.m->y, v))
-						l.m->x = w;
+						l.m->y = w;
 					else if (streq(l.m->y, w))
 						l.m->y = u;
 					if (l.m->z != NULL) {
@@ -383,6 +668,20 @@ static int _substitute_var(struct func *f, size_t *i)
 					else if (streq(l.r->val, w))
 						l.r->val = u;
 					break;
+				case ASM:
+					for (size_t k = 0; k < l.as->incount; k++) {
+						if (streq(l.as->invars[k], v))
+							l.as->invars[k] = w;
+						else if (streq(l.as->invars[k], w))
+							l.as->invars[k] = u;
+					}
+					for (size_t k = 0; k < l.as->outcount; k++) {
+						if (streq(l.as->outvars[k], v))
+							l.as->outvars[k] = w;
+						else if (streq(l.as->outvars[k], w))
+							l.as->outvars[k] = u;
+					}
+					break;
 				case GOTO:
 				case LABEL:
 					break;
@@ -390,6 +689,9 @@ static int _substitute_var(struct func *f, size_t *i)
 					EXIT(3, "Unknown line type (%d)", l.line->type);
 				}
 			}
+			for (size_t k = 0; k < n; k++)
+				_changed(c, users[k]);
+			free(users);
 			return 1;
 		}
 	}
@@ -402,19 +704,21 @@ static int _substitute_var(struct func *f, size_t *i)
  * This only applies if the variable is destroyed before the inversion has
  * side effects.
  */
-static int _inverse_math_if(struct func *f, size_t *i)
+static int _inverse_math_if(struct lines *c, size_t i)
 {
-	if (*i >= f->linecount - 2)
+	func f = c->f;
+	size_t i1 = _after(c, i, 1), i2 = _after(c, i, 2);
+	if (i2 == END)
 		return 0;
-	union func_line_all_p fl0 = { .line = f->lines[*i + 0] },
-	                      fl1 = { .line = f->lines[*i + 1] },
-	                      fl2 = { .line = f->lines[*i + 2] };
+	union func_line_all_p fl0 = { .line = f->lines[i ] },
+	                      fl1 = { .line = f->lines[i1] },
+	                      fl2 = { .line = f->lines[i2] };
 	if (fl0.m->op == MATH_INV &&
 	    fl1.line->type == IF &&
 	    fl2.line->type == DESTROY) {
 		if (streq(fl0.m->x, fl1.i->var) && streq(fl1.i->var, fl2.d->var)) {
 			fl1.i->inv = !fl1.i->inv;
-			REMOVEAT(*i);
+			_remove(c, i);
 			return 1;
 		}
 	}
@@ -429,14 +733,17 @@ static int _inverse_math_if(struct func *f, size_t *i)
  * In such cases the temporary variable can be removed and the assignee used
  * directly.
  */
-static int _substitute_temp_var(struct func *f, size_t *i)
+static int _substitute_temp_var(struct lines *c, size_t i)
 {
-	if (*i >= f->linecount - 3)
+	func f = c->f;
+	size_t i1 = _after(c, i, 1), i2 = _after(c, i, 2), i3 = _after(c, i, 3);
+	if (i3 == END)
 		return 0;
-	union func_line_all_p fl0 = { .line = f->lines[*i + 0] },
-	                      fl1 = { .line = f->lines[*i + 1] },
-	                      fl2 = { .line = f->lines[*i + 2] },
-	                      fl3 = { .line = f->lines[*i + 3] };
+	union func_line_all_p fl0 = { .line = f->lines[i ] },
+	                      fl1 = { .line = f->lines[i1] },
+	                      fl2 = { .line = f->lines[i2] },
+	                      fl3 = { .line = f->lines[i3] };
+	size_t keep;
 	if (fl3.line->type == DESTROY &&
 	    streq(fl0.d->var, fl3.d->var)) {
 		if (fl1.line->type == ASSIGN &&
@@ -444,23 +751,30 @@ static int _substitute_temp_var(struct func *f, size_t *i)
 		    streq(fl0.d->var, fl1.a->var)      &&
 		    streq(fl0.d->var, fl2.i->var)) {
 			fl2.i->var = fl1.a->value;
-			f->lines[*i] = fl2.line;
+			keep = i2;
 		} else if (fl1.line->type == MATH   &&
 		           fl2.line->type == ASSIGN &&
 		           streq(fl0.d->var, fl1.m->x)        &&
 			   streq(fl0.d->var, fl2.a->value)) {
 			fl1.m->x = fl2.a->var;
-			f->lines[*i] = fl1.line;
+			keep = i1;
 		} else if (fl1.line->type == FUNC   && 
 		           fl2.line->type == ASSIGN &&
 		           streq(fl0.d->var, fl1.f->var)      &&
 			   streq(fl0.d->var, fl2.a->value)) {
 			fl1.f->var = fl2.a->var;
-			f->lines[*i] = fl1.line;
+			keep = i1;
 		} else {
 			return 0;
 		}
-		REMOVERANGE(*i + 1, *i + 4);
+		// Keep the line in its slot and remove the others around it
+		if (keep != i1)
+			_remove(c, i1);
+		if (keep != i2)
+			_remove(c, i2);
+		_remove(c, i);
+		_remove(c, i3);
+		_changed(c, keep);
 		return 1;
 	}
 	return 0;
@@ -470,18 +784,20 @@ static int _substitute_temp_var(struct func *f, size_t *i)
 /**
  * Remove redundant inversions by simply inverting the if statement
  */
-static int _invert_if(struct func *f, size_t *i)
+static int _invert_if(struct lines *c, size_t i)
 {
-	struct func_line_math *m = (struct func_line_math *)f->lines[*i];
+	func f = c->f;
+	struct func_line_math *m = (struct func_line_math *)f->lines[i];
 	if (m->op == MATH_INV && streq(m->x, m->y)) {
-		for (size_t j = *i + 1; j < f->linecount - 1; j++) {
-			union func_line_all_p l0 = { .line = f->lines[j + 0] },
-					      l1 = { .line = f->lines[j + 1] };
+		for (size_t j = c->next[i]; j != END && c->next[j] != END; j = c->next[j]) {
+			union func_line_all_p l0 = { .line = f->lines[j] },
+					      l1 = { .line = f->lines[c->next[j]] };
 			if (l0.line->type == IF &&
 			    l1.line->type == DESTROY &&
 			    streq(m->x, l0.i->var) && streq(m->x, l1.d->var)) {
 				l0.i->inv = !l0.i->inv;
-				REMOVEAT(*i);
+				_changed(c, j);
+				_remove(c, i);
 				return 1;
 			}
 		}
@@ -494,11 +810,15 @@ static int _invert_if(struct func *f, size_t *i)
  * Remove unused (private) labels
  * Labels prevent some optimizations, hence removing them is still potentially useful
  */
-static int _unused_label(func f, size_t *i)
+static int _unused_label(struct lines *c, size_t i)
 {
-	const char *lbl = ((struct func_line_label *)f->lines[*i])->label;
-	for (size_t j = 0; j < f->linecount; j++) {
-		union func_line_all_p l = { .line = f->lines[j] };
+	const char *lbl = ((struct func_line_label *)c->f->lines[i])->label;
+	struct uses *u = c->chains ? _uses(c, lbl, 0) : NULL;
+	size_t n = c->chains ? (u != NULL ? u->count : 0) : c->count;
+	for (size_t j = 0; j < n; j++) {
+		union func_line_all_p l = { .line = c->f->lines[c->chains ? u->slots[j] : j] };
+		if (l.line == NULL)
+			continue;
 		if (l.line->type == GOTO) {
 			if (streq(lbl, l.g->label))
 				return 0;
@@ -507,7 +827,7 @@ static int _unused_label(func f, size_t *i)
 				return 0;
 		}
 	}
-	REMOVEAT(*i);
+	_remove(c, i);
 	return 1;
 }
 
@@ -515,9 +835,9 @@ static int _unused_label(func f, size_t *i)
 /**
  * Precompute math that uses constants
  */
-static int _precompute_math(func f, size_t *i)
+static int _precompute_math(struct lines *c, size_t i)
 {
-	struct func_line_math *m = (struct func_line_math *)f->lines[*i];
+	struct func_line_math *m = (struct func_line_math *)c->f->lines[i];
 	if (isnum(*m->y) && isnum(*m->z)) {
 		ssize_t x, y = atol(m->y), z = atol(m->z);
 		switch (m->op) {
@@ -529,11 +849,12 @@ static int _precompute_math(func f, size_t *i)
 		case MATH_MOD: x = y - (y / z) * z; break;
 		default: return 0; // Nevermind I guess
 		}
-		struct func_line_assign *a = malloc(sizeof *a);
+		struct func_line_assign *a = arena_alloc(&unit_arena, sizeof *a);
 		a->type = ASSIGN;
 		a->var       = m->x;
-		a->value     = strprintf("%ld", x);
-		f->lines[*i] = (struct func_line *)a;
+		a->value     = internf("%ld", x);
+		c->f->lines[i] = (struct func_line *)a;
+		_changed(c, i);
 	}
 	return 0;
 }
@@ -542,24 +863,31 @@ static int _precompute_math(func f, size_t *i)
 /**
  * Reduce the amount of temporary variables in a serie of math statements
  */
-static int _substitute_var2(func f, size_t *i)
+static int _substitute_var2(struct lines *c, size_t i)
 {
-	if (*i < 3)
+	func f = c->f;
+	size_t i2 = _before(c, i, 1), i1 = _before(c, i, 2), i0 = _before(c, i, 3);
+	if (i0 == END)
 		return 0;
-	union func_line_all_p fl3 = { .line = f->lines[*i - 0] },
-	                      fl2 = { .line = f->lines[*i - 1] },
-	                      fl1 = { .line = f->lines[*i - 2] },
-	                      fl0 = { .line = f->lines[*i - 3] };
+	union func_line_all_p fl3 = { .line = f->lines[i ] },
+	                      fl2 = { .line = f->lines[i2] },
+	                      fl1 = { .line = f->lines[i1] },
+	                      fl0 = { .line = f->lines[i0] };
 	if (fl0.line->type == MATH    &&
 	    fl1.line->type == DECLARE &&
 	    fl2.line->type == MATH    &&
 	    fl3.line->type == DESTROY &&
-	     streq(fl3.d->var, fl3.d->var)      &&
+	     streq(fl3.d->var, fl0.m->x)        &&
 	     streq(fl1.d->var, fl2.m->x)        &&
-	    (streq(fl3.d->var, fl2.m->y) || streq(fl3.d->var, fl2.m->z))) {
+	    (streq(fl3.d->var, fl2.m->y) ||
+	     (fl2.m->z != NULL && streq(fl3.d->var, fl2.m->z)))) {
 		// Exception: ignore memory operations in the second math statement
 		if (fl2.m->op == MATH_LOADAT)
 			return 0;
+		// Only one operand can be replaced
+		if (streq(fl2.m->y, fl0.m->x) &&
+		    fl2.m->z != NULL && streq(fl2.m->z, fl0.m->x))
+			return 0;
 		// Don't write the substitute if it is an argument
 		//if (streq(fl2.m->x, fl2.m
 
@@ -571,7 +899,10 @@ static int _substitute_var2(func f, size_t *i)
 		fl0.m->x = fl1.d->var;
 
 		// Swap declare and math statement
-		SWAP(struct func_line *, f->lines[*i - 2], f->lines[*i - 3]);
+		SWAP(struct func_line *, f->lines[i1], f->lines[i0]);
+		_changed(c, i0);
+		_changed(c, i1);
+		_changed(c, i2);
 		return 1;
 	}
 	return 0;
@@ -587,12 +918,13 @@ static int _substitute_var2(func f, size_t *i)
  * of a function is considered in case it's a stack allocated array. The
  * function may put data in the array).
  */
-static int _unused_declare(func f, size_t *i)
+static int _unused_declare(struct lines *c, size_t i)
 {
-	union func_line_all_p l = { .line = f->lines[*i] };
+	func f = c->f;
+	union func_line_all_p l = { .line = f->lines[i] };
 	assert(l.line->type == DECLARE);
 	const char *v = l.d->var;
-	for (size_t j = *i + 1; j < f->linecount; j++) {
+	for (size_t j = c->next[i]; j != END; j = c->next[j]) {
 		l.line = f->lines[j];
 		switch (l.line->type) {
 		case ASSIGN:
@@ -607,7 +939,7 @@ static int _unused_declare(func f, size_t *i)
 			break;
 		case DESTROY:
 			if (streq(v, l.d->var)) {
-				REMOVEAT(j);
+				_remove(c, j);
 				goto unused;
 			}
 			break;
@@ -634,7 +966,7 @@ static int _unused_declare(func f, size_t *i)
 		}
 	}
 unused:
-	REMOVEAT(*i);
+	_remove(c, i);
 	return 1;
 }
 
@@ -644,19 +976,22 @@ unused:
  * follows after (ignoring destroy and declare statements) and invert the
  * if statement.
  */
-static int _immediate_goto(func f, size_t *i)
+static int _immediate_goto(struct lines *c, size_t i)
 {
+	func f = c->f;
 	union func_line_all_p l;
 	const char *lbl;
 
-	for (size_t j = *i + 1; j < f->linecount; j++) {
+	for (size_t j = c->next[i]; j != END; j = c->next[j]) {
 		l.line = f->lines[j];
 		if (l.line->type == GOTO) {
 			lbl = l.g->label;
-			REMOVEAT(j);
-			l.line = f->lines[*i];
+			_remove(c, j);
+			_touch(c, i);
+			l.line = f->lines[i];
 			l.i->label = lbl;
 			l.i->inv   = !l.i->inv;
+			_changed(c, i);
 			return 1;
 		}
 		if (l.line->type != DECLARE &&
@@ -667,153 +1002,185 @@ static int _immediate_goto(func f, size_t *i)
 }
 
 
-#if 0
-// IDK what this does tbh
-static void _findconst(struct func *f)
+
+/**
+ * Applies an optimization and records whether it changed anything and how many
+ * lines it removed.
+ */
+#define PASS(stage, call) ({				\
+	size_t _n = f->linecount;			\
+	int _c = REPORT(stage, call);			\
+	if (_c)						\
+		report_changes(stage, _n, f->linecount);\
+	_c;						\
+})
+
+
+static void _init(struct lines *c, func f)
 {
-	struct hashtbl h;
-	h_create(&h, 16);
-	for (size_t i = 0; i < f->linecount; i++) {
-		union func_line_all_p l = { .line = f->lines[i] };
-		size_t j;
-		switch (l.line->type) {
-		case DECLARE:
-			h_add(&h, l.d->var, 0);
-			break;
-		case ASSIGN:
-			j = h_get(&h, l.a->var);
-			if (j == -1) {
-				// Is a function. Skip
-			} else if (j == 0) {
-				// Not assigned yet, so potentially constant
-				h_rem(&h, l.d->var);
-				h_add(&h, l.d->var, i);
-				l.a->cons = 1;
-			} else {
-				// Reassigned, so not constant
-				((struct func_line_assign *)f->lines[j])->cons = 0;
-				h_rem(&h, l.a->var);
-			}
-			break;
-		case MATH:
-			j = h_get(&h, l.m->x);
-			if (j != -1 && j != 0) {
-				// Reassigned, so not constant
-				((struct func_line_assign *)f->lines[j])->cons = 0;
-				h_rem(&h, l.m->x);
-			}
-			break;
-		}
+	c->f       = f;
+	c->count   = f->linecount;
+	c->words   = (c->count + 63) / 64;
+	c->current = 0;
+	c->next    = malloc((c->count + 1) * sizeof *c->next);
+	c->prev    = malloc((c->count + 1) * sizeof *c->prev);
+	c->now     = calloc(c->words + 1, sizeof *c->now);
+	c->later   = calloc(c->words + 1, sizeof *c->later);
+	if (c->next == NULL || c->prev == NULL || c->now == NULL || c->later == NULL)
+		EXITERRNO(3, "Failed to allocate lines");
+	c->uses = NULL;
+	c->usecount = c->usecapacity = 0;
+	c->chains = c->count > SMALLFUNC;
+	if (c->chains)
+		h_create(&c->names, 16);
+	for (size_t i = 0; i < c->count; i++) {
+		c->next[i] = i + 1 < c->count ? i + 1 : END;
+		c->prev[i] = i > 0 ? i - 1 : END;
+		c->later[i / 64] |= 1UL << (i % 64);
+		_register(c, i);
 	}
-	for (size_t i = 0; i < f->linecount; i++) {
-		union func_line_all_p l = { .line = f->lines[i] };
-		if (l.line->type == DECLARE || l.line->type == FUNC_LINE_DESTROY) {
-			size_t j = h_get(&h, l.d->var);
-			if (j != -1 && j != 0) {
-				REMOVEAT(*i);
-			}
-		}
+}
+
+
+static int _pending(struct lines *c)
+{
+	for (size_t w = 0; w < c->words; w++) {
+		if (c->later[w] != 0)
+			return 1;
 	}
+	return 0;
 }
-#else
-#define _findconst(f) NULL
-#endif
 
 
+/**
+ * Compacts the remaining lines.
+ */
+static void _done(struct lines *c)
+{
+	func f = c->f;
+	size_t n = 0;
+	for (size_t i = 0; i < c->count; i++) {
+		if (f->lines[i] != NULL)
+			f->lines[n++] = f->lines[i];
+	}
+	assert(n == f->linecount);
+	for (size_t i = 0; i < c->usecount; i++)
+		free(c->uses[i].slots);
+	free(c->uses);
+	if (c->chains)
+		h_destroy(&c->names);
+	free(c->next);
+	free(c->prev);
+	free(c->now);
+	free(c->later);
+}
+
+
+/**
+ * Applies the optimizations to a line until one of them changes it. Returns 1
+ * if the line changed.
+ */
+static int _visit(struct lines *c, size_t i, struct hashtbl *h_const)
+{
+	func f = c->f;
+	union func_line_all_p fl = { .line = f->lines[i] };
+	switch (f->lines[i]->type) {
+	case ASSIGN:
+		// Determine if the value is a constant
+		// This is necessary for other optimizations
+		if (fl.a->cons && isnum(*fl.a->value)) {
+			size_t j = strtol(fl.a->value, NULL, 0);
+			h_add(h_const, fl.a->var, j);
+		}
+		if (optimize_lines_options & UNUSED_ASSIGN)
+			// Break if any change occured
+			if (PASS(REPORT_UNUSED_ASSIGN, _unused_assign(c, i, h_const)))
+				break;
+		return 0;
+	case DECLARE:
+		if (optimize_lines_options & SUBSTITUTE_TEMP_IF_VAR)
+			if (PASS(REPORT_SUBSTITUTE_TEMP_VAR, _substitute_temp_var(c, i)))
+				break;
+		if (optimize_lines_options & SUBSTITUTE_VAR)
+			if (PASS(REPORT_SUBSTITUTE_VAR, _substitute_var(c, i)))
+				break;
+		if (optimize_lines_options & UNUSED_DECLARE)
+			if (PASS(REPORT_UNUSED_DECLARE, _unused_declare(c, i)))
+				break;
+		return 0;
+	case DESTROY:
+		if (optimize_lines_options & SUBSTITUTE_VAR)
+			if (PASS(REPORT_SUBSTITUTE_VAR, _substitute_var2(c, i)))
+				break;
+		return 0;
+	case MATH:
+		if (optimize_lines_options & UNUSED_ASSIGN)
+			if (PASS(REPORT_UNUSED_ASSIGN, _unused_assign(c, i, h_const)))
+				break;
+		if (optimize_lines_options & INVERSE_MATH_IF)
+			if (PASS(REPORT_INVERSE_MATH_IF, _inverse_math_if(c, i)))
+				break;
+		if (optimize_lines_options & FAST_DIV)
+			if (PASS(REPORT_FAST_DIV, _fast_div(c, i)))
+				break;
+		if (optimize_lines_options & NOP_MATH)
+			if (PASS(REPORT_NOP_MATH, _nop_math(c, i)))
+				break;
+		if (optimize_lines_options & INVERT_IF)
+			if (PASS(REPORT_INVERT_IF, _invert_if(c, i)))
+				break;
+		if (optimize_lines_options & PRECOMPUTE_MATH)
+			if (PASS(REPORT_PRECOMPUTE_MATH, _precompute_math(c, i)))
+				break;
+		return 0;
+	case FUNC:
+		if (optimize_lines_options & UNUSED_ASSIGN)
+			if (PASS(REPORT_UNUSED_ASSIGN, _unused_assign(c, i, h_const)))
+				break;
+		return 0;
+	case IF:
+		if (optimize_lines_options & CONSTANT_IF)
+			if (PASS(REPORT_CONSTANT_IF, _constant_if(c, i, h_const)))
+				break;
+		if (optimize_lines_options & IMMEDIATE_GOTO)
+			if (PASS(REPORT_IMMEDIATE_GOTO, _immediate_goto(c, i)))
+				break;
+		return 0;
+	case LABEL:
+		if (optimize_lines_options & UNUSED_LABEL)
+			if (PASS(REPORT_UNUSED_LABEL, _unused_label(c, i)))
+				break;
+		return 0;
+	default:
+		return 0;
+	}
+	return 1;
+}
 
-int optimize_func_linear(struct func *f)
+
+int optimize_func_linear(struct func *f, size_t rounds)
 {
 	FDEBUG("Applying lineair optimization");
 	struct hashtbl h_const;
 	h_create(&h_const, 4);
-	// Looping works well enough
-	int changed, haschanged = 0;
+	struct lines c;
+	_init(&c, f);
+	int haschanged = 0;
 	do {
-		changed = 0;
-		if (optimize_lines_options & FINDCONST)
-			_findconst(f);
-		for (size_t i = 0; i < f->linecount; i++) {
-			union func_line_all_p fl = { .line = f->lines[i] };
-			switch (f->lines[i]->type) {
-			case ASSIGN:
-				// Determine if the value is a constant
-				// This is necessary for other optimizations
-				if (fl.a->cons && isnum(*fl.a->value)) {
-					size_t j = strtol(fl.a->value, NULL, 0);
-					h_add(&h_const, fl.a->var, j);
-				}
-				if (optimize_lines_options & UNUSED_ASSIGN)
-					// Break if any change occured
-					if (_unused_assign(f, &i, &h_const))
-						break;
-				goto nochange;
-			case DECLARE:
-				if (optimize_lines_options & SUBSTITUTE_TEMP_IF_VAR)
-					if (_substitute_temp_var(f, &i))
-						break;
-				if (optimize_lines_options & SUBSTITUTE_VAR)
-					if (_substitute_var(f, &i))
-						break;
-				// Totally broken, do not use
-				// This optimization does not take in account gotos
-				if (0 && optimize_lines_options & EARLY_DESTROY)
-					if (_early_destroy(f, &i))
-						break;
-				if (optimize_lines_options & UNUSED_DECLARE)
-					if (_unused_declare(f, &i))
-						break;
-				goto nochange;
-			case DESTROY:
-				if (optimize_lines_options & SUBSTITUTE_VAR)
-					if (_substitute_var2(f, &i))
-						break;
-				goto nochange;
-			case MATH:
-				if (optimize_lines_options & UNUSED_ASSIGN)
-					if (_unused_assign(f, &i, &h_const))
-						break;
-				if (optimize_lines_options & INVERSE_MATH_IF)
-					if (_inverse_math_if(f, &i))
-						break;
-				if (optimize_lines_options & FAST_DIV)
-					if (_fast_div(f, &i))
-						break;
-				if (optimize_lines_options & NOP_MATH)
-					if (_nop_math(f, &i))
-						break;
-				if (optimize_lines_options & INVERT_IF)
-					if (_invert_if(f, &i))
-						break;
-				if (optimize_lines_options & PRECOMPUTE_MATH)
-					if (_precompute_math(f, &i))
-						break;
-				goto nochange;
-			case FUNC:
-				if (optimize_lines_options & UNUSED_ASSIGN)
-					if (_unused_assign(f, &i, &h_const))
-						break;
-				goto nochange;
-			case IF:
-				if (optimize_lines_options & CONSTANT_IF)
-					if (_constant_if(f, &i, &h_const))
-						break;
-				if (optimize_lines_options & IMMEDIATE_GOTO)
-					if (_immediate_goto(f, &i))
-						break;
-				goto nochange;
-			case LABEL:
-				if (optimize_lines_options & UNUSED_LABEL)
-					if (_unused_label(f, &i))
-						break;
-				goto nochange;
-			default:
-				goto nochange;
+		SWAP(uint64_t *, c.now, c.later);
+		for (size_t w = 0; w < c.words; w++) {
+			while (c.now[w] != 0) {
+				size_t i = w * 64 + __builtin_ctzl(c.now[w]);
+				c.now[w] &= c.now[w] - 1;
+				if (f->lines[i] == NULL)
+					continue;
+				c.current = i;
+				haschanged |= _visit(&c, i, &h_const);
 			}
-			changed = 1;
-		nochange:;
 		}
-		haschanged |= changed;
-	} while (changed);
+	} while (_pending(&c) && --rounds != 0);
+	_done(&c);
+	h_destroy(&h_const);
 
 	return haschanged;
 }
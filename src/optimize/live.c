@@ -0,0 +1,336 @@
+#include "optimize/live.h"
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+#include "flow.h"
+#include "func.h"
+#include "optimize/lines.h"
+#include "report.h"
+#include "util.h"
+
+
+/**
+ * The lines are only changed once all optimizations are done, so the line
+ * numbers of the flow stay valid. Lines are only ever removed or made to use
+ * fewer variables in the meantime, which keeps the flow safe to query.
+ */
+struct live {
+	func f;
+	struct flow fl;
+	char *removed;
+	size_t removedcount;
+	struct insert {
+		size_t after;
+		struct func_line *line;
+	} *ins;
+	size_t inscount, inscap;
+};
+
+
+static void _insert(struct live *c, size_t after, struct func_line *line)
+{
+	if (c->inscount >= c->inscap) {
+		c->inscap = c->inscap * 2 + 8;
+		c->ins = realloc(c->ins, c->inscap * sizeof *c->ins);
+		if (c->ins == NULL)
+			EXITERRNO(3, "Failed to reallocate insertions");
+	}
+	c->ins[c->inscount].after = after;
+	c->ins[c->inscount].line  = line;
+	c->inscount++;
+}
+
+
+static void _remove(struct live *c, size_t i)
+{
+	if (!c->removed[i]) {
+		c->removed[i] = 1;
+		c->removedcount++;
+	}
+}
+
+
+/**
+ * Returns the constant the variable used at line i has or NULL if it isn't
+ * the same constant on every path to it.
+ */
+static const char *_const(struct flow *fl, size_t i, const char *var)
+{
+	size_t v = flow_var(fl, var);
+	if (v == FLOW_NONE)
+		return NULL;
+	const size_t *defs;
+	size_t n = flow_defs(fl, i, v, &defs);
+	const char *c = NULL;
+	for (size_t k = 0; k < n; k++) {
+		if (defs[k] == FLOW_ENTRY)
+			return NULL;
+		union func_line_all_p l = { .line = fl->f->lines[defs[k]] };
+		if (l.line->type != ASSIGN || !isnum(*l.a->value) ||
+		    (c != NULL && !streq(c, l.a->value)))
+			return NULL;
+		c = l.a->value;
+	}
+	return c;
+}
+
+
+/**
+ * Replace variables with a constant if every assignment that reaches them
+ * assigns that constant. At most one operand of a math line is replaced so
+ * the code generator never has to deal with two constants.
+ */
+static int _findconst(struct live *c)
+{
+	func f = c->f;
+	struct flow *fl = &c->fl;
+	const char *k;
+	int changed = 0;
+	for (size_t i = 0; i < f->linecount; i++) {
+		union func_line_all_p l = { .line = f->lines[i] };
+		switch (l.line->type) {
+		case ASSIGN:
+			if ((k = _const(fl, i, l.a->value)) != NULL) {
+				l.a->value = k;
+				changed = 1;
+			}
+			break;
+		case FUNC:
+			for (size_t j = 0; j < l.f->argcount; j++) {
+				if ((k = _const(fl, i, l.f->args[j])) != NULL) {
+					l.f->args[j] = k;
+					changed = 1;
+				}
+			}
+			break;
+		case IF:
+			if ((k = _const(fl, i, l.i->var)) != NULL) {
+				l.i->var = k;
+				changed = 1;
+			}
+			break;
+		case MATH:
+			if (l.m->op == MATH_LOADAT || isnum(*l.m->y) ||
+			    (l.m->z != NULL && isnum(*l.m->z)))
+				break;
+			if ((k = _const(fl, i, l.m->y)) != NULL) {
+				l.m->y = k;
+				changed = 1;
+			} else if (l.m->z != NULL &&
+			           (k = _const(fl, i, l.m->z)) != NULL) {
+				l.m->z = k;
+				changed = 1;
+			}
+			break;
+		case RETURN:
+			if (l.r->val != NULL &&
+			    (k = _const(fl, i, l.r->val)) != NULL) {
+				l.r->val = k;
+				changed = 1;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return changed;
+}
+
+
+/**
+ * Remove assignments to variables that aren't live afterwards. Function calls
+ * are kept for their side effects but their result is discarded.
+ */
+static int _unused_assign(struct live *c)
+{
+	func f = c->f;
+	struct flow *fl = &c->fl;
+	size_t w = fl->words;
+	uint64_t *live = malloc((w + 1) * sizeof *live);
+	if (live == NULL)
+		EXITERRNO(3, "Failed to allocate live variables");
+	int changed = 0;
+	for (size_t b = fl->blockcount; b-- > 0; ) {
+		memcpy(live, fl->out + b * w, w * sizeof *live);
+		for (size_t i = fl->blocks[b].end; i-- > fl->blocks[b].start; ) {
+			union func_line_all_p l = { .line = f->lines[i] };
+			const char *v;
+			switch (l.line->type) {
+			case ASSIGN: v = l.a->var; break;
+			case FUNC  : v = l.f->var; break;
+			case MATH  : v = l.m->x  ; break;
+			default    : v = NULL    ; break;
+			}
+			size_t k = flow_var(fl, v);
+			if (k != FLOW_NONE && !flow_has(live, k)) {
+				FDEBUG("'%s' is not used after line %lu", v, i);
+				changed = 1;
+				if (l.line->type == FUNC) {
+					l.f->var = NULL;
+				} else {
+					// The operands aren't used either now
+					_remove(c, i);
+					continue;
+				}
+			}
+			flow_step(fl, i, live);
+		}
+	}
+	free(live);
+	return changed;
+}
+
+
+static int _falls_through(struct func_line *l)
+{
+	return l->type != GOTO && l->type != RETURN && l->type != THROW;
+}
+
+
+/**
+ * Destroy variables right after the line that mentions them last if they
+ * aren't live afterwards. Other optimizations look for a destroy right after
+ * a variable is used, which lines2func only emits for temporary variables of
+ * conditions.
+ *
+ * The optimizations on lines assume that a variable isn't mentioned after it
+ * is destroyed until it is declared again, so the line has to be the last one
+ * that mentions it in that sense too, not only along the paths from it.
+ */
+static int _early_destroy(struct live *c)
+{
+	func f = c->f;
+	struct flow *fl = &c->fl;
+	size_t w = fl->words;
+	uint64_t *live = malloc((w + 1) * sizeof *live);
+	char *mentioned = calloc(fl->varcount + 1, 1);
+	size_t *destroy = malloc((fl->varcount + 1) * sizeof *destroy);
+	if (live == NULL || mentioned == NULL || destroy == NULL)
+		EXITERRNO(3, "Failed to allocate live variables");
+	memset(destroy, 0xff, fl->varcount * sizeof *destroy);
+	int changed = 0;
+	for (size_t b = fl->blockcount; b-- > 0; ) {
+		memcpy(live, fl->out + b * w, w * sizeof *live);
+		for (size_t i = fl->blocks[b].end; i-- > fl->blocks[b].start; ) {
+			union func_line_all_p l = { .line = f->lines[i] };
+			if (c->removed[i])
+				continue;
+			if (l.line->type == DESTROY) {
+				size_t v = flow_var(fl, l.d->var);
+				if (v != FLOW_NONE && !mentioned[v])
+					destroy[v] = i;
+				continue;
+			}
+			if (l.line->type == DECLARE) {
+				size_t v = flow_var(fl, l.d->var);
+				if (v != FLOW_NONE) {
+					mentioned[v] = 0;
+					destroy[v] = -1;
+				}
+				continue;
+			}
+			// A destroy is already in place if only destroys follow
+			size_t next = i + 1;
+			while (next < f->linecount &&
+			       (c->removed[next] || f->lines[next]->type == DESTROY))
+				next++;
+			for (int d = 0; d < 2; d++) {
+				size_t *vars = d ? fl->defvars : fl->usevars;
+				size_t *off  = d ? fl->defoff  : fl->useoff;
+				for (size_t k = off[i]; k < off[i + 1]; k++) {
+					size_t v = vars[k];
+					if (mentioned[v])
+						continue;
+					mentioned[v] = 1;
+					if (flow_has(live, v) || !_falls_through(l.line) ||
+					    destroy[v] < next)
+						continue;
+					FDEBUG("Destroying '%s' after line %lu", fl->names[v], i);
+					if (destroy[v] != -1)
+						_remove(c, destroy[v]);
+					union func_line_all_p dl;
+					dl.line       = arena_alloc(&unit_arena, sizeof *dl.d);
+					dl.line->type = DESTROY;
+					dl.d->type    = NULL;
+					dl.d->var     = fl->names[v];
+					_insert(c, i, dl.line);
+					destroy[v] = -1;
+					changed = 1;
+				}
+			}
+			flow_step(fl, i, live);
+		}
+	}
+	free(live);
+	free(mentioned);
+	free(destroy);
+	return changed;
+}
+
+
+/**
+ * Removes and inserts the lines the optimizations asked for.
+ */
+static void _apply(struct live *c)
+{
+	func f = c->f;
+	if (c->removedcount == 0 && c->inscount == 0)
+		return;
+	size_t cap = f->linecount - c->removedcount + c->inscount + 1;
+	struct func_line **lines = malloc(cap * sizeof *lines);
+	if (lines == NULL)
+		EXITERRNO(3, "Failed to allocate lines");
+	// Insertions were made from the last line to the first
+	size_t n = 0, p = c->inscount;
+	for (size_t i = 0; i < f->linecount; i++) {
+		if (!c->removed[i])
+			lines[n++] = f->lines[i];
+		for ( ; p > 0 && c->ins[p - 1].after == i; p--)
+			lines[n++] = c->ins[p - 1].line;
+	}
+	free(f->lines);
+	f->lines     = lines;
+	f->linecount = n;
+	f->linecap   = cap;
+}
+
+
+#define PASS(stage, call) ({					\
+	size_t _n = c.f->linecount - c.removedcount + c.inscount;	\
+	int _c = REPORT(stage, call);				\
+	if (_c)							\
+		report_changes(stage, _n,			\
+		               c.f->linecount - c.removedcount + c.inscount);\
+	_c;							\
+})
+
+
+int optimize_func_live(func f)
+{
+	enum optimize_lines_options o = optimize_lines_options;
+	if (!(o & (FINDCONST | UNUSED_ASSIGN | EARLY_DESTROY)) || f->linecount == 0)
+		return 0;
+	FDEBUG("Applying flow optimizations");
+
+	struct live c = { .f = f };
+	c.removed = calloc(f->linecount, 1);
+	if (c.removed == NULL)
+		EXITERRNO(3, "Failed to allocate lines");
+	REPORT(REPORT_FLOW, (flow_build(&c.fl, f), 0));
+
+	int changed = 0;
+	if (o & FINDCONST) {
+		REPORT(REPORT_FLOW, (flow_chains(&c.fl), 0));
+		changed |= PASS(REPORT_FINDCONST, _findconst(&c));
+	}
+	if (o & UNUSED_ASSIGN)
+		changed |= PASS(REPORT_UNUSED_ASSIGN, _unused_assign(&c));
+	if (o & EARLY_DESTROY)
+		changed |= PASS(REPORT_EARLY_DESTROY, _early_destroy(&c));
+
+	_apply(&c);
+	flow_free(&c.fl);
+	free(c.removed);
+	free(c.ins);
+	return changed;
+}
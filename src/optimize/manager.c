@@ -0,0 +1,128 @@
+#include "optimize/manager.h"
+#include <string.h>
+#include "optimize/branch.h"
+#include "optimize/free.h"
+#include "optimize/lines.h"
+#include "optimize/live.h"
+#include "optimize/vasm.h"
+#include "report.h"
+#include "util.h"
+
+
+size_t optimize_iterations;
+
+
+static const struct {
+	const char *name;
+	enum optimize_lines_options option;
+} passes[] = {
+	{ "unused-assign"  , UNUSED_ASSIGN          },
+	{ "early-destroy"  , EARLY_DESTROY          },
+	{ "constant-if"    , CONSTANT_IF            },
+	{ "fast-div"       , FAST_DIV               },
+	{ "nop-math"       , NOP_MATH               },
+	{ "substitute-var" , SUBSTITUTE_VAR         },
+	{ "inverse-math-if", INVERSE_MATH_IF        },
+	{ "substitute-temp", SUBSTITUTE_TEMP_IF_VAR },
+	{ "findconst"      , FINDCONST              },
+	{ "invert-if"      , INVERT_IF              },
+	{ "unused-label"   , UNUSED_LABEL           },
+	{ "precompute-math", PRECOMPUTE_MATH        },
+	{ "unused-declare" , UNUSED_DECLARE         },
+	{ "immediate-goto" , IMMEDIATE_GOTO         },
+	{ "branches"       , BRANCHES               },
+	{ "free"           , INSERT_FREE            },
+	{ "vasm"           , OPTIMIZE_VASM          },
+};
+
+
+// func2vasm can't copy structs yet, it needs the temporary variable of a
+// struct initialization to be substituted
+#define O0	(SUBSTITUTE_TEMP_IF_VAR)
+// Cheap optimizations that don't need many iterations to be useful
+#define O1	(O0 | FINDCONST | UNUSED_ASSIGN | CONSTANT_IF | NOP_MATH | \
+		 PRECOMPUTE_MATH | IMMEDIATE_GOTO | UNUSED_LABEL | \
+		 INSERT_FREE | OPTIMIZE_VASM)
+#define O2	(O1 | FAST_DIV | SUBSTITUTE_VAR | INVERSE_MATH_IF | \
+		 INVERT_IF | BRANCHES | EARLY_DESTROY)
+
+
+
+void optimize_level(int level)
+{
+	switch (level) {
+	case 0:
+		optimize_lines_options = O0;
+		optimize_iterations = 1;
+		break;
+	case 1:
+		optimize_lines_options = O1;
+		optimize_iterations = 2;
+		break;
+	default:
+		// There is no -O3 yet: _unused_declare doesn't understand struct
+		// members, so it has to be enabled explicitly
+		optimize_lines_options = O2;
+		optimize_iterations = 0;
+		break;
+	}
+}
+
+
+int optimize_pass(const char *name, int enable)
+{
+	for (size_t i = 0; i < sizeof passes / sizeof *passes; i++) {
+		if (streq(passes[i].name, name)) {
+			if (enable)
+				optimize_lines_options |= passes[i].option;
+			else
+				optimize_lines_options &= ~passes[i].option;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+void optimize_print_passes(void)
+{
+	for (size_t i = 0; i < sizeof passes / sizeof *passes; i++)
+		ERROR("                %s", passes[i].name);
+}
+
+
+void optimize_func(func f)
+{
+	// With a budget every iteration is a single pass over the lines,
+	// otherwise the lines settle before the branches are looked at
+	size_t n = optimize_iterations;
+	int changed;
+	do {
+		changed = optimize_func_linear(f, n > 0 ? 1 : 0);
+		if (optimize_lines_options & BRANCHES) {
+			size_t c = f->linecount;
+			if (REPORT(REPORT_BRANCHES, optimize_func_branches(f))) {
+				report_changes(REPORT_BRANCHES, c, f->linecount);
+				changed = 1;
+			}
+		}
+		if (optimize_func_live(f))
+			changed = 1;
+	} while (changed && --n != 0);
+	if (optimize_lines_options & INSERT_FREE) {
+		size_t c = f->linecount;
+		if (REPORT(REPORT_FREE, optimize_func_free(f)))
+			report_changes(REPORT_FREE, c, f->linecount);
+	}
+}
+
+
+void optimize_vasm(union vasm_all *vasms, size_t *vasmcount)
+{
+	if (!(optimize_lines_options & OPTIMIZE_VASM))
+		return;
+	size_t c = *vasmcount;
+	REPORT(REPORT_OPTIMIZEVASM, (optimizevasm(vasms, vasmcount), 0));
+	if (*vasmcount != c)
+		report_changes(REPORT_OPTIMIZEVASM, c, *vasmcount);
+}
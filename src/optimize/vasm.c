@@ -1,5 +1,7 @@
 #include "optimize/vasm.h"
+#include <stdlib.h>
 #include <string.h>
+#include "arena.h"
 #include "vasm.h"
 #include "util.h"
 
@@ -41,6 +43,23 @@ static void _pushpop_to_mov(union vasm_all *vasms, size_t *vasmcount, size_t *i)
 			// Subroutines can change the registers to any value they like
 			return;
 		}
+		if (a.op == OP_RET || a.op == OP_JMP || a.op == OP_JZ ||
+		    a.op == OP_JNZ || a.op == OP_JP || a.op == OP_JPZ ||
+		    a.op == OP_JLT || a.op == OP_JLE || a.op == OP_JEQ ||
+		    a.op == OP_JNE) {
+			// The pop may belong to another path
+			return;
+		}
+		if (a.op == OP_PUSHM || a.op == OP_POPM) {
+			// Keep the stack accounting simple
+			return;
+		}
+		if ((get_vasm_args_type(a.op) == ARGS_TYPE_REG2    && a.r2.r0  == 31) ||
+		    (get_vasm_args_type(a.op) == ARGS_TYPE_REG3    && a.r3.r0  == 31) ||
+		    (get_vasm_args_type(a.op) == ARGS_TYPE_REG2INT && a.r2s.r0 == 31)) {
+			// The stack pointer is adjusted manually
+			return;
+		}
 		if (a.op == OP_PUSH) {
 			stackdiff++;
 		}
@@ -93,6 +112,12 @@ foundpop:
 			if (a.op == OP_SET && a.rs.r == pushr)
 				pushwritten = 1;
 			break;
+		case ARGS_TYPE_REG2INT:
+			if (a.r2s.r0 == pushr)
+				pushwritten = 1;
+			if (a.r2s.r1 == popr)
+				popused = 1;
+			break;
 		}
 		if (pushwritten && popused)
 			return;
@@ -147,6 +172,14 @@ static int optimizevasm_replace(union vasm_all *vasms, size_t *vasmcount)
 						if (a.r.r == reg)
 							goto unused;
 						break;
+					case OP_PUSHM:
+						if (strtol(a.s.s, NULL, 0) & (1L << reg))
+							goto used;
+						break;
+					case OP_POPM:
+						if (strtol(a.s.s, NULL, 0) & (1L << reg))
+							goto unused;
+						break;
 					case OP_PUSH:
 					case OP_JZ:
 					case OP_JNZ:
@@ -171,6 +204,25 @@ static int optimizevasm_replace(union vasm_all *vasms, size_t *vasmcount)
 						if (a.r3.r0 == reg)
 							goto unused;
 						break;
+					case OP_ADDI:
+					case OP_SUBI:
+					case OP_MULI:
+					case OP_ANDI:
+					case OP_LSHIFTI:
+					case OP_RSHIFTI:
+					case OP_LESSI:
+						if (a.r2s.r1 == reg)
+							goto used;
+						if (a.r2s.r0 == reg)
+							goto unused;
+						break;
+					case OP_JLT:
+					case OP_JLE:
+					case OP_JEQ:
+					case OP_JNE:
+						if (a.r2s.r0 == reg || a.r2s.r1 == reg)
+							goto used;
+						break;
 					case OP_MOV:
 					case OP_NOT:
 					case OP_INV:
@@ -247,6 +299,27 @@ static int optimizevasm_peephole3(union vasm_all *vasms, size_t *vasmcount)
 				i -= 3;
 			}
 			break;
+		case OP_JLT:
+		case OP_JLE:
+		case OP_JEQ:
+		case OP_JNE:
+			if (a1.op == OP_JMP   &&
+			    a2.op == OP_LABEL &&
+			    streq(a0.r2s.s, a2.s.s)) {
+				// a < b is the inverse of b <= a
+				switch (a0.op) {
+				case OP_JLT: a0.op = OP_JLE; SWAP(char, a0.r2s.r0, a0.r2s.r1); break;
+				case OP_JLE: a0.op = OP_JLT; SWAP(char, a0.r2s.r0, a0.r2s.r1); break;
+				case OP_JEQ: a0.op = OP_JNE; break;
+				case OP_JNE: a0.op = OP_JEQ; break;
+				}
+				a0.r2s.s = a1.s.s;
+				vasms[i] = a0;
+				(*vasmcount)--;
+				memmove(vasms + i + 1, vasms + i + 2, (*vasmcount - i) * sizeof vasms[i]);
+				i -= 3;
+			}
+			break;
 		}
 	}
 
@@ -287,6 +360,41 @@ static int optimizevasm_peephole4(union vasm_all *vasms, size_t *vasmcount)
 }
 
 
+/**
+ * Collapse runs of pushes in ascending and pops in descending register order
+ * into a single pushm or popm. This must run last as the other passes only
+ * understand single register pushes and pops.
+ */
+static int optimizevasm_pushpopm(union vasm_all *vasms, size_t *vasmcount)
+{
+	for (size_t i = 0; i < *vasmcount; i++) {
+		union vasm_all a = vasms[i];
+		if (a.op != OP_PUSH && a.op != OP_POP)
+			continue;
+		int op = a.op, last = a.r.r;
+		uint32_t mask = 1U << last;
+		size_t j;
+		for (j = i + 1; j < *vasmcount; j++) {
+			union vasm_all b = vasms[j];
+			if (b.op != op || b.r.r == 31)
+				break;
+			if (op == OP_PUSH ? b.r.r <= last : b.r.r >= last)
+				break;
+			last = b.r.r;
+			mask |= 1U << last;
+		}
+		if (j - i < 2 || (mask & (1U << 31)))
+			continue;
+		vasms[i].s.op = op == OP_PUSH ? OP_PUSHM : OP_POPM;
+		vasms[i].s.s  = internf("0x%x", mask);
+		memmove(vasms + i + 1, vasms + j, (*vasmcount - j) * sizeof *vasms);
+		*vasmcount -= j - i - 1;
+	}
+
+	return 0;
+}
+
+
 void optimizevasm(union vasm_all *vasm, size_t *vasmcount) {
 	for (size_t i = 0; i < 5; i++) {
 		optimizevasm_replace  (vasm, vasmcount);
@@ -294,4 +402,5 @@ void optimizevasm(union vasm_all *vasm, size_t *vasmcount) {
 		optimizevasm_peephole3(vasm, vasmcount);
 		optimizevasm_peephole4(vasm, vasmcount);
 	}
+	optimizevasm_pushpopm(vasm, vasmcount);
 }
@@ -0,0 +1,125 @@
+#include "parallel.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdalign.h>
+#include "util.h"
+
+
+size_t parallel_threads = 1;
+
+
+/**
+ * The slice of a worker is packed as (start << 32) | end so that both the
+ * owner and thieves can update it with a single CAS.
+ */
+struct worker {
+	alignas(64) uint64_t slice;
+	pthread_t thread;
+	struct pool *pool;
+};
+
+
+struct pool {
+	struct worker *workers;
+	size_t count;
+	void (*fn)(size_t i, void *arg);
+	void *arg;
+};
+
+
+#define SLICE(s, e)	(((uint64_t)(s) << 32) | (uint32_t)(e))
+#define START(x)	((uint32_t)((x) >> 32))
+#define END(x)		((uint32_t)(x))
+
+
+static int _pop(struct worker *w, size_t *i)
+{
+	uint64_t o = __atomic_load_n(&w->slice, __ATOMIC_ACQUIRE);
+	while (START(o) < END(o)) {
+		if (__sync_bool_compare_and_swap(&w->slice, o, SLICE(START(o) + 1, END(o)))) {
+			*i = START(o);
+			return 0;
+		}
+		o = __atomic_load_n(&w->slice, __ATOMIC_ACQUIRE);
+	}
+	return -1;
+}
+
+
+static int _steal(struct worker *w)
+{
+	struct pool *p = w->pool;
+	while (1) {
+		// Pick the worker with the most work left
+		struct worker *v = NULL;
+		uint64_t o = 0;
+		for (size_t i = 0; i < p->count; i++) {
+			uint64_t s = __atomic_load_n(&p->workers[i].slice, __ATOMIC_ACQUIRE);
+			if (START(s) < END(s) && END(s) - START(s) > END(o) - START(o)) {
+				v = &p->workers[i];
+				o = s;
+			}
+		}
+		if (v == NULL)
+			return -1;
+		// Take the upper half
+		uint32_t m = END(o) - (END(o) - START(o) + 1) / 2;
+		if (__sync_bool_compare_and_swap(&v->slice, o, SLICE(START(o), m))) {
+			// Nobody steals from an empty slice, so no CAS is needed
+			__atomic_store_n(&w->slice, SLICE(m, END(o)), __ATOMIC_RELEASE);
+			return 0;
+		}
+	}
+}
+
+
+static void *_work(void *arg)
+{
+	struct worker *w = arg;
+	struct pool *p = w->pool;
+	do {
+		size_t i;
+		while (_pop(w, &i) == 0)
+			p->fn(i, p->arg);
+	} while (_steal(w) == 0);
+	return NULL;
+}
+
+
+void parallel_for(size_t count, void (*fn)(size_t i, void *arg), void *arg)
+{
+	size_t n = parallel_threads < count ? parallel_threads : count;
+	if (n <= 1) {
+		for (size_t i = 0; i < count; i++)
+			fn(i, arg);
+		return;
+	}
+	if (count > UINT32_MAX)
+		EXIT(1, "Too many items to run in parallel (%lu)", count);
+
+	struct pool p = { .count = n, .fn = fn, .arg = arg };
+	p.workers = aligned_alloc(alignof(struct worker), n * sizeof *p.workers);
+	if (p.workers == NULL)
+		EXITERRNO(3, "Failed to allocate workers");
+	for (size_t i = 0; i < n; i++) {
+		p.workers[i].slice = SLICE(count * i / n, count * (i + 1) / n);
+		p.workers[i].pool  = &p;
+	}
+	// The calling thread is the first worker
+	for (size_t i = 1; i < n; i++) {
+		int e = pthread_create(&p.workers[i].thread, NULL, _work, &p.workers[i]);
+		if (e != 0)
+			EXIT(3, "Failed to create thread: %s", strerror(e));
+	}
+	_work(&p.workers[0]);
+	for (size_t i = 1; i < n; i++)
+		pthread_join(p.workers[i].thread, NULL);
+	free(p.workers);
+}
+
+
+size_t parallel_cpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
@@ -0,0 +1,255 @@
+#include "report.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+
+int report_enabled;
+
+
+static const char *stagenames[REPORT_STAGES] = {
+	[REPORT_TEXT2LINES         ] = "text2lines",
+	[REPORT_FINDBOUNDARIES     ] = "_findboundaries",
+	[REPORT_LINES2FUNC         ] = "lines2func",
+	[REPORT_FLOW               ] = "flow_build",
+	[REPORT_FINDCONST          ] = "_findconst",
+	[REPORT_UNUSED_ASSIGN      ] = "_unused_assign",
+	[REPORT_SUBSTITUTE_TEMP_VAR] = "_substitute_temp_var",
+	[REPORT_SUBSTITUTE_VAR     ] = "_substitute_var",
+	[REPORT_UNUSED_DECLARE     ] = "_unused_declare",
+	[REPORT_INVERSE_MATH_IF    ] = "_inverse_math_if",
+	[REPORT_FAST_DIV           ] = "_fast_div",
+	[REPORT_NOP_MATH           ] = "_nop_math",
+	[REPORT_INVERT_IF          ] = "_invert_if",
+	[REPORT_PRECOMPUTE_MATH    ] = "_precompute_math",
+	[REPORT_CONSTANT_IF        ] = "_constant_if",
+	[REPORT_IMMEDIATE_GOTO     ] = "_immediate_goto",
+	[REPORT_UNUSED_LABEL       ] = "_unused_label",
+	[REPORT_EARLY_DESTROY      ] = "_early_destroy",
+	[REPORT_BRANCHES           ] = "optimize_func_branches",
+	[REPORT_FREE               ] = "optimize_func_free",
+	[REPORT_FUNC2VASM          ] = "func2vasm",
+	[REPORT_OPTIMIZEVASM       ] = "optimizevasm",
+	[REPORT_VASM2VBIN          ] = "vasm2vbin",
+	[REPORT_LINKOBJ            ] = "linkobj",
+};
+
+
+static const struct {
+	const char *name;
+	enum report_stage first, last;
+} phases[REPORT_PHASES] = {
+	[REPORT_PREPROCESS] = { "preprocess", REPORT_TEXT2LINES    , REPORT_TEXT2LINES   },
+	[REPORT_IMMEDIATE ] = { "immediate" , REPORT_FINDBOUNDARIES, REPORT_FREE         },
+	[REPORT_ASSEMBLY  ] = { "assembly"  , REPORT_FUNC2VASM     , REPORT_OPTIMIZEVASM },
+	[REPORT_BINARY    ] = { "binary"    , REPORT_VASM2VBIN     , REPORT_VASM2VBIN    },
+	[REPORT_LINK      ] = { "link"      , REPORT_LINKOBJ       , REPORT_LINKOBJ      },
+};
+
+
+struct counters {
+	uint64_t ns, calls, allocs, bytes;
+	uint64_t changes;
+	int64_t removed;
+	// Peak resident memory of the process in KiB
+	long peak;
+};
+
+
+static struct counters stages[REPORT_STAGES];
+static struct counters phasestats[REPORT_PHASES];
+
+static struct {
+	const char *name;
+	uint64_t ns[REPORT_STAGES];
+	uint64_t total;
+} *funcs;
+static size_t funccount;
+static thread_local size_t current = -1;
+
+// Allocations of the current thread and of all threads
+static thread_local struct counters allocs;
+static struct counters totalallocs;
+
+
+
+void report_alloc(size_t size)
+{
+	if (!report_enabled)
+		return;
+	allocs.allocs++;
+	allocs.bytes += size;
+	__sync_fetch_and_add(&totalallocs.allocs, 1);
+	__sync_fetch_and_add(&totalallocs.bytes, size);
+}
+
+
+static long _peak(void)
+{
+	struct rusage r;
+	getrusage(RUSAGE_SELF, &r);
+	return r.ru_maxrss;
+}
+
+
+static void _max(long *p, long v)
+{
+	long o = __atomic_load_n(p, __ATOMIC_RELAXED);
+	while (o < v && !__sync_bool_compare_and_swap(p, o, v))
+		o = __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+
+static uint64_t _now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000UL + t.tv_nsec;
+}
+
+
+void report_begin(struct report_mark *m)
+{
+	if (!report_enabled)
+		return;
+	m->ns     = _now();
+	m->allocs = allocs.allocs;
+	m->bytes  = allocs.bytes;
+	m->totalallocs = __atomic_load_n(&totalallocs.allocs, __ATOMIC_RELAXED);
+	m->totalbytes  = __atomic_load_n(&totalallocs.bytes , __ATOMIC_RELAXED);
+}
+
+
+void report_stage(enum report_stage s, const struct report_mark *m)
+{
+	if (!report_enabled)
+		return;
+	uint64_t ns = _now() - m->ns;
+	__sync_fetch_and_add(&stages[s].ns, ns);
+	__sync_fetch_and_add(&stages[s].calls, 1);
+	__sync_fetch_and_add(&stages[s].allocs, allocs.allocs - m->allocs);
+	__sync_fetch_and_add(&stages[s].bytes, allocs.bytes - m->bytes);
+	_max(&stages[s].peak, _peak());
+	if (current < funccount) {
+		funcs[current].ns[s] += ns;
+		funcs[current].total += ns;
+	}
+}
+
+
+void report_phase(enum report_phase p, const struct report_mark *m)
+{
+	if (!report_enabled)
+		return;
+	phasestats[p].ns     += _now() - m->ns;
+	phasestats[p].calls++;
+	phasestats[p].allocs += __atomic_load_n(&totalallocs.allocs, __ATOMIC_RELAXED) -
+	                        m->totalallocs;
+	phasestats[p].bytes  += __atomic_load_n(&totalallocs.bytes , __ATOMIC_RELAXED) -
+	                        m->totalbytes;
+	_max(&phasestats[p].peak, _peak());
+}
+
+
+void report_changes(enum report_stage s, size_t before, size_t after)
+{
+	if (!report_enabled)
+		return;
+	__sync_fetch_and_add(&stages[s].changes, 1);
+	__sync_fetch_and_add(&stages[s].removed, (int64_t)before - (int64_t)after);
+}
+
+
+static int _is_pass(enum report_stage s)
+{
+	return (s >= REPORT_FINDCONST && s <= REPORT_FREE) || s == REPORT_OPTIMIZEVASM;
+}
+
+
+void report_funcs(size_t count)
+{
+	if (!report_enabled)
+		return;
+	funcs = calloc(count, sizeof *funcs);
+	if (funcs == NULL)
+		EXITERRNO(3, "Failed to allocate function report");
+	funccount = count;
+}
+
+
+void report_func(size_t i, const char *name)
+{
+	current = i;
+	if (i < funccount)
+		funcs[i].name = name;
+}
+
+
+static int _cmp_total(const void *a, const void *b)
+{
+	uint64_t x = ((const typeof(*funcs) *)a)->total,
+	         y = ((const typeof(*funcs) *)b)->total;
+	return x < y ? 1 : x > y ? -1 : 0;
+}
+
+
+#define MS(ns)	((double)(ns) / 1e6)
+
+
+void report_print(FILE *f)
+{
+	if (!report_enabled)
+		return;
+
+	uint64_t wall = 0;
+	for (size_t p = 0; p < REPORT_PHASES; p++)
+		wall += phasestats[p].ns;
+
+	fprintf(f, "\nTime report (stages are summed over all threads)\n");
+	fprintf(f, "Peak is the resident memory of the process when a stage "
+	        "last ended\n");
+	fprintf(f, "Allocations are those from the arenas of the compiler\n\n");
+	fprintf(f, "  %-26s %10s %6s %10s %10s %10s %10s %10s %10s\n",
+	        "phase / stage", "time (ms)", "%", "calls", "allocs", "KiB",
+	        "peak KiB", "changes", "removed");
+	for (size_t p = 0; p < REPORT_PHASES; p++) {
+		struct counters *c = &phasestats[p];
+		if (c->calls == 0)
+			continue;
+		fprintf(f, "  %-26s %10.2f %6.1f %10s %10lu %10lu %10ld\n",
+		        phases[p].name, MS(c->ns), 100.0 * c->ns / wall, "",
+		        c->allocs, c->bytes / 1024, c->peak);
+		for (size_t s = phases[p].first; s <= phases[p].last; s++) {
+			struct counters *c = &stages[s];
+			if (c->calls == 0)
+				continue;
+			fprintf(f, "    %-24s %10.2f %6.1f %10lu %10lu %10lu %10ld",
+			        stagenames[s], MS(c->ns), 100.0 * c->ns / wall,
+			        c->calls, c->allocs, c->bytes / 1024, c->peak);
+			if (_is_pass(s))
+				fprintf(f, " %10lu %10ld", c->changes, c->removed);
+			fprintf(f, "\n");
+		}
+	}
+	fprintf(f, "  %-26s %10.2f\n", "total", MS(wall));
+
+	if (funccount == 0)
+		return;
+	qsort(funcs, funccount, sizeof *funcs, _cmp_total);
+	size_t n = funccount < 10 ? funccount : 10;
+	fprintf(f, "\nSlowest functions (ms)\n\n");
+	fprintf(f, "  %-26s %10s %10s %10s %10s %10s %10s\n", "function", "total",
+	        "lines2func", "optimize", "func2vasm", "optimizevasm", "vasm2vbin");
+	for (size_t i = 0; i < n; i++) {
+		uint64_t opt = 0;
+		for (size_t s = REPORT_FLOW; s <= REPORT_FREE; s++)
+			opt += funcs[i].ns[s];
+		fprintf(f, "  %-26s %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		        funcs[i].name != NULL ? funcs[i].name : "?",
+		        MS(funcs[i].total), MS(funcs[i].ns[REPORT_LINES2FUNC]),
+		        MS(opt), MS(funcs[i].ns[REPORT_FUNC2VASM]),
+		        MS(funcs[i].ns[REPORT_OPTIMIZEVASM]),
+		        MS(funcs[i].ns[REPORT_VASM2VBIN]));
+	}
+}
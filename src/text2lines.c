@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
 #include "lines.h"
 #include "util.h"
 
@@ -110,6 +112,12 @@ static char *_trim(const char *text, pos2_t **pos, size_t *poscount)
 	d++, c++;		\
 } while (0)
 #define MARK do {		\
+	if (pc >= pl) {		\
+		pl *= 2;	\
+		p = realloc(p, pl * sizeof *p);	\
+		if (p == NULL)	\
+			EXITERRNO(3, "Failed to grow position list");	\
+	}			\
 	p[pc].p.c = s - buf;	\
 	p[pc].p.x = x;		\
 	p[pc].p.y = y;		\
@@ -166,15 +174,19 @@ static char *_trim(const char *text, pos2_t **pos, size_t *poscount)
 
 static pos2_t _getpos(pos2_t *p, size_t pc, size_t c)
 {
-	for (size_t i = pc; i > 0; i--) {
-		pos2_t n = p[i - 1];
-		if (n.c <= c) {
-		       	n.p.x += c - n.c;
-			//n.p.c  = c;
-			return n;
-		}
+	// Find the last entry that starts at or before c
+	size_t l = 0, h = pc;
+	while (l < h) {
+		size_t m = (l + h) / 2;
+		if (p[m].c <= c)
+			l = m + 1;
+		else
+			h = m;
 	}
-	assert(0);
+	assert(l > 0);
+	pos2_t n = p[l - 1];
+	n.p.x += c - n.c;
+	return n;
 }
 
 
@@ -242,7 +254,18 @@ int text2lines(const char *text,
 	char **strs   = malloc(ss * sizeof *strs);
 	const char *c = text;
 
+	// A source line expands to at most two lines
+#define RESERVE(n) do {						\
+	if (lc + (n) > ls) {					\
+		ls = (lc + (n)) * 2;				\
+		lns = realloc(lns, ls * sizeof *lns);		\
+		if (lns == NULL)				\
+			EXITERRNO(3, "Failed to grow line list");\
+	}							\
+} while (0)
+
 	while (*c != 0) {
+		RESERVE(2);
 
 		// Skip comments
 		if (*c == '#') {
@@ -272,7 +295,7 @@ int text2lines(const char *text,
 			}
 			pos2_t p = _getpos(pos, poscount, s - text);
 			b[l] = 0;
-			lns[lc].text = strclone(b);
+			lns[lc].text = arena_strndup(&unit_arena, b, SIZE_MAX);
 			lns[lc].pos  = p.p;
 			lc++;
 		}
@@ -318,7 +341,7 @@ int text2lines(const char *text,
 			} while (*e++ != 0);
 			// TODO: braces
 			pos2_t p = _getpos(pos, poscount, *c);
-			lns[lc].text = strprintf("%s = %s %c (%s)", buf0, buf0, op, buf1);
+			lns[lc].text = arena_printf(&unit_arena, "%s = %s %c (%s)", buf0, buf0, op, buf1);
 			lns[lc].pos  = p.p;
 			free(buf0);
 			free(buf1);
@@ -355,10 +378,7 @@ int text2lines(const char *text,
 					continue;
 				*ptr++ = ' ';
 			} else if (*c == '"') {
-				memcpy(ptr, "_str_", sizeof ".str_" - 1);
-				ptr += sizeof ".str_" - 1;
-				*ptr = '0' + sc;
-				ptr++;
+				ptr += sprintf(ptr, "_str_%lu", sc);
 				char buf2[4096], *ptr2 = buf2;
 				c++;
 				while (*c != '"') {
@@ -367,6 +387,12 @@ int text2lines(const char *text,
 					c++;
 				}
 				c++;
+				if (sc >= ss) {
+					ss *= 2;
+					strs = realloc(strs, ss * sizeof *strs);
+					if (strs == NULL)
+						EXITERRNO(3, "Failed to grow string list");
+				}
 				char *p = malloc(ptr2 - buf2 + 1);
 				memcpy(p, buf2, ptr2 - buf2);
 				p[ptr2 - buf2] = 0;
@@ -409,7 +435,7 @@ int text2lines(const char *text,
 			}
 		}
 		*ptr = 0;
-		const char *m = strclone(buf);
+		const char *m = arena_strndup(&unit_arena, buf, SIZE_MAX);
 		pos2_t p = _getpos(pos, poscount, d - text);
 		lns[lc].text = m;
 		lns[lc].pos  = p.p;
@@ -425,10 +451,11 @@ int text2lines(const char *text,
 		// Split 'elif' into 'else' and 'if' and append 'end'
 		if (strstart(t, "elif ")) {
 			const char *s = t;
+			RESERVE(2);
 			memmove(lns + i + 1, lns + i, (lc - i) * sizeof *lns);
 			lc++;
 			lns[i++].text = "else";
-			lns[i++].text = strclone(s + strlen("el"));
+			lns[i++].text = arena_strndup(&unit_arena, s + strlen("el"), SIZE_MAX);
 			size_t j = i;
 			while (!streq(lns[j].text, "end"))
 				j++;
@@ -443,10 +470,12 @@ int text2lines(const char *text,
 			size_t l = strlen(t) - 2;
 			if (l == 0)
 				EXIT(1, "%s must be preceded by a variable name", t);
-			lns[i].text = strprintf("%.*s = %.*s %c 1", l, t, l, t, t[l]);
+			lns[i].text = arena_printf(&unit_arena, "%.*s = %.*s %c 1", l, t, l, t, t[l]);
 		}
 	}
 
+#undef RESERVE
+
 	*linecount   = lc;
 	*lines       = realloc(lns , lc * sizeof *lns);
 	*stringcount = sc;
@@ -10,12 +10,6 @@
 #define FUNC_LINE_FUNC   1
 
 
-struct lblpos lbl2pos[4096];
-size_t lbl2poscount;
-struct lblpos pos2lbl[4096];
-size_t pos2lblcount;
-
-
 int getop(const char *mnem)
 {
 	char c = *mnem;
@@ -26,6 +20,10 @@ int getop(const char *mnem)
 			return OP_ADD;
 		if (streq("and", mnem))
 			return OP_AND;
+		if (streq("addi", mnem))
+			return OP_ADDI;
+		if (streq("andi", mnem))
+			return OP_ANDI;
 		break;
 	case 'c':
 		if (streq("call", mnem))
@@ -46,6 +44,18 @@ int getop(const char *mnem)
 			return OP_JZ;
 		if (streq("jnz", mnem))
 			return OP_JNZ;
+		if (streq("jp", mnem))
+			return OP_JP;
+		if (streq("jpz", mnem))
+			return OP_JPZ;
+		if (streq("jlt", mnem))
+			return OP_JLT;
+		if (streq("jle", mnem))
+			return OP_JLE;
+		if (streq("jeq", mnem))
+			return OP_JEQ;
+		if (streq("jne", mnem))
+			return OP_JNE;
 		break;
 	case 'l':
 		if (streq("ldl", mnem))
@@ -70,6 +80,10 @@ int getop(const char *mnem)
 			return OP_LESS;
 		if (streq("lesse", mnem))
 			return OP_LESSE;
+		if (streq("lshifti", mnem))
+			return OP_LSHIFTI;
+		if (streq("lessi", mnem))
+			return OP_LESSI;
 		break;
 	case 'm':
 		if (streq("mov", mnem))
@@ -78,6 +92,8 @@ int getop(const char *mnem)
 			return OP_MOD;
 		if (streq("mul", mnem))
 			return OP_MUL;
+		if (streq("muli", mnem))
+			return OP_MULI;
 		break;
 	case 'n':
 		if (streq("not", mnem))
@@ -88,6 +104,10 @@ int getop(const char *mnem)
 			return OP_PUSH;
 		if (streq("pop", mnem))
 			return OP_POP;
+		if (streq("pushm", mnem))
+			return OP_PUSHM;
+		if (streq("popm", mnem))
+			return OP_POPM;
 		break;
 	case 'r':
 		if (streq("rem", mnem))
@@ -96,6 +116,8 @@ int getop(const char *mnem)
 			return OP_RET;
 		if (streq("rshift", mnem))
 			return OP_RSHIFT;
+		if (streq("rshifti", mnem))
+			return OP_RSHIFTI;
 		break;
 	case 's':
 		if (streq("set", mnem))
@@ -126,6 +148,8 @@ int getop(const char *mnem)
 			return OP_STRBAT;
 		if (streq("sub", mnem))
 			return OP_SUB;
+		if (streq("subi", mnem))
+			return OP_SUBI;
 		if (streq("syscall", mnem))
 			return OP_SYSCALL;
 		break;
@@ -224,6 +248,7 @@ int parse_op_args(union vasm_all *v, const char *args)
 	case ARGS_TYPE_REG1:
 		REG(v->r.r);
 		break;
+	case ARGS_TYPE_INT:
 	case ARGS_TYPE_LONG:
 		STR(v->s.s);
 		break;
@@ -232,6 +257,14 @@ int parse_op_args(union vasm_all *v, const char *args)
 		SKIP;
 		STR(v->rs.s);
 		break;
+	case ARGS_TYPE_REG2INT:
+	case ARGS_TYPE_REG2LONG:
+		REG(v->r2s.r0);
+		SKIP;
+		REG(v->r2s.r1);
+		SKIP;
+		STR(v->r2s.s);
+		break;
 	case ARGS_TYPE_SPECIAL:
 		switch (v->op) {
 		// Raw (aka str)
@@ -259,7 +292,7 @@ int parse_op_args(union vasm_all *v, const char *args)
 			size_t l = ptr - start;
 			char *m  = malloc(l + 1);
 			memcpy(m, start, l);
-			m[l] = 0;
+			m[l - 1] = 0;
 			v->s.s = m;
 			break;
 		// Do nothing
@@ -275,9 +308,12 @@ int parse_op_args(union vasm_all *v, const char *args)
 }
 
 
-int text2vasm(char *buf, size_t len, union vasm_all *vasms, size_t *vasmcount_p)
+int text2vasm(char *buf, size_t len, union vasm_all **vasms_p, size_t *vasmcount_p)
 {
-	size_t vasmcount = 0;
+	size_t vasmcount = 0, vasmcap = 256;
+	union vasm_all *vasms = malloc(vasmcap * sizeof *vasms);
+	if (vasms == NULL)
+		return -1;
 
 	char *ptr = buf;
 	while (ptr - buf < len) {
@@ -310,6 +346,13 @@ int text2vasm(char *buf, size_t len, union vasm_all *vasms, size_t *vasmcount_p)
 				ptr++;
 			continue;
 		}
+		if (vasmcount >= vasmcap) {
+			vasmcap *= 2;
+			union vasm_all *v = realloc(vasms, vasmcap * sizeof *vasms);
+			if (v == NULL)
+				return -1;
+			vasms = v;
+		}
 		vasms[vasmcount].op = op;
 
 		// Check if it is a label
@@ -345,6 +388,7 @@ int text2vasm(char *buf, size_t len, union vasm_all *vasms, size_t *vasmcount_p)
 		vasmcount++;
 	}
 
+	*vasms_p     = vasms;
 	*vasmcount_p = vasmcount;
 
 	return 0;
@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
+#include "arena.h"
 #include "hashtbl.h"
 #include "util.h"
 
@@ -9,6 +11,9 @@
 static struct type *types;
 static struct hashtbl typestable;
 static size_t typescount, typescapacity;
+// The table is filled while parsing declarations and read concurrently while
+// compiling functions
+static pthread_rwlock_t typeslock = PTHREAD_RWLOCK_INITIALIZER;
 
 
 static int _add_type(const char *name, struct type_meta *m, size_t ms,
@@ -16,18 +21,41 @@ static int _add_type(const char *name, struct type_meta *m, size_t ms,
 {
 	struct type t = { .name = name, .type = type };
 	memcpy(&t.meta, m, ms);
+	pthread_rwlock_wrlock(&typeslock);
 	if (typescapacity <= typescount) {
 		if (types == NULL)
 			h_create(&typestable, 4);
 		size_t n = typescapacity * 3 / 2 + 1;
 		void  *a = realloc(types, n * sizeof *types);
-		if (a == NULL)
+		if (a == NULL) {
+			pthread_rwlock_unlock(&typeslock);
 			return -1;
+		}
 		typescapacity = n;
 		types = a;
 	}
 	types[typescount++] = t;
-	return h_add(&typestable, name, typescount - 1);
+	int r = h_add(&typestable, name, typescount - 1);
+	pthread_rwlock_unlock(&typeslock);
+	return r;
+}
+
+
+/**
+ * Copies the declared type with the given name to dest if dest is not NULL.
+ */
+static int _find_type(struct type *dest, const char *name)
+{
+	size_t i;
+	int r = -1;
+	pthread_rwlock_rdlock(&typeslock);
+	if (typescount > 0 && h_get2(&typestable, name, &i) == 0) {
+		if (dest != NULL)
+			*dest = types[i];
+		r = 0;
+	}
+	pthread_rwlock_unlock(&typeslock);
+	return r;
 }
 
 
@@ -96,8 +124,7 @@ int get_type(struct type *dest, const char *name)
 		const char *p = strchr(name, '*');
 		memcpy(ddname, name, p - name);
 		ddname[p - name] = 0;
-		size_t dummy;
-		if (typescount == 0 || h_get2(&typestable, ddname, &dummy) < 0)
+		if (_find_type(NULL, ddname) < 0)
 			return -1;
 
 		dest->name = name;
@@ -119,17 +146,14 @@ int get_type(struct type *dest, const char *name)
 		const char *p = strchr(name, '[');
 		memcpy(ddname, name, p - name);
 		ddname[p - name] = 0;
-		size_t dummy;
-		if (typescount == 0 || h_get2(&typestable, ddname, &dummy) < 0)
+		if (_find_type(NULL, ddname) < 0)
 			return -1;
 
 		dest->name = name;
 		dest->type = TYPE_ARRAY;
 	} else {
-		size_t i = 0;
-		if (typescount == 0 || h_get2(&typestable, name, &i) < 0)
+		if (_find_type(dest, name) < 0)
 			return -1;
-		*dest = types[i];
 	}
 
 	return 0;
@@ -167,7 +191,7 @@ int get_deref_type(struct type *dest, const char *name)
 	if (dname[l - 1] == ']') {
 		if (l < 3)
 			return -1;
-		dest->name = strclone(dname);
+		dest->name = intern(dname);
 		dest->type = TYPE_ARRAY;
 		struct type_meta_array *m = (void *)&dest->meta;
 		m->fixed = dname[l - 2] != '[';
@@ -182,18 +206,13 @@ int get_deref_type(struct type *dest, const char *name)
 		}
 		return 0;
 	} else if (dname[l - 1] == '*') {
-		dest->name = strclone(dname);
+		dest->name = intern(dname);
 		dest->type = TYPE_POINTER;
 		return 0;
 	}
 
 	// Get non-pointer/array type
-	size_t i;
-	if (typescount == 0 || h_get2(&typestable, dname, &i) < 0)
-		return -1;
-
-	*dest = types[i];
-	return 0;
+	return _find_type(dest, dname);
 }
 
 
@@ -267,13 +286,12 @@ int get_deref_type_size(const char *name, size_t *size)
 
 int get_member_offset(const char *parent, const char *member, size_t *offset)
 {
-	size_t i;
-	if (h_get2(&typestable, parent, &i) < 0)
+	struct type t;
+	if (_find_type(&t, parent) < 0)
 		return -1;
-	struct type *t = &types[i];
-	if (t->type != TYPE_CLASS)
+	if (t.type != TYPE_CLASS)
 		return -1;
-	struct type_meta_class *m = (void *)&t->meta;
+	struct type_meta_class *m = (void *)&t.meta;
 	size_t o = 0;
 	for (size_t j = 0; j < m->count; j++) {
 		if (streq(member, m->names[j])) {
@@ -300,13 +318,12 @@ int get_member_offset(const char *parent, const char *member, size_t *offset)
 
 const char *get_member_type(const char *parent, const char *member)
 {
-	size_t i;
-	if (h_get2(&typestable, parent, &i) < 0)
+	struct type t;
+	if (_find_type(&t, parent) < 0)
 		return NULL;
-	struct type *t = &types[i];
-	if (t->type != TYPE_CLASS)
+	if (t.type != TYPE_CLASS)
 		return NULL;
-	struct type_meta_class *m = (void *)&t->meta;
+	struct type_meta_class *m = (void *)&t.meta;
 	for (size_t j = 0; j < m->count; j++) {
 		if (streq(member, m->names[j]))
 			return m->types[j];
@@ -320,7 +337,7 @@ int get_root_type(struct type *dest, const char *str, hashtbl variables, const c
 {
 	const char *p = strchr(str, '.');
 	size_t l = p == NULL ? strlen(str) : p - str;
-	*parent = strnclone(str, l);
+	*parent = internn(str, l);
 	const char *type;
 	if (h_get2(variables, *parent, (size_t *)&type) < 0)
 		return -1;
@@ -347,6 +364,6 @@ const char *get_function_name(const char *str, hashtbl variables)
 	if (get_type(&t, name) < 0)
 		return NULL;
 	if (t.type == TYPE_CLASS || t.type == TYPE_STRUCT)
-		return strprintf("%s.%s", t.name, func);
+		return internf("%s.%s", t.name, func);
 	return NULL;
 }
@@ -1,5 +1,6 @@
 #include <string.h>
 #include <stdio.h>
+#include "arena.h"
 #include "func.h"
 #include "hashtbl.h"
 #include "types.h"
@@ -17,8 +18,8 @@ static const char *_deref_arr(const char *w, struct func *f,
 		// Get array and index
 		p++;
 		const char *q = strchr(p, ']');
-		const char *array = strnclone(w, p - w - 1);
-		const char *index = strnclone(p, q - p);
+		const char *array = internn(w, p - w - 1);
+		const char *index = internn(p, q - p);
 		// Get type
 		const char *type;
 		if (h_get2(variables, array, (size_t *)&type) == -1)
@@ -29,9 +30,9 @@ static const char *_deref_arr(const char *w, struct func *f,
 			tq = strrchr(type, '*');
 		if (tq == NULL)
 			EXIT(1, "Variable '%s' of type '%s' cannot be dereferenced", array, type);
-		type = strnclone(type, tq - type);
+		type = internn(type, tq - type);
 		// Create temporary variable
-		const char *v = strprintf("__elem%d", counter++);
+		const char *v = internf("__elem%d", __sync_fetch_and_add(&counter, 1));
 		// If type size isn't 1, multiply the index by the size
 		size_t size;
 		if (get_type_size(type, &size) < 0)
@@ -39,7 +40,7 @@ static const char *_deref_arr(const char *w, struct func *f,
 		// Add lines
 		if (size != 1) {
 			const char *i = new_temp_var(f, "long", "i", variables);
-			line_math(f, MATH_MUL, i, index, strprintf("%lu", size));
+			line_math(f, MATH_MUL, i, index, internf("%lu", size));
 			line_declare(f, v, type, variables);
 			line_math(f, MATH_LOADAT, v, array, i);
 			line_destroy(f, i, variables);
@@ -143,7 +144,7 @@ const char *deref_var(const char *m, func f,
 		; struct type_meta_number *mn = (void *)&type.meta;
 		if (streq(member, "sizeof")) {
 			*etemp = 0;
-			return strprintf("%lu", mn->size);
+			return internf("%lu", mn->size);
 		} else {
 			EXIT(1, "Type number doesn't have member '%s'", member);
 		}
@@ -172,7 +173,7 @@ const char *deref_var(const char *m, func f,
 			// Fixed array
 			if (streq(member, "length")) {
 				if (etemp) *etemp = 0;
-				return strprintf("%lu", ma->size);
+				return internf("%lu", ma->size);
 			} else if (streq(member, "ptr")) {
 				if (etemp) *etemp = 0;
 				return parent;
@@ -204,8 +205,8 @@ const char *deref_var(const char *m, func f,
 		size_t o;
 		if (get_member_offset(type.name, b, &o) < 0)
 			EXIT(3, "wtf?");
-		line_load(f, cvar, parent, strprintf("%ld", o));
-		const char *s = c == NULL ? cvar : strprintf("%s.%s", cvar, member);
+		line_load(f, cvar, parent, internf("%ld", o));
+		const char *s = c == NULL ? cvar : internf("%s.%s", cvar, member);
 		const char *rvar = deref_var(s, f, variables, etemp);
 		if (*etemp)
 			line_destroy(f, cvar, variables);
@@ -227,7 +228,7 @@ const char *deref_var(const char *m, func f,
 		const char *t;
 		if (h_get2(variables, b, (size_t *)&t) < 0)
 			EXIT(1, "Variable '%s' not declared", b);
-		const char *s = c == NULL ? strclone(b) : strprintf("%s.%s", b, c + 1);
+		const char *s = c == NULL ? intern(b) : internf("%s.%s", b, c + 1);
 		return deref_var(s, f, variables, etemp);
 	}
 	default:
@@ -241,21 +242,21 @@ const char *deref_var(const char *m, func f,
 	while (*c != 0) {
 		if (*c == '[') {
 			deref_type = 0;
-			var = array = strnclone(m, c - m);
+			var = array = internn(m, c - m);
 			c++;
 			const char *d = c;
 			c = strchr(d, ']');
 			if (c == NULL)
 				EXIT(1, "Expected ']'");
 			c--;
-			//index = strnclone(d, c - d);
+			//index = internn(d, c - d);
 			break;
 		} else if (*c == '.') {
 
 			deref_type = 1;
-			var = parent = strnclone(m, c - m);
+			var = parent = internn(m, c - m);
 			c++;
-			member = strclone(c);
+			member = intern(c);
 			break;
 		}
 		c++;
@@ -276,7 +277,7 @@ const char *deref_var(const char *m, func f,
 	case -1:
 		if (etemp)
 			*etemp = 0;
-		return strclone(m);
+		return intern(m);
 	// Array access
 	case 0:
 		return _deref_arr(m, f, variables, etemp);
@@ -318,7 +319,7 @@ int assign_var(func f, const char *var, const char *val, hashtbl variables)
 
 array_dereference:;
 	// Get the array name
-	const char *array = strnclone(var, p - var);
+	const char *array = internn(var, p - var);
 	p++;
 	// Get the index name
 	const char *q = p;
@@ -328,7 +329,7 @@ array_dereference:;
 		p++;
 	}
 	char indextemp;
-	const char *index = parse_expr(f, strnclone(q, p - q), &indextemp, "TODO", variables);
+	const char *index = parse_expr(f, internn(q, p - q), &indextemp, "TODO", variables);
 	p++;
 	// If the size isn't 1, multiply the index by the size
 	if (h_get2(variables, array, (size_t *)&typename) == -1)
@@ -342,7 +343,7 @@ array_dereference:;
 			i = index;
 		else
 			i = new_temp_var(f, "long", "i", variables);
-		line_math(f, MATH_MUL, i, index, strprintf("%lu", size));
+		line_math(f, MATH_MUL, i, index, internf("%lu", size));
 	} else {
 		i = index;
 	}
@@ -361,7 +362,7 @@ array_dereference:;
 
 member_dereference:;
 	// Get the parent's name
-	const char *parent = strnclone(var, p - var);
+	const char *parent = internn(var, p - var);
 	p++;
 	// Get the members name
 	/*const char **/q = p;
@@ -370,7 +371,7 @@ member_dereference:;
 			break;
 		p++;
 	}
-	const char *member = strnclone(q, p - q);
+	const char *member = internn(q, p - q);
 	// Check if it is the final dereference
 	int isfinal = *p == 0;
 	// Check what type the parent is
@@ -393,7 +394,7 @@ member_dereference:;
 		size_t o;
 		if (get_member_offset(typename, member, &o) == -1)
 			EXIT(1, "Class '%s' doesn't have member '%s'", parent, member);
-		const char *so = strprintf("%ld", o);
+		const char *so = internf("%ld", o);
 		if (isfinal) {
 			// Store the value
 			line_store(f, parent, so, dval);
@@ -403,7 +404,7 @@ member_dereference:;
 			const char *mtype = get_member_type(typename, member);
 			const char *tmp = new_temp_var(f, mtype, NULL, variables);
 			line_load(f, tmp, parent, so);
-			const char *n = strprintf("%s%s", tmp, p);
+			const char *n = internf("%s%s", tmp, p);
 			assign_var(f, n, dval, variables);
 			line_store(f, parent, so, tmp);
 			line_destroy(f, tmp, variables);
@@ -411,11 +412,11 @@ member_dereference:;
 	} else if (type.type == TYPE_STRUCT) {
 		if (isfinal) {
 			// 'Merge' parent and member into one variable and assign it
-			const char *n = strprintf("%s@%s", parent, member);
+			const char *n = internf("%s@%s", parent, member);
 			line_assign(f, n, dval);
 		} else {
 			// Call assign_var with merged variable
-			const char *n = strprintf("%s@%s", parent, q);
+			const char *n = internf("%s@%s", parent, q);
 			assign_var(f, n, dval, variables);
 		}
 	} else {
@@ -1,5 +1,6 @@
 #include "vasm.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include "util.h"
 
 
@@ -49,6 +50,27 @@ int get_vasm_args_type(int op)
 		return ARGS_TYPE_REG3;
 	case OP_JMPRB:
 		return ARGS_TYPE_BYTE;
+	case OP_PUSHM:
+	case OP_POPM:
+		return ARGS_TYPE_INT;
+	case OP_ADDI:
+	case OP_SUBI:
+	case OP_MULI:
+	case OP_ANDI:
+	case OP_LSHIFTI:
+	case OP_RSHIFTI:
+	case OP_LESSI:
+		return ARGS_TYPE_REG2INT;
+	case OP_JLTB:
+	case OP_JLEB:
+	case OP_JEQB:
+	case OP_JNEB:
+		return ARGS_TYPE_REG2BYTE;
+	case OP_JLT:
+	case OP_JLE:
+	case OP_JEQ:
+	case OP_JNE:
+		return ARGS_TYPE_REG2LONG;
 	case OP_JMP:
 	case OP_CALL:
 		return ARGS_TYPE_LONG;
@@ -107,6 +129,14 @@ int vasm2str(union vasm_all a, char *buf, size_t bufsize) {
 	case OP_JNZ   : op = "jnz"   ; break;
 	case OP_JZB   : op = "jzb"   ; break;
 	case OP_JNZB  : op = "jnzb"  ; break;
+	case OP_JLT   : op = "jlt"   ; break;
+	case OP_JLE   : op = "jle"   ; break;
+	case OP_JEQ   : op = "jeq"   ; break;
+	case OP_JNE   : op = "jne"   ; break;
+	case OP_JLTB  : op = "jltb"  ; break;
+	case OP_JLEB  : op = "jleb"  ; break;
+	case OP_JEQB  : op = "jeqb"  ; break;
+	case OP_JNEB  : op = "jneb"  ; break;
 	case OP_SET   : op = "set"   ; break;
 	case OP_SETB  : op = "setb"  ; break;
 	case OP_SETS  : op = "sets"  ; break;
@@ -123,6 +153,8 @@ int vasm2str(union vasm_all a, char *buf, size_t bufsize) {
 	case OP_LDLAT : op = "ldlat" ; break;
 	case OP_PUSH  : op = "push"  ; break;
 	case OP_POP   : op = "pop"   ; break;
+	case OP_PUSHM : op = "pushm" ; break;
+	case OP_POPM  : op = "popm"  ; break;
 	case OP_ADD   : op = "add"   ; break;
 	case OP_SUB   : op = "sub"   ; break;
 	case OP_MUL   : op = "mul"   ; break;
@@ -138,6 +170,13 @@ int vasm2str(union vasm_all a, char *buf, size_t bufsize) {
 	case OP_LSHIFT: op = "lshift"; break;
 	case OP_LESS  : op = "less"  ; break;
 	case OP_LESSE : op = "lesse" ; break;
+	case OP_ADDI  : op = "addi"  ; break;
+	case OP_SUBI  : op = "subi"  ; break;
+	case OP_MULI  : op = "muli"  ; break;
+	case OP_ANDI  : op = "andi"  ; break;
+	case OP_LSHIFTI:op ="lshifti"; break;
+	case OP_RSHIFTI:op ="rshifti"; break;
+	case OP_LESSI : op = "lessi" ; break;
 	case OP_SYSCALL:op ="syscall"; break;
 	case OP_RAW_LONG:
 		snprintf(buf, bufsize, ".long\t%s", a.s.s);
@@ -175,9 +214,43 @@ int vasm2str(union vasm_all a, char *buf, size_t bufsize) {
 	case ARGS_TYPE_REGLONG:
 		snprintf(buf, bufsize, "%s\tr%d,%s", op, a.rs.r, a.rs.s);
 		break;
+	case ARGS_TYPE_REG2INT:
+	case ARGS_TYPE_REG2BYTE:
+	case ARGS_TYPE_REG2LONG:
+		snprintf(buf, bufsize, "%s\tr%d,r%d,%s", op, a.r2s.r0, a.r2s.r1, a.r2s.s);
+		break;
 	default:
 		EXIT(3, "OP arguments type not classified (%d)", a.op);
 	}
 
 	return 0;
 }
+
+
+static void _lblpos_add(struct lblpos **list, size_t *count, size_t *cap,
+                        const char *lbl, size_t pos)
+{
+	if (*count >= *cap) {
+		size_t n = *cap == 0 ? 64 : *cap * 2;
+		struct lblpos *l = realloc(*list, n * sizeof *l);
+		if (l == NULL)
+			EXITERRNO(3, "Failed to grow label map");
+		*list = l;
+		*cap  = n;
+	}
+	(*list)[*count].lbl = lbl;
+	(*list)[*count].pos = pos;
+	(*count)++;
+}
+
+
+void lblmap_add_lbl2pos(struct lblmap *map, const char *lbl, size_t pos)
+{
+	_lblpos_add(&map->lbl2pos, &map->lbl2poscount, &map->lbl2poscap, lbl, pos);
+}
+
+
+void lblmap_add_pos2lbl(struct lblmap *map, const char *lbl, size_t pos)
+{
+	_lblpos_add(&map->pos2lbl, &map->pos2lblcount, &map->pos2lblcap, lbl, pos);
+}
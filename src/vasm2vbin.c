@@ -1,4 +1,3 @@
-#include <assert.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
@@ -10,6 +9,9 @@
 #include "vasm2vbin.h"
 
 
+enum vbin_format vasm2vbin_format = VBIN_FORMAT_LE;
+
+
 
 static size_t _getlblpos(const char *lbl, struct lblmap *map)
 {
@@ -24,9 +26,9 @@ static size_t _getlblpos(const char *lbl, struct lblmap *map)
  * Note that it is actually an estimate since a value can be between 1 and 8
  * bytes.
  */
-static size_t _getoplen(struct vasm v)
+static size_t _getoplen(const union vasm_all *v)
 {
-	switch (get_vasm_args_type(v.op)) {
+	switch (get_vasm_args_type(v->op)) {
 	case ARGS_TYPE_NONE:
 		return 1;
 	case ARGS_TYPE_REG1:
@@ -51,8 +53,14 @@ static size_t _getoplen(struct vasm v)
 		return 6;
 	case ARGS_TYPE_REGLONG:
 		return 10;
+	case ARGS_TYPE_REG2INT:
+		return 7;
+	case ARGS_TYPE_REG2BYTE:
+		return 4;
+	case ARGS_TYPE_REG2LONG:
+		return 11;
 	case ARGS_TYPE_SPECIAL:
-		switch (v.op) {
+		switch (v->op) {
 		case OP_RAW_BYTE:
 			return 1;
 		case OP_RAW_SHORT:
@@ -62,27 +70,25 @@ static size_t _getoplen(struct vasm v)
 		case OP_RAW_LONG:
 			return 8;
 		case OP_RAW_STR:
-			; struct vasm_str *a = (struct vasm_str *)&v;
-			return strlen(a->s);
+			return strlen(v->s.s);
 		case OP_LABEL:
 			return 0;
 		default:
-			EXIT(1, "Unknown op '%d'", v.op);
+			EXIT(1, "Unknown op '%d'", v->op);
 		}
 	default:
-		EXIT(1, "Unknown op '%d'", v.op);
+		EXIT(1, "Unknown op '%d'", v->op);
 	}
 }
 
 
-int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t *vbinlen_p, struct lblmap *map)
+int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char **vbin_p, size_t *vbinlen_p, struct lblmap *map)
 {
-	size_t vbinlen = 0;
-	#define POS2LBL(s) do {                                \
-		map->pos2lbl[map->pos2lblcount].lbl = s;       \
-		map->pos2lbl[map->pos2lblcount].pos = vbinlen; \
-		map->pos2lblcount++;                           \
-	} while (0)
+	size_t vbinlen = 0, vbincap = 0;
+	char  *vbin = NULL;
+	enum vbin_format fmt = vasm2vbin_format;
+	*map = (struct lblmap){ .format = fmt };
+	#define POS2LBL(s) lblmap_add_pos2lbl(map, s, vbinlen)
 
 	// Used for forward relative jumps
 	struct lblpos jmprelmap[256];
@@ -98,6 +104,15 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 		    a.op == (unsigned char)OP_COMMENT)
 			continue;
 
+		// Make sure the longest encoding of the op fits
+		size_t need = vbinlen + _getoplen(&a) + 1;
+		if (need > vbincap) {
+			vbincap = need * 2 > 256 ? need * 2 : 256;
+			vbin = realloc(vbin, vbincap);
+			if (vbin == NULL)
+				EXITERRNO(3, "Failed to grow binary");
+		}
+
 		vbin[vbinlen] = vasms[i].op;
 		vbinlen++;
 
@@ -135,7 +150,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 					size_t d = 3; // op (1) + reg (1) + offset (1)
 					for (size_t j = i + 1; j < vasmcount; j++) {
 						union vasm_all b = vasms[j];
-						d += _getoplen(b.a);
+						d += _getoplen(&b);
 						if (d > 0x7F)
 							break;
 						if (b.op == OP_LABEL &&
@@ -155,7 +170,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 					val = strtol(a.rs.s, NULL, 0);
 				else 
 					POS2LBL(a.rs.s);
-				*(size_t *)(vbin + vbinlen) = val;
+				*(size_t *)(vbin + vbinlen) = htovbin64(fmt, val);
 				vbinlen += sizeof val;
 			shortop_jmp:
 				break;
@@ -165,9 +180,16 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 					val = strtol(a.s.s, NULL, 0);
 				else 
 					POS2LBL(a.s.s);
-				*(size_t *)(vbin + vbinlen) = val;
+				*(size_t *)(vbin + vbinlen) = htovbin64(fmt, val);
 				vbinlen += sizeof val;
 				break;
+			} else if (a.op == OP_PUSHM || a.op == OP_POPM) {
+				val = strtol(a.s.s, NULL, 0);
+				if (val > 0xFFFFffff)
+					abort();
+				*(uint32_t *)(vbin + vbinlen) = htovbin32(fmt, val);
+				vbinlen += 4;
+				break;
 			} else {
 				EXIT(3, "Unexpected OP (%d)", a.op);
 			}
@@ -215,19 +237,19 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 				case OP_SETS:
 					if (val > 0xFFFF)
 						abort();
-					*(uint16_t *)(vbin + vbinlen) = htobe16(val);
+					*(uint16_t *)(vbin + vbinlen) = htovbin16(fmt, val);
 					vbinlen += 2;
 					break;
 				case OP_SETI:
 					if (val > 0xFFFFffff)
 						abort();
-					*(uint32_t *)(vbin + vbinlen) = htobe32(val);
+					*(uint32_t *)(vbin + vbinlen) = htovbin32(fmt, val);
 					vbinlen += 4;
 					break;
 				case OP_SETL:
 					if (val > 0xFFFFffffFFFFffff)
 						abort();
-					*(uint64_t *)(vbin + vbinlen) = htobe64(val);
+					*(uint64_t *)(vbin + vbinlen) = htovbin64(fmt, val);
 					vbinlen += 8;
 					break;
 				}
@@ -249,7 +271,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 						case OP_JNZ: op = OP_JNZB; break;
 						case OP_JP : op = OP_JPB ; break;
 						case OP_JPZ: op = OP_JPZB; break;
-						default: assert(0);
+						default: EXIT(3, "Unexpected OP (%d)", a.op);
 						}
 						vbin[vbinlen - 2] = op;
 						vbin[vbinlen++  ] = (char)d;
@@ -260,7 +282,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 					size_t d = 3; // op (1) + reg (1) + offset (1)
 					for (size_t j = i + 1; j < vasmcount; j++) {
 						union vasm_all b = vasms[j];
-						d += _getoplen(b.a);
+						d += _getoplen(&b);
 						if (d > 0x7F)
 							break;
 						if (b.op == OP_LABEL &&
@@ -271,7 +293,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 							case OP_JNZ: op = OP_JNZB; break;
 							case OP_JP : op = OP_JPB ; break;
 							case OP_JPZ: op = OP_JPZB; break;
-							default: assert(0);
+							default: EXIT(3, "Unexpected OP (%d)", a.op);
 							}
 							vbin[vbinlen - 2] = op;
 							vbin[vbinlen++  ] = 0xFF;
@@ -288,7 +310,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 					val = strtol(a.rs.s, NULL, 0);
 				else 
 					POS2LBL(a.rs.s);
-				*(size_t *)(vbin + vbinlen) = val;
+				*(size_t *)(vbin + vbinlen) = htovbin64(fmt, val);
 				vbinlen += sizeof val;
 			shortop:
 				break;
@@ -296,24 +318,84 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 				EXIT(3, "Unknown OP (%d)", a.op);
 			}
 			break;
+		case ARGS_TYPE_REG2INT:
+			vbin[vbinlen++] = a.r2s.r0;
+			vbin[vbinlen++] = a.r2s.r1;
+			val = strtol(a.r2s.s, NULL, 0);
+			if ((ssize_t)val < INT32_MIN || (ssize_t)val > INT32_MAX)
+				EXIT(1, "Immediate out of range (%s)", a.r2s.s);
+			*(uint32_t *)(vbin + vbinlen) = htovbin32(fmt, val);
+			vbinlen += 4;
+			break;
+		case ARGS_TYPE_REG2LONG:
+			vbin[vbinlen++] = a.r2s.r0;
+			vbin[vbinlen++] = a.r2s.r1;
+#ifndef FORCE_LONGJMP
+			; char rop;
+			switch (a.op) {
+			case OP_JLT: rop = OP_JLTB; break;
+			case OP_JLE: rop = OP_JLEB; break;
+			case OP_JEQ: rop = OP_JEQB; break;
+			case OP_JNE: rop = OP_JNEB; break;
+			default: EXIT(3, "Unexpected OP (%d)", a.op);
+			}
+			val = _getlblpos(a.r2s.s, map);
+			if (val != -1) {
+				ssize_t d = (ssize_t)val - (ssize_t)vbinlen;
+				if (-0x80 <= d && d <= 0x7F) {
+					vbin[vbinlen - 3] = rop;
+					vbin[vbinlen++  ] = (char)d;
+					break;
+				}
+			} else {
+				// Estimate distance
+				size_t d = 4; // op (1) + regs (2) + offset (1)
+				for (size_t j = i + 1; j < vasmcount; j++) {
+					union vasm_all b = vasms[j];
+					d += _getoplen(&b);
+					if (d > 0x7F)
+						break;
+					if (b.op == OP_LABEL &&
+					    streq(a.r2s.s, b.s.s)) {
+						vbin[vbinlen - 3] = rop;
+						vbin[vbinlen++  ] = 0xFF;
+						jmprelmap[jmprelmapcount].lbl = a.r2s.s;
+						jmprelmap[jmprelmapcount].pos = vbinlen - 1;
+						jmprelmapcount++;
+						goto shortop_cmp;
+					}
+				}
+			}
+#endif
+			val = -1;
+			if (isnum(*a.r2s.s))
+				val = strtol(a.r2s.s, NULL, 0);
+			else
+				POS2LBL(a.r2s.s);
+			*(size_t *)(vbin + vbinlen) = htovbin64(fmt, val);
+			vbinlen += sizeof val;
+#ifndef FORCE_LONGJMP
+		shortop_cmp:
+#endif
+			break;
 		case ARGS_TYPE_SPECIAL:
 			switch (a.op) {
 			case OP_RAW_LONG:
 				vbinlen--;
 				val = strtol(a.s.s, NULL, 0);
-							*(unsigned long *)(vbin + vbinlen) = htobe64(val);
+				*(unsigned long *)(vbin + vbinlen) = htovbin64(fmt, val);
 				vbinlen += sizeof (unsigned long);
 				break;
 			case OP_RAW_INT:
 				vbinlen--;
 				val = strtol(a.s.s, NULL, 0);
-				*(unsigned int *)(vbin + vbinlen) = htobe32(val);
+				*(unsigned int *)(vbin + vbinlen) = htovbin32(fmt, val);
 				vbinlen += sizeof (unsigned int);
 				break;
 			case OP_RAW_SHORT:
 				vbinlen--;
 				val = strtol(a.s.s, NULL, 0);
-				*(unsigned short*)(vbin + vbinlen) = htobe16(val);
+				*(unsigned short*)(vbin + vbinlen) = htovbin16(fmt, val);
 				vbinlen += sizeof (unsigned short);
 				break;
 			case OP_RAW_BYTE:
@@ -347,9 +429,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 				break;
 			case OP_LABEL:
 				vbinlen--;
-				map->lbl2pos[map->lbl2poscount].lbl = a.s.s;
-				map->lbl2pos[map->lbl2poscount].pos = vbinlen;
-				map->lbl2poscount++;
+				lblmap_add_lbl2pos(map, a.s.s, vbinlen);
 				// Fill in short jumps
 				for (size_t j = 0; j < jmprelmapcount; j++) {
 					const char *lbl = jmprelmap[j].lbl;
@@ -379,6 +459,7 @@ int vasm2vbin(const union vasm_all *vasms, size_t vasmcount, char *vbin, size_t
 	// Fill in local addresses
 	// TODO
 
+	*vbin_p    = vbin;
 	*vbinlen_p = vbinlen;
 	return 0;
 }
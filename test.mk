@@ -5,20 +5,28 @@ TEST_LIB = -L $(STD_DIR)/_start.sso
 _ssc := $(SSC) $(TEST_LIB)
 
 
-test: test-basic test-performance test-io
+test: test-basic test-performance test-io test-net test-libsstvm
 
 
-test-basic: test-hello test-count
+test-basic: test-hello test-count test-branch
 
 test-performance: test-prime-naive test-prime-fast
 
 test-io: test-writeln_num 
 
+test-net: test-net-echo
+
 
 test-hello: all
 	$(_ssc) test/basic/hello.sst -o /tmp/hello.ss
 	$(SH) -c './build/interpreter /tmp/hello.ss'
 
+test-branch: all
+	$(_ssc) test/basic/branch.sst -O0 -o /tmp/branch-O0.ss
+	$(_ssc) test/basic/branch.sst -O1 -o /tmp/branch-O1.ss
+	$(SH) -c './build/interpreter /tmp/branch-O0.ss 2>/dev/null; [ $$? -eq 132 ]'
+	$(SH) -c './build/interpreter /tmp/branch-O1.ss 2>/dev/null; [ $$? -eq 132 ]'
+
 test-count: all
 	$(_ssc) test/count/main.sst -o /tmp/count.ss
 	$(SH) -c 'time ./build/interpreter /tmp/count.ss'
@@ -33,7 +41,22 @@ test-prime-fast: all
 
 test-writeln_num: all
 	$(_ssc) test/io/writeln-num.sst -o /tmp/writeln-num.ss
-	$(SH) -c './build/interpreter /tmp/writeln-num.ss'
+	$(SH) -c '[ "$$(./build/interpreter /tmp/writeln-num.ss 2>/dev/null)" = \
+	            "$$(printf "1\n2\n3\n404\n9001\n500")" ]'
+
+test-net-echo: all
+	$(_ssc) test/net/echo.sst -o /tmp/net-echo.ss
+	$(SH) -c 'timeout 10 ./build/interpreter /tmp/net-echo.ss'
+
+test-libsstvm: all
+	$(_ssc) test/libsstvm/sum.sst -o /tmp/sstvm-sum.ss
+	$(_ssc) test/libsstvm/throw.sst -o /tmp/sstvm-throw.ss
+	$(_ssc) test/libsstvm/wrap.sst -o /tmp/sstvm-wrap.ss
+	$(_ssc) test/libsstvm/spin.sst -o /tmp/sstvm-spin.ss
+	$(CC) $(INCLUDE) $(CFLAGS) test/libsstvm/host.c $(OUTPUT)/libsstvm.a \
+	      -o /tmp/sstvm-host
+	$(SH) -c '/tmp/sstvm-host /tmp/sstvm-sum.ss /tmp/sstvm-throw.ss \
+	          /tmp/sstvm-wrap.ss /tmp/sstvm-spin.ss'
 
 test-readln: all
 	$(_ssc) test/io/readln.sst -o /tmp/readln.ss
@@ -0,0 +1,114 @@
+/**
+ * Runs several programs side by side in vms of the same process, a slice of
+ * each at a time, and checks how every one of them ended. Then checks that a
+ * program stuck in a loop still gives control back after every slice.
+ */
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sstvm.h"
+#include "util.h"
+
+
+#define SLICE	100
+
+
+static const struct {
+	// Index of the executable in argv
+	int arg;
+	enum vm_state state;
+	int64_t exitcode;
+} programs[] = {
+	{ 1, VM_EXITED , 1999000 },
+	{ 2, VM_ABORTED, 134     },
+	{ 1, VM_EXITED , 1999000 },
+	{ 3, VM_EXITED , 42      },
+	{ 1, VM_EXITED , 1999000 },
+};
+
+#define PROGRAMCOUNT (sizeof programs / sizeof *programs)
+
+
+static struct vm *_load(const char *file)
+{
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+		EXITERRNO(1, "Failed to open executable");
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+		EXITERRNO(1, "Failed to stat executable");
+	void *bin = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (bin == MAP_FAILED)
+		EXITERRNO(1, "Failed to map executable");
+	close(fd);
+
+	struct vm *vm = vm_create();
+	if (vm == NULL)
+		EXITERRNO(1, "Failed to create vm");
+	if (vm_load(vm, bin, st.st_size) < 0) {
+		fprintf(stderr, "Invalid executable '%s'\n", file);
+		exit(1);
+	}
+	munmap(bin, st.st_size);
+	return vm;
+}
+
+
+int main(int argc, char **argv)
+{
+	if (argc < 5) {
+		fprintf(stderr, "Usage: %s <sum> <throw> <wrap> <spin>\n",
+		        argv[0]);
+		return 1;
+	}
+
+	struct vm *vms[PROGRAMCOUNT];
+	for (size_t i = 0; i < PROGRAMCOUNT; i++)
+		vms[i] = _load(argv[programs[i].arg]);
+
+	// Interleave the programs until all of them stopped
+	size_t running = PROGRAMCOUNT, slices = 0;
+	while (running > 0) {
+		running = 0;
+		for (size_t i = 0; i < PROGRAMCOUNT; i++) {
+			if (vms[i]->state != VM_READY)
+				continue;
+			if (vm_run_for(vms[i], SLICE) == VM_READY)
+				running++;
+			slices++;
+		}
+	}
+
+	int failed = 0;
+	for (size_t i = 0; i < PROGRAMCOUNT; i++) {
+		if (vms[i]->state != programs[i].state ||
+		    vms[i]->exitcode != programs[i].exitcode) {
+			fprintf(stderr, "vm %lu: state %d, exit code %ld, "
+			        "expected state %d, exit code %ld\n",
+			        i, vms[i]->state, vms[i]->exitcode,
+			        programs[i].state, programs[i].exitcode);
+			failed = 1;
+		}
+		vm_destroy(vms[i]);
+	}
+	printf("Ran %lu programs in %lu slices\n", PROGRAMCOUNT, slices);
+
+	struct vm *spin = _load(argv[4]);
+	for (int i = 0; i < 10; i++) {
+		size_t before = spin->icounter;
+		enum vm_state s = vm_run_for(spin, SLICE);
+		if (s != VM_READY || spin->icounter < before + SLICE) {
+			fprintf(stderr, "spin: slice %d returned state %d after "
+			        "%lu units\n", i, s, spin->icounter - before);
+			failed = 1;
+			break;
+		}
+	}
+	vm_destroy(spin);
+	return failed;
+}